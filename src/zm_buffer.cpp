@@ -19,6 +19,7 @@
 
 #include <string.h>
 #include <fcntl.h>
+#include <sys/socket.h>
 
 #include "zm.h"
 #include "zm_buffer.h"
@@ -79,3 +80,15 @@ int Buffer::read_into( int sd, unsigned int bytes ) {
   }
   return bytes_read;
 }
+
+// Like read_into, but reads at most bytes and takes recv flags, so callers can
+// pull whatever is already queued on the socket without asking for its size first.
+int Buffer::recv_into( int sd, unsigned int bytes, int flags ) {
+  this->expand(bytes);
+  int bytes_read = recv( sd, mTail, bytes, flags );
+  if ( bytes_read > 0 ) {
+    mTail += bytes_read;
+    mSize += bytes_read;
+  }
+  return bytes_read;
+}
@@ -173,6 +173,7 @@ public:
     return( (int)mSize );
   }
   int read_into( int sd, unsigned int bytes );
+  int recv_into( int sd, unsigned int bytes, int flags );
 };
 
 #endif // ZM_BUFFER_H
@@ -50,7 +50,7 @@ Camera::Camera(
 {
   linesize = width * colours;
   pixels = width * height;
-  imagesize = height * linesize;
+  imagesize = zm_image_buffer_size(width, height, colours, subpixelorder);
 
   Debug(2, "New camera id: %d width: %d line size: %d height: %d colours: %d subpixelorder: %d capture: %d",
       monitor_id, width, linesize, height, colours, subpixelorder, capture);
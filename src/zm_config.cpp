@@ -26,13 +26,72 @@
 #include <errno.h>
 #include <dirent.h>
 #include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pwd.h>
+#include <cinttypes>
 
 #include "zm_utils.h"
 
+#include <vector>
+
 // Note that Error and Debug calls won't actually go anywhere unless you 
 // set the relevant ENV vars because the logger gets it's setting from the 
 // config.
 
+// The Config table is kept in a snapshot under ZM_PATH_MAP, so that the
+// processes started for every stream and zmu call don't each have to load it
+// from the database. Anything that changes Config bumps the number in the
+// generation file, and a snapshot is only used while the number it was taken
+// at is still current.
+#define ZM_CONFIG_SNAPSHOT    "zm_config.snapshot"
+#define ZM_CONFIG_GENERATION  "zm_config.generation"
+
+// ZM_PATH_MAP is usually /dev/shm, where anyone can create files. Only those
+// written by root, us or the web user, and that nobody else can change, are
+// believed.
+bool zmTrustedFile(int fd, const std::string &path) {
+  struct stat st;
+  if ( fstat(fd, &st) ) {
+    Warning("Can't stat %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  bool owner_ok = !st.st_uid || (st.st_uid == geteuid());
+  if ( !owner_ok && !staticConfig.WEB_USER.empty() ) {
+    struct passwd *pw = getpwnam(staticConfig.WEB_USER.c_str());
+    owner_ok = pw && (st.st_uid == pw->pw_uid);
+  }
+  if ( !owner_ok || (st.st_mode & (S_IWGRP|S_IWOTH)) ) {
+    Warning("Ignoring %s, it is owned by uid %d with mode %o", path.c_str(), st.st_uid, st.st_mode & 07777);
+    return false;
+  }
+  return true;
+}
+
+// Reads a generation file, 0 if there isn't one yet. Returns false if there
+// is one that can't be trusted, so that nothing cached against it is either.
+bool zmReadGeneration(const std::string &path, uint64_t &generation) {
+  generation = 0;
+  int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+  if ( fd < 0 )
+    return errno == ENOENT;
+  if ( !zmTrustedFile(fd, path) ) {
+    close(fd);
+    return false;
+  }
+  FILE *fp = fdopen(fd, "r");
+  if ( !fp ) {
+    close(fd);
+    return false;
+  }
+  if ( fscanf(fp, "%" SCNu64, &generation) != 1 )
+    generation = 0;
+  fclose(fp);
+  return true;
+}
+
 void zmLoadConfig() {
 
   // Process name, value pairs from the main config file first
@@ -65,7 +124,20 @@ void zmLoadConfig() {
   if ( !zmDbConnect() ) {
     Fatal("Can't connect to db. Can't continue.");
   }
-  config.Load();
+  if ( !staticConfig.PATH_MAP.empty() ) {
+    // Read before loading, so a change made while we load leaves the
+    // snapshot out of date rather than passing it off as current.
+    uint64_t generation;
+    std::string snapshot = staticConfig.PATH_MAP + "/" ZM_CONFIG_SNAPSHOT;
+    if ( !zmReadGeneration(staticConfig.PATH_MAP + "/" ZM_CONFIG_GENERATION, generation) ) {
+      config.Load();
+    } else if ( !config.LoadSnapshot(snapshot, generation) ) {
+      config.Load();
+      config.SaveSnapshot(snapshot, generation);
+    }
+  } else {
+    config.Load();
+  }
   config.Assign();
 
   // Populate the server config entries
@@ -198,6 +270,8 @@ void process_configfile(char const *configFile) {
       staticConfig.PATH_SWAP = std::string(val_ptr);
     else if ( strcasecmp(name_ptr, "ZM_PATH_ARP") == 0 )
       staticConfig.PATH_ARP = std::string(val_ptr);
+    else if ( strcasecmp(name_ptr, "ZM_WEB_USER") == 0 )
+      staticConfig.WEB_USER = std::string(val_ptr);
     else {
       // We ignore this now as there may be more parameters than the
       // c/c++ binaries are bothered about
@@ -368,6 +442,109 @@ void Config::Load() {
   mysql_free_result(result);
 }
 
+// Returns false, leaving nothing loaded, if the snapshot is missing, out of
+// date or doesn't match this build.
+bool Config::LoadSnapshot(const std::string &path, uint64_t generation) {
+  int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+  if ( fd < 0 ) {
+    Debug(1, "No config snapshot %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if ( !zmTrustedFile(fd, path) || fstat(fd, &st) || ((size_t)st.st_size < sizeof(SnapshotHeader)) ) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if ( map == MAP_FAILED ) {
+    Debug(1, "Can't map config snapshot %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  const SnapshotHeader *header = (const SnapshotHeader *)map;
+  const uint32_t *offsets = (const uint32_t *)(header+1);
+  const char *data = (const char *)(offsets + 3*header->n_items);
+  bool valid = !memcmp(header->magic, "ZMCF", 4)
+    && (header->layout == 1)
+    && (header->generation == generation)
+    && !strncmp(header->version, ZM_VERSION, sizeof(header->version))
+    && (header->n_items > ZM_MAX_CFG_ID)
+    && (header->n_items < 0x10000)
+    && ((size_t)st.st_size == sizeof(SnapshotHeader) + 3*sizeof(uint32_t)*header->n_items + header->data_size)
+    && header->data_size
+    && (data[header->data_size-1] == '\0');
+  for ( uint32_t i = 0; valid && (i < 3*header->n_items); i++ )
+    valid = offsets[i] < header->data_size;
+
+  if ( valid ) {
+    n_items = header->n_items;
+    items = new ConfigItem *[n_items];
+    for ( int i = 0; i < n_items; i++ )
+      items[i] = new ConfigItem(data+offsets[3*i], data+offsets[3*i+1], data+offsets[3*i+2]);
+    Debug(1, "Loaded %d config items from snapshot %s", n_items, path.c_str());
+  } else {
+    Debug(1, "Config snapshot %s is out of date", path.c_str());
+  }
+  munmap(map, st.st_size);
+  return valid;
+}
+
+// Written to a temporary file and renamed into place, so readers only ever
+// see a whole snapshot. It has the passwords and auth secret in it, so only
+// the web user's group may read it. ZM_PATH_MAP is usually sticky, so one
+// written by root is given to the web user, or nothing else could replace it.
+void Config::SaveSnapshot(const std::string &path, uint64_t generation) const {
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "ZMCF", 4);
+  header.layout = 1;
+  header.generation = generation;
+  strncpy(header.version, ZM_VERSION, sizeof(header.version));
+  header.n_items = n_items;
+
+  std::vector<uint32_t> offsets;
+  std::string data;
+  for ( int i = 0; i < n_items; i++ ) {
+    const char *strings[3] = { items[i]->Name(), items[i]->Value(), items[i]->Type() };
+    for ( int j = 0; j < 3; j++ ) {
+      offsets.push_back(data.size());
+      data.append(strings[j], strlen(strings[j])+1);
+    }
+  }
+  header.data_size = data.size();
+
+  std::string temp_path = stringtf("%s.%d", path.c_str(), getpid());
+  int fd = open(temp_path.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0640);
+  if ( fd < 0 ) {
+    Debug(1, "Can't create config snapshot %s: %s", temp_path.c_str(), strerror(errno));
+    return;
+  }
+  FILE *fp = fdopen(fd, "w");
+  if ( !fp ) {
+    Debug(1, "Can't open config snapshot %s: %s", temp_path.c_str(), strerror(errno));
+    close(fd);
+    unlink(temp_path.c_str());
+    return;
+  }
+  bool written = (fwrite(&header, sizeof(header), 1, fp) == 1)
+    && (fwrite(&offsets[0], sizeof(uint32_t), offsets.size(), fp) == offsets.size())
+    && (fwrite(data.data(), 1, data.size(), fp) == data.size());
+  if ( written && !geteuid() && !staticConfig.WEB_USER.empty() ) {
+    struct passwd *pw = getpwnam(staticConfig.WEB_USER.c_str());
+    if ( pw && fchown(fileno(fp), pw->pw_uid, pw->pw_gid) )
+      Warning("Can't give config snapshot %s to %s: %s", temp_path.c_str(), staticConfig.WEB_USER.c_str(), strerror(errno));
+  }
+  if ( fclose(fp) )
+    written = false;
+  if ( !written || rename(temp_path.c_str(), path.c_str()) ) {
+    Warning("Can't write config snapshot %s: %s", path.c_str(), strerror(errno));
+    unlink(temp_path.c_str());
+    return;
+  }
+  Debug(1, "Saved %d config items to snapshot %s", n_items, path.c_str());
+}
+
 void Config::Assign() {
 ZM_CFG_ASSIGN_LIST
 }
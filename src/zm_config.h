@@ -29,6 +29,7 @@
 #include "zm_config_data.h"
 
 #include <string>
+#include <stdint.h>
 
 #ifdef HAVE_LIBAVFORMAT
 #define ZM_HAS_FFMPEG       1
@@ -55,6 +56,8 @@
 #define ZM_SUSPENDED_RATE     int(1000000/4) // A slower rate for when disabled etc
 
 extern void zmLoadConfig();
+extern bool zmTrustedFile(int fd, const std::string &path);
+extern bool zmReadGeneration(const std::string &path, uint64_t &generation);
 
 extern void process_configfile(char const *configFile);
 
@@ -78,6 +81,7 @@ struct StaticConfig {
   std::string PATH_LOGS;
   std::string PATH_SWAP;
   std::string PATH_ARP;
+  std::string WEB_USER;
   char    capture_file_format[PATH_MAX];
   char    analyse_file_format[PATH_MAX];
   char    general_file_format[PATH_MAX];
@@ -107,6 +111,9 @@ public:
   ~ConfigItem();
   void Copy(const ConfigItem&);
   void ConvertValue() const;
+  const char *Name() const { return name; }
+  const char *Value() const { return value; }
+  const char *Type() const { return type; }
   bool BooleanValue() const;
   int IntegerValue() const;
   double DecimalValue() const;
@@ -138,11 +145,24 @@ private:
   int n_items;
   ConfigItem **items;
 
+  // Layout of the snapshot file, followed by an offset to the name, value
+  // and type of each item and then the strings themselves.
+  struct SnapshotHeader {
+    char magic[4];
+    uint32_t layout;
+    uint64_t generation;    // Of the counter when the snapshot was taken
+    char version[16];       // ZM_VERSION of whatever wrote it
+    uint32_t n_items;
+    uint32_t data_size;     // Bytes of strings
+  };
+
 public:
   Config();
   ~Config();
 
   void Load();
+  bool LoadSnapshot(const std::string &path, uint64_t generation);
+  void SaveSnapshot(const std::string &path, uint64_t generation) const;
   void Assign();
   const ConfigItem &Item( int id );
 };
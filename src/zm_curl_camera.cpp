@@ -24,6 +24,11 @@
 
 #include "zm_packetqueue.h"
 
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
 #if HAVE_LIBCURL
 
 /* Func ptrs for libcurl functions */
@@ -37,9 +42,19 @@ static CURLcode (*curl_easy_getinfo_f)(CURL* , CURLINFO, ...) = nullptr;
 static CURLcode (*curl_easy_perform_f)(CURL*) = nullptr;
 static CURLcode (*curl_easy_setopt_f)(CURL*, CURLoption, ...) = nullptr;
 static void (*curl_easy_cleanup_f)(CURL*) = nullptr;
+static CURLM* (*curl_multi_init_f)(void) = nullptr;
+static CURLMcode (*curl_multi_cleanup_f)(CURLM*) = nullptr;
+static CURLMcode (*curl_multi_setopt_f)(CURLM*, CURLMoption, ...) = nullptr;
+static CURLMcode (*curl_multi_add_handle_f)(CURLM*, CURL*) = nullptr;
+static CURLMcode (*curl_multi_remove_handle_f)(CURLM*, CURL*) = nullptr;
+static CURLMcode (*curl_multi_socket_action_f)(CURLM*, curl_socket_t, int, int*) = nullptr;
+static CURLMcode (*curl_multi_assign_f)(CURLM*, curl_socket_t, void*) = nullptr;
+static CURLMsg* (*curl_multi_info_read_f)(CURLM*, int*) = nullptr;
+static const char* (*curl_multi_strerror_f)(CURLMcode) = nullptr;
 
 #define CURL_MAXRETRY 5
 #define CURL_BUFFER_INITIAL_SIZE 65536
+#define CURL_MULTI_MAX_EVENTS 64
 
 const char* content_length_match = "Content-Length:";
 const char* content_type_match = "Content-Type:";
@@ -69,11 +84,20 @@ void bind_libcurl_symbols() {
   *(void**) (&curl_easy_perform_f) = dlsym(curl_lib, "curl_easy_perform");
   *(void**) (&curl_easy_setopt_f) = dlsym(curl_lib, "curl_easy_setopt");
   *(void**) (&curl_easy_cleanup_f) = dlsym(curl_lib, "curl_easy_cleanup");
+  *(void**) (&curl_multi_init_f) = dlsym(curl_lib, "curl_multi_init");
+  *(void**) (&curl_multi_cleanup_f) = dlsym(curl_lib, "curl_multi_cleanup");
+  *(void**) (&curl_multi_setopt_f) = dlsym(curl_lib, "curl_multi_setopt");
+  *(void**) (&curl_multi_add_handle_f) = dlsym(curl_lib, "curl_multi_add_handle");
+  *(void**) (&curl_multi_remove_handle_f) = dlsym(curl_lib, "curl_multi_remove_handle");
+  *(void**) (&curl_multi_socket_action_f) = dlsym(curl_lib, "curl_multi_socket_action");
+  *(void**) (&curl_multi_assign_f) = dlsym(curl_lib, "curl_multi_assign");
+  *(void**) (&curl_multi_info_read_f) = dlsym(curl_lib, "curl_multi_info_read");
+  *(void**) (&curl_multi_strerror_f) = dlsym(curl_lib, "curl_multi_strerror");
 }
 
 cURLCamera::cURLCamera( int p_id, const std::string &p_path, const std::string &p_user, const std::string &p_pass, unsigned int p_width, unsigned int p_height, int p_colours, int p_brightness, int p_contrast, int p_hue, int p_colour, bool p_capture, bool p_record_audio ) :
   Camera( p_id, CURL_SRC, p_width, p_height, p_colours, ZM_SUBPIX_ORDER_DEFAULT_FOR_COLOUR(p_colours), p_brightness, p_contrast, p_hue, p_colour, p_capture, p_record_audio ),
-  mPath( p_path ), mUser( p_user ), mPass ( p_pass ), bTerminate( false ), bReset( false ), mode ( MODE_UNSET )
+  mPath( p_path ), mUser( p_user ), mPass ( p_pass ), c( nullptr ), multi( nullptr ), attempt( 1 ), bTerminate( false ), bReset( false ), mode ( MODE_UNSET )
 {
 
   if ( capture ) {
@@ -93,17 +117,6 @@ void cURLCamera::Initialise() {
   content_type_match_len = strlen(content_type_match);
 
   databuffer.expand(CURL_BUFFER_INITIAL_SIZE);
-  
-  bind_libcurl_symbols();
-  /* cURL initialization */
-  CURLcode cRet = (*curl_global_init_f)(CURL_GLOBAL_ALL);
-  if(cRet != CURLE_OK) {
-    Error("libcurl initialization failed: ", (*curl_easy_strerror_f)(cRet));
-    dlclose(curl_lib);
-    return;
-  }
-
-  Debug(2,"libcurl version: %s", (*curl_version_f)());
 
   /* Create the shared data mutex */
   int nRet = pthread_mutex_init(&shareddata_mutex, nullptr);
@@ -124,20 +137,39 @@ void cURLCamera::Initialise() {
     return;
   }
 
-  /* Create the thread */
-  nRet = pthread_create(&thread, nullptr, thread_func_dispatcher, this);
-  if(nRet != 0) {
-    Error("Thread creation failed: %s",strerror(nRet));
+  /* The shared thread does libcurl initialization the first time it is needed */
+  multi = cURLMultiThread::acquire();
+  if ( !multi )
+    return;
+
+  if ( setup_handle() < 0 ) {
+    if ( c ) {
+      (*curl_easy_cleanup_f)(c);
+      c = nullptr;
+    }
     return;
   }
+
+  /* Hand the transfer over to the shared thread */
+  multi->add(this);
 }
 
 void cURLCamera::Terminate() {
-  /* Signal the thread to terminate */
+  /* Signal the transfer to terminate */
   bTerminate = true;
 
-  /* Wait for thread termination */
-  pthread_join(thread, nullptr);
+  /* Wait until the shared thread has let go of our handle */
+  if ( multi ) {
+    if ( c )
+      multi->remove(this);
+    multi = nullptr;
+    cURLMultiThread::release();
+  }
+
+  if ( c ) {
+    (*curl_easy_cleanup_f)(c);
+    c = nullptr;
+  }
 
   /* Destroy condition variables */
   pthread_cond_destroy(&request_complete_cond);
@@ -145,12 +177,6 @@ void cURLCamera::Terminate() {
 
   /* Destroy mutex */
   pthread_mutex_destroy(&shareddata_mutex);
-
-  /* cURL cleanup */
-  (*curl_global_cleanup_f)();
-
-  if(curl_lib)
-    dlclose(curl_lib);
 }
 
 int cURLCamera::PrimeCapture() {
@@ -420,75 +446,62 @@ size_t cURLCamera::header_callback( void *buffer, size_t size, size_t nmemb, voi
   return size*nmemb;
 }
 
-void* cURLCamera::thread_func() {
-  long tRet;
-  double dSize;
-
+int cURLCamera::setup_handle() {
   c = (*curl_easy_init_f)();
   if(c == nullptr) {
-    dlclose(curl_lib);
     Error("Failed getting easy handle from libcurl");
-    tRet = -51;
-    return (void*)tRet;
+    return -51;
   }
 
   CURLcode cRet;
   /* Set URL */
   cRet = (*curl_easy_setopt_f)(c, CURLOPT_URL, mPath.c_str());
   if(cRet != CURLE_OK) {
-    Error("Failed setting libcurl URL: %s", *(curl_easy_strerror_f)(cRet));
-    tRet = -52;
-    return (void*)tRet;
+    Error("Failed setting libcurl URL: %s", (*curl_easy_strerror_f)(cRet));
+    return -52;
   }
   
   /* Header callback */
   cRet = (*curl_easy_setopt_f)(c, CURLOPT_HEADERFUNCTION, &header_callback_dispatcher);
   if(cRet != CURLE_OK) {
     Error("Failed setting libcurl header callback function: %s", (*curl_easy_strerror_f)(cRet));
-    tRet = -53;
-    return (void*)tRet;
+    return -53;
   }
   
   cRet = (*curl_easy_setopt_f)(c, CURLOPT_HEADERDATA, this);
   if(cRet != CURLE_OK) {
     Error("Failed setting libcurl header callback object: %s", (*curl_easy_strerror_f)(cRet));
-    tRet = -54;
-    return (void*)tRet;
+    return -54;
   }
   /* Data callback */
   cRet = (*curl_easy_setopt_f)(c, CURLOPT_WRITEFUNCTION, &data_callback_dispatcher);
   if(cRet != CURLE_OK) {
     Error("Failed setting libcurl data callback function: %s", (*curl_easy_strerror_f)(cRet));
-    tRet = -55;
-    return (void*)tRet;
+    return -55;
   }
 
   cRet = (*curl_easy_setopt_f)(c, CURLOPT_WRITEDATA, this);
   if(cRet != CURLE_OK) {
     Error("Failed setting libcurl data callback object: %s", (*curl_easy_strerror_f)(cRet));
-    tRet = -56;
-    return (void*)tRet;
+    return -56;
   }
   /* Progress callback */
   cRet = (*curl_easy_setopt_f)(c, CURLOPT_NOPROGRESS, 0);
   if(cRet != CURLE_OK) {
     Error("Failed enabling libcurl progress callback function: %s", (*curl_easy_strerror_f)(cRet));  
-    tRet = -57;
-    return (void*)tRet;
+    return -57;
   }
   
   cRet = (*curl_easy_setopt_f)(c, CURLOPT_PROGRESSFUNCTION, &progress_callback_dispatcher);
   if(cRet != CURLE_OK) {
     Error("Failed setting libcurl progress callback function: %s", (*curl_easy_strerror_f)(cRet));
-    tRet = -58;
-    return (void*)tRet;
+    return -58;
   }
   
   cRet = (*curl_easy_setopt_f)(c, CURLOPT_PROGRESSDATA, this);
   if(cRet != CURLE_OK) {
     Error("Failed setting libcurl progress callback object: %s", (*curl_easy_strerror_f)(cRet));
-    tRet = -59;
-    return (void*)tRet;
+    return -59;
   }
   /* Set username and password */
   if(!mUser.empty()) {
@@ -507,74 +520,80 @@ void* cURLCamera::thread_func() {
   if(cRet != CURLE_OK)
     Warning("Failed setting libcurl acceptable http authenication methods: %s", (*curl_easy_strerror_f)(cRet));
 
+  /* Lets the shared thread find us from the easy handle */
+  cRet = (*curl_easy_setopt_f)(c, CURLOPT_PRIVATE, this);
+  if(cRet != CURLE_OK) {
+    Error("Failed setting libcurl private pointer: %s", (*curl_easy_strerror_f)(cRet));
+    return -62;
+  }
 
-  /* Work loop */
-  for(int attempt=1;attempt<=CURL_MAXRETRY;attempt++) {
-    tRet = 0;
-    while(!bTerminate) {
-      /* Do the work */
-      cRet = (*curl_easy_perform_f)(c);
+  /* Many handles share one thread, so libcurl must not use signals for timeouts */
+  cRet = (*curl_easy_setopt_f)(c, CURLOPT_NOSIGNAL, 1L);
+  if(cRet != CURLE_OK)
+    Warning("Failed disabling libcurl signals: %s", (*curl_easy_strerror_f)(cRet));
 
-      if(mode == MODE_SINGLE) {
-        if(cRet != CURLE_OK) {
-          break;
-        }
-        /* Attempt to get the size of the file */
-        cRet = (*curl_easy_getinfo_f)(c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &dSize);
-        if(cRet != CURLE_OK) {
-          break;
-        }
-        /* We need to lock for the offsets array and the condition variable */
-        lock();
-        /* Push the size into our offsets array */
-        if(dSize > 0) {
-          single_offsets.push_back(dSize);
-        } else {
-          Error("Unable to get the size of the image");
-          tRet = -60;
-          return (void*)tRet;
-        }
-        /* Signal the request complete condition variable */
-        tRet = pthread_cond_signal(&request_complete_cond);
-        if(tRet != 0) {
-          Error("Failed signaling request completed condition variable: %s",strerror(tRet));
-          tRet = -61;
-          return (void*)tRet;
-        }
-        /* Unlock */
-        unlock();
+  /* Keep the connection open between snapshot requests */
+  cRet = (*curl_easy_setopt_f)(c, CURLOPT_TCP_KEEPALIVE, 1L);
+  if(cRet != CURLE_OK)
+    Warning("Failed enabling libcurl tcp keepalive: %s", (*curl_easy_strerror_f)(cRet));
 
-      } else if (mode == MODE_STREAM) {
-        break;
-      }
-    }
+  return 0;
+}
+
+/* Called on the shared thread when a transfer finishes. Returns true if the
+ * transfer should be started again. */
+bool cURLCamera::request_complete(CURLcode cRet) {
+  if ( bTerminate || cRet == CURLE_ABORTED_BY_CALLBACK ) {
+    /* Aborted */
+    return false;
+  }
 
-    /* Return value checking */
-    if(cRet == CURLE_ABORTED_BY_CALLBACK || bTerminate) {
-      /* Aborted */
-      break;
-    } else if (cRet != CURLE_OK) {
-      /* Some error */
-      Error("cURL Request failed: %s",(*curl_easy_strerror_f)(cRet));
-      if(attempt < CURL_MAXRETRY) {
-        Error("Retrying.. Attempt %d of %d",attempt,CURL_MAXRETRY);
-        /* Do a reset */
-        lock();
-        databuffer.clear();
-        single_offsets.clear();
-        mode = MODE_UNSET;
-        bReset = true;
+  if ( (cRet == CURLE_OK) && (mode == MODE_SINGLE) ) {
+    double dSize;
+    /* Attempt to get the size of the file */
+    cRet = (*curl_easy_getinfo_f)(c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &dSize);
+    if ( cRet == CURLE_OK ) {
+      /* We need to lock for the offsets array and the condition variable */
+      lock();
+      /* Push the size into our offsets array */
+      if ( dSize <= 0 ) {
+        Error("Unable to get the size of the image");
         unlock();
+        return false;
       }
-      tRet = -50;
+      single_offsets.push_back(dSize);
+      /* Signal the request complete condition variable */
+      int nRet = pthread_cond_signal(&request_complete_cond);
+      unlock();
+      if ( nRet != 0 ) {
+        Error("Failed signaling request completed condition variable: %s",strerror(nRet));
+        return false;
+      }
+      /* Single images don't count against our retries, go get the next one */
+      return true;
     }
   }
-      
-  /* Cleanup */
-  (*curl_easy_cleanup_f)(c);
-  c = nullptr;
-  
-  return (void*)tRet;
+
+  if ( cRet != CURLE_OK ) {
+    /* Some error */
+    Error("cURL Request failed: %s",(*curl_easy_strerror_f)(cRet));
+  }
+  if ( attempt >= CURL_MAXRETRY ) {
+    Error("cURL Request failed %d times, giving up", attempt);
+    return false;
+  }
+  if ( cRet != CURLE_OK ) {
+    Error("Retrying.. Attempt %d of %d",attempt,CURL_MAXRETRY);
+    /* Do a reset */
+    lock();
+    databuffer.clear();
+    single_offsets.clear();
+    mode = MODE_UNSET;
+    bReset = true;
+    unlock();
+  }
+  attempt++;
+  return true;
 }
 
 int cURLCamera::lock() {
@@ -607,6 +626,293 @@ int cURLCamera::progress_callback(void *userdata, double dltotal, double dlnow,
   return 0;
 }
 
+cURLMultiThread *cURLMultiThread::smInstance = nullptr;
+int cURLMultiThread::smUsers = 0;
+Mutex cURLMultiThread::smInstanceMutex;
+
+static long monotonic_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+cURLMultiThread *cURLMultiThread::acquire() {
+  ScopedMutex lock(smInstanceMutex);
+
+  if ( !smInstance ) {
+    bind_libcurl_symbols();
+    if ( !curl_lib )
+      return nullptr;
+    if ( !curl_multi_init_f || !curl_multi_socket_action_f ) {
+      Error("The loaded libcurl does not support the multi socket interface");
+      return nullptr;
+    }
+
+    /* cURL initialization */
+    CURLcode cRet = (*curl_global_init_f)(CURL_GLOBAL_ALL);
+    if ( cRet != CURLE_OK ) {
+      Error("libcurl initialization failed: %s", (*curl_easy_strerror_f)(cRet));
+      return nullptr;
+    }
+    Debug(2, "libcurl version: %s", (*curl_version_f)());
+
+    smInstance = new cURLMultiThread();
+    if ( !smInstance->mMulti || (smInstance->mEpollFd < 0) || (smInstance->mWakeupFd < 0) ) {
+      delete smInstance;
+      smInstance = nullptr;
+      (*curl_global_cleanup_f)();
+      return nullptr;
+    }
+    smInstance->start();
+  }
+  smUsers++;
+  return smInstance;
+}
+
+void cURLMultiThread::release() {
+  ScopedMutex lock(smInstanceMutex);
+
+  if ( !smInstance || --smUsers > 0 )
+    return;
+
+  smInstance->stop();
+  smInstance->join();
+  delete smInstance;
+  smInstance = nullptr;
+
+  /* cURL cleanup */
+  (*curl_global_cleanup_f)();
+}
+
+cURLMultiThread::cURLMultiThread() :
+  mMulti(nullptr),
+  mEpollFd(-1),
+  mWakeupFd(-1),
+  mTimerDeadline(-1),
+  mStop(false),
+  mCondition(mMutex)
+{
+  mMulti = (*curl_multi_init_f)();
+  if ( !mMulti ) {
+    Error("Failed getting multi handle from libcurl");
+    return;
+  }
+  (*curl_multi_setopt_f)(mMulti, CURLMOPT_SOCKETFUNCTION, &cURLMultiThread::socket_callback);
+  (*curl_multi_setopt_f)(mMulti, CURLMOPT_SOCKETDATA, this);
+  (*curl_multi_setopt_f)(mMulti, CURLMOPT_TIMERFUNCTION, &cURLMultiThread::timer_callback);
+  (*curl_multi_setopt_f)(mMulti, CURLMOPT_TIMERDATA, this);
+
+  mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+  if ( mEpollFd < 0 ) {
+    Error("Can't create epoll instance: %s", strerror(errno));
+    return;
+  }
+  /* Lets other threads interrupt epoll_wait when they add or remove cameras */
+  mWakeupFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if ( mWakeupFd < 0 ) {
+    Error("Can't create eventfd: %s", strerror(errno));
+    return;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = mWakeupFd;
+  if ( epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeupFd, &ev) < 0 ) {
+    Error("Can't add eventfd to epoll: %s", strerror(errno));
+    close(mWakeupFd);
+    mWakeupFd = -1;
+  }
+}
+
+cURLMultiThread::~cURLMultiThread() {
+  if ( mMulti ) {
+    for ( std::set<cURLCamera *>::iterator it = mCameras.begin(); it != mCameras.end(); ++it )
+      (*curl_multi_remove_handle_f)(mMulti, (*it)->handle());
+    (*curl_multi_cleanup_f)(mMulti);
+    mMulti = nullptr;
+  }
+  if ( mWakeupFd >= 0 )
+    close(mWakeupFd);
+  if ( mEpollFd >= 0 )
+    close(mEpollFd);
+}
+
+void cURLMultiThread::wakeup() {
+  uint64_t one = 1;
+  if ( write(mWakeupFd, &one, sizeof(one)) < 0 && errno != EAGAIN )
+    Error("Can't wake up cURL thread: %s", strerror(errno));
+}
+
+void cURLMultiThread::add(cURLCamera *camera) {
+  mMutex.lock();
+  mPendingAdds.push_back(camera);
+  mMutex.unlock();
+  wakeup();
+}
+
+void cURLMultiThread::remove(cURLCamera *camera) {
+  mMutex.lock();
+  for ( std::deque<cURLCamera *>::iterator it = mPendingAdds.begin(); it != mPendingAdds.end(); ++it ) {
+    if ( *it == camera ) {
+      /* Never got started, so there is nothing to wait for */
+      mPendingAdds.erase(it);
+      mMutex.unlock();
+      return;
+    }
+  }
+  mPendingRemoves.push_back(camera);
+  wakeup();
+  /* libcurl may still be calling into the camera until the handle is removed */
+  while ( mCameras.count(camera) || (std::find(mPendingRemoves.begin(), mPendingRemoves.end(), camera) != mPendingRemoves.end()) ) {
+    mCondition.wait();
+  }
+  mMutex.unlock();
+}
+
+void cURLMultiThread::stop() {
+  mStop = true;
+  wakeup();
+}
+
+void cURLMultiThread::processPending() {
+  std::deque<cURLCamera *> adds;
+  std::deque<cURLCamera *> removes;
+
+  mMutex.lock();
+  adds.swap(mPendingAdds);
+  removes.swap(mPendingRemoves);
+  mMutex.unlock();
+
+  for ( std::deque<cURLCamera *>::iterator it = removes.begin(); it != removes.end(); ++it ) {
+    (*curl_multi_remove_handle_f)(mMulti, (*it)->handle());
+  }
+  for ( std::deque<cURLCamera *>::iterator it = adds.begin(); it != adds.end(); ++it ) {
+    CURLMcode mRet = (*curl_multi_add_handle_f)(mMulti, (*it)->handle());
+    if ( mRet != CURLM_OK ) {
+      Error("Failed adding cURL handle: %s", (*curl_multi_strerror_f)(mRet));
+      continue;
+    }
+  }
+
+  if ( adds.empty() && removes.empty() )
+    return;
+
+  mMutex.lock();
+  for ( std::deque<cURLCamera *>::iterator it = removes.begin(); it != removes.end(); ++it )
+    mCameras.erase(*it);
+  for ( std::deque<cURLCamera *>::iterator it = adds.begin(); it != adds.end(); ++it )
+    mCameras.insert(*it);
+  mCondition.broadcast();
+  mMutex.unlock();
+  Debug(3, "cURL thread now has %zu cameras", mCameras.size());
+}
+
+void cURLMultiThread::checkCompleted() {
+  CURLMsg *msg;
+  int msgs_left;
+
+  while ( (msg = (*curl_multi_info_read_f)(mMulti, &msgs_left)) ) {
+    if ( msg->msg != CURLMSG_DONE )
+      continue;
+
+    CURL *easy = msg->easy_handle;
+    CURLcode cRet = msg->data.result;
+    cURLCamera *camera = nullptr;
+    (*curl_easy_getinfo_f)(easy, CURLINFO_PRIVATE, &camera);
+
+    /* An easy handle has to be removed and added again to restart it. The
+     * connection stays in the multi handle's cache, so it gets reused. */
+    (*curl_multi_remove_handle_f)(mMulti, easy);
+    if ( camera && camera->request_complete(cRet) ) {
+      CURLMcode mRet = (*curl_multi_add_handle_f)(mMulti, easy);
+      if ( mRet != CURLM_OK )
+        Error("Failed restarting cURL handle: %s", (*curl_multi_strerror_f)(mRet));
+    }
+  }
+}
+
+int cURLMultiThread::socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+  cURLMultiThread *thread = reinterpret_cast<cURLMultiThread *>(userp);
+
+  if ( what == CURL_POLL_REMOVE ) {
+    /* The socket may already be closed, in which case epoll has dropped it */
+    epoll_ctl(thread->mEpollFd, EPOLL_CTL_DEL, s, nullptr);
+    return 0;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  if ( what & CURL_POLL_IN )
+    ev.events |= EPOLLIN;
+  if ( what & CURL_POLL_OUT )
+    ev.events |= EPOLLOUT;
+  ev.data.fd = s;
+
+  if ( epoll_ctl(thread->mEpollFd, EPOLL_CTL_MOD, s, &ev) < 0 ) {
+    if ( (errno != ENOENT) || (epoll_ctl(thread->mEpollFd, EPOLL_CTL_ADD, s, &ev) < 0) )
+      Error("Can't watch cURL socket %d: %s", s, strerror(errno));
+  }
+  return 0;
+}
+
+int cURLMultiThread::timer_callback(CURLM *multi, long timeout_ms, void *userp) {
+  cURLMultiThread *thread = reinterpret_cast<cURLMultiThread *>(userp);
+  thread->mTimerDeadline = (timeout_ms < 0) ? -1 : monotonic_ms() + timeout_ms;
+  return 0;
+}
+
+int cURLMultiThread::run() {
+  struct epoll_event events[CURL_MULTI_MAX_EVENTS];
+  int running;
+
+  Debug(2, "Starting cURL thread");
+  while ( !mStop ) {
+    processPending();
+
+    int wait_ms = -1;
+    if ( mTimerDeadline >= 0 ) {
+      wait_ms = mTimerDeadline - monotonic_ms();
+      if ( wait_ms < 0 )
+        wait_ms = 0;
+    }
+
+    int n_events = epoll_wait(mEpollFd, events, CURL_MULTI_MAX_EVENTS, wait_ms);
+    if ( n_events < 0 ) {
+      if ( errno != EINTR )
+        Error("epoll_wait failed: %s", strerror(errno));
+      continue;
+    }
+
+    for ( int i = 0; i < n_events; i++ ) {
+      int fd = events[i].data.fd;
+      if ( fd == mWakeupFd ) {
+        uint64_t count;
+        if ( read(mWakeupFd, &count, sizeof(count)) < 0 && errno != EAGAIN )
+          Error("Can't read cURL thread eventfd: %s", strerror(errno));
+        continue;
+      }
+      int flags = 0;
+      if ( events[i].events & EPOLLIN )
+        flags |= CURL_CSELECT_IN;
+      if ( events[i].events & EPOLLOUT )
+        flags |= CURL_CSELECT_OUT;
+      if ( events[i].events & (EPOLLERR|EPOLLHUP) )
+        flags |= CURL_CSELECT_ERR;
+      (*curl_multi_socket_action_f)(mMulti, fd, flags, &running);
+    }
+
+    if ( (mTimerDeadline >= 0) && (monotonic_ms() >= mTimerDeadline) ) {
+      mTimerDeadline = -1;
+      (*curl_multi_socket_action_f)(mMulti, CURL_SOCKET_TIMEOUT, 0, &running);
+    }
+
+    checkCompleted();
+  }
+  Debug(2, "cURL thread exiting");
+
+  return 0;
+}
+
 /* These functions call the functions in the class for the correct object */
 size_t data_callback_dispatcher(void *buffer, size_t size, size_t nmemb, void *userdata) {
   return reinterpret_cast<cURLCamera*>(userdata)->data_callback(buffer,size,nmemb,userdata);
@@ -620,8 +926,4 @@ int progress_callback_dispatcher(void *userdata, double dltotal, double dlnow, d
   return reinterpret_cast<cURLCamera*>(userdata)->progress_callback(userdata,dltotal,dlnow,ultotal,ulnow);
 }
 
-void* thread_func_dispatcher(void* object) {
-  return reinterpret_cast<cURLCamera*>(object)->thread_func();
-}
-
 #endif // HAVE_LIBCURL
@@ -28,13 +28,17 @@
 #include "zm_regexp.h"
 #include "zm_utils.h"
 #include "zm_signal.h"
+#include "zm_thread.h"
 #include <string>
 #include <deque>
+#include <set>
 
 #if HAVE_CURL_CURL_H
 #include <curl/curl.h>
 #endif
 
+class cURLMultiThread;
+
 //
 // Class representing 'curl' cameras, i.e. those which are
 // accessed using the curl library
@@ -49,6 +53,8 @@ protected:
 
   /* cURL object(s) */
   CURL* c;
+  cURLMultiThread *multi;
+  int attempt;
 
   /* Shared data */
   volatile bool bTerminate;
@@ -58,7 +64,6 @@ protected:
   std::deque<size_t> single_offsets;
 
   /* pthread objects */
-  pthread_t thread;
   pthread_mutex_t shareddata_mutex;
   pthread_cond_t data_available_cond;
   pthread_cond_t request_complete_cond;
@@ -85,17 +90,61 @@ public:
   size_t header_callback(void *buffer, size_t size, size_t nmemb, void *userdata);
   int progress_callback(void *userdata, double dltotal, double dlnow, double ultotal, double ulnow);  
   int debug_callback(CURL* handle, curl_infotype type, char* str, size_t strsize, void* data);
-  void* thread_func();
+  int setup_handle();
+  bool request_complete(CURLcode cRet);
+  CURL *handle() const { return c; }
   int lock();
   int unlock();
 
 };
 
+//
+// A single thread per process that drives the transfers of all cURL cameras
+// through one curl multi handle, woken by epoll on their sockets. Connections
+// are kept in the multi handle's cache so snapshot cameras reuse them.
+//
+class cURLMultiThread : public Thread {
+private:
+  static cURLMultiThread *smInstance;
+  static int smUsers;
+  static Mutex smInstanceMutex;
+
+  CURLM *mMulti;
+  int mEpollFd;
+  int mWakeupFd;
+  long mTimerDeadline; // Monotonic ms at which curl wants a timeout, or -1
+  bool mStop;
+
+  Mutex mMutex;
+  Condition mCondition;
+  std::deque<cURLCamera *> mPendingAdds;
+  std::deque<cURLCamera *> mPendingRemoves;
+  std::set<cURLCamera *> mCameras;
+
+  cURLMultiThread();
+  ~cURLMultiThread();
+
+  void wakeup();
+  void processPending();
+  void checkCompleted();
+
+public:
+  static cURLMultiThread *acquire();
+  static void release();
+
+  void add(cURLCamera *camera);
+  void remove(cURLCamera *camera);
+  void stop();
+  int run();
+
+  static int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp);
+  static int timer_callback(CURLM *multi, long timeout_ms, void *userp);
+};
+
 /* Dispatchers */
 size_t header_callback_dispatcher(void *buffer, size_t size, size_t nmemb, void *userdata);
 size_t data_callback_dispatcher(void *buffer, size_t size, size_t nmemb, void *userdata);
 int progress_callback_dispatcher(void *userdata, double dltotal, double dlnow, double ultotal, double ulnow);
-void* thread_func_dispatcher(void* object);
 
 #endif // HAVE_LIBCURL
 
@@ -105,8 +105,9 @@ MYSQL_RES * zmDbFetch(const char * query) {
   }
 
   if ( mysql_query(&dbconn, query) ) {
-    db_mutex.unlock();
+    // The error belongs to the connection, read it before another thread can use it
     Error("Can't run query: %s", mysql_error(&dbconn));
+    db_mutex.unlock();
     return nullptr;
   }
   Debug(4, "Success running query: %s", query);
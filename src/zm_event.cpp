@@ -56,18 +56,22 @@ Event::Event(
   cause(p_cause),
   noteSetMap(p_noteSetMap),
   videoEvent(p_videoEvent),
-  videowriter(nullptr)
+  videowriter(nullptr),
+  open_thread(nullptr),
+  open_condition(open_mutex),
+  opened(false),
+  pending_bytes(0),
+  pending_alarm_frames(0),
+  notes_pending(false)
 {
-
-  std::string notes;
-  createNotes(notes);
+  id = 0;
+  createNotes(open_notes);
 
   struct timeval now;
   gettimeofday(&now, 0);
 
-  bool untimedEvent = false;
   if ( !start_time.tv_sec ) {
-    untimedEvent = true;
+    Warning("Event has zero time, setting to current");
     start_time = now;
   } else if ( start_time.tv_sec > now.tv_sec ) {
     Error(
@@ -80,6 +84,30 @@ Event::Event(
   Storage * storage = monitor->getStorage();
   scheme = storage->Scheme();
 
+  end_time.tv_sec = 0;
+  frames = 0;
+  alarm_frames = 0;
+  tot_score = 0;
+  max_score = 0;
+  alarm_frame_written = false;
+  last_db_frame = 0;
+
+  // The database and the event storage can both be slow, so the row, the
+  // directories and the video writer are set up on a thread of their own
+  // while frames added in the meantime are kept in memory.
+  open_thread = new std::thread([](Event *event) {
+      event->Open();
+      event->open_mutex.lock();
+      event->opened = true;
+      event->open_condition.broadcast();
+      event->open_mutex.unlock();
+      }, this);
+} // Event::Event( Monitor *p_monitor, struct timeval p_start_time, const std::string &p_cause, const StringSetMap &p_noteSetMap, bool p_videoEvent )
+
+// Inserts the event into the database and creates its directory and video writer
+void Event::Open() {
+  Storage * storage = monitor->getStorage();
+
   unsigned int state_id = 0;
   zmDbRow dbrow;
   if ( dbrow.fetch("SELECT Id FROM States WHERE IsActive=1") ) {
@@ -87,7 +115,8 @@ Event::Event(
   }
 
   char sql[ZM_SQL_MED_BUFSIZ];
-  struct tm *stime = localtime(&start_time.tv_sec);
+  struct tm tm_info;
+  struct tm *stime = localtime_r(&start_time.tv_sec, &tm_info);
   snprintf(sql, sizeof(sql), "INSERT INTO Events "
       "( MonitorId, StorageId, Name, StartTime, Width, Height, Cause, Notes, StateId, Orientation, Videoed, DefaultVideo, SaveJPEGs, Scheme )"
      " VALUES ( %u, %u, 'New Event', from_unixtime( %ld ), %u, %u, '%s', '%s', %u, %d, %d, '%s', %d, '%s' )",
@@ -97,7 +126,7 @@ Event::Event(
       monitor->Width(),
       monitor->Height(),
       cause.c_str(),
-      notes.c_str(), 
+      open_notes.c_str(),
       state_id,
       monitor->getOrientation(),
       videoEvent,
@@ -116,15 +145,6 @@ Event::Event(
   id = mysql_insert_id(&dbconn);
 
   db_mutex.unlock();
-  if ( untimedEvent ) {
-    Warning("Event %d has zero time, setting to current", id);
-  }
-  end_time.tv_sec = 0;
-  frames = 0;
-  alarm_frames = 0;
-  tot_score = 0;
-  max_score = 0;
-  alarm_frame_written = false;
 
   std::string id_file;
 
@@ -194,7 +214,7 @@ Event::Event(
 		}
   } // deep storage or not
 
-  last_db_frame = 0;
+  frame_index.Create(path, id, start_time);
 
   video_name = "";
 
@@ -206,11 +226,13 @@ Event::Event(
   if ( monitor->GetOptVideoWriter() != 0 ) {
     video_name = stringtf("%" PRIu64 "-%s", id, "video.mp4");
     snprintf(sql, sizeof(sql), "UPDATE Events SET DefaultVideo = '%s' WHERE Id=%" PRIu64, video_name.c_str(), id);
+    db_mutex.lock();
     if ( mysql_query(&dbconn, sql) ) {
       db_mutex.unlock();
       Error("Can't update event: %s. sql was (%s)", mysql_error(&dbconn), sql);
       return;
     }
+    db_mutex.unlock();
     video_file = path + "/" + video_name;
 			Debug(1, "Writing video file to %s", video_file.c_str());
 
@@ -241,9 +263,119 @@ Event::Event(
     /* No video object */
     videowriter = nullptr;
   }
-} // Event::Event( Monitor *p_monitor, struct timeval p_start_time, const std::string &p_cause, const StringSetMap &p_noteSetMap, bool p_videoEvent )
+} // void Event::Open()
+
+uint64_t Event::Id() const {
+  // The id comes from the insert, so wait for it if the event is still being opened
+  open_mutex.lock();
+  while ( !opened )
+    open_condition.wait();
+  open_mutex.unlock();
+  return id;
+}
+
+// Returns true once the event has been opened and any frames held back in the
+// meantime have been written. Only waits for the open when too much is held.
+bool Event::Opened() {
+  if ( !open_thread )
+    return true;
+
+  open_mutex.lock();
+  bool done = opened;
+  open_mutex.unlock();
+  if ( !done ) {
+    if ( pending_bytes < max_pending_bytes )
+      return false;
+    Warning("Event still opening with %lu bytes of frames held, waiting for it", pending_bytes);
+  }
+  WaitOpen();
+  return true;
+}
+
+void Event::WaitOpen() {
+  if ( !open_thread )
+    return;
+
+  open_thread->join();
+  delete open_thread;
+  open_thread = nullptr;
+
+  Debug(1, "Event %" PRIu64 " open, writing %d held frames", id, pending_frames.size());
+  while ( pending_frames.size() ) {
+    if ( pending_frames.front().pre_capture ) {
+      // Pre-event frames go back through AddFrames so they are inserted in batches
+      std::vector<Image *> pre_images;
+      std::vector<struct timeval *> pre_timestamps;
+      for ( std::deque<PendingFrame>::iterator it = pending_frames.begin();
+          it != pending_frames.end() && it->pre_capture; ++it ) {
+        pre_images.push_back(it->image);
+        pre_timestamps.push_back(&(it->timestamp));
+      }
+      AddFrames(pre_images.size(), &pre_images[0], &pre_timestamps[0]);
+      for ( unsigned int i = 0; i < pre_images.size(); i++ ) {
+        delete pending_frames.front().image;
+        pending_frames.pop_front();
+      }
+    } else {
+      PendingFrame pending = pending_frames.front();
+      pending_frames.pop_front();
+      if ( pending.score > 0 )
+        pending_alarm_frames--;
+      AddFrame(pending.image, pending.timestamp, pending.score, pending.alarm_image);
+      delete pending.image;
+      delete pending.alarm_image;
+    }
+  }
+  pending_bytes = 0;
+  pending_alarm_frames = 0;
+
+  if ( notes_pending ) {
+    notes_pending = false;
+    WriteNotes();
+  }
+
+  for ( std::vector<std::string>::iterator it = pending_stats.begin(); it != pending_stats.end(); ++it )
+    WriteStats(*it);
+  pending_stats.clear();
+} // end void Event::WaitOpen()
+
+// Records the SET clause of a row of zone stats, which can't be inserted until the event has an id
+void Event::AddStats(const std::string &stats) {
+  if ( !Opened() ) {
+    pending_stats.push_back(stats);
+    return;
+  }
+  WriteStats(stats);
+}
+
+void Event::WriteStats(const std::string &stats) {
+  std::string sql = stringtf("INSERT INTO Stats SET EventId=%" PRIu64 ", %s", id, stats.c_str());
+  db_mutex.lock();
+  if ( mysql_query(&dbconn, sql.c_str()) ) {
+    Error("Can't insert event stats: %s", mysql_error(&dbconn));
+  }
+  db_mutex.unlock();
+}
+
+void Event::BufferFrame(Image *image, struct timeval timestamp, int score, Image *alarm_image, bool pre_capture) {
+  PendingFrame pending;
+  pending.image = new Image(*image);
+  pending.timestamp = timestamp;
+  pending.score = score;
+  pending.alarm_image = alarm_image ? new Image(*alarm_image) : nullptr;
+  pending.pre_capture = pre_capture;
+  pending_frames.push_back(pending);
+
+  pending_bytes += image->Size() + (alarm_image ? alarm_image->Size() : 0);
+  if ( score > 0 )
+    pending_alarm_frames++;
+  end_time = timestamp;
+}
 
 Event::~Event() {
+  // Anything held back while opening has to be written before the event is closed
+  WaitOpen();
+
   // We close the videowriter first, because if we finish the event, we might try to view the file, but we aren't done writing it yet.
 
   /* Close the video file */
@@ -282,6 +414,7 @@ Event::~Event() {
      Debug(3, "Video start_time %d sec %d usec not valid -- frame deltas not updated",
            video_start_time.tv_sec, video_start_time.tv_usec);
   }
+  frame_index.Close(end_time, frames, video_offset.tv_sec + video_offset.tv_usec*1e-6);
 
   // Should not be static because we might be multi-threaded
   char sql[ZM_SQL_LGE_BUFSIZ];
@@ -434,72 +567,89 @@ void Event::updateNotes(const StringSetMap &newNoteSetMap) {
   } // end if have new notes
 
   if ( update ) {
-    std::string notes;
-    createNotes(notes);
+    if ( !Opened() ) {
+      // The row doesn't exist yet, so write the notes once it does
+      notes_pending = true;
+      return;
+    }
+    WriteNotes();
+  }  // end if update
+}  // void Event::updateNotes(const StringSetMap &newNoteSetMap)
 
-    Debug(2, "Updating notes for event %d, '%s'", id, notes.c_str());
-    static char sql[ZM_SQL_LGE_BUFSIZ];
+void Event::WriteNotes() {
+  std::string notes;
+  createNotes(notes);
+
+  Debug(2, "Updating notes for event %d, '%s'", id, notes.c_str());
+  static char sql[ZM_SQL_LGE_BUFSIZ];
 #if USE_PREPARED_SQL
-    static MYSQL_STMT *stmt = 0;
+  static MYSQL_STMT *stmt = 0;
 
-    char notesStr[ZM_SQL_MED_BUFSIZ] = "";
-    unsigned long notesLen = 0;
+  char notesStr[ZM_SQL_MED_BUFSIZ] = "";
+  unsigned long notesLen = 0;
 
-    if ( !stmt ) {
-      const char *sql = "UPDATE `Events` SET `Notes` = ? WHERE `Id` = ?";
+  if ( !stmt ) {
+    const char *sql = "UPDATE `Events` SET `Notes` = ? WHERE `Id` = ?";
 
-      stmt = mysql_stmt_init(&dbconn);
-      if ( mysql_stmt_prepare(stmt, sql, strlen(sql)) ) {
-        Fatal("Unable to prepare sql '%s': %s", sql, mysql_stmt_error(stmt));
-      }
+    stmt = mysql_stmt_init(&dbconn);
+    if ( mysql_stmt_prepare(stmt, sql, strlen(sql)) ) {
+      Fatal("Unable to prepare sql '%s': %s", sql, mysql_stmt_error(stmt));
+    }
 
-      /* Get the parameter count from the statement */
-      if ( mysql_stmt_param_count(stmt) != 2 ) {
-        Error("Unexpected parameter count %ld in sql '%s'", mysql_stmt_param_count(stmt), sql);
-      }
+    /* Get the parameter count from the statement */
+    if ( mysql_stmt_param_count(stmt) != 2 ) {
+      Error("Unexpected parameter count %ld in sql '%s'", mysql_stmt_param_count(stmt), sql);
+    }
 
-      MYSQL_BIND  bind[2];
-      memset(bind, 0, sizeof(bind));
+    MYSQL_BIND  bind[2];
+    memset(bind, 0, sizeof(bind));
 
-      /* STRING PARAM */
-      bind[0].buffer_type = MYSQL_TYPE_STRING;
-      bind[0].buffer = (char *)notesStr;
-      bind[0].buffer_length = sizeof(notesStr);
-      bind[0].is_null = 0;
-      bind[0].length = &notesLen;
+    /* STRING PARAM */
+    bind[0].buffer_type = MYSQL_TYPE_STRING;
+    bind[0].buffer = (char *)notesStr;
+    bind[0].buffer_length = sizeof(notesStr);
+    bind[0].is_null = 0;
+    bind[0].length = &notesLen;
 
-      bind[1].buffer_type= MYSQL_TYPE_LONG;
-      bind[1].buffer= (char *)&id;
-      bind[1].is_null= 0;
-      bind[1].length= 0;
+    bind[1].buffer_type= MYSQL_TYPE_LONG;
+    bind[1].buffer= (char *)&id;
+    bind[1].is_null= 0;
+    bind[1].length= 0;
 
-      /* Bind the buffers */
-      if ( mysql_stmt_bind_param(stmt, bind) ) {
-        Error("Unable to bind sql '%s': %s", sql, mysql_stmt_error(stmt));
-      }
+    /* Bind the buffers */
+    if ( mysql_stmt_bind_param(stmt, bind) ) {
+      Error("Unable to bind sql '%s': %s", sql, mysql_stmt_error(stmt));
     }
+  }
 
-    strncpy(notesStr, notes.c_str(), sizeof(notesStr));
+  strncpy(notesStr, notes.c_str(), sizeof(notesStr));
 
-    if ( mysql_stmt_execute(stmt) ) {
-      Error("Unable to execute sql '%s': %s", sql, mysql_stmt_error(stmt));
-    }
+  if ( mysql_stmt_execute(stmt) ) {
+    Error("Unable to execute sql '%s': %s", sql, mysql_stmt_error(stmt));
+  }
 #else
-    static char escapedNotes[ZM_SQL_MED_BUFSIZ];
+  static char escapedNotes[ZM_SQL_MED_BUFSIZ];
 
-    mysql_real_escape_string(&dbconn, escapedNotes, notes.c_str(), notes.length());
+  mysql_real_escape_string(&dbconn, escapedNotes, notes.c_str(), notes.length());
 
-    snprintf(sql, sizeof(sql), "UPDATE `Events` SET `Notes` = '%s' WHERE `Id` = %" PRIu64, escapedNotes, id);
-    db_mutex.lock();
-    if ( mysql_query(&dbconn, sql) ) {
-      Error("Can't insert event: %s", mysql_error(&dbconn));
-    }
-    db_mutex.unlock();
+  snprintf(sql, sizeof(sql), "UPDATE `Events` SET `Notes` = '%s' WHERE `Id` = %" PRIu64, escapedNotes, id);
+  db_mutex.lock();
+  if ( mysql_query(&dbconn, sql) ) {
+    Error("Can't insert event: %s", mysql_error(&dbconn));
+  }
+  db_mutex.unlock();
 #endif
-  }  // end if update
-}  // void Event::updateNotes(const StringSetMap &newNoteSetMap)
+}  // void Event::WriteNotes()
 
 void Event::AddFrames(int n_frames, Image **images, struct timeval **timestamps) {
+  if ( !Opened() ) {
+    for ( int i = 0; i < n_frames; i++ ) {
+      if ( timestamps[i]->tv_sec > 0 )
+        BufferFrame(images[i], *(timestamps[i]), 0, nullptr, true);
+    }
+    return;
+  }
+
   for (int i = 0; i < n_frames; i += ZM_SQL_BATCH_SIZE) {
     AddFramesInternal(n_frames, i, images, timestamps);
   }
@@ -517,6 +667,7 @@ void Event::AddFramesInternal(int n_frames, int start_frame, Image **images, str
     }
 
     frames++;
+    frame_index.Add(frames, NORMAL, *(timestamps[i]));
 
     if ( monitor->GetOptSaveJPEGs() & 1 ) {
 			std::string event_file = stringtf(staticConfig.capture_file_format, path.c_str(), frames);
@@ -629,12 +780,18 @@ void Event::AddFrame(Image *image, struct timeval timestamp, int score, Image *a
     return;
   }
 
+  if ( !Opened() ) {
+    BufferFrame(image, timestamp, score, alarm_image, false);
+    return;
+  }
+
   frames++;
   bool write_to_db = false;
   FrameType frame_type = score>0?ALARM:(score<0?BULK:NORMAL);
   // < 0 means no motion detection is being done.
   if ( score < 0 )
     score = 0;
+  frame_index.Add(frames, frame_type, timestamp);
 
   if ( monitor->GetOptSaveJPEGs() & 1 ) {
     std::string event_file = stringtf(staticConfig.capture_file_format, path.c_str(), frames);
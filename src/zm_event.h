@@ -34,12 +34,17 @@
 #include <set>
 #include <map>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <thread>
 
 #include "zm.h"
 #include "zm_image.h"
 #include "zm_stream.h"
 #include "zm_video.h"
 #include "zm_storage.h"
+#include "zm_thread.h"
+#include "zm_event_index.h"
 
 class Zone;
 class Monitor;
@@ -74,6 +79,17 @@ class Event {
     };
     std::queue<Frame*> frame_data;
 
+    // A frame added while the event is still being opened
+    struct PendingFrame {
+      Image *image;
+      struct timeval timestamp;
+      int score;
+      Image *alarm_image;
+      bool pre_capture;
+    };
+    // Frames held in memory beyond this wait for the open rather than growing further
+    static const unsigned long max_pending_bytes = 128*1024*1024;
+
     static int pre_alarm_count;
     static PreAlarmData pre_alarm_data[MAX_PRE_ALARM_FRAMES];
 
@@ -102,8 +118,25 @@ class Event {
     std::string timecodes_file;
     int        last_db_frame;
     Storage::Schemes  scheme;
+    EventIndex frame_index;
+
+    std::thread *open_thread; // Inserts the event row and creates its directory off the analysis thread
+    mutable Mutex open_mutex;
+    mutable Condition open_condition;
+    bool opened;
+    std::string open_notes;
+    std::deque<PendingFrame> pending_frames;
+    unsigned long pending_bytes;
+    int pending_alarm_frames;
+    bool notes_pending;
+    std::vector<std::string> pending_stats;   // Zone stats recorded while the event is still being opened
 
     void createNotes( std::string &notes );
+    void Open();
+    void WaitOpen();
+    void BufferFrame( Image *image, struct timeval timestamp, int score, Image *alarm_image, bool pre_capture );
+    void WriteNotes();
+    void WriteStats( const std::string &stats );
 
   public:
     static bool OpenFrameSocket( int );
@@ -112,10 +145,11 @@ class Event {
     Event( Monitor *p_monitor, struct timeval p_start_time, const std::string &p_cause, const StringSetMap &p_noteSetMap, bool p_videoEvent=false );
     ~Event();
 
-    uint64_t Id() const { return id; }
+    uint64_t Id() const;
+    bool Opened();
     const std::string &Cause() const { return cause; }
-    int Frames() const { return frames; }
-    int AlarmFrames() const { return alarm_frames; }
+    int Frames() const { return frames + pending_frames.size(); }
+    int AlarmFrames() const { return alarm_frames + pending_alarm_frames; }
 
     const struct timeval &StartTime() const { return start_time; }
     const struct timeval &EndTime() const { return end_time; }
@@ -128,6 +162,7 @@ class Event {
 
     void AddFrames( int n_frames, Image **images, struct timeval **timestamps );
     void AddFrame( Image *image, struct timeval timestamp, int score=0, Image *alarm_image=nullptr );
+    void AddStats( const std::string &stats );
 
   private:
     void AddFramesInternal( int n_frames, int start_frame, Image **images, struct timeval **timestamps );
@@ -0,0 +1,160 @@
+//ZoneMinder Event Index Implementation Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "zm_event_index.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cinttypes>
+
+#include "zm.h"
+
+const char *EventIndex::filename = "frames.idx";
+
+EventIndex::EventIndex() :
+  fd(-1),
+  map(nullptr),
+  map_size(0),
+  header(nullptr),
+  entries(nullptr),
+  entry_count(0),
+  event_id(0)
+{
+  start_time.tv_sec = 0;
+  start_time.tv_usec = 0;
+}
+
+EventIndex::~EventIndex() {
+  if ( map )
+    munmap(map, map_size);
+  if ( fd >= 0 )
+    close(fd);
+}
+
+void EventIndex::fillHeader(Header *h) const {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, "ZMFI", sizeof(h->magic));
+  h->version = version;
+  h->event_id = event_id;
+  h->start_time = (start_time.tv_sec * INT64_C(1000000)) + start_time.tv_usec;
+}
+
+bool EventIndex::Create(const std::string &event_path, uint64_t p_event_id, const struct timeval &p_start_time) {
+  std::string path = event_path + "/" + filename;
+  fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if ( fd < 0 ) {
+    Error("Can't create frame index %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  event_id = p_event_id;
+  start_time = p_start_time;
+
+  Header h;
+  fillHeader(&h);
+  if ( write(fd, &h, sizeof(h)) != sizeof(h) ) {
+    Error("Can't write frame index %s: %s", path.c_str(), strerror(errno));
+    close(fd);
+    fd = -1;
+    return false;
+  }
+  return true;
+}
+
+bool EventIndex::Add(int frame_id, int type, const struct timeval &timestamp) {
+  if ( fd < 0 )
+    return false;
+
+  Entry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.delta = ((timestamp.tv_sec - start_time.tv_sec) * INT64_C(1000000)) + (timestamp.tv_usec - start_time.tv_usec);
+  entry.frame_id = frame_id;
+  entry.type = type;
+  if ( write(fd, &entry, sizeof(entry)) != sizeof(entry) ) {
+    Error("Can't add frame %d to frame index: %s", frame_id, strerror(errno));
+    // A torn entry would throw out every one after it
+    close(fd);
+    fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void EventIndex::Close(const struct timeval &end_time, int frame_count, double video_offset) {
+  if ( fd < 0 )
+    return;
+
+  Header h;
+  fillHeader(&h);
+  h.end_time = (end_time.tv_sec * INT64_C(1000000)) + end_time.tv_usec;
+  h.video_offset = video_offset * 1000000;
+  h.frame_count = frame_count;
+  if ( pwrite(fd, &h, sizeof(h), 0) != sizeof(h) )
+    Error("Can't finish frame index for event %" PRIu64 ": %s", event_id, strerror(errno));
+  close(fd);
+  fd = -1;
+}
+
+bool EventIndex::Map(const std::string &event_path, uint64_t p_event_id) {
+  std::string path = event_path + "/" + filename;
+  int map_fd = open(path.c_str(), O_RDONLY);
+  if ( map_fd < 0 ) {
+    // Events recorded before there were indexes don't have one
+    Debug(1, "No frame index %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if ( (fstat(map_fd, &st) < 0) || ((size_t)st.st_size < sizeof(Header)) ) {
+    Warning("Frame index %s is too short", path.c_str());
+    close(map_fd);
+    return false;
+  }
+  map_size = st.st_size;
+  void *mem = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, map_fd, 0);
+  close(map_fd);
+  if ( mem == MAP_FAILED ) {
+    Warning("Can't map frame index %s: %s", path.c_str(), strerror(errno));
+    map_size = 0;
+    return false;
+  }
+  map = (uint8_t *)mem;
+
+  header = (const Header *)map;
+  if ( memcmp(header->magic, "ZMFI", sizeof(header->magic)) || (header->version != version) || (header->event_id != p_event_id) ) {
+    Warning("Frame index %s is not one for event %" PRIu64, path.c_str(), p_event_id);
+    munmap(map, map_size);
+    map = nullptr;
+    map_size = 0;
+    header = nullptr;
+    return false;
+  }
+  event_id = p_event_id;
+  entries = (const Entry *)(map + sizeof(Header));
+  entry_count = (map_size - sizeof(Header)) / sizeof(Entry);
+  return true;
+}
+
+double EventIndex::Duration() const {
+  if ( !entry_count )
+    return 0.0;
+  return (entries[entry_count-1].delta - entries[0].delta) / 1000000.0;
+}
@@ -0,0 +1,89 @@
+//ZoneMinder Event Index Interface Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef ZM_EVENT_INDEX_H
+#define ZM_EVENT_INDEX_H
+
+#include <sys/time.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+//
+// A compact binary index of every frame in an event, kept in the event's
+// directory alongside its images and video. zma appends to it as frames are
+// added, and zms maps it to find out where each frame is without going
+// through the Frames table, which only has some of the frames in it anyway.
+// Entries are only ever appended, so an index can be read while the event
+// is still being recorded; anything past the last whole entry is ignored.
+//
+class EventIndex {
+  public:
+    struct Header {
+      char magic[4];
+      uint32_t version;
+      uint64_t event_id;
+      int64_t start_time;     // Microseconds since the epoch
+      int64_t end_time;       // Microseconds since the epoch, 0 while the event is being recorded
+      int64_t video_offset;   // Microseconds to take off every delta to match the video, set when the event ends
+      uint32_t frame_count;   // Set when the event ends
+      uint32_t padding;
+    };
+    struct Entry {
+      int64_t delta;          // Microseconds since the start of the event
+      uint32_t frame_id;
+      uint8_t type;
+      uint8_t padding[3];
+    };
+
+  private:
+    static const char *filename;
+    static const uint32_t version = 1;
+
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    const Header *header;
+    const Entry *entries;
+    int entry_count;
+    uint64_t event_id;
+    struct timeval start_time;
+
+    void fillHeader(Header *h) const;
+
+  public:
+    EventIndex();
+    ~EventIndex();
+
+    // Writing, by the event
+    bool Create(const std::string &event_path, uint64_t p_event_id, const struct timeval &p_start_time);
+    bool Add(int frame_id, int type, const struct timeval &timestamp);
+    void Close(const struct timeval &end_time, int frame_count, double video_offset);
+
+    // Reading, by zms
+    bool Map(const std::string &event_path, uint64_t event_id);
+    int Frames() const { return entry_count; }
+    const Entry &Frame(int index) const { return entries[index]; }
+    // Seconds since the start of the event, with the video offset applied
+    double Offset(int index) const { return (entries[index].delta - header->video_offset) / 1000000.0; }
+    // Seconds from the first frame to the last
+    double Duration() const;
+};
+
+#endif // ZM_EVENT_INDEX_H
@@ -35,6 +35,7 @@
 #include "zm_mpeg.h"
 #include "zm_signal.h"
 #include "zm_event.h"
+#include "zm_event_index.h"
 #include "zm_eventstream.h"
 #include "zm_storage.h"
 #include "zm_monitor.h"
@@ -112,203 +113,252 @@ bool EventStream::loadInitialEventData(uint64_t init_event_id, unsigned int init
   return true;
 }
 
-bool EventStream::loadEventData(uint64_t event_id) {
-  static char sql[ZM_SQL_MED_BUFSIZ];
+// Reads everything needed to stream an event without touching the stream
+// itself, so that it can also be done ahead of time on the prefetch thread.
+// The storage area is kept in *event_storage for next time.
+EventStream::LoadedEvent *EventStream::readEvent(uint64_t event_id, Storage **event_storage) {
+  char sql[ZM_SQL_MED_BUFSIZ];
 
   snprintf(sql, sizeof(sql),
       "SELECT `MonitorId`, `StorageId`, `Frames`, unix_timestamp( `StartTime` ) AS StartTimestamp, "
       "unix_timestamp( `EndTime` ) AS EndTimestamp, "
-      "(SELECT max(`Delta`)-min(`Delta`) FROM `Frames` WHERE `EventId`=`Events`.`Id`) AS Duration, "
       "`DefaultVideo`, `Scheme`, `SaveJPEGs`, `Orientation`+0 FROM `Events` WHERE `Id` = %" PRIu64, event_id);
 
-  if ( mysql_query(&dbconn, sql) ) {
-    Error("Can't run query: %s", mysql_error(&dbconn));
-    exit(mysql_errno(&dbconn));
-  }
-
-  MYSQL_RES *result = mysql_store_result(&dbconn);
-  if ( !result ) {
-    Error("Can't use query result: %s", mysql_error(&dbconn));
-    exit(mysql_errno(&dbconn));
-  }
-
-  if ( !mysql_num_rows(result) ) {
-    Fatal("Unable to load event %d, not found in DB", event_id);
-  }
+  MYSQL_RES *result = zmDbFetch(sql);
+  if ( !result )
+    return nullptr;
 
   MYSQL_ROW dbrow = mysql_fetch_row(result);
-
-  if ( mysql_errno(&dbconn) ) {
-    Error("Can't fetch row: %s", mysql_error(&dbconn));
-    exit(mysql_errno(&dbconn));
+  if ( !dbrow ) {
+    Error("Unable to load event %" PRIu64 ", not found in DB", event_id);
+    mysql_free_result(result);
+    return nullptr;
   }
 
-  delete event_data;
-  event_data = new EventData;
-  event_data->event_id = event_id;
-
-  event_data->monitor_id = atoi(dbrow[0]);
-  event_data->storage_id = dbrow[1] ? atoi(dbrow[1]) : 0;
-  event_data->frame_count = dbrow[2] == nullptr ? 0 : atoi(dbrow[2]);
-  event_data->start_time = atoi(dbrow[3]);
-  event_data->end_time = dbrow[4] ? atoi(dbrow[4]) : 0;
-  event_data->duration = dbrow[5] ? atof(dbrow[5]) : 0.0;
-  strncpy(event_data->video_file, dbrow[6], sizeof(event_data->video_file)-1);
-  std::string scheme_str = std::string(dbrow[7]);
+  LoadedEvent *loaded = new LoadedEvent;
+  loaded->ffmpeg_input = nullptr;
+  EventData *data = loaded->event_data = new EventData;
+  data->event_id = event_id;
+  data->frames = nullptr;
+
+  data->monitor_id = atoi(dbrow[0]);
+  data->storage_id = dbrow[1] ? atoi(dbrow[1]) : 0;
+  data->frame_count = dbrow[2] == nullptr ? 0 : atoi(dbrow[2]);
+  data->start_time = atoi(dbrow[3]);
+  data->end_time = dbrow[4] ? atoi(dbrow[4]) : 0;
+  data->duration = 0.0;
+  data->video_file[0] = '\0';
+  if ( dbrow[5] )
+    strncpy(data->video_file, dbrow[5], sizeof(data->video_file)-1);
+  data->video_file[sizeof(data->video_file)-1] = '\0';
+  std::string scheme_str = std::string(dbrow[6]);
   if ( scheme_str == "Deep" ) {
-    event_data->scheme = Storage::DEEP;
+    data->scheme = Storage::DEEP;
   } else if ( scheme_str == "Medium" ) {
-    event_data->scheme = Storage::MEDIUM;
+    data->scheme = Storage::MEDIUM;
   } else {
-    event_data->scheme = Storage::SHALLOW;
+    data->scheme = Storage::SHALLOW;
   }
-  event_data->SaveJPEGs = dbrow[8] == nullptr ? 0 : atoi(dbrow[8]);
-  event_data->Orientation = (Monitor::Orientation)(dbrow[9] == nullptr ? 0 : atoi(dbrow[9]));
+  data->SaveJPEGs = dbrow[7] == nullptr ? 0 : atoi(dbrow[7]);
+  data->Orientation = (Monitor::Orientation)(dbrow[8] == nullptr ? 0 : atoi(dbrow[8]));
   mysql_free_result(result);
 
-  if ( !monitor ) {
-    monitor = Monitor::Load(event_data->monitor_id, false, Monitor::QUERY);
-  } else if ( monitor->Id() != event_data->monitor_id ) {
-    delete monitor;
-    monitor = Monitor::Load(event_data->monitor_id, false, Monitor::QUERY);
-  }
-  if ( !monitor ) {
-    Fatal("Unable to load monitor id %d for streaming", event_data->monitor_id);
-  }
-
-  if ( !storage ) {
-    storage = new Storage(event_data->storage_id);
-  } else if ( storage->Id() != event_data->storage_id ) {
-    delete storage;
-    storage = new Storage(event_data->storage_id);
+  if ( !*event_storage ) {
+    *event_storage = new Storage(data->storage_id);
+  } else if ( (*event_storage)->Id() != data->storage_id ) {
+    delete *event_storage;
+    *event_storage = new Storage(data->storage_id);
   }
-  const char *storage_path = storage->Path();
+  const char *storage_path = (*event_storage)->Path();
 
-  if ( event_data->scheme == Storage::DEEP ) {
-    struct tm *event_time = localtime(&event_data->start_time);
+  if ( data->scheme == Storage::DEEP ) {
+    struct tm event_tm;
+    struct tm *event_time = localtime_r(&data->start_time, &event_tm);
 
     if ( storage_path[0] == '/' )
-      snprintf(event_data->path, sizeof(event_data->path),
+      snprintf(data->path, sizeof(data->path),
           "%s/%d/%02d/%02d/%02d/%02d/%02d/%02d",
-          storage_path, event_data->monitor_id,
+          storage_path, data->monitor_id,
           event_time->tm_year-100, event_time->tm_mon+1, event_time->tm_mday,
           event_time->tm_hour, event_time->tm_min, event_time->tm_sec);
     else
-      snprintf(event_data->path, sizeof(event_data->path),
+      snprintf(data->path, sizeof(data->path),
           "%s/%s/%d/%02d/%02d/%02d/%02d/%02d/%02d",
-          staticConfig.PATH_WEB.c_str(), storage_path, event_data->monitor_id,
+          staticConfig.PATH_WEB.c_str(), storage_path, data->monitor_id,
           event_time->tm_year-100, event_time->tm_mon+1, event_time->tm_mday,
           event_time->tm_hour, event_time->tm_min, event_time->tm_sec);
-  } else if ( event_data->scheme == Storage::MEDIUM ) {
-    struct tm *event_time = localtime(&event_data->start_time);
+  } else if ( data->scheme == Storage::MEDIUM ) {
+    struct tm event_tm;
+    struct tm *event_time = localtime_r(&data->start_time, &event_tm);
     if ( storage_path[0] == '/' )
-      snprintf(event_data->path, sizeof(event_data->path),
+      snprintf(data->path, sizeof(data->path),
           "%s/%d/%04d-%02d-%02d/%" PRIu64,
-          storage_path, event_data->monitor_id,
+          storage_path, data->monitor_id,
           event_time->tm_year+1900, event_time->tm_mon+1, event_time->tm_mday,
-          event_data->event_id);
+          data->event_id);
     else
-      snprintf(event_data->path, sizeof(event_data->path),
+      snprintf(data->path, sizeof(data->path),
           "%s/%s/%d/%04d-%02d-%02d/%" PRIu64,
-          staticConfig.PATH_WEB.c_str(), storage_path, event_data->monitor_id,
+          staticConfig.PATH_WEB.c_str(), storage_path, data->monitor_id,
           event_time->tm_year+1900, event_time->tm_mon+1, event_time->tm_mday, 
-          event_data->event_id);
+          data->event_id);
 
   } else {
     if ( storage_path[0] == '/' )
-      snprintf(event_data->path, sizeof(event_data->path), "%s/%d/%" PRIu64,
-          storage_path, event_data->monitor_id, event_data->event_id);
+      snprintf(data->path, sizeof(data->path), "%s/%d/%" PRIu64,
+          storage_path, data->monitor_id, data->event_id);
     else
-      snprintf(event_data->path, sizeof(event_data->path), "%s/%s/%d/%" PRIu64, 
-          staticConfig.PATH_WEB.c_str(), storage_path, event_data->monitor_id,
-          event_data->event_id);
-  }
-
-  updateFrameRate((double)event_data->frame_count/event_data->duration);
-
-  snprintf(sql, sizeof(sql), "SELECT `FrameId`, unix_timestamp(`TimeStamp`), `Delta` "
-      "FROM `Frames` WHERE `EventId` = %" PRIu64 " ORDER BY `FrameId` ASC", event_id);
-  if ( mysql_query(&dbconn, sql) ) {
-    Error("Can't run query: %s", mysql_error(&dbconn));
-    exit(mysql_errno(&dbconn));
+      snprintf(data->path, sizeof(data->path), "%s/%s/%d/%" PRIu64, 
+          staticConfig.PATH_WEB.c_str(), storage_path, data->monitor_id,
+          data->event_id);
   }
 
-  result = mysql_store_result(&dbconn);
-  if ( !result ) {
-    Error("Can't use query result: %s", mysql_error(&dbconn));
-    exit(mysql_errno(&dbconn));
-  }
-
-  event_data->n_frames = mysql_num_rows(result);
-
-  event_data->frames = new FrameData[event_data->frame_count];
   int last_id = 0;
-  double last_timestamp = event_data->start_time;
+  double last_timestamp = data->start_time;
   double last_delta = 0.0;
-
-  while ( ( dbrow = mysql_fetch_row(result) ) ) {
-    int id = atoi(dbrow[0]);
-    //timestamp = atof(dbrow[1]);
-    double delta = atof(dbrow[2]);
+  double first_delta = 0.0;
+  // Frames that aren't listed are spread evenly between the ones either side of them
+  auto add_frame = [&](int id, double delta) {
     int id_diff = id - last_id;
     double frame_delta = id_diff ? (delta-last_delta)/id_diff : (delta-last_delta);
     // Fill in data between bulk frames
     if ( id_diff > 1 ) {
       for ( int i = last_id+1; i < id; i++ ) {
         // Delta is the time since last frame, no since beginning of Event
-        event_data->frames[i-1].delta = frame_delta;
-        event_data->frames[i-1].timestamp = last_timestamp + ((i-last_id)*frame_delta);
-        event_data->frames[i-1].offset = event_data->frames[i-1].timestamp - event_data->start_time;
-        event_data->frames[i-1].in_db = false;
+        data->frames[i-1].delta = frame_delta;
+        data->frames[i-1].timestamp = last_timestamp + ((i-last_id)*frame_delta);
+        data->frames[i-1].offset = data->frames[i-1].timestamp - data->start_time;
+        data->frames[i-1].in_db = false;
         Debug(3, "Frame %d timestamp:(%f), offset(%f) delta(%f), in_db(%d)",
             i,
-            event_data->frames[i-1].timestamp,
-            event_data->frames[i-1].offset,
-            event_data->frames[i-1].delta,
-            event_data->frames[i-1].in_db
+            data->frames[i-1].timestamp,
+            data->frames[i-1].offset,
+            data->frames[i-1].delta,
+            data->frames[i-1].in_db
             );
       }
     }
-    event_data->frames[id-1].timestamp = event_data->start_time + delta;
-    event_data->frames[id-1].offset = delta;
-    event_data->frames[id-1].delta = frame_delta;
-    event_data->frames[id-1].in_db = true;
+    if ( !last_id )
+      first_delta = delta;
+    data->frames[id-1].timestamp = data->start_time + delta;
+    data->frames[id-1].offset = delta;
+    data->frames[id-1].delta = frame_delta;
+    data->frames[id-1].in_db = true;
     last_id = id;
     last_delta = delta;
-    last_timestamp = event_data->frames[id-1].timestamp;
+    last_timestamp = data->frames[id-1].timestamp;
     Debug(3, "Frame %d timestamp:(%f), offset(%f) delta(%f), in_db(%d)",
         id,
-        event_data->frames[id-1].timestamp,
-        event_data->frames[id-1].offset,
-        event_data->frames[id-1].delta,
-        event_data->frames[id-1].in_db
+        data->frames[id-1].timestamp,
+        data->frames[id-1].offset,
+        data->frames[id-1].delta,
+        data->frames[id-1].in_db
         );
+  };
+
+  // Events have an index of all their frames, only older ones need the Frames table
+  EventIndex frame_index;
+  if ( frame_index.Map(data->path, event_id) ) {
+    int n_frames = frame_index.Frames();
+    data->n_frames = n_frames;
+    // The Frames column lags behind while the event is being recorded
+    if ( (unsigned long)n_frames > data->frame_count )
+      data->frame_count = n_frames;
+    data->frames = new FrameData[data->frame_count];
+    int i;
+    for ( i = 0; i < n_frames; i++ ) {
+      int id = frame_index.Frame(i).frame_id;
+      if ( (id <= last_id) || ((unsigned long)id > data->frame_count) ) {
+        Warning("Frame index for event %" PRIu64 " has frame %d out of order at %d", event_id, id, i);
+        break;
+      }
+      add_frame(id, frame_index.Offset(i));
+    }
+    // If the index went wrong part way through, only the frames before that count
+    data->duration = (i == n_frames) ? frame_index.Duration() : last_delta - first_delta;
+    Debug(1, "Loaded %d frames from frame index", n_frames);
+  } else {
+    snprintf(sql, sizeof(sql), "SELECT `FrameId`, unix_timestamp(`TimeStamp`), `Delta` "
+        "FROM `Frames` WHERE `EventId` = %" PRIu64 " ORDER BY `FrameId` ASC", event_id);
+    result = zmDbFetch(sql);
+    if ( !result ) {
+      freeEvent(loaded);
+      return nullptr;
+    }
+
+    data->n_frames = mysql_num_rows(result);
+
+    data->frames = new FrameData[data->frame_count];
+    while ( ( dbrow = mysql_fetch_row(result) ) ) {
+      int id = atoi(dbrow[0]);
+      //timestamp = atof(dbrow[1]);
+      if ( (id <= last_id) || ((unsigned long)id > data->frame_count) ) {
+        Debug(1, "Ignoring frame %d of event with %lu frames", id, data->frame_count);
+        continue;
+      }
+      add_frame(id, atof(dbrow[2]));
+    }
+    data->duration = last_delta - first_delta;
+
+    mysql_free_result(result);
   }
   // Incomplete events might not have any frame data
-  event_data->last_frame_id = last_id;
+  data->last_frame_id = last_id;
 
-  if ( mysql_errno(&dbconn) ) {
-    Error("Can't fetch row: %s", mysql_error(&dbconn));
-    exit(mysql_errno(&dbconn));
-  }
-  mysql_free_result(result);
+  return loaded;
+}  // EventStream::LoadedEvent *EventStream::readEvent(uint64_t event_id, Storage **event_storage)
 
-  if ( event_data->video_file[0] || (monitor->GetOptVideoWriter() > 0) ) {
-    if ( !event_data->video_file[0] ) {
-      snprintf(event_data->video_file, sizeof(event_data->video_file), "%" PRIu64 "-%s", event_data->event_id, "video.mp4");
-    }
-    std::string filepath = std::string(event_data->path) + "/" + std::string(event_data->video_file);
-    Debug(1, "Loading video file from %s", filepath.c_str());
-    if ( ffmpeg_input )
-      delete ffmpeg_input;
+// Opens the event's video, if it has one. An input that is already open on
+// the same file is carried on with rather than opened again.
+void EventStream::openEventVideo(LoadedEvent *loaded, int video_writer, FFmpeg_Input *current_input) {
+  EventData *data = loaded->event_data;
+  if ( !(data->video_file[0] || (video_writer > 0)) )
+    return;
 
-    ffmpeg_input = new FFmpeg_Input();
-    if ( 0 > ffmpeg_input->Open(filepath.c_str()) ) {
+  if ( !data->video_file[0] ) {
+    snprintf(data->video_file, sizeof(data->video_file), "%" PRIu64 "-%s", data->event_id, "video.mp4");
+  }
+  std::string filepath = std::string(data->path) + "/" + std::string(data->video_file);
+  if ( current_input && (current_input->get_filename() == filepath) ) {
+    // Reloading an event that was still being recorded, the input we have
+    // keeps following the file so there's no need to open it again.
+    Debug(1, "Continuing with video file %s", filepath.c_str());
+    loaded->ffmpeg_input = current_input;
+  } else {
+    Debug(1, "Loading video file from %s", filepath.c_str());
+    loaded->ffmpeg_input = new FFmpeg_Input();
+    if ( 0 > loaded->ffmpeg_input->Open(filepath.c_str()) ) {
       Warning("Unable to open ffmpeg_input %s", filepath.c_str());
-      delete ffmpeg_input;
-      ffmpeg_input = nullptr;
+      delete loaded->ffmpeg_input;
+      loaded->ffmpeg_input = nullptr;
     }
   }
+  if ( loaded->ffmpeg_input )
+    loaded->ffmpeg_input->set_follow(!data->end_time);
+}
+
+void EventStream::freeEvent(LoadedEvent *loaded) {
+  if ( !loaded )
+    return;
+  if ( loaded->event_data ) {
+    delete[] loaded->event_data->frames;
+    delete loaded->event_data;
+  }
+  delete loaded->ffmpeg_input;
+  delete loaded;
+}
+
+// Makes a loaded event the one being streamed, returning the one it replaces
+EventStream::LoadedEvent *EventStream::installEvent(LoadedEvent *loaded) {
+  LoadedEvent *replaced = new LoadedEvent;
+  replaced->event_data = event_data;
+  replaced->ffmpeg_input = (ffmpeg_input != loaded->ffmpeg_input) ? ffmpeg_input : nullptr;
+
+  event_data = loaded->event_data;
+  ffmpeg_input = loaded->ffmpeg_input;
+  delete loaded;
+
+  updateFrameRate((double)event_data->frame_count/event_data->duration);
 
   // Not sure about this
   if ( forceEventChange || mode == MODE_ALL_GAPLESS ) {
@@ -319,7 +369,27 @@ bool EventStream::loadEventData(uint64_t event_id) {
   }
   Debug(2, "Event:%" PRIu64 ", Frames:%ld, Last Frame ID(%ld, Duration: %.2f",
       event_data->event_id, event_data->frame_count, event_data->last_frame_id, event_data->duration);
+  return replaced;
+}
 
+bool EventStream::loadEventData(uint64_t event_id) {
+  LoadedEvent *loaded = readEvent(event_id, &storage);
+  if ( !loaded ) {
+    Fatal("Unable to load event %" PRIu64, event_id);
+  }
+
+  if ( !monitor ) {
+    monitor = Monitor::Load(loaded->event_data->monitor_id, false, Monitor::QUERY);
+  } else if ( monitor->Id() != loaded->event_data->monitor_id ) {
+    delete monitor;
+    monitor = Monitor::Load(loaded->event_data->monitor_id, false, Monitor::QUERY);
+  }
+  if ( !monitor ) {
+    Fatal("Unable to load monitor id %d for streaming", loaded->event_data->monitor_id);
+  }
+
+  openEventVideo(loaded, monitor->GetOptVideoWriter(), ffmpeg_input);
+  freeEvent(installEvent(loaded));
   return true;
 } // bool EventStream::loadEventData( int event_id )
 
@@ -601,13 +671,36 @@ void EventStream::processCommand(const CmdMsg *msg) {
   updateFrameRate((double)event_data->frame_count/event_data->duration);
 }  // void EventStream::processCommand(const CmdMsg *msg)
 
-bool EventStream::checkEventLoaded() {
-  static char sql[ZM_SQL_SML_BUFSIZ];
+// Returns the id of the event before or after event_id on the same monitor, 0 if there is none
+uint64_t EventStream::adjacentEventId(unsigned int monitor_id, uint64_t event_id, bool next) {
+  char sql[ZM_SQL_SML_BUFSIZ];
 
-  if ( curr_frame_id <= 0 ) {
+  if ( next )
+    snprintf(sql, sizeof(sql),
+        "SELECT `Id` FROM `Events` WHERE `MonitorId` = %d AND `Id` > %" PRIu64 " ORDER BY `Id` ASC LIMIT 1",
+        monitor_id, event_id);
+  else
     snprintf(sql, sizeof(sql),
         "SELECT `Id` FROM `Events` WHERE `MonitorId` = %d AND `Id` < %" PRIu64 " ORDER BY `Id` DESC LIMIT 1",
-        event_data->monitor_id, event_data->event_id);
+        monitor_id, event_id);
+  Debug(1, "Checking for %s event %s", next ? "next" : "previous", sql);
+
+  MYSQL_RES *result = zmDbFetch(sql);
+  if ( !result )
+    return 0;
+  MYSQL_ROW dbrow = mysql_fetch_row(result);
+  uint64_t adjacent_id = dbrow ? atoll(dbrow[0]) : 0;
+  if ( !adjacent_id )
+    Debug(1, "No rows returned for %s", sql);
+  mysql_free_result(result);
+  return adjacent_id;
+}
+
+bool EventStream::checkEventLoaded() {
+  bool next;
+
+  if ( curr_frame_id <= 0 ) {
+    next = false;
   } else if ( (unsigned int)curr_frame_id > event_data->last_frame_id ) {
     if ( !event_data->end_time ) {
       // We are viewing an in-process event, so just reload it.
@@ -616,9 +709,7 @@ bool EventStream::checkEventLoaded() {
         curr_frame_id = event_data->last_frame_id;
       return false;
     }
-    snprintf(sql, sizeof(sql),
-        "SELECT `Id` FROM `Events` WHERE `MonitorId` = %d AND `Id` > %" PRIu64 " ORDER BY `Id` ASC LIMIT 1",
-        event_data->monitor_id, event_data->event_id);
+    next = true;
   } else {
     // No event change required
     Debug(3, "No event change required, as curr frame %d <=> event frames %d",
@@ -628,32 +719,19 @@ bool EventStream::checkEventLoaded() {
 
   // Event change required.
   if ( forceEventChange || ( (mode != MODE_SINGLE) && (mode != MODE_NONE) ) ) {
-    Debug(1, "Checking for next event %s", sql);
-    if ( mysql_query(&dbconn, sql) ) {
-      Error("Can't run query: %s", mysql_error(&dbconn));
-      exit(mysql_errno(&dbconn));
-    }
-
-    MYSQL_RES *result = mysql_store_result(&dbconn);
-    if ( !result ) {
-      Error("Can't use query result: %s", mysql_error(&dbconn));
-      exit(mysql_errno(&dbconn));
-    }
-    if ( mysql_num_rows(result) != 1 ) {
-      Debug(1, "No rows returned for %s", sql);
-    }
-    MYSQL_ROW dbrow = mysql_fetch_row(result);
-
-    if ( mysql_errno(&dbconn)) {
-      Error("Can't fetch row: %s", mysql_error(&dbconn));
-      exit(mysql_errno(&dbconn));
-    }
-
-    if ( dbrow ) {
-      uint64_t event_id = atoll(dbrow[0]);
-      Debug(1, "Loading new event %" PRIu64, event_id);
-
-      loadEventData(event_id);
+    LoadedEvent *loaded = takePrefetched(next);
+    uint64_t event_id = loaded ? loaded->event_data->event_id
+      : adjacentEventId(event_data->monitor_id, event_data->event_id, next);
+
+    if ( event_id ) {
+      if ( loaded ) {
+        Debug(1, "Switching to prefetched event %" PRIu64, event_id);
+        keepPrefetched(installEvent(loaded));
+      } else {
+        Debug(1, "Loading new event %" PRIu64, event_id);
+        loadEventData(event_id);
+      }
+      requestPrefetch();
 
       if ( replay_rate < 0 )  // rewind
         curr_frame_id = event_data->last_frame_id;
@@ -662,7 +740,7 @@ bool EventStream::checkEventLoaded() {
       Debug(2, "New frame id = %d", curr_frame_id);
       return true;
     } else {
-      Debug(2, "No next event loaded using %s. Pausing", sql);
+      Debug(2, "No %s event found. Pausing", next ? "next" : "previous");
       if ( curr_frame_id <= 0 )
         curr_frame_id = 1;
       else
@@ -670,7 +748,6 @@ bool EventStream::checkEventLoaded() {
       paused = true;
       sendTextFrame("No more event data found");
     }  // end if found a new event or not
-    mysql_free_result(result);
     forceEventChange = false;
   } else {
     Debug(2, "Pausing because mode is %d", mode);
@@ -683,6 +760,132 @@ bool EventStream::checkEventLoaded() {
   return false;
 }  // void EventStream::checkEventLoaded()
 
+// Asks the prefetch thread to load the events either side of the current one.
+// It is only started for the modes that go on from one event to the next.
+void EventStream::requestPrefetch() {
+  if ( (mode != MODE_ALL) && (mode != MODE_ALL_GAPLESS) )
+    return;
+
+  prefetch_mutex.lock();
+  prefetch_around = event_data->event_id;
+  prefetch_monitor_id = event_data->monitor_id;
+  prefetch_video_writer = monitor->GetOptVideoWriter();
+  if ( !prefetch_thread )
+    prefetch_thread = new std::thread(&EventStream::prefetchThread, this);
+  prefetch_condition.signal();
+  prefetch_mutex.unlock();
+}
+
+// Takes the event before or after the current one if it has been loaded ahead
+EventStream::LoadedEvent *EventStream::takePrefetched(bool next) {
+  LoadedEvent *loaded = nullptr;
+  if ( !prefetch_thread )
+    return loaded;
+
+  uint64_t current_id = event_data->event_id;
+  prefetch_mutex.lock();
+  // It is already loading them, that won't take any longer than doing it here
+  while ( prefetch_busy && (prefetch_around == current_id) )
+    prefetch_condition.wait();
+  uint64_t wanted_id = (prefetched_around == current_id) ? prefetched_ids[next ? 0 : 1] : 0;
+  for ( std::vector<LoadedEvent *>::iterator it = prefetched.begin(); wanted_id && (it != prefetched.end()); ++it ) {
+    if ( (*it)->event_data->event_id == wanted_id ) {
+      loaded = *it;
+      prefetched.erase(it);
+      break;
+    }
+  }
+  prefetch_mutex.unlock();
+  return loaded;
+}
+
+// Holds on to the event that has just been switched away from, which is now
+// a neighbour of the new one, unless it was still being recorded.
+void EventStream::keepPrefetched(LoadedEvent *replaced) {
+  if ( !replaced->event_data || !replaced->event_data->end_time ) {
+    freeEvent(replaced);
+    return;
+  }
+  prefetch_mutex.lock();
+  prefetched.push_back(replaced);
+  prefetch_mutex.unlock();
+}
+
+void EventStream::prefetchThread() {
+  Storage *prefetch_storage = nullptr;
+
+  prefetch_mutex.lock();
+  while ( !prefetch_stop ) {
+    if ( !prefetch_around || (prefetched_around == prefetch_around) ) {
+      prefetch_condition.wait();
+      continue;
+    }
+    uint64_t around = prefetch_around;
+    unsigned int monitor_id = prefetch_monitor_id;
+    int video_writer = prefetch_video_writer;
+    std::vector<LoadedEvent *> have;
+    have.swap(prefetched);
+    prefetch_busy = true;
+    prefetch_mutex.unlock();
+
+    uint64_t ids[2] = { 0, 0 };
+    std::vector<LoadedEvent *> loaded;
+    for ( int i = 0; i < 2; i++ ) {
+      ids[i] = adjacentEventId(monitor_id, around, i == 0);
+      if ( !ids[i] )
+        continue;
+      LoadedEvent *event = nullptr;
+      for ( std::vector<LoadedEvent *>::iterator it = have.begin(); it != have.end(); ++it ) {
+        if ( (*it)->event_data->event_id == ids[i] ) {
+          event = *it;
+          have.erase(it);
+          break;
+        }
+      }
+      if ( !event ) {
+        Debug(1, "Prefetching event %" PRIu64 " %s %" PRIu64, ids[i], i ? "before" : "after", around);
+        event = readEvent(ids[i], &prefetch_storage);
+        if ( event )
+          openEventVideo(event, video_writer, nullptr);
+      }
+      if ( event )
+        loaded.push_back(event);
+    }
+    // Anything else is no longer next to the event being streamed
+    for ( std::vector<LoadedEvent *>::iterator it = have.begin(); it != have.end(); ++it )
+      freeEvent(*it);
+
+    prefetch_mutex.lock();
+    // The stream may have handed back the event it switched away from in the meantime
+    prefetched.insert(prefetched.end(), loaded.begin(), loaded.end());
+    prefetched_around = around;
+    prefetched_ids[0] = ids[0];
+    prefetched_ids[1] = ids[1];
+    prefetch_busy = false;
+    prefetch_condition.broadcast();
+  }
+  prefetch_mutex.unlock();
+
+  delete prefetch_storage;
+}
+
+void EventStream::stopPrefetch() {
+  if ( !prefetch_thread )
+    return;
+
+  prefetch_mutex.lock();
+  prefetch_stop = true;
+  prefetch_condition.broadcast();
+  prefetch_mutex.unlock();
+  prefetch_thread->join();
+  delete prefetch_thread;
+  prefetch_thread = nullptr;
+
+  for ( std::vector<LoadedEvent *>::iterator it = prefetched.begin(); it != prefetched.end(); ++it )
+    freeEvent(*it);
+  prefetched.clear();
+}
+
 Image * EventStream::getImage( ) {
   static char filepath[PATH_MAX];
 
@@ -737,9 +940,8 @@ bool EventStream::sendFrame(int delta_us) {
 
     bool send_raw = (type == STREAM_JPEG) && ((scale>=ZM_SCALE_BASE)&&(zoom==ZM_SCALE_BASE)) && filepath[0];
 
-    fprintf(stdout, "--" BOUNDARY "\r\n");
-
     if ( send_raw ) {
+      fprintf(stdout, "--" BOUNDARY "\r\n");
       if ( !send_file(filepath) ) {
         Error("Can't send %s: %s", filepath, strerror(errno));
         return false;
@@ -758,6 +960,10 @@ bool EventStream::sendFrame(int delta_us) {
         if ( frame ) {
           image = new Image(frame);
           //av_frame_free(&frame);
+        } else if ( ffmpeg_input->following() ) {
+          // The video lags the frames table by up to a fragment while recording
+          Debug(1, "Frame %d isn't in the video yet", curr_frame_id);
+          return true;
         } else {
           Error("Failed getting a frame.");
           return false;
@@ -795,6 +1001,8 @@ bool EventStream::sendFrame(int delta_us) {
         return false;
       }
       
+      fprintf(stdout, "--" BOUNDARY "\r\n");
+
       Image *send_image = prepareImage(image);
       static unsigned char temp_img_buffer[ZM_MAX_IMAGE_SIZE];
       int img_buffer_size = 0;
@@ -847,6 +1055,8 @@ void EventStream::runStream() {
   }
 
   updateFrameRate((double)event_data->frame_count/event_data->duration);
+  // Have the events either side ready before they are needed
+  requestPrefetch();
   gettimeofday(&start, nullptr);
   uint64_t start_usec = start.tv_sec * 1000000 + start.tv_usec;
   uint64_t last_frame_offset = 0;
@@ -26,6 +26,10 @@
 #include "zm_ffmpeg_input.h"
 #include "zm_monitor.h"
 #include "zm_storage.h"
+#include "zm_thread.h"
+
+#include <thread>
+#include <vector>
 
 #ifdef __cplusplus
 extern "C" {
@@ -83,7 +87,36 @@ class EventStream : public StreamBase {
 
     EventData *event_data;
 
+    // An event read ahead of being streamed, ready to be swapped in
+    struct LoadedEvent {
+      EventData *event_data;
+      FFmpeg_Input *ffmpeg_input;
+    };
+    std::thread *prefetch_thread;
+    Mutex prefetch_mutex;
+    Condition prefetch_condition;
+    bool prefetch_stop;
+    bool prefetch_busy;
+    uint64_t prefetch_around;               // Event whose neighbours are wanted
+    unsigned int prefetch_monitor_id;
+    int prefetch_video_writer;
+    uint64_t prefetched_around;             // Event whose neighbours have been looked up
+    uint64_t prefetched_ids[2];             // Next and previous events, 0 if there was none
+    std::vector<LoadedEvent *> prefetched;
+
   protected:
+    static uint64_t adjacentEventId( unsigned int monitor_id, uint64_t event_id, bool next );
+    static LoadedEvent *readEvent( uint64_t event_id, Storage **event_storage );
+    static void openEventVideo( LoadedEvent *loaded, int video_writer, FFmpeg_Input *current_input );
+    static void freeEvent( LoadedEvent *loaded );
+    LoadedEvent *installEvent( LoadedEvent *loaded );
+
+    void requestPrefetch();
+    LoadedEvent *takePrefetched( bool next );
+    void keepPrefetched( LoadedEvent *replaced );
+    void prefetchThread();
+    void stopPrefetch();
+
     bool loadEventData( uint64_t event_id );
     bool loadInitialEventData( uint64_t init_event_id, unsigned int init_frame_id );
     bool loadInitialEventData( int monitor_id, time_t event_time );
@@ -100,13 +133,24 @@ class EventStream : public StreamBase {
       curr_stream_time(0.0),
       send_frame(false),
       event_data(nullptr),
+      prefetch_thread(nullptr),
+      prefetch_condition(prefetch_mutex),
+      prefetch_stop(false),
+      prefetch_busy(false),
+      prefetch_around(0),
+      prefetch_monitor_id(0),
+      prefetch_video_writer(0),
+      prefetched_around(0),
       storage(nullptr),
       ffmpeg_input(nullptr),
       // Used when loading frames from an mp4
       input_codec_context(nullptr),
       input_codec(nullptr)
-    {}
+    {
+      prefetched_ids[0] = prefetched_ids[1] = 0;
+    }
     ~EventStream() {
+        stopPrefetch();
         if ( event_data ) {
           if ( event_data->frames ) {
             delete[] event_data->frames;
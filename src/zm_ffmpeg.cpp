@@ -67,7 +67,8 @@ void log_libav_callback(void *ptr, int level, const char *fmt, va_list vargs) {
     int length = strlen(logString);
     // ffmpeg logs have a carriage return, so replace it with terminator
     logString[length-1] = 0;
-    log->logPrint(false, __FILE__, __LINE__, log_level, logString);
+    static constexpr const char *logFileName = logBasename(__FILE__, __FILE__);
+    log->logPrint(false, logFileName, __LINE__, log_level, logString);
   }
 }
 
@@ -133,7 +134,7 @@ enum _AVPIXELFORMAT GetFFMPEGPixelFormat(unsigned int p_colours, unsigned p_subp
         break;
       }
     case ZM_COLOUR_GRAY8:
-      pf = AV_PIX_FMT_GRAY8;
+      pf = (p_subpixelorder == ZM_SUBPIX_ORDER_YUV420P) ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_GRAY8;
       break;
     default:
       Panic("Unexpected colours: %d",p_colours);
@@ -143,6 +144,80 @@ enum _AVPIXELFORMAT GetFFMPEGPixelFormat(unsigned int p_colours, unsigned p_subp
 
   return pf;
 }
+
+/* Maps limited range (16-235 luma, 16-240 chroma) samples to the full range that
+   YUV420P images hold */
+struct YuvRangeTables {
+  uint8_t luma[256];
+  uint8_t chroma[256];
+  YuvRangeTables() {
+    for ( int i = 0; i < 256; i++ ) {
+      int y = ((i-16)*255 + 109)/219;
+      int c = (((i-128)*255) + ((i >= 128) ? 112 : -112))/224 + 128;
+      luma[i] = y < 0 ? 0 : (y > 255 ? 255 : y);
+      chroma[i] = c < 0 ? 0 : (c > 255 ? 255 : c);
+    }
+  }
+};
+
+static void copy_plane(uint8_t *dst, const uint8_t *src, int src_linesize,
+    unsigned int width, unsigned int height, const uint8_t *table) {
+  for ( unsigned int y = 0; y < height; y++ ) {
+    if ( table ) {
+      for ( unsigned int x = 0; x < width; x++ )
+        dst[x] = table[src[x]];
+    } else {
+      memcpy(dst, src, width);
+    }
+    dst += width;
+    src += src_linesize;
+  }
+}
+
+/* Copies a decoded 4:2:0 frame straight into the buffer of a YUV420P image. Returns
+   false for any other format or size, which the caller has to convert with swscale. */
+bool zm_copy_yuv420p(const AVFrame *frame, uint8_t *buffer, unsigned int width, unsigned int height) {
+  if ( ((unsigned int)frame->width != width) || ((unsigned int)frame->height != height) )
+    return false;
+
+  bool full_range;
+  switch ( frame->format ) {
+    case AV_PIX_FMT_YUVJ420P :
+      full_range = true;
+      break;
+    case AV_PIX_FMT_YUV420P :
+    case AV_PIX_FMT_NV12 :
+      full_range = (frame->color_range == AVCOL_RANGE_JPEG);
+      break;
+    default :
+      return false;
+  }
+
+  static const YuvRangeTables tables;
+  const unsigned int chroma_width = (width+1)>>1;
+  const unsigned int chroma_height = (height+1)>>1;
+  uint8_t *u_plane = buffer + (width*height);
+  uint8_t *v_plane = u_plane + (chroma_width*chroma_height);
+
+  copy_plane(buffer, frame->data[0], frame->linesize[0], width, height, full_range ? nullptr : tables.luma);
+  if ( frame->format == AV_PIX_FMT_NV12 ) {
+    /* Interleaved chroma */
+    const uint8_t *src = frame->data[1];
+    for ( unsigned int y = 0; y < chroma_height; y++ ) {
+      for ( unsigned int x = 0; x < chroma_width; x++ ) {
+        u_plane[x] = full_range ? src[2*x] : tables.chroma[src[2*x]];
+        v_plane[x] = full_range ? src[2*x+1] : tables.chroma[src[2*x+1]];
+      }
+      u_plane += chroma_width;
+      v_plane += chroma_width;
+      src += frame->linesize[1];
+    }
+  } else {
+    copy_plane(u_plane, frame->data[1], frame->linesize[1], chroma_width, chroma_height, full_range ? nullptr : tables.chroma);
+    copy_plane(v_plane, frame->data[2], frame->linesize[2], chroma_width, chroma_height, full_range ? nullptr : tables.chroma);
+  }
+  return true;
+}
 /* The following is copied directly from newer ffmpeg. */
 #if LIBAVUTIL_VERSION_CHECK(52, 7, 0, 17, 100)
 #else
@@ -213,6 +213,7 @@ void FFMPEGDeInit();
 
 #if HAVE_LIBAVUTIL
 enum _AVPIXELFORMAT GetFFMPEGPixelFormat(unsigned int p_colours, unsigned p_subpixelorder);
+bool zm_copy_yuv420p(const AVFrame *frame, uint8_t *buffer, unsigned int width, unsigned int height);
 #endif // HAVE_LIBAVUTIL
 
 #if !LIBAVCODEC_VERSION_CHECK(54, 25, 0, 51, 100)
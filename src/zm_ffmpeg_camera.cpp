@@ -144,8 +144,10 @@ FfmpegCamera::FfmpegCamera(
   mFrame = nullptr;
   frameCount = 0;
   mCanCapture = false;
-  videoStore = nullptr;
+  videoWriter = nullptr;
+  segmentWriter = nullptr;
   have_video_keyframe = false;
+  writer_event_id = 0;
   packetqueue = nullptr;
   error_count = 0;
   use_hwaccel = true;
@@ -171,6 +173,10 @@ FfmpegCamera::FfmpegCamera(
   } else if ( colours == ZM_COLOUR_GRAY8 ) {
     subpixelorder = ZM_SUBPIX_ORDER_NONE;
     imagePixFormat = AV_PIX_FMT_GRAY8;
+  } else if ( colours == ZM_COLOUR_YUV420P ) {
+    colours = ZM_COLOUR_GRAY8;
+    subpixelorder = ZM_SUBPIX_ORDER_YUV420P;
+    imagePixFormat = AV_PIX_FMT_YUVJ420P;
   } else {
     Panic("Unexpected colours: %d", colours);
   }
@@ -178,7 +184,8 @@ FfmpegCamera::FfmpegCamera(
   frame_buffer = nullptr;
   // sws_scale needs 32bit aligned width and an extra 16 bytes padding, so recalculate imagesize, which was width*height*bytes_per_pixel
 #if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
-  alignment = 32;
+  // The planes of a YUV420P image are packed one after the other
+  alignment = (subpixelorder == ZM_SUBPIX_ORDER_YUV420P) ? 1 : 32;
   imagesize = av_image_get_buffer_size(imagePixFormat, width, height, alignment);
   // av_image_get_linesize isn't aligned, so we have to do that.
   linesize = FFALIGN(av_image_get_linesize(imagePixFormat, width, 0), alignment);
@@ -689,9 +696,16 @@ int FfmpegCamera::Close() {
   }
 #endif
 
-  if ( videoStore ) {
-    delete videoStore;
-    videoStore = nullptr;
+  if ( videoWriter ) {
+    // Finishes writing what it has queued and closes the video
+    delete videoWriter;
+    videoWriter = nullptr;
+    writer_event_id = 0;
+  }
+  if ( segmentWriter ) {
+    // Finishes writing what it has queued and completes the current segment
+    delete segmentWriter;
+    segmentWriter = nullptr;
   }
 
   if ( mVideoCodecContext ) {
@@ -745,6 +759,18 @@ int FfmpegCamera::CaptureAndRecord(
 
   struct timeval video_buffer_duration = monitor->GetVideoBufferDuration();
 
+  if ( config.passthrough_segment_length > 0 ) {
+    if ( !segmentWriter ) {
+      segmentWriter = new SegmentWriter(monitor,
+          mFormatContext->streams[mVideoStreamId],
+          ((record_audio && (mAudioStreamId >= 0)) ? mFormatContext->streams[mAudioStreamId] : nullptr));
+      segmentWriter->start();
+    }
+  } else if ( !videoWriter ) {
+    videoWriter = new VideoStoreWriter(monitor, mFormatContext->streams[mVideoStreamId]);
+    videoWriter->start();
+  }
+
   int frameComplete = false;
   while ( !frameComplete ) {
     av_init_packet(&packet);
@@ -800,16 +826,42 @@ int FfmpegCamera::CaptureAndRecord(
       packet.dts = packet.pts;
     }
 
-    // Video recording
-    if ( recording.tv_sec ) {
-      uint32_t last_event_id = monitor->GetLastEventId();
-      uint32_t video_writer_event_id = monitor->GetVideoWriterEventId();
+    // Live viewers stream the packets as they are
+    PacketRing *packet_ring = monitor->GetPacketRing();
+    if ( packet_ring && (packet.stream_index == mVideoStreamId) ) {
+      struct timeval now;
+      gettimeofday(&now, nullptr);
+      packet_ring->Store(&packet, mFormatContext->streams[mVideoStreamId], now);
+    }
+
+    if ( videoWriter )
+      checkVideoWriter();
+
+    if ( segmentWriter ) {
+      // Everything is recorded, events just get linked to the segments they overlap
+      uint64_t last_event_id = recording.tv_sec ? monitor->GetLastEventId() : 0;
+      uint64_t video_writer_event_id = monitor->GetVideoWriterEventId();
 
       if ( last_event_id != video_writer_event_id ) {
-        Debug(2, "Have change of event.  last_event(%d), our current (%d)",
-            last_event_id, video_writer_event_id);
+        if ( video_writer_event_id )
+          segmentWriter->endEvent(video_writer_event_id);
+        if ( last_event_id )
+          monitor->SetVideoWriterStartTime(segmentWriter->startEvent(last_event_id, event_file, recording));
+        monitor->SetVideoWriterEventId(last_event_id);
+      }
 
-        if ( videoStore ) {
+      if ( (packet.stream_index == mVideoStreamId)
+          || (record_audio && (packet.stream_index == mAudioStreamId)) )
+        segmentWriter->queuePacket(&packet);
+    } else if ( recording.tv_sec ) {
+      // Video recording
+      uint64_t last_event_id = monitor->GetLastEventId();
+
+      if ( last_event_id != writer_event_id ) {
+        Debug(2, "Have change of event.  last_event(%" PRIu64 "), our current (%" PRIu64 ")",
+            last_event_id, writer_event_id);
+
+        if ( videoWriter->isOpen() ) {
           Info("Re-starting video storage module");
 
           // I don't know if this is important or not... but I figure we might
@@ -817,119 +869,102 @@ int FfmpegCamera::CaptureAndRecord(
           // Also don't know how much it matters for audio.
           if ( packet.stream_index == mVideoStreamId ) {
             // Write the packet to our video store
-            int ret = videoStore->writeVideoFramePacket(&packet);
-            if ( ret < 0 ) {  // Less than zero and we skipped a frame
-              Warning("Error writing last packet to videostore.");
-            }
+            videoWriter->queuePacket(&packet);
           }  // end if video
 
-          delete videoStore;
-          videoStore = nullptr;
+          videoWriter->close();
           have_video_keyframe = false;
-
-          monitor->SetVideoWriterEventId(0);
-        }  // end if videoStore
+        }  // end if videoWriter is open
+        writer_event_id = 0;
+        monitor->SetVideoWriterEventId(0);
       }  // end if end of recording
 
-      if ( last_event_id && !videoStore ) {
+      // A writer that failed to open stays closed until the next event
+      if ( last_event_id && !writer_event_id ) {
         // Instantiate the video storage module
 
         packetqueue->dumpQueue();
+        AVStream *audio_in_stream = nullptr;
         if ( record_audio ) {
           if ( mAudioStreamId == -1 ) {
             Debug(3, "Record Audio on but no audio stream found");
-            videoStore = new VideoStore((const char *) event_file, "mp4",
-                mFormatContext->streams[mVideoStreamId],
-                nullptr,
-                this->getMonitor());
-
           } else {
             Debug(3, "Video module initiated with audio stream");
-            videoStore = new VideoStore((const char *) event_file, "mp4",
-                mFormatContext->streams[mVideoStreamId],
-                mFormatContext->streams[mAudioStreamId],
-                this->getMonitor());
+            audio_in_stream = mFormatContext->streams[mAudioStreamId];
           }
         } else {
           if ( mAudioStreamId >= 0 ) {
             Debug(3, "Record_audio is false so exclude audio stream");
           }
-          videoStore = new VideoStore((const char *) event_file, "mp4",
-              mFormatContext->streams[mVideoStreamId],
-              nullptr,
-              this->getMonitor());
         }  // end if record_audio
 
-        if ( !videoStore->open() ) {
-          delete videoStore;
-          videoStore = nullptr;
+        // The writer opens the file, the monitor is only told about the
+        // video once checkVideoWriter() sees that the open succeeded.
+        videoWriter->open((const char *) event_file, audio_in_stream);
+        writer_event_id = last_event_id;
+
+        // Need to write out all the frames from the last keyframe?
+        // No... need to write out all frames from when the event began.
+        // Due to PreEventFrames, this could be more than
+        // since the last keyframe.
+        unsigned int packet_count = 0;
+        ZMPacket *queued_packet;
+        struct timeval video_offset = {0};
+
+        // Clear all packets that predate the moment when the recording began
+        packetqueue->clear_unwanted_packets(
+            &recording, 0, mVideoStreamId);
+
+        while ( (queued_packet = packetqueue->popPacket()) ) {
+          AVPacket *avp = queued_packet->av_packet();
+
+          // compute time offset between event start and first frame in video
+          if (packet_count == 0){
+              monitor->SetVideoWriterStartTime(queued_packet->timestamp);
+              timersub(&queued_packet->timestamp, &recording, &video_offset);
+              Info("Event video offset is %.3f sec (<0 means video starts early)",
+                   video_offset.tv_sec + video_offset.tv_usec*1e-6);
+          }
 
-        } else {
-          monitor->SetVideoWriterEventId(last_event_id);
-
-          // Need to write out all the frames from the last keyframe?
-          // No... need to write out all frames from when the event began.
-          // Due to PreEventFrames, this could be more than
-          // since the last keyframe.
-          unsigned int packet_count = 0;
-          ZMPacket *queued_packet;
-          struct timeval video_offset = {0};
-
-          // Clear all packets that predate the moment when the recording began
-          packetqueue->clear_unwanted_packets(
-              &recording, 0, mVideoStreamId);
-
-          while ( (queued_packet = packetqueue->popPacket()) ) {
-            AVPacket *avp = queued_packet->av_packet();
-
-            // compute time offset between event start and first frame in video
-            if (packet_count == 0){
-                monitor->SetVideoWriterStartTime(queued_packet->timestamp);
-                timersub(&queued_packet->timestamp, &recording, &video_offset);
-                Info("Event video offset is %.3f sec (<0 means video starts early)",
-                     video_offset.tv_sec + video_offset.tv_usec*1e-6);
-            }
-
-            packet_count += 1;
-            // Write the packet to our video store
-            Debug(2, "Writing queued packet stream: %d  KEY %d, remaining (%d)",
-                avp->stream_index,
-                avp->flags & AV_PKT_FLAG_KEY,
-                packetqueue->size());
-            if ( avp->stream_index == mVideoStreamId ) {
-              ret = videoStore->writeVideoFramePacket(avp);
-              have_video_keyframe = true;
-            } else if ( avp->stream_index == mAudioStreamId ) {
-              ret = videoStore->writeAudioFramePacket(avp);
-            } else {
-              Warning("Unknown stream id in queued packet (%d)",
-                  avp->stream_index);
-              ret = -1;
-            }
-            if ( ret < 0 ) {
-              // Less than zero and we skipped a frame
-            }
+          packet_count += 1;
+          // Write the packet to our video store
+          Debug(2, "Writing queued packet stream: %d  KEY %d, remaining (%d)",
+              avp->stream_index,
+              avp->flags & AV_PKT_FLAG_KEY,
+              packetqueue->size());
+          if ( avp->stream_index == mVideoStreamId ) {
+            videoWriter->queuePacket(queued_packet);
+            have_video_keyframe = true;
+          } else if ( avp->stream_index == mAudioStreamId ) {
+            videoWriter->queuePacket(queued_packet);
+          } else {
+            Warning("Unknown stream id in queued packet (%d)",
+                avp->stream_index);
             delete queued_packet;
-          }  // end while packets in the packetqueue
-          Debug(2, "Wrote %d queued packets", packet_count);
-        }
+          }
+        }  // end while packets in the packetqueue
+        Debug(2, "Queued %d buffered packets", packet_count);
       }  // end if ! was recording
 
     } else {
       // Not recording
 
-      if ( videoStore ) {
-        Debug(1, "Deleting videoStore instance");
-        delete videoStore;
-        videoStore = nullptr;
+      if ( videoWriter && videoWriter->isOpen() ) {
+        Debug(1, "Closing video storage");
+        videoWriter->close();
         have_video_keyframe = false;
+      }
+      if ( writer_event_id ) {
+        writer_event_id = 0;
         monitor->SetVideoWriterEventId(0);
       }
     }  // end if recording or not
 
     // Buffer video packets, since we are not recording.
     // All audio packets are keyframes, so only if it's a video keyframe
-    if ( packet.stream_index == mVideoStreamId ) {
+    if ( segmentWriter ) {
+      // The segments already hold the pre-event video
+    } else if ( packet.stream_index == mVideoStreamId ) {
       if ( keyframe ) {
         Debug(3, "Clearing queue");
         if (video_buffer_duration.tv_sec > 0 || video_buffer_duration.tv_usec > 0) {
@@ -965,15 +1000,9 @@ int FfmpegCamera::CaptureAndRecord(
     }  // end if packet type
 
     if ( packet.stream_index == mVideoStreamId ) {
-      if ( (have_video_keyframe || keyframe) && videoStore ) {
-        int ret = videoStore->writeVideoFramePacket(&packet);
-        if ( ret < 0 ) {
-          // Less than zero and we skipped a frame
-          Error("Unable to write video packet code: %d, framecount %d: %s",
-              ret, frameCount, av_make_error_string(ret).c_str());
-        } else {
-          have_video_keyframe = true;
-        }
+      if ( (have_video_keyframe || keyframe) && videoWriter && videoWriter->isOpen() ) {
+        videoWriter->queuePacket(&packet);
+        have_video_keyframe = true;
       }  // end if keyframe or have_video_keyframe
 
       ret = zm_send_packet_receive_frame(mVideoCodecContext, mRawFrame, packet);
@@ -1039,18 +1068,12 @@ int FfmpegCamera::CaptureAndRecord(
     } else if ( packet.stream_index == mAudioStreamId ) {
       // FIXME best way to copy all other streams
       frameComplete = 1;
-      if ( videoStore ) {
+      if ( videoWriter && videoWriter->isOpen() ) {
         if ( record_audio ) {
           if ( have_video_keyframe ) {
             // Write the packet to our video store
             // FIXME no relevance of last key frame
-            int ret = videoStore->writeAudioFramePacket(&packet);
-            if ( ret < 0 ) {
-              // Less than zero and we skipped a frame
-              Warning("Failure to write audio packet.");
-              zm_av_packet_unref(&packet);
-              return 0;
-            }
+            videoWriter->queuePacket(&packet);
           } else {
             Debug(3, "Not recording audio because no video keyframe");
           }
@@ -1082,6 +1105,29 @@ int FfmpegCamera::CaptureAndRecord(
   return frameCount;
 }  // end FfmpegCamera::CaptureAndRecord
 
+// Picks up how the writer thread got on with what was queued to it
+void FfmpegCamera::checkVideoWriter() {
+  int error;
+  unsigned int errors = videoWriter->takeWriteErrors(error);
+  if ( errors ) {
+    Error("Unable to write %u packets to the event video: %s",
+        errors, av_make_error_string(error).c_str());
+  }
+
+  if ( !videoWriter->isOpen() || (monitor->GetVideoWriterEventId() == writer_event_id) )
+    return;
+
+  int result = videoWriter->openResult();
+  if ( result > 0 ) {
+    monitor->SetVideoWriterEventId(writer_event_id);
+  } else if ( result < 0 ) {
+    Error("Unable to record video for event %" PRIu64 ", its packets will be dropped",
+        writer_event_id);
+    videoWriter->close();
+    have_video_keyframe = false;
+  }
+}  // end void FfmpegCamera::checkVideoWriter()
+
 int FfmpegCamera::transfer_to_image(
     Image &image,
     AVFrame *output_frame,
@@ -1096,6 +1142,10 @@ int FfmpegCamera::transfer_to_image(
     Error("Failed requesting writeable buffer for the captured image.");
     return -1;
   }
+  // Decoders mostly produce 4:2:0 already, which only needs copying
+  if ( (subpixelorder == ZM_SUBPIX_ORDER_YUV420P) && zm_copy_yuv420p(input_frame, image_buffer, width, height) )
+    return 0;
+
   // if image_buffer was allocated then use it.
   buffer = frame_buffer ? frame_buffer : image_buffer;
 
@@ -26,6 +26,8 @@
 #include "zm_ffmpeg.h"
 #include "zm_videostore.h"
 #include "zm_packetqueue.h"
+#include "zm_segment_writer.h"
+#include "zm_videostore_writer.h"
 
 #if HAVE_LIBAVUTIL_HWCONTEXT_H
 typedef struct DecodeContext {
@@ -77,9 +79,11 @@ class FfmpegCamera : public Camera {
     bool mCanCapture;
 #endif // HAVE_LIBAVFORMAT
 
-    VideoStore          *videoStore;
+    VideoStoreWriter    *videoWriter;   // Writes event videos, off the capture thread
+    SegmentWriter       *segmentWriter; // Continuous recording, when segments are configured
     zm_packetqueue      *packetqueue;
     bool                have_video_keyframe;
+    uint64_t            writer_event_id; // Event the video writer was last opened for
 
 #if HAVE_LIBSWSCALE
     struct SwsContext   *mConvertContext;
@@ -123,5 +127,6 @@ class FfmpegCamera : public Camera {
   private:
     static int FfmpegInterruptCallback(void*ctx);
     int transfer_to_image(Image &i, AVFrame *output_frame, AVFrame *input_frame);
+    void checkVideoWriter();
 };
 #endif // ZM_FFMPEG_CAMERA_H
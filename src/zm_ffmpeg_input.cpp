@@ -1,5 +1,8 @@
 
 #include "zm_ffmpeg_input.h"
+
+#include <sys/stat.h>
+
 #include "zm_logger.h"
 #include "zm_ffmpeg.h"
 
@@ -11,6 +14,10 @@ FFmpeg_Input::FFmpeg_Input() {
   streams = nullptr;
   frame = nullptr;
 	last_seek_request = -1;
+  follow = false;
+  file_size = 0;
+  last_dts = nullptr;
+  resuming = false;
 }
 
 FFmpeg_Input::~FFmpeg_Input() {
@@ -22,6 +29,10 @@ FFmpeg_Input::~FFmpeg_Input() {
     delete[] streams;
     streams = nullptr;
   }
+  if ( last_dts ) {
+    delete[] last_dts;
+    last_dts = nullptr;
+  }
   if ( frame ) {
     av_frame_free(&frame);
     frame = nullptr;
@@ -40,6 +51,10 @@ int FFmpeg_Input::Open(const char *filepath) {
 
   int error;
 
+  filename = filepath;
+  struct stat st;
+  file_size = stat(filepath, &st) ? 0 : st.st_size;
+
   /** Open the input file to read from it. */
   error = avformat_open_input(&input_format_context, filepath, nullptr, nullptr);
   if ( error < 0 ) {
@@ -60,6 +75,7 @@ int FFmpeg_Input::Open(const char *filepath) {
   }
 
   streams = new stream[input_format_context->nb_streams];
+  last_dts = new int64_t[input_format_context->nb_streams];
   Debug(2, "Have %d streams", input_format_context->nb_streams);
 
   for ( unsigned int i = 0; i < input_format_context->nb_streams; i += 1 ) {
@@ -83,6 +99,7 @@ int FFmpeg_Input::Open(const char *filepath) {
     }
 
     streams[i].frame_count = 0;
+    last_dts[i] = AV_NOPTS_VALUE;
 #if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
     streams[i].context = avcodec_alloc_context3(nullptr);
     avcodec_parameters_to_context(streams[i].context, input_format_context->streams[i]->codecpar);
@@ -119,13 +136,81 @@ int FFmpeg_Input::Open(const char *filepath) {
   return 0;
 } // end int FFmpeg_Input::Open( const char * filepath )
 
+void FFmpeg_Input::set_follow(bool p_follow) {
+  if ( follow && !p_follow ) {
+    // The writer has finished, so pick up whatever it wrote since we last looked
+    Refresh();
+  }
+  follow = p_follow;
+}
+
+// The demuxer only indexes the fragments that were in the file when it was
+// opened, so to get at the ones written since we reopen the file, keeping
+// the decoders as they are, and carry on from the last packet read.
+// Returns 1 if there was more to read, 0 if not and < 0 on error.
+int FFmpeg_Input::Refresh() {
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+  struct stat st;
+  if ( !input_format_context || stat(filename.c_str(), &st) || (st.st_size <= file_size) )
+    return 0;
+
+  AVFormatContext *refreshed_context = nullptr;
+  int error = avformat_open_input(&refreshed_context, filename.c_str(), nullptr, nullptr);
+  if ( error < 0 ) {
+    Error("Could not reopen input file '%s' (error '%s')",
+        filename.c_str(), av_make_error_string(error).c_str());
+    return error;
+  }
+  if ( refreshed_context->nb_streams != input_format_context->nb_streams ) {
+    Error("Number of streams in %s changed from %d to %d",
+        filename.c_str(), input_format_context->nb_streams, refreshed_context->nb_streams);
+    avformat_close_input(&refreshed_context);
+    return AVERROR_INVALIDDATA;
+  }
+  Debug(2, "Reopened %s, grown from %jd to %jd bytes",
+      filename.c_str(), (intmax_t)file_size, (intmax_t)st.st_size);
+
+  avformat_close_input(&input_format_context);
+  input_format_context = refreshed_context;
+  file_size = st.st_size;
+
+  int stream_id = (video_stream_id >= 0) ? video_stream_id : 0;
+  if ( last_dts[stream_id] != AV_NOPTS_VALUE ) {
+    if ( av_seek_frame(input_format_context, stream_id, last_dts[stream_id], AVSEEK_FLAG_BACKWARD) < 0 )
+      Warning("Unable to seek back to where we were in %s", filename.c_str());
+    resuming = true;
+  }
+  return 1;
+#else
+  return 0;
+#endif
+} // end int FFmpeg_Input::Refresh()
+
 AVFrame *FFmpeg_Input::get_frame(int stream_id) {
   int frameComplete = false;
+  bool refreshed = false;
   AVPacket packet;
   av_init_packet(&packet);
 
   while ( !frameComplete ) {
     int ret = av_read_frame(input_format_context, &packet);
+    if ( follow && (ret >= 0) && (packet.flags & AV_PKT_FLAG_CORRUPT) ) {
+      // The writer is still part way through this packet
+      Debug(3, "Read a partial packet at the end of %s", filename.c_str());
+      zm_av_packet_unref(&packet);
+      ret = AVERROR_EOF;
+    }
+    // A packet read as the end is reached is still good, the next read finds the end
+    if ( follow && (ret < 0) && (ret == AVERROR_EOF || (input_format_context->pb && input_format_context->pb->eof_reached)) ) {
+      // Only reopen once per frame, so a writer trickling data in can't keep us here
+      if ( !refreshed ) {
+        refreshed = true;
+        if ( Refresh() > 0 )
+          continue;
+      }
+      Debug(3, "Caught up with the writer of %s", filename.c_str());
+      return nullptr;
+    }
     if ( ret < 0 ) {
       if (
           // Check if EOF.
@@ -142,6 +227,18 @@ AVFrame *FFmpeg_Input::get_frame(int stream_id) {
     }
     dumpPacket(input_format_context->streams[packet.stream_index], &packet, "Received packet");
 
+    if ( resuming ) {
+      int64_t last = last_dts[packet.stream_index];
+      if ( (packet.dts != AV_NOPTS_VALUE) && (last != AV_NOPTS_VALUE) && (packet.dts <= last) ) {
+        // Already decoded before the file was reopened
+        zm_av_packet_unref(&packet);
+        continue;
+      }
+      if ( (video_stream_id < 0) || (packet.stream_index == video_stream_id) )
+        resuming = false;
+    }
+    last_dts[packet.stream_index] = packet.dts;
+
     if ( (stream_id < 0) || (packet.stream_index == stream_id) ) {
       Debug(3, "Packet is for our stream (%d)", packet.stream_index);
 
@@ -189,6 +286,7 @@ AVFrame *FFmpeg_Input::get_frame(int stream_id, double at) {
 
   if ( !frame ) {
     // Don't have a frame yet, so get a keyframe before the timestamp
+    resuming = false;
     ret = av_seek_frame(input_format_context, stream_id, seek_target, AVSEEK_FLAG_FRAME);
     if ( ret < 0 ) {
       Error("Unable to seek in stream");
@@ -212,6 +310,7 @@ AVFrame *FFmpeg_Input::get_frame(int stream_id, double at) {
 		 ) {
     zm_dump_frame(frame, "frame->pts > seek_target, seek backwards");
   // our frame must be beyond our seek target. so go backwards to before it
+    resuming = false;
     if ( ( ret = av_seek_frame(input_format_context, stream_id, seek_target, 
             AVSEEK_FLAG_BACKWARD | AVSEEK_FLAG_FRAME
             ) < 0 ) ) {
@@ -233,6 +332,11 @@ AVFrame *FFmpeg_Input::get_frame(int stream_id, double at) {
     zm_dump_frame(frame, "pts <= seek_target");
     while ( frame && (frame->pts < seek_target) ) {
       if ( !get_frame(stream_id) ) {
+        if ( follow ) {
+          // Not written yet, the latest we have will do until it is
+          Debug(3, "Frame at %" PRId64 " not written yet", seek_target);
+          return frame;
+        }
         Warning("Got no frame. returning nothing");
         return frame;
       }
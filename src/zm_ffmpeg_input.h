@@ -13,6 +13,8 @@ extern "C" {
 }
 #endif
 
+#include <string>
+
 class FFmpeg_Input {
 
   public:
@@ -21,6 +23,15 @@ class FFmpeg_Input {
 
     int Open( const char *filename );
     int Close();
+    // While following, the end of the file is taken to be where the writer
+    // has got to rather than the end of the video.
+    void set_follow(bool p_follow);
+    bool following() const {
+      return follow;
+    }
+    const std::string &get_filename() const {
+      return filename;
+    }
     AVFrame *get_frame( int stream_id=-1 );
     AVFrame *get_frame( int stream_id, double at );
     int get_video_stream_id() const {
@@ -31,6 +42,8 @@ class FFmpeg_Input {
     }
 
   private:
+    int Refresh();
+
     typedef struct {
         AVCodecContext *context;
         AVCodec *codec;
@@ -43,6 +56,12 @@ class FFmpeg_Input {
     AVFormatContext *input_format_context;
     AVFrame *frame;
 		int64_t last_seek_request;
+
+    std::string filename;
+    bool follow;
+    off_t file_size;        // Size of the file when it was last opened
+    int64_t *last_dts;      // Last packet read from each stream
+    bool resuming;          // Skipping packets already read before a refresh
 };
 
 #endif
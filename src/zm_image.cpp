@@ -27,6 +27,8 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <algorithm>
+#include <vector>
 
 static unsigned char y_table_global[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 15, 16, 17, 18, 19, 20, 22, 23, 24, 25, 26, 27, 29, 30, 31, 32, 33, 34, 36, 37, 38, 39, 40, 41, 43, 44, 45, 46, 47, 48, 50, 51, 52, 53, 54, 55, 57, 58, 59, 60, 61, 62, 64, 65, 66, 67, 68, 69, 71, 72, 73, 74, 75, 76, 78, 79, 80, 81, 82, 83, 85, 86, 87, 88, 89, 90, 91, 93, 94, 95, 96, 97, 98, 100, 101, 102, 103, 104, 105, 107, 108, 109, 110, 111, 112, 114, 115, 116, 117, 118, 119, 121, 122, 123, 124, 125, 126, 128, 129, 130, 131, 132, 133, 135, 136, 137, 138, 139, 140, 142, 143, 144, 145, 146, 147, 149, 150, 151, 152, 153, 154, 156, 157, 158, 159, 160, 161, 163, 164, 165, 166, 167, 168, 170, 171, 172, 173, 174, 175, 176, 178, 179, 180, 181, 182, 183, 185, 186, 187, 188, 189, 190, 192, 193, 194, 195, 196, 197, 199, 200, 201, 202, 203, 204, 206, 207, 208, 209, 210, 211, 213, 214, 215, 216, 217, 218, 220, 221, 222, 223, 224, 225, 227, 228, 229, 230, 231, 232, 234, 235, 236, 237, 238, 239, 241, 242, 243, 244, 245, 246, 248, 249, 250, 251, 252, 253, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255};
 
@@ -50,11 +52,8 @@ static short *b_u_table;
 
 struct SwsContext *sws_convert_context = nullptr;
 
-jpeg_compress_struct *Image::writejpg_ccinfo[101] = { };
-jpeg_compress_struct *Image::encodejpg_ccinfo[101] = { };
-jpeg_decompress_struct *Image::readjpg_dcinfo = nullptr;
-jpeg_decompress_struct *Image::decodejpg_dcinfo = nullptr;
-struct zm_error_mgr Image::jpg_err;
+thread_local Image::JpegCodecs Image::jpeg_codecs;
+thread_local struct zm_error_mgr Image::jpg_err;
 
 /* Pointer to blend function. */
 static blend_fptr_t fptr_blend;
@@ -75,12 +74,21 @@ static deinterlace_4field_fptr_t fptr_deinterlace_4field_argb;
 static deinterlace_4field_fptr_t fptr_deinterlace_4field_abgr;
 static deinterlace_4field_fptr_t fptr_deinterlace_4field_gray8;
 
+/* Pointers to rotate and flip functions */
+static transpose_fptr_t fptr_transpose_gray8;
+static transpose_fptr_t fptr_transpose_rgb32;
+static reverse_fptr_t fptr_reverse_gray8;
+static reverse_fptr_t fptr_reverse_rgb32;
+
+/* Pointer to area averaging scale function */
+static rowsum_fptr_t fptr_rowsum;
+
 /* Pointer to image buffer memory copy function */
 imgbufcpy_fptr_t fptr_imgbufcpy;
 
 void Image::update_function_pointers() {
   /* Because many loops are unrolled and work on 16 colours/time or 4 pixels/time, we have to meet requirements */
-  if ( pixels % 16 || pixels % 12 ) {
+  if ( pixels % 16 || pixels % 12 || (IsPlanar() && (pixels % 32)) ) {
     // have to use non-loop unrolled functions
     delta8_rgb = &std_delta8_rgb;
     delta8_bgr = &std_delta8_bgr;
@@ -118,6 +126,8 @@ Image::Image() {
   buffer = 0;
   buffertype = 0;
   holdbuffer = 0;
+  scratch_buffer = nullptr;
+  scratch_allocation = 0;
   text[0] = '\0';
   blend = fptr_blend;
 }
@@ -136,6 +146,8 @@ Image::Image(const char *filename) {
   buffer = 0;
   buffertype = 0;
   holdbuffer = 0;
+  scratch_buffer = nullptr;
+  scratch_allocation = 0;
   ReadJpeg(filename, ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB);
   text[0] = '\0';
   update_function_pointers();
@@ -151,9 +163,11 @@ Image::Image(int p_width, int p_height, int p_colours, int p_subpixelorder, uint
   linesize = p_width * p_colours;
   padding = p_padding;
   subpixelorder = p_subpixelorder;
-  size = linesize*height + padding;
+  size = zm_image_buffer_size(width, height, colours, subpixelorder) + padding;
   buffer = nullptr;
   holdbuffer = 0;
+  scratch_buffer = nullptr;
+  scratch_allocation = 0;
   if ( p_buffer ) {
     allocation = size;
     buffertype = ZM_BUFTYPE_DONTFREE;
@@ -176,9 +190,11 @@ Image::Image(int p_width, int p_linesize, int p_height, int p_colours, int p_sub
   colours = p_colours;
   padding = p_padding;
   subpixelorder = p_subpixelorder;
-  size = linesize*height + padding;
+  size = (IsPlanar() ? zm_image_buffer_size(width, height, colours, subpixelorder) : linesize*height) + padding;
   buffer = nullptr;
   holdbuffer = 0;
+  scratch_buffer = nullptr;
+  scratch_allocation = 0;
   if ( p_buffer ) {
     allocation = size;
     buffertype = ZM_BUFTYPE_DONTFREE;
@@ -212,6 +228,8 @@ Image::Image(const AVFrame *frame) {
 
   buffer = nullptr;
   holdbuffer = 0;
+  scratch_buffer = nullptr;
+  scratch_allocation = 0;
   AllocImgBuffer(size);
 
 #if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
@@ -256,6 +274,8 @@ Image::Image(const Image &p_image) {
   size = p_image.size; // allocation is set in AllocImgBuffer
   buffer = nullptr;
   holdbuffer = 0;
+  scratch_buffer = nullptr;
+  scratch_allocation = 0;
   AllocImgBuffer(size);
   (*fptr_imgbufcpy)(buffer, p_image.buffer, size);
   strncpy(text, p_image.text, sizeof(text));
@@ -264,35 +284,52 @@ Image::Image(const Image &p_image) {
 
 Image::~Image() {
   DumpImgBuffer();
+  if ( scratch_buffer ) {
+    DumpBuffer(scratch_buffer, ZM_BUFTYPE_ZM);
+    scratch_buffer = nullptr;
+  }
 }
 
 /* Should be called as part of program shutdown to free everything */
 void Image::Deinitialise() {
   if ( !initialised ) return;
   initialised = false;
+
+  if ( sws_convert_context ) {
+    sws_freeContext(sws_convert_context);
+    sws_convert_context = nullptr;
+  }
+}  // end void Image::Deinitialise()
+
+Image::JpegCodecs::JpegCodecs() :
+  writejpg_ccinfo(),
+  encodejpg_ccinfo(),
+  readjpg_dcinfo(nullptr),
+  decodejpg_dcinfo(nullptr)
+{
+}
+
+/* Runs as each thread that used them exits */
+Image::JpegCodecs::~JpegCodecs() {
   if ( readjpg_dcinfo ) {
     jpeg_destroy_decompress(readjpg_dcinfo);
     delete readjpg_dcinfo;
-    readjpg_dcinfo = nullptr;
   }
   if ( decodejpg_dcinfo ) {
     jpeg_destroy_decompress(decodejpg_dcinfo);
     delete decodejpg_dcinfo;
-    decodejpg_dcinfo = nullptr;
   }
   for ( unsigned int quality=0; quality <= 100; quality += 1 ) {
     if ( writejpg_ccinfo[quality] ) {
       jpeg_destroy_compress(writejpg_ccinfo[quality]);
       delete writejpg_ccinfo[quality];
-      writejpg_ccinfo[quality] = nullptr;
+    }
+    if ( encodejpg_ccinfo[quality] ) {
+      jpeg_destroy_compress(encodejpg_ccinfo[quality]);
+      delete encodejpg_ccinfo[quality];
     }
   } // end foreach quality
-
-  if ( sws_convert_context ) {
-    sws_freeContext(sws_convert_context);
-    sws_convert_context = nullptr;
-  }
-}  // end void Image::Deinitialise()
+}
 
 void Image::Initialise() {
   /* Assign the blend pointer to function */
@@ -464,6 +501,28 @@ void Image::Initialise() {
   fptr_deinterlace_4field_gray8 = &std_deinterlace_4field_gray8;
   Debug(4, "Deinterlace: Using standard functions");
 
+  if ( config.cpu_extensions && sse_version >= 20 ) {
+    fptr_transpose_gray8 = &sse2_transpose_gray8;
+    fptr_transpose_rgb32 = &sse2_transpose_rgb32;
+    fptr_reverse_gray8 = &sse2_reverse_gray8;
+    fptr_reverse_rgb32 = &sse2_reverse_rgb32;
+    Debug(4, "Rotate: Using SSE2 functions");
+  } else {
+    fptr_transpose_gray8 = &std_transpose_gray8;
+    fptr_transpose_rgb32 = &std_transpose_rgb32;
+    fptr_reverse_gray8 = &std_reverse_gray8;
+    fptr_reverse_rgb32 = &std_reverse_rgb32;
+    Debug(4, "Rotate: Using standard functions");
+  }
+
+  if ( config.cpu_extensions && sse_version >= 20 ) {
+    fptr_rowsum = &sse2_rowsum;
+    Debug(4, "Scale: Using SSE2 functions");
+  } else {
+    fptr_rowsum = &std_rowsum;
+    Debug(4, "Scale: Using standard functions");
+  }
+
 #if defined(__i386__) && !defined(__x86_64__)
   /* Use SSE2 aligned memory copy? */
   if ( config.cpu_extensions && sse_version >= 20 ) {
@@ -511,7 +570,7 @@ uint8_t* Image::WriteBuffer(
 
   if ( p_width != width || p_height != height || p_colours != colours || p_subpixelorder != subpixelorder ) {
 
-    unsigned int newsize = (p_width * p_height) * p_colours;
+    unsigned int newsize = zm_image_buffer_size(p_width, p_height, p_colours, p_subpixelorder);
 
     if ( buffer == nullptr ) {
       AllocImgBuffer(newsize);
@@ -567,7 +626,7 @@ void Image::AssignDirect(
     return;
   }
 
-  unsigned int new_buffer_size = ((p_width*p_height)*p_colours);
+  unsigned int new_buffer_size = zm_image_buffer_size(p_width, p_height, p_colours, p_subpixelorder);
 
   if ( buffer_size < new_buffer_size ) {
     Error("Attempt to directly assign buffer from an undersized buffer of size: %zu, needed %dx%d*%d colours = %zu",
@@ -621,7 +680,7 @@ void Image::Assign(
     const unsigned int p_subpixelorder,
     const uint8_t* new_buffer,
     const size_t buffer_size) {
-  unsigned int new_size = (p_width * p_height) * p_colours;
+  unsigned int new_size = zm_image_buffer_size(p_width, p_height, p_colours, p_subpixelorder);
 
   if ( new_buffer == nullptr ) {
     Error("Attempt to assign buffer from a NULL pointer");
@@ -670,7 +729,8 @@ void Image::Assign(
 }
 
 void Image::Assign(const Image &image) {
-  unsigned int new_size = image.height * image.linesize;
+  unsigned int new_size = image.IsPlanar() ?
+    zm_image_buffer_size(image.width, image.height, image.colours, image.subpixelorder) : image.height * image.linesize;
 
   if ( image.buffer == nullptr ) {
     Error("Attempt to assign image with an empty buffer");
@@ -860,10 +920,10 @@ bool Image::WriteRaw(const char *filename) const {
 
 bool Image::ReadJpeg(const char *filename, unsigned int p_colours, unsigned int p_subpixelorder) {
   unsigned int new_width, new_height, new_colours, new_subpixelorder;
-  struct jpeg_decompress_struct *cinfo = readjpg_dcinfo;
+  struct jpeg_decompress_struct *cinfo = jpeg_codecs.readjpg_dcinfo;
 
   if ( !cinfo ) {
-    cinfo = readjpg_dcinfo = new jpeg_decompress_struct;
+    cinfo = jpeg_codecs.readjpg_dcinfo = new jpeg_decompress_struct;
     cinfo->err = jpeg_std_error(&jpg_err.pub);
     jpg_err.pub.error_exit = zm_jpeg_error_exit;
     jpg_err.pub.emit_message = zm_jpeg_emit_message;
@@ -1003,20 +1063,20 @@ bool Image::WriteJpeg(const char *filename, int quality_override, struct timeval
 }
 
 bool Image::WriteJpeg(const char *filename, int quality_override, struct timeval timestamp, bool on_blocking_abort) const {
-  if ( config.colour_jpeg_files && (colours == ZM_COLOUR_GRAY8) ) {
+  if ( config.colour_jpeg_files && (colours == ZM_COLOUR_GRAY8) && !IsPlanar() ) {
     Image temp_image(*this);
     temp_image.Colourise(ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB);
     return temp_image.WriteJpeg(filename, quality_override, timestamp, on_blocking_abort);
   }
   int quality = quality_override ? quality_override : config.jpeg_file_quality;
 
-  struct jpeg_compress_struct *cinfo = writejpg_ccinfo[quality];
+  struct jpeg_compress_struct *cinfo = jpeg_codecs.writejpg_ccinfo[quality];
   FILE *outfile = nullptr;
   static int raw_fd = 0;
   raw_fd = 0;
 
   if ( !cinfo ) {
-    cinfo = writejpg_ccinfo[quality] = new jpeg_compress_struct;
+    cinfo = jpeg_codecs.writejpg_ccinfo[quality] = new jpeg_compress_struct;
     cinfo->err = jpeg_std_error(&jpg_err.pub);
     jpeg_create_compress(cinfo);
   }
@@ -1058,7 +1118,10 @@ bool Image::WriteJpeg(const char *filename, int quality_override, struct timeval
   cinfo->image_width = width;   /* image width and height, in pixels */
   cinfo->image_height = height;
 
-  switch ( colours ) {
+  if ( IsPlanar() ) {
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_YCbCr;
+  } else switch ( colours ) {
     case ZM_COLOUR_GRAY8:
         cinfo->input_components = 1;
         cinfo->in_color_space = JCS_GRAYSCALE;
@@ -1115,6 +1178,13 @@ cinfo->out_color_space = JCS_RGB;
   jpeg_set_defaults(cinfo);
   jpeg_set_quality(cinfo, quality, FALSE);
   cinfo->dct_method = JDCT_FASTEST;
+  if ( IsPlanar() ) {
+    /* The planes are already subsampled the way JPEG wants them */
+    cinfo->raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo->do_fancy_downsampling = FALSE;
+#endif
+  }
 
   jpeg_start_compress(cinfo, TRUE);
   if ( config.add_jpeg_comments && text[0] ) {
@@ -1145,10 +1215,14 @@ cinfo->out_color_space = JCS_RGB;
     jpeg_write_marker(cinfo, EXIF_CODE, (const JOCTET *)exiftimes, sizeof(exiftimes));
   }
 
-  JSAMPROW row_pointer = buffer;  /* pointer to a single row */
-  while ( cinfo->next_scanline < cinfo->image_height ) {
-    jpeg_write_scanlines(cinfo, &row_pointer, 1);
-    row_pointer += linesize;
+  if ( IsPlanar() ) {
+    WriteJpegPlanes(cinfo);
+  } else {
+    JSAMPROW row_pointer = buffer;  /* pointer to a single row */
+    while ( cinfo->next_scanline < cinfo->image_height ) {
+      jpeg_write_scanlines(cinfo, &row_pointer, 1);
+      row_pointer += linesize;
+    }
   }
   jpeg_finish_compress(cinfo);
   fclose(outfile);
@@ -1163,10 +1237,10 @@ bool Image::DecodeJpeg(
     unsigned int p_subpixelorder)
 {
   unsigned int new_width, new_height, new_colours, new_subpixelorder;
-  struct jpeg_decompress_struct *cinfo = decodejpg_dcinfo;
+  struct jpeg_decompress_struct *cinfo = jpeg_codecs.decodejpg_dcinfo;
 
   if ( !cinfo ) {
-    cinfo = decodejpg_dcinfo = new jpeg_decompress_struct;
+    cinfo = jpeg_codecs.decodejpg_dcinfo = new jpeg_decompress_struct;
     cinfo->err = jpeg_std_error( &jpg_err.pub );
     jpg_err.pub.error_exit = zm_jpeg_error_exit;
     jpg_err.pub.emit_message = zm_jpeg_emit_message;
@@ -1276,7 +1350,7 @@ cinfo->out_color_space = JCS_RGB;
 }
 
 bool Image::EncodeJpeg(JOCTET *outbuffer, int *outbuffer_size, int quality_override) const {
-  if ( config.colour_jpeg_files && (colours == ZM_COLOUR_GRAY8) ) {
+  if ( config.colour_jpeg_files && (colours == ZM_COLOUR_GRAY8) && !IsPlanar() ) {
     Image temp_image(*this);
     temp_image.Colourise(ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB);
     return temp_image.EncodeJpeg(outbuffer, outbuffer_size, quality_override);
@@ -1284,10 +1358,10 @@ bool Image::EncodeJpeg(JOCTET *outbuffer, int *outbuffer_size, int quality_overr
 
   int quality = quality_override ? quality_override : config.jpeg_stream_quality;
 
-  struct jpeg_compress_struct *cinfo = encodejpg_ccinfo[quality];
+  struct jpeg_compress_struct *cinfo = jpeg_codecs.encodejpg_ccinfo[quality];
 
   if ( !cinfo ) {
-    cinfo = encodejpg_ccinfo[quality] = new jpeg_compress_struct;
+    cinfo = jpeg_codecs.encodejpg_ccinfo[quality] = new jpeg_compress_struct;
     cinfo->err = jpeg_std_error(&jpg_err.pub);
     jpg_err.pub.error_exit = zm_jpeg_error_exit;
     jpg_err.pub.emit_message = zm_jpeg_emit_message;
@@ -1299,7 +1373,10 @@ bool Image::EncodeJpeg(JOCTET *outbuffer, int *outbuffer_size, int quality_overr
   cinfo->image_width = width;   /* image width and height, in pixels */
   cinfo->image_height = height;
 
-  switch ( colours ) {
+  if ( IsPlanar() ) {
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_YCbCr;
+  } else switch ( colours ) {
     case ZM_COLOUR_GRAY8:
         cinfo->input_components = 1;
         cinfo->in_color_space = JCS_GRAYSCALE;
@@ -1354,13 +1431,24 @@ cinfo->out_color_space = JCS_RGB;
   jpeg_set_defaults(cinfo);
   jpeg_set_quality(cinfo, quality, FALSE);
   cinfo->dct_method = JDCT_FASTEST;
+  if ( IsPlanar() ) {
+    /* The planes are already subsampled the way JPEG wants them */
+    cinfo->raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo->do_fancy_downsampling = FALSE;
+#endif
+  }
 
   jpeg_start_compress(cinfo, TRUE);
 
-  JSAMPROW row_pointer = buffer;
-  while ( cinfo->next_scanline < cinfo->image_height ) {
-    jpeg_write_scanlines(cinfo, &row_pointer, 1);
-    row_pointer += linesize;
+  if ( IsPlanar() ) {
+    WriteJpegPlanes(cinfo);
+  } else {
+    JSAMPROW row_pointer = buffer;
+    while ( cinfo->next_scanline < cinfo->image_height ) {
+      jpeg_write_scanlines(cinfo, &row_pointer, 1);
+      row_pointer += linesize;
+    }
   }
 
   jpeg_finish_compress(cinfo);
@@ -1368,6 +1456,45 @@ cinfo->out_color_space = JCS_RGB;
   return true;
 }
 
+/* Hands the Y, U and V planes to libjpeg an MCU row at a time, 16 luma and 8 chroma lines.
+   libjpeg reads whole blocks, so lines are copied out and padded by repeating their last
+   sample, and the bottom line is repeated to fill the last MCU row. */
+void Image::WriteJpegPlanes(jpeg_compress_struct *cinfo) const {
+  const unsigned int chroma_width = (width+1)>>1;
+  const unsigned int chroma_height = (height+1)>>1;
+  const unsigned int padded_width = (width+15) & ~15;
+  const unsigned int padded_chroma_width = padded_width>>1;
+  const uint8_t *planes[3] = { buffer, buffer+pixels, buffer+pixels+(chroma_width*chroma_height) };
+
+  std::vector<uint8_t> lines((16*padded_width) + (2*8*padded_chroma_width));
+  JSAMPROW rows[3][16];
+  for ( unsigned int i = 0; i < 16; i++ )
+    rows[0][i] = &lines[i*padded_width];
+  for ( unsigned int i = 0; i < 8; i++ ) {
+    rows[1][i] = &lines[(16*padded_width) + (i*padded_chroma_width)];
+    rows[2][i] = &lines[(16*padded_width) + ((8+i)*padded_chroma_width)];
+  }
+  JSAMPARRAY data[3] = { rows[0], rows[1], rows[2] };
+
+  for ( unsigned int y = 0; y < height; y += 16 ) {
+    for ( unsigned int plane = 0; plane < 3; plane++ ) {
+      const unsigned int plane_width = plane ? chroma_width : width;
+      const unsigned int plane_height = plane ? chroma_height : height;
+      const unsigned int line_width = plane ? padded_chroma_width : padded_width;
+      const unsigned int n_lines = plane ? 8 : 16;
+      const unsigned int first_line = plane ? y>>1 : y;
+
+      for ( unsigned int i = 0; i < n_lines; i++ ) {
+        const uint8_t *src = planes[plane] + (std::min(first_line+i, plane_height-1) * plane_width);
+        uint8_t *dst = rows[plane][i];
+        memcpy(dst, src, plane_width);
+        memset(dst+plane_width, src[plane_width-1], line_width-plane_width);
+      }
+    }
+    jpeg_write_raw_data(cinfo, data, 16);
+  }
+}
+
 #if HAVE_ZLIB_H
 bool Image::Unzip( const Bytef *inbuffer, unsigned long inbuffer_size ) {
   unsigned long zip_size = size;
@@ -1411,17 +1538,20 @@ bool Image::Crop( unsigned int lo_x, unsigned int lo_y, unsigned int hi_x, unsig
     return true;
   }
 
-  unsigned int new_size = new_width*new_height*colours;
-  uint8_t *new_buffer = AllocBuffer(new_size);
+  if ( IsPlanar() )
+    Colourise(ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB);
+
+  /* As big as the whole image, so that it can take whole frames again once swapped in */
+  uint8_t *new_buffer = ScratchBuffer(size);
 
   unsigned int new_stride = new_width * colours;
   for ( unsigned int y = lo_y, ny = 0; y <= hi_y; y++, ny++ ) {
-    unsigned char *pbuf = &buffer[((y*linesize)+lo_x)];
-    unsigned char *pnbuf = &new_buffer[(ny*new_width)*colours];
+    unsigned char *pbuf = &buffer[(y*linesize)+(lo_x*colours)];
+    unsigned char *pnbuf = &new_buffer[ny*new_stride];
     memcpy( pnbuf, pbuf, new_stride );
   }
 
-  AssignDirect(new_width, new_height, colours, subpixelorder, new_buffer, new_size, ZM_BUFTYPE_ZM);
+  AssignScratchBuffer(new_width, new_height);
 
   return true;
 }
@@ -1438,6 +1568,9 @@ void Image::Overlay( const Image &image ) {
         width, height, image.width, image.height);
   }
 
+  if ( IsPlanar() )
+    Colourise(ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB);
+
   if ( colours == image.colours && subpixelorder != image.subpixelorder ) {
     Warning("Attempt to overlay images of same format but with different subpixel order.");
   }
@@ -1874,44 +2007,95 @@ const Coord Image::centreCoord( const char *text, int size=1 ) const {
   return Coord(x, y);
 }
 
+PrivacyMask::PrivacyMask(const unsigned char *p_bitmask, unsigned int p_width, unsigned int p_height) :
+  width(p_width),
+  height(p_height)
+{
+  line_spans.reserve(height+1);
+  const unsigned char *ptr = p_bitmask;
+
+  for ( unsigned int y = 0; y < height; y++ ) {
+    line_spans.push_back(spans.size());
+    unsigned int x = 0;
+    while ( x < width ) {
+      if ( !ptr[x] ) {
+        x++;
+        continue;
+      }
+      Span span;
+      span.lo_x = x;
+      while ( x < width && ptr[x] )
+        x++;
+      span.hi_x = x;
+      spans.push_back(span);
+    }
+    ptr += width;
+  }
+  line_spans.push_back(spans.size());
+  Debug(3, "Privacy mask of %ux%u has %zu spans", width, height, spans.size());
+}
+
 /* RGB32 compatible: complete */
-void Image::MaskPrivacy( const unsigned char *p_bitmask, const Rgb pixel_colour ) {
+void Image::MaskPrivacy( const PrivacyMask &p_mask, const Rgb pixel_colour ) {
+  MaskPrivacy(p_mask, 0, height, pixel_colour);
+}
+
+/* Masks only rows lo_y to hi_y-1, so that a band can be masked while it is still in cache */
+void Image::MaskPrivacy( const PrivacyMask &p_mask, unsigned int lo_y, unsigned int hi_y, const Rgb pixel_colour ) {
+  if ( p_mask.Width() != width || p_mask.Height() != height ) {
+    Error("Privacy mask of %ux%u does not match image of %ux%u",
+        p_mask.Width(), p_mask.Height(), width, height);
+    return;
+  }
+  if ( colours != ZM_COLOUR_GRAY8 && colours != ZM_COLOUR_RGB24 && colours != ZM_COLOUR_RGB32 ) {
+    Panic("MaskPrivacy called with unexpected colours: %d", colours);
+    return;
+  }
+
   const uint8_t pixel_r_col = RED_VAL_RGBA(pixel_colour);
   const uint8_t pixel_g_col = GREEN_VAL_RGBA(pixel_colour);
   const uint8_t pixel_b_col = BLUE_VAL_RGBA(pixel_colour);
   const uint8_t pixel_bw_col = pixel_colour & 0xff;
   const Rgb pixel_rgb_col = rgb_convert(pixel_colour,subpixelorder);
 
-  unsigned char *ptr = &buffer[0];
-  unsigned int i = 0;
+  if ( hi_y > height )
+    hi_y = height;
 
-  for ( unsigned int y = 0; y < height; y++ ) {
-    if ( colours == ZM_COLOUR_GRAY8 ) {
-      for ( unsigned int x = 0; x < width; x++, ptr++ ) {
-        if ( p_bitmask[i] )
-          *ptr = pixel_bw_col;
-        i++;
-      }
-    } else if ( colours == ZM_COLOUR_RGB24 ) {
-      for ( unsigned int x = 0; x < width; x++, ptr += colours ) {
-        if ( p_bitmask[i] ) {
-          RED_PTR_RGBA(ptr) = pixel_r_col;
-          GREEN_PTR_RGBA(ptr) = pixel_g_col;
-          BLUE_PTR_RGBA(ptr) = pixel_b_col;
+  for ( unsigned int y = lo_y; y < hi_y; y++ ) {
+    unsigned int n_spans;
+    const PrivacyMask::Span *span = p_mask.LineSpans(y, n_spans);
+    uint8_t *line = buffer + (y*linesize);
+
+    for ( ; n_spans; n_spans--, span++ ) {
+      unsigned int n_pixels = span->hi_x - span->lo_x;
+      uint8_t *ptr = line + (span->lo_x*colours);
+
+      if ( colours == ZM_COLOUR_GRAY8 ) {
+        memset(ptr, pixel_bw_col, n_pixels);
+        if ( IsPlanar() ) {
+          /* Neutral chroma too, or the masked area would keep its colours */
+          unsigned int chroma_width = (width+1)>>1;
+          unsigned int chroma_offset = ((y>>1)*chroma_width) + (span->lo_x>>1);
+          unsigned int chroma_pixels = ((span->hi_x+1)>>1) - (span->lo_x>>1);
+          memset(buffer + pixels + chroma_offset, 128, chroma_pixels);
+          memset(buffer + pixels + (chroma_width*((height+1)>>1)) + chroma_offset, 128, chroma_pixels);
         }
-        i++;
-      }
-    } else if ( colours == ZM_COLOUR_RGB32 ) {
-      for ( unsigned int x = 0; x < width; x++, ptr += colours ) {
-        Rgb *temp_ptr = (Rgb*)ptr;
-        if ( p_bitmask[i] )
-          *temp_ptr = pixel_rgb_col;
-        i++;
+      } else if ( colours == ZM_COLOUR_RGB24 ) {
+        /* Set the first pixel, then keep doubling what has been filled in */
+        RED_PTR_RGBA(ptr) = pixel_r_col;
+        GREEN_PTR_RGBA(ptr) = pixel_g_col;
+        BLUE_PTR_RGBA(ptr) = pixel_b_col;
+        unsigned int filled = 3;
+        unsigned int span_bytes = n_pixels*3;
+        while ( filled < span_bytes ) {
+          unsigned int copy_bytes = std::min(filled, span_bytes - filled);
+          memcpy(ptr + filled, ptr, copy_bytes);
+          filled += copy_bytes;
+        }
+      } else {
+        std::fill_n((Rgb*)ptr, n_pixels, pixel_rgb_col);
       }
-    } else {
-      Panic("MaskPrivacy called with unexpected colours: %d", colours);
-      return;
-    }
+    } // end foreach span
   } // end foreach y
 }
 
@@ -2103,6 +2287,11 @@ void Image::Timestamp( const char *label, const time_t when, const Coord &coord,
 void Image::Colourise(const unsigned int p_reqcolours, const unsigned int p_reqsubpixelorder) {
   Debug(9, "Colourise: Req colours: %u Req subpixel order: %u Current colours: %u Current subpixel order: %u",p_reqcolours,p_reqsubpixelorder,colours,subpixelorder);
 
+  if ( IsPlanar() ) {
+    ColourisePlanar(p_reqcolours, p_reqsubpixelorder);
+    return;
+  }
+
   if ( colours != ZM_COLOUR_GRAY8) {
     Warning("Target image is already colourised, colours: %u",colours);
     return;
@@ -2157,8 +2346,67 @@ void Image::Colourise(const unsigned int p_reqcolours, const unsigned int p_reqs
   }
 }
 
+/* YUV420P to RGB24 or RGB32, using the full range (JPEG) coefficients */
+void Image::ColourisePlanar(const unsigned int p_reqcolours, const unsigned int p_reqsubpixelorder) {
+  int r_offset, g_offset, b_offset, a_offset;
+  switch ( p_reqsubpixelorder ) {
+    case ZM_SUBPIX_ORDER_BGR :
+    case ZM_SUBPIX_ORDER_BGRA :
+      r_offset = 2; g_offset = 1; b_offset = 0; a_offset = 3;
+      break;
+    case ZM_SUBPIX_ORDER_ARGB :
+      r_offset = 1; g_offset = 2; b_offset = 3; a_offset = 0;
+      break;
+    case ZM_SUBPIX_ORDER_ABGR :
+      r_offset = 3; g_offset = 2; b_offset = 1; a_offset = 0;
+      break;
+    default :
+      r_offset = 0; g_offset = 1; b_offset = 2; a_offset = 3;
+      break;
+  }
+  if ( p_reqcolours != ZM_COLOUR_RGB24 && p_reqcolours != ZM_COLOUR_RGB32 ) {
+    Error("Colourise called with unexpected colours: %d", p_reqcolours);
+    return;
+  }
+
+  const unsigned int chroma_width = (width+1)>>1;
+  const uint8_t *y_plane = buffer;
+  const uint8_t *u_plane = buffer + pixels;
+  const uint8_t *v_plane = u_plane + chroma_width*((height+1)>>1);
+  unsigned int new_size = pixels*p_reqcolours;
+  uint8_t *new_buffer = AllocBuffer(new_size);
+  uint8_t *pdest = new_buffer;
+
+  for ( unsigned int y = 0; y < height; y++ ) {
+    const uint8_t *py = y_plane + (y*width);
+    const uint8_t *pu = u_plane + ((y>>1)*chroma_width);
+    const uint8_t *pv = v_plane + ((y>>1)*chroma_width);
+    for ( unsigned int x = 0; x < width; x++, pdest += p_reqcolours ) {
+      int lum = py[x] << 16;
+      int u = pu[x>>1] - 128;
+      int v = pv[x>>1] - 128;
+      int r = (lum + 91881*v + 32768) >> 16;
+      int g = (lum - 22554*u - 46802*v + 32768) >> 16;
+      int b = (lum + 116130*u + 32768) >> 16;
+      pdest[r_offset] = r < 0 ? 0 : (r > 255 ? 255 : r);
+      pdest[g_offset] = g < 0 ? 0 : (g > 255 ? 255 : g);
+      pdest[b_offset] = b < 0 ? 0 : (b > 255 ? 255 : b);
+      if ( p_reqcolours == ZM_COLOUR_RGB32 )
+        pdest[a_offset] = 0;
+    }
+  }
+
+  AssignDirect(width, height, p_reqcolours, p_reqsubpixelorder, new_buffer, new_size, ZM_BUFTYPE_ZM);
+}
+
 /* RGB32 compatible: complete */
 void Image::DeColourise() {
+  if ( IsPlanar() ) {
+    /* The Y plane is already the greyscale image */
+    subpixelorder = ZM_SUBPIX_ORDER_NONE;
+    size = width * height;
+    return;
+  }
   colours = ZM_COLOUR_GRAY8;
   subpixelorder = ZM_SUBPIX_ORDER_NONE;
   size = width * height;
@@ -2541,168 +2789,191 @@ void Image::Fill(Rgb colour, const Polygon &polygon) {
   Fill(colour, 1, polygon);
 }
 
+/* Transposes a block of pixels. Output row k holds source column k, output pixel j comes from source row j.
+   Strides are signed so that callers can walk the source upwards or the output backwards to get rotations. */
+static void transpose_block(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride, unsigned int block_width, unsigned int block_height, unsigned int colours) {
+  for ( unsigned int k = 0; k < block_width; k++ ) {
+    const uint8_t* s_ptr = src + k*colours;
+    uint8_t* d_ptr = dst + k*dst_stride;
+    for ( unsigned int j = 0; j < block_height; j++ ) {
+      for ( unsigned int c = 0; c < colours; c++ )
+        d_ptr[c] = s_ptr[c];
+      d_ptr += colours;
+      s_ptr += src_stride;
+    }
+  }
+}
+
+/* Reverses the order of pixels in a line */
+static void reverse_line(const uint8_t* src, uint8_t* dst, unsigned long count, unsigned int colours) {
+  const uint8_t* s_ptr = src + count*colours;
+  for ( unsigned long i = 0; i < count; i++ ) {
+    s_ptr -= colours;
+    for ( unsigned int c = 0; c < colours; c++ )
+      *dst++ = s_ptr[c];
+  }
+}
+
+/* Rotates by 90 or 270 degrees in blocks. The source is walked in narrow strips of columns,
+   so that only a few output lines are being written at a time and each of them is written
+   sequentially, instead of scattering every pixel over the whole output image. */
+static void rotate_transpose(const uint8_t* src, uint8_t* dst, unsigned int width, unsigned int height, unsigned int colours, bool clockwise) {
+  transpose_fptr_t fptr_transpose;
+  unsigned int block;
+
+  if ( colours == ZM_COLOUR_GRAY8 ) {
+    fptr_transpose = fptr_transpose_gray8;
+    block = 8;
+  } else if ( colours == ZM_COLOUR_RGB32 ) {
+    fptr_transpose = fptr_transpose_rgb32;
+    block = 4;
+  } else /* Assume RGB24 */ {
+    fptr_transpose = &std_transpose_rgb24;
+    block = 8;
+  }
+
+  const long src_linesize = width*colours;
+  const long dst_linesize = height*colours;
+  const unsigned int strip = block*2;
+
+  for ( unsigned int strip_x = 0; strip_x < width; strip_x += strip ) {
+    unsigned int strip_hi_x = std::min(strip_x + strip, width);
+    for ( unsigned int y = 0; y < height; y += block ) {
+      unsigned int block_height = std::min(block, height - y);
+      for ( unsigned int x = strip_x; x < strip_hi_x; x += block ) {
+        unsigned int block_width = std::min(block, strip_hi_x - x);
+        const uint8_t* s_ptr;
+        uint8_t* d_ptr;
+        long src_stride, dst_stride;
+
+        if ( clockwise ) {
+          /* Source line y ends up in output column height-1-y, so read the block bottom up */
+          s_ptr = src + (y+block_height-1)*src_linesize + x*colours;
+          src_stride = -src_linesize;
+          d_ptr = dst + x*dst_linesize + (height-y-block_height)*colours;
+          dst_stride = dst_linesize;
+        } else {
+          /* Source column x ends up in output line width-1-x, so write the block bottom up */
+          s_ptr = src + y*src_linesize + x*colours;
+          src_stride = src_linesize;
+          d_ptr = dst + (width-1-x)*dst_linesize + y*colours;
+          dst_stride = -dst_linesize;
+        }
+
+        if ( block_width == block && block_height == block )
+          (*fptr_transpose)(s_ptr, src_stride, d_ptr, dst_stride);
+        else
+          transpose_block(s_ptr, src_stride, d_ptr, dst_stride, block_width, block_height, colours);
+      }
+    }
+  }
+}
+
+/* Picks the line reversal function for the colour depth */
+static reverse_fptr_t reverse_function(unsigned int colours) {
+  if ( colours == ZM_COLOUR_GRAY8 )
+    return fptr_reverse_gray8;
+  else if ( colours == ZM_COLOUR_RGB32 )
+    return fptr_reverse_rgb32;
+  return &std_reverse_rgb24;
+}
+
+/* Makes the contents of the scratch buffer the image, with new dimensions.
+   Our own buffer is swapped with the scratch buffer, a held one is copied into */
+void Image::AssignScratchBuffer(unsigned int p_width, unsigned int p_height) {
+  unsigned int new_size = p_width*p_height*colours;
+
+  if ( holdbuffer && buffer ) {
+    if ( new_size > allocation ) {
+      Error("Held buffer is undersized for assigned buffer");
+      return;
+    }
+    (*fptr_imgbufcpy)(buffer, scratch_buffer, new_size);
+  } else if ( buffertype == ZM_BUFTYPE_ZM ) {
+    std::swap(buffer, scratch_buffer);
+    std::swap(allocation, scratch_allocation);
+  } else {
+    /* A foreign buffer is let go of rather than written over */
+    DumpImgBuffer();
+    buffer = scratch_buffer;
+    buffertype = ZM_BUFTYPE_ZM;
+    allocation = scratch_allocation;
+    scratch_buffer = nullptr;
+    scratch_allocation = 0;
+  }
+
+  width = p_width;
+  height = p_height;
+  linesize = width*colours;
+  pixels = width*height;
+  size = new_size;
+}
+
 void Image::Rotate(int angle) {
   angle %= 360;
 
   if ( !angle || angle%90 ) {
     return;
   }
-  unsigned int new_height = height;
-  unsigned int new_width = width;
-  uint8_t* rotate_buffer = AllocBuffer(size);
+  if ( IsPlanar() )
+    Colourise(ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB);
+  Rotate(angle, ScratchBuffer(size));
 
-  switch ( angle ) {
-    case 90 :
-      {
-        new_height = width;
-        new_width = height;
+  if ( angle == 180 )
+    AssignScratchBuffer(width, height);
+  else
+    AssignScratchBuffer(height, width);
+}  // void Image::Rotate(int angle)
 
-        unsigned int line_bytes = new_width*colours;
-        unsigned char *s_ptr = buffer;
+/* Writes the rotated image into rotate_buffer, which must hold at least size bytes.
+   The image itself is left untouched. */
+void Image::Rotate(int angle, uint8_t *rotate_buffer) const {
+  angle %= 360;
 
-        if ( colours == ZM_COLOUR_GRAY8 ) {
-          for ( unsigned int i = new_width; i > 0; i-- ) {
-            unsigned char *d_ptr = rotate_buffer+(i-1);
-            for ( unsigned int j = new_height; j > 0; j-- ) {
-              *d_ptr = *s_ptr++;
-              d_ptr += line_bytes;
-            }
-          }
-        } else if ( colours == ZM_COLOUR_RGB32 ) {
-          Rgb* s_rptr = (Rgb*)s_ptr;
-          for ( unsigned int i = new_width; i; i-- ) {
-            Rgb* d_rptr = (Rgb*)(rotate_buffer+((i-1)<<2));
-            for ( unsigned int j = new_height; j; j-- ) {
-              *d_rptr = *s_rptr++;
-              d_rptr += new_width;
-            }
-          }
-        } else /* Assume RGB24 */ {
-          for ( unsigned int i = new_width; i; i-- ) {
-            unsigned char *d_ptr = rotate_buffer+((i-1)*3);
-            for ( unsigned int j = new_height; j; j-- ) {
-              *d_ptr = *s_ptr++;
-              *(d_ptr+1) = *s_ptr++;
-              *(d_ptr+2) = *s_ptr++;
-              d_ptr += line_bytes;
-            }
-          }
-        }
-        break;
-      }
+  switch ( angle ) {
+    case 90 :
+    case 270 :
+      rotate_transpose(buffer, rotate_buffer, width, height, colours, angle == 90);
+      break;
     case 180 :
       {
-        unsigned char *s_ptr = buffer+size;
-        unsigned char *d_ptr = rotate_buffer;
-
-        if ( colours == ZM_COLOUR_GRAY8 ) {
-          while( s_ptr > buffer ) {
-            s_ptr--;
-            *d_ptr++ = *s_ptr;
-          }
-        } else if ( colours == ZM_COLOUR_RGB32 ) {
-          Rgb* s_rptr = (Rgb*)s_ptr;
-          Rgb* d_rptr = (Rgb*)d_ptr;
-          while( s_rptr > (Rgb*)buffer ) {
-            s_rptr--;
-            *d_rptr++ = *s_rptr;
-          }
-        } else /* Assume RGB24 */ {
-          while( s_ptr > buffer ) {
-            s_ptr -= 3;
-            *d_ptr++ = *s_ptr;
-            *d_ptr++ = *(s_ptr+1);
-            *d_ptr++ = *(s_ptr+2);
-          }
-        }
-        break;
-      }
-    case 270 :
-      {
-        new_height = width;
-        new_width = height;
-
-        unsigned int line_bytes = new_width*colours;
-        unsigned char *s_ptr = buffer+size;
-
-        if ( colours == ZM_COLOUR_GRAY8 ) {
-          for ( unsigned int i = new_width; i > 0; i-- ) {
-            unsigned char *d_ptr = rotate_buffer+(i-1);
-            for ( unsigned int j = new_height; j > 0; j-- ) {
-              s_ptr--;
-              *d_ptr = *s_ptr;
-              d_ptr += line_bytes;
-            }
-          }
-        } else if ( colours == ZM_COLOUR_RGB32 ) {
-          Rgb* s_rptr = (Rgb*)s_ptr;
-          for ( unsigned int i = new_width; i > 0; i-- ) {
-            Rgb* d_rptr = (Rgb*)(rotate_buffer+((i-1)<<2));
-            for ( unsigned int j = new_height; j > 0; j-- ) {
-              s_rptr--;
-              *d_rptr = *s_rptr;
-              d_rptr += new_width;
-            }
-          }
-        } else /* Assume RGB24 */ {
-          for ( unsigned int i = new_width; i > 0; i-- ) {
-            unsigned char *d_ptr = rotate_buffer+((i-1)*3);
-            for ( unsigned int j = new_height; j > 0; j-- ) {
-              *(d_ptr+2) = *(--s_ptr);
-              *(d_ptr+1) = *(--s_ptr);
-              *d_ptr = *(--s_ptr);
-              d_ptr += line_bytes;
-            }
-          }
+        reverse_fptr_t fptr_reverse = reverse_function(colours);
+        unsigned int line_bytes = width*colours;
+        const uint8_t *s_ptr = buffer;
+        uint8_t *d_ptr = rotate_buffer + (height*line_bytes);
+
+        for ( unsigned int y = 0; y < height; y++ ) {
+          d_ptr -= line_bytes;
+          (*fptr_reverse)(s_ptr, d_ptr, width);
+          s_ptr += line_bytes;
         }
         break;
       }
   }
-
-  AssignDirect(new_width, new_height, colours, subpixelorder, rotate_buffer, size, ZM_BUFTYPE_ZM);
-}  // void Image::Rotate(int angle)
+}  // void Image::Rotate(int angle, uint8_t *rotate_buffer)
 
 /* RGB32 compatible: complete */
 void Image::Flip( bool leftright ) {
-  uint8_t* flip_buffer = AllocBuffer(size);
+  if ( IsPlanar() )
+    Colourise(ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB);
+  Flip(leftright, ScratchBuffer(size));
+  AssignScratchBuffer(width, height);
+}
 
+/* Writes the flipped image into flip_buffer, which must hold at least size bytes */
+void Image::Flip( bool leftright, uint8_t *flip_buffer ) const {
   unsigned int line_bytes = width*colours;
-  unsigned int line_bytes2 = 2*line_bytes;
+
   if ( leftright ) {
     // Horizontal flip, left to right
-    unsigned char *s_ptr = buffer+line_bytes;
-    unsigned char *d_ptr = flip_buffer;
-    unsigned char *max_d_ptr = flip_buffer + size;
+    reverse_fptr_t fptr_reverse = reverse_function(colours);
+    const uint8_t *s_ptr = buffer;
+    uint8_t *d_ptr = flip_buffer;
 
-    if ( colours == ZM_COLOUR_GRAY8 ) {
-      while( d_ptr < max_d_ptr ) {
-        for ( unsigned int j = 0; j < width; j++ ) {
-          s_ptr--;
-          *d_ptr++ = *s_ptr;
-        }
-        s_ptr += line_bytes2;
-      }
-    } else if ( colours == ZM_COLOUR_RGB32 ) {
-      Rgb* s_rptr = (Rgb*)s_ptr;
-      Rgb* d_rptr = (Rgb*)flip_buffer;
-      Rgb* max_d_rptr = (Rgb*)max_d_ptr;
-      while( d_rptr < max_d_rptr ) {
-        for ( unsigned int j = 0; j < width; j++ ) {
-          s_rptr--;
-          *d_rptr++ = *s_rptr;
-        }
-        s_rptr += width * 2;
-      }
-    } else /* Assume RGB24 */ {
-      while( d_ptr < max_d_ptr ) {
-        for ( unsigned int j = 0; j < width; j++ ) {
-          s_ptr -= 3;
-          *d_ptr++ = *s_ptr;
-          *d_ptr++ = *(s_ptr+1);
-          *d_ptr++ = *(s_ptr+2);
-        }
-        s_ptr += line_bytes2;
-      }
+    for ( unsigned int y = 0; y < height; y++ ) {
+      (*fptr_reverse)(s_ptr, d_ptr, width);
+      s_ptr += line_bytes;
+      d_ptr += line_bytes;
     }
   } else {
     // Vertical flip, top to bottom
@@ -2715,8 +2986,6 @@ void Image::Flip( bool leftright ) {
       d_ptr += line_bytes;
     }
   }
-
-  AssignDirect(width, height, colours, subpixelorder, flip_buffer, size, ZM_BUFTYPE_ZM);
 }
 
 void Image::Scale(unsigned int factor) {
@@ -2728,6 +2997,23 @@ void Image::Scale(unsigned int factor) {
     return;
   }
 
+  /* The geometric operations only know packed pixels */
+  if ( IsPlanar() )
+    Colourise(ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB);
+
+  if ( factor < ZM_SCALE_BASE ) {
+    /* Same dimensions as sampling every n'th pixel would give */
+    unsigned int new_width = std::max(1U, ((width*factor)+(factor/2))/ZM_SCALE_BASE);
+    unsigned int new_height = std::max(1U, ((height*factor)+(factor/2))/ZM_SCALE_BASE);
+
+    /* Blocks are summed in 16 bits, 257 lines of 255 at most */
+    if ( (height+new_height-1)/new_height <= 257 ) {
+      ScaleArea(new_width, new_height, ScratchBuffer(size));
+      AssignScratchBuffer(new_width, new_height);
+      return;
+    }
+  }
+
   unsigned int new_width = (width*factor)/ZM_SCALE_BASE;
   unsigned int new_height = (height*factor)/ZM_SCALE_BASE;
 
@@ -2810,13 +3096,54 @@ void Image::Scale(unsigned int factor) {
   AssignDirect(new_width, new_height, colours, subpixelorder, scale_buffer, scale_buffer_size, ZM_BUFTYPE_ZM);
 }
 
-void Image::Deinterlace_Discard() {
+/* Downscales by averaging the block of pixels each scaled pixel covers, rather than
+   sampling one of them, so that fine detail doesn't alias and noise is smoothed out.
+   Whole source lines are summed into 16 bit totals at a time, which is vectorised. */
+void Image::ScaleArea(unsigned int new_width, unsigned int new_height, uint8_t *scale_buffer) const {
+  static thread_local std::vector<uint16_t> sums;
+  static thread_local std::vector<unsigned int> x_starts;
+  unsigned int line_bytes = width*colours;
+
+  if ( sums.size() < line_bytes )
+    sums.resize(line_bytes);
+  if ( x_starts.size() < new_width+1 )
+    x_starts.resize(new_width+1);
+  for ( unsigned int x = 0; x <= new_width; x++ )
+    x_starts[x] = (x*width)/new_width;
+
+  uint8_t *pd = scale_buffer;
+  for ( unsigned int y = 0; y < new_height; y++ ) {
+    unsigned int lo_y = (y*height)/new_height;
+    unsigned int hi_y = ((y+1)*height)/new_height;
+
+    memset(sums.data(), 0, line_bytes*sizeof(uint16_t));
+    for ( unsigned int sy = lo_y; sy < hi_y; sy++ )
+      (*fptr_rowsum)(&buffer[sy*linesize], sums.data(), line_bytes);
+
+    for ( unsigned int x = 0; x < new_width; x++ ) {
+      unsigned int lo_x = x_starts[x];
+      unsigned int hi_x = x_starts[x+1];
+      unsigned int area = (hi_x-lo_x)*(hi_y-lo_y);
+      const uint16_t *ps = &sums[lo_x*colours];
+
+      for ( unsigned int c = 0; c < colours; c++ ) {
+        unsigned int total = 0;
+        for ( unsigned int sx = lo_x; sx < hi_x; sx++ )
+          total += ps[((sx-lo_x)*colours)+c];
+        *pd++ = (total+(area/2))/area;
+      }
+    }
+  }
+}
+
+void Image::Deinterlace_Discard(unsigned int lo_y, unsigned int hi_y) {
   /* Simple deinterlacing. Copy the even lines into the odd lines */
+  /* lo_y must be even, so that each line pair lies within one band */
 
   if ( colours == ZM_COLOUR_GRAY8 ) {
     const uint8_t *psrc;
     uint8_t *pdest;
-    for (unsigned int y = 0; y < (unsigned int)height; y += 2) {
+    for (unsigned int y = lo_y; y+1 < hi_y; y += 2) {
       psrc = buffer + (y * width);
       pdest = buffer + ((y+1) * width);
       for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -2826,7 +3153,7 @@ void Image::Deinterlace_Discard() {
   } else if ( colours == ZM_COLOUR_RGB24 ) {
     const uint8_t *psrc;
     uint8_t *pdest;
-    for (unsigned int y = 0; y < (unsigned int)height; y += 2) {
+    for (unsigned int y = lo_y; y+1 < hi_y; y += 2) {
       psrc = buffer + ((y * width) * 3);
       pdest = buffer + (((y+1) * width) * 3);
       for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -2838,7 +3165,7 @@ void Image::Deinterlace_Discard() {
   } else if ( colours == ZM_COLOUR_RGB32 ) {
     const Rgb *psrc;
     Rgb *pdest;
-    for (unsigned int y = 0; y < (unsigned int)height; y += 2) {
+    for (unsigned int y = lo_y; y+1 < hi_y; y += 2) {
       psrc = (Rgb*)(buffer + ((y * width) << 2));
       pdest = (Rgb*)(buffer + (((y+1) * width) << 2));
       for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -2850,14 +3177,15 @@ void Image::Deinterlace_Discard() {
   }
 }
 
-void Image::Deinterlace_Linear() {
+void Image::Deinterlace_Linear(unsigned int lo_y, unsigned int hi_y) {
   /* Simple deinterlacing. The odd lines are average of the line above and line below */
+  /* Only odd lines are written, so the line below may lie in the next band */
 
   const uint8_t *pbelow, *pabove;
   uint8_t *pcurrent;
 
   if ( colours == ZM_COLOUR_GRAY8 ) {
-    for (unsigned int y = 1; y < (unsigned int)(height-1); y += 2) {
+    for (unsigned int y = lo_y|1; y < hi_y && y < (unsigned int)(height-1); y += 2) {
       pabove = buffer + ((y-1) * width);
       pbelow = buffer + ((y+1) * width);
       pcurrent = buffer + (y * width);
@@ -2866,13 +3194,14 @@ void Image::Deinterlace_Linear() {
       }
     }
     /* Special case for the last line */
+    if ( hi_y < height ) return;
     pcurrent = buffer + ((height-1) * width);
     pabove = buffer + ((height-2) * width);
     for (unsigned int x = 0; x < (unsigned int)width; x++) {
       *pcurrent++ = *pabove++;
     }
   } else if ( colours == ZM_COLOUR_RGB24 ) {
-    for (unsigned int y = 1; y < (unsigned int)(height-1); y += 2) {
+    for (unsigned int y = lo_y|1; y < hi_y && y < (unsigned int)(height-1); y += 2) {
       pabove = buffer + (((y-1) * width) * 3);
       pbelow = buffer + (((y+1) * width) * 3);
       pcurrent = buffer + ((y * width) * 3);
@@ -2883,6 +3212,7 @@ void Image::Deinterlace_Linear() {
       }
     }
     /* Special case for the last line */
+    if ( hi_y < height ) return;
     pcurrent = buffer + (((height-1) * width) * 3);
     pabove = buffer + (((height-2) * width) * 3);
     for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -2891,7 +3221,7 @@ void Image::Deinterlace_Linear() {
       *pcurrent++ = *pabove++;
     }
   } else if ( colours == ZM_COLOUR_RGB32 ) {
-    for (unsigned int y = 1; y < (unsigned int)(height-1); y += 2) {
+    for (unsigned int y = lo_y|1; y < hi_y && y < (unsigned int)(height-1); y += 2) {
       pabove = buffer + (((y-1) * width) << 2);
       pbelow = buffer + (((y+1) * width) << 2);
       pcurrent = buffer + ((y * width) << 2);
@@ -2903,6 +3233,7 @@ void Image::Deinterlace_Linear() {
       }
     }
     /* Special case for the last line */
+    if ( hi_y < height ) return;
     pcurrent = buffer + (((height-1) * width) << 2);
     pabove = buffer + (((height-2) * width) << 2);
     for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -2917,13 +3248,14 @@ void Image::Deinterlace_Linear() {
 
 }
 
-void Image::Deinterlace_Blend() {
+void Image::Deinterlace_Blend(unsigned int lo_y, unsigned int hi_y) {
   /* Simple deinterlacing. Blend the fields together. 50% blend */
+  /* lo_y must be even, so that each line pair lies within one band */
 
   uint8_t *pabove, *pcurrent;
 
   if ( colours == ZM_COLOUR_GRAY8 ) {
-    for (unsigned int y = 1; y < (unsigned int)height; y += 2) {
+    for (unsigned int y = lo_y+1; y < hi_y; y += 2) {
       pabove = buffer + ((y-1) * width);
       pcurrent = buffer + (y * width);
       for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -2932,7 +3264,7 @@ void Image::Deinterlace_Blend() {
       }
     }
   } else if ( colours == ZM_COLOUR_RGB24 ) {
-    for (unsigned int y = 1; y < (unsigned int)height; y += 2) {
+    for (unsigned int y = lo_y+1; y < hi_y; y += 2) {
       pabove = buffer + (((y-1) * width) * 3);
       pcurrent = buffer + ((y * width) * 3);
       for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -2945,7 +3277,7 @@ void Image::Deinterlace_Blend() {
       }
     }
   } else if ( colours == ZM_COLOUR_RGB32 ) {
-    for (unsigned int y = 1; y < (unsigned int)height; y += 2) {
+    for (unsigned int y = lo_y+1; y < hi_y; y += 2) {
       pabove = buffer + (((y-1) * width) << 2);
       pcurrent = buffer + ((y * width) << 2);
       for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -2965,7 +3297,7 @@ void Image::Deinterlace_Blend() {
 
 }
 
-void Image::Deinterlace_Blend_CustomRatio(int divider) {
+void Image::Deinterlace_Blend_CustomRatio(int divider, unsigned int lo_y, unsigned int hi_y) {
   /* Simple deinterlacing. Blend the fields together at a custom ratio. */
   /* 1 = 50% blending   */
   /* 2 = 25% blending   */
@@ -2980,7 +3312,7 @@ void Image::Deinterlace_Blend_CustomRatio(int divider) {
   }
 
   if ( colours == ZM_COLOUR_GRAY8 ) {
-    for (unsigned int y = 1; y < (unsigned int)height; y += 2) {
+    for (unsigned int y = lo_y+1; y < hi_y; y += 2) {
       pabove = buffer + ((y-1) * width);
       pcurrent = buffer + (y * width);
       for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -2991,7 +3323,7 @@ void Image::Deinterlace_Blend_CustomRatio(int divider) {
       }
     }
   } else if ( colours == ZM_COLOUR_RGB24 ) {
-    for (unsigned int y = 1; y < (unsigned int)height; y += 2) {
+    for (unsigned int y = lo_y+1; y < hi_y; y += 2) {
       pabove = buffer + (((y-1) * width) * 3);
       pcurrent = buffer + ((y * width) * 3);
       for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -3010,7 +3342,7 @@ void Image::Deinterlace_Blend_CustomRatio(int divider) {
       }
     }
   } else if ( colours == ZM_COLOUR_RGB32 ) {
-    for (unsigned int y = 1; y < (unsigned int)height; y += 2) {
+    for (unsigned int y = lo_y+1; y < hi_y; y += 2) {
       pabove = buffer + (((y-1) * width) << 2);
       pcurrent = buffer + ((y * width) << 2);
       for (unsigned int x = 0; x < (unsigned int)width; x++) {
@@ -5230,3 +5562,236 @@ __attribute__((noinline)) void std_deinterlace_4field_abgr(uint8_t* col1, uint8_
     pncurrent += 4;
   }
 }
+
+__attribute__((noinline)) void std_transpose_gray8(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride) {
+  transpose_block(src, src_stride, dst, dst_stride, 8, 8, ZM_COLOUR_GRAY8);
+}
+
+__attribute__((noinline)) void std_transpose_rgb24(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride) {
+  transpose_block(src, src_stride, dst, dst_stride, 8, 8, ZM_COLOUR_RGB24);
+}
+
+__attribute__((noinline)) void std_transpose_rgb32(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride) {
+  transpose_block(src, src_stride, dst, dst_stride, 4, 4, ZM_COLOUR_RGB32);
+}
+
+__attribute__((noinline)) void std_reverse_gray8(const uint8_t* src, uint8_t* dst, unsigned long count) {
+  reverse_line(src, dst, count, ZM_COLOUR_GRAY8);
+}
+
+__attribute__((noinline)) void std_reverse_rgb24(const uint8_t* src, uint8_t* dst, unsigned long count) {
+  reverse_line(src, dst, count, ZM_COLOUR_RGB24);
+}
+
+__attribute__((noinline)) void std_reverse_rgb32(const uint8_t* src, uint8_t* dst, unsigned long count) {
+  reverse_line(src, dst, count, ZM_COLOUR_RGB32);
+}
+
+/* Grayscale 8x8 transpose SSE2 */
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((noinline,__target__("sse2")))
+#endif
+void sse2_transpose_gray8(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride) {
+#if ((defined(__i386__) || defined(__x86_64__) || defined(ZM_KEEP_SSE)) && !defined(ZM_STRIP_SSE))
+  const uint8_t* row;
+  uint8_t* drow;
+
+  /* Interleave bytes, then words, then dwords. Each resulting qword is one column of the block. */
+  __asm__ __volatile__ (
+      "movq (%2), %%xmm0\n\t"
+      "movq (%2,%3), %%xmm1\n\t"
+      "lea (%2,%3,2), %0\n\t"
+      "movq (%0), %%xmm2\n\t"
+      "movq (%0,%3), %%xmm3\n\t"
+      "lea (%0,%3,2), %0\n\t"
+      "movq (%0), %%xmm4\n\t"
+      "movq (%0,%3), %%xmm5\n\t"
+      "lea (%0,%3,2), %0\n\t"
+      "movq (%0), %%xmm6\n\t"
+      "movq (%0,%3), %%xmm7\n\t"
+      "punpcklbw %%xmm1, %%xmm0\n\t"
+      "punpcklbw %%xmm3, %%xmm2\n\t"
+      "punpcklbw %%xmm5, %%xmm4\n\t"
+      "punpcklbw %%xmm7, %%xmm6\n\t"
+      "movdqa %%xmm0, %%xmm1\n\t"
+      "punpcklwd %%xmm2, %%xmm0\n\t"
+      "punpckhwd %%xmm2, %%xmm1\n\t"
+      "movdqa %%xmm4, %%xmm3\n\t"
+      "punpcklwd %%xmm6, %%xmm4\n\t"
+      "punpckhwd %%xmm6, %%xmm3\n\t"
+      "movdqa %%xmm0, %%xmm2\n\t"
+      "punpckldq %%xmm4, %%xmm0\n\t"
+      "punpckhdq %%xmm4, %%xmm2\n\t"
+      "movdqa %%xmm1, %%xmm5\n\t"
+      "punpckldq %%xmm3, %%xmm1\n\t"
+      "punpckhdq %%xmm3, %%xmm5\n\t"
+      "movq %%xmm0, (%4)\n\t"
+      "movhps %%xmm0, (%4,%5)\n\t"
+      "lea (%4,%5,2), %1\n\t"
+      "movq %%xmm2, (%1)\n\t"
+      "movhps %%xmm2, (%1,%5)\n\t"
+      "lea (%1,%5,2), %1\n\t"
+      "movq %%xmm1, (%1)\n\t"
+      "movhps %%xmm1, (%1,%5)\n\t"
+      "lea (%1,%5,2), %1\n\t"
+      "movq %%xmm5, (%1)\n\t"
+      "movhps %%xmm5, (%1,%5)\n\t"
+      : "=&r" (row), "=&r" (drow)
+      : "r" (src), "r" (src_stride), "r" (dst), "r" (dst_stride)
+      : "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "%xmm5", "%xmm6", "%xmm7", "memory"
+      );
+#else
+  Panic("SSE function called on a non x86\\x86-64 platform");
+#endif
+}
+
+/* RGB32 4x4 transpose SSE2 */
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((noinline,__target__("sse2")))
+#endif
+void sse2_transpose_rgb32(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride) {
+#if ((defined(__i386__) || defined(__x86_64__) || defined(ZM_KEEP_SSE)) && !defined(ZM_STRIP_SSE))
+  const uint8_t* row;
+  uint8_t* drow;
+
+  __asm__ __volatile__ (
+      "movdqu (%2), %%xmm0\n\t"
+      "movdqu (%2,%3), %%xmm1\n\t"
+      "lea (%2,%3,2), %0\n\t"
+      "movdqu (%0), %%xmm2\n\t"
+      "movdqu (%0,%3), %%xmm3\n\t"
+      "movdqa %%xmm0, %%xmm4\n\t"
+      "punpckldq %%xmm1, %%xmm0\n\t"
+      "punpckhdq %%xmm1, %%xmm4\n\t"
+      "movdqa %%xmm2, %%xmm5\n\t"
+      "punpckldq %%xmm3, %%xmm2\n\t"
+      "punpckhdq %%xmm3, %%xmm5\n\t"
+      "movdqa %%xmm0, %%xmm1\n\t"
+      "punpcklqdq %%xmm2, %%xmm0\n\t"
+      "punpckhqdq %%xmm2, %%xmm1\n\t"
+      "movdqa %%xmm4, %%xmm3\n\t"
+      "punpcklqdq %%xmm5, %%xmm4\n\t"
+      "punpckhqdq %%xmm5, %%xmm3\n\t"
+      "movdqu %%xmm0, (%4)\n\t"
+      "movdqu %%xmm1, (%4,%5)\n\t"
+      "lea (%4,%5,2), %1\n\t"
+      "movdqu %%xmm4, (%1)\n\t"
+      "movdqu %%xmm3, (%1,%5)\n\t"
+      : "=&r" (row), "=&r" (drow)
+      : "r" (src), "r" (src_stride), "r" (dst), "r" (dst_stride)
+      : "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "%xmm5", "memory"
+      );
+#else
+  Panic("SSE function called on a non x86\\x86-64 platform");
+#endif
+}
+
+/* Grayscale line reverse SSE2 */
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((noinline,__target__("sse2")))
+#endif
+void sse2_reverse_gray8(const uint8_t* src, uint8_t* dst, unsigned long count) {
+#if ((defined(__i386__) || defined(__x86_64__) || defined(ZM_KEEP_SSE)) && !defined(ZM_STRIP_SSE))
+  unsigned long chunks = count >> 4;
+  const uint8_t* s_end = src + count;
+
+  if ( chunks ) {
+    /* Reverse the dwords, then the words in each dword, then the bytes in each word */
+    __asm__ __volatile__ (
+        "1:\n\t"
+        "sub $0x10, %0\n\t"
+        "movdqu (%0), %%xmm0\n\t"
+        "pshufd $0x1b, %%xmm0, %%xmm0\n\t"
+        "pshuflw $0xb1, %%xmm0, %%xmm0\n\t"
+        "pshufhw $0xb1, %%xmm0, %%xmm0\n\t"
+        "movdqa %%xmm0, %%xmm1\n\t"
+        "psrlw $0x8, %%xmm0\n\t"
+        "psllw $0x8, %%xmm1\n\t"
+        "por %%xmm1, %%xmm0\n\t"
+        "movdqu %%xmm0, (%1)\n\t"
+        "add $0x10, %1\n\t"
+        "sub $0x1, %2\n\t"
+        "jnz 1b\n\t"
+        : "+r" (s_end), "+r" (dst), "+r" (chunks)
+        :
+        : "%xmm0", "%xmm1", "cc", "memory"
+        );
+  }
+  reverse_line(src, dst, count & 15, ZM_COLOUR_GRAY8);
+#else
+  Panic("SSE function called on a non x86\\x86-64 platform");
+#endif
+}
+
+/* RGB32 line reverse SSE2 */
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((noinline,__target__("sse2")))
+#endif
+void sse2_reverse_rgb32(const uint8_t* src, uint8_t* dst, unsigned long count) {
+#if ((defined(__i386__) || defined(__x86_64__) || defined(ZM_KEEP_SSE)) && !defined(ZM_STRIP_SSE))
+  unsigned long chunks = count >> 2;
+  const uint8_t* s_end = src + (count << 2);
+
+  if ( chunks ) {
+    __asm__ __volatile__ (
+        "1:\n\t"
+        "sub $0x10, %0\n\t"
+        "movdqu (%0), %%xmm0\n\t"
+        "pshufd $0x1b, %%xmm0, %%xmm0\n\t"
+        "movdqu %%xmm0, (%1)\n\t"
+        "add $0x10, %1\n\t"
+        "sub $0x1, %2\n\t"
+        "jnz 1b\n\t"
+        : "+r" (s_end), "+r" (dst), "+r" (chunks)
+        :
+        : "%xmm0", "cc", "memory"
+        );
+  }
+  reverse_line(src, dst, count & 3, ZM_COLOUR_RGB32);
+#else
+  Panic("SSE function called on a non x86\\x86-64 platform");
+#endif
+}
+
+/* Adds a line of bytes onto 16 bit running totals */
+__attribute__((noinline)) void std_rowsum(const uint8_t* src, uint16_t* sums, unsigned long count) {
+  for ( unsigned long i = 0; i < count; i++ )
+    sums[i] += src[i];
+}
+
+/* Line summing SSE2, unpacking 16 bytes to words at a time */
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((noinline,__target__("sse2")))
+#endif
+void sse2_rowsum(const uint8_t* src, uint16_t* sums, unsigned long count) {
+#if ((defined(__i386__) || defined(__x86_64__) || defined(ZM_KEEP_SSE)) && !defined(ZM_STRIP_SSE))
+  unsigned long chunks = count >> 4;
+
+  if ( chunks ) {
+    __asm__ __volatile__ (
+        "pxor %%xmm0, %%xmm0\n\t"
+        "1:\n\t"
+        "movdqu (%0), %%xmm1\n\t"
+        "movdqa %%xmm1, %%xmm2\n\t"
+        "punpcklbw %%xmm0, %%xmm1\n\t"
+        "punpckhbw %%xmm0, %%xmm2\n\t"
+        "movdqu (%1), %%xmm3\n\t"
+        "movdqu 0x10(%1), %%xmm4\n\t"
+        "paddw %%xmm3, %%xmm1\n\t"
+        "paddw %%xmm4, %%xmm2\n\t"
+        "movdqu %%xmm1, (%1)\n\t"
+        "movdqu %%xmm2, 0x10(%1)\n\t"
+        "add $0x10, %0\n\t"
+        "add $0x20, %1\n\t"
+        "sub $0x1, %2\n\t"
+        "jnz 1b\n\t"
+        : "+r" (src), "+r" (sums), "+r" (chunks)
+        :
+        : "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "cc", "memory"
+        );
+  }
+  std_rowsum(src, sums, count & 15);
+#else
+  Panic("SSE function called on a non x86\\x86-64 platform");
+#endif
+}
@@ -35,6 +35,7 @@ class Image;
 #include "zm_ffmpeg.h"
 
 #include <errno.h>
+#include <vector>
 
 #if HAVE_ZLIB_H
 #include <zlib.h>
@@ -51,6 +52,9 @@ typedef void (*delta_fptr_t)(const uint8_t*, const uint8_t*, uint8_t*, unsigned
 typedef void (*convert_fptr_t)(const uint8_t*, uint8_t*, unsigned long);
 typedef void (*deinterlace_4field_fptr_t)(uint8_t*, uint8_t*, unsigned int, unsigned int, unsigned int);
 typedef void* (*imgbufcpy_fptr_t)(void*, const void*, size_t);
+typedef void (*transpose_fptr_t)(const uint8_t*, long, uint8_t*, long);
+typedef void (*reverse_fptr_t)(const uint8_t*, uint8_t*, unsigned long);
+typedef void (*rowsum_fptr_t)(const uint8_t*, uint16_t*, unsigned long);
 
 extern imgbufcpy_fptr_t fptr_imgbufcpy;
 
@@ -80,6 +84,35 @@ inline static void DumpBuffer(uint8_t* buffer, int buffertype) {
 	}
 }
 
+//
+// Privacy zones held as runs of masked pixels on each line, so that
+// masking a frame costs only as much as the masked area.
+//
+class PrivacyMask {
+public:
+  struct Span {
+    unsigned int lo_x;
+    unsigned int hi_x; // One past the last masked pixel
+  };
+
+protected:
+  unsigned int width;
+  unsigned int height;
+  std::vector<Span> spans;
+  std::vector<unsigned int> line_spans; // Index of the first span of each line, plus one past the end
+
+public:
+  // Builds the spans from a one byte per pixel mask, any non zero pixel is masked
+  PrivacyMask(const unsigned char *p_bitmask, unsigned int p_width, unsigned int p_height);
+
+  inline unsigned int Width() const { return width; }
+  inline unsigned int Height() const { return height; }
+  inline bool Empty() const { return spans.empty(); }
+  inline const Span *LineSpans(unsigned int y, unsigned int &n_spans) const {
+    n_spans = line_spans[y+1] - line_spans[y];
+    return n_spans ? &spans[line_spans[y]] : nullptr;
+  }
+};
 
 //
 // This is image class, and represents a frame captured from a 
@@ -135,6 +168,21 @@ protected:
 		allocation = p_bufsize;
 	}
 
+	/* Work area for rotating, flipping, cropping and scaling, kept for the life of the image so it isn't allocated per frame */
+	inline uint8_t *ScratchBuffer(size_t p_size) {
+		if ( scratch_allocation < p_size ) {
+			if ( scratch_buffer )
+				DumpBuffer(scratch_buffer, ZM_BUFTYPE_ZM);
+			scratch_buffer = AllocBuffer(p_size);
+			scratch_allocation = p_size;
+		}
+		return scratch_buffer;
+	}
+	void AssignScratchBuffer(unsigned int p_width, unsigned int p_height);
+	void ScaleArea(unsigned int new_width, unsigned int new_height, uint8_t *scale_buffer) const;
+	void ColourisePlanar(const unsigned int p_reqcolours, const unsigned int p_reqsubpixelorder);
+	void WriteJpegPlanes(jpeg_compress_struct *cinfo) const;
+
 public:
 	enum { ZM_CHAR_HEIGHT=11, ZM_CHAR_WIDTH=6 };
 	enum { LINE_HEIGHT=ZM_CHAR_HEIGHT+0 };
@@ -145,11 +193,19 @@ protected:
 	static unsigned char *y_r_table;
 	static unsigned char *y_g_table;
 	static unsigned char *y_b_table;
-	static jpeg_compress_struct *writejpg_ccinfo[101];
-	static jpeg_compress_struct *encodejpg_ccinfo[101];
-	static jpeg_decompress_struct *readjpg_dcinfo;
-	static jpeg_decompress_struct *decodejpg_dcinfo;
-	static struct zm_error_mgr jpg_err;
+	/* Per thread, so that threads other than the main one can read and write JPEGs too.
+	   The destructor frees them when the thread exits. */
+	struct JpegCodecs {
+		jpeg_compress_struct *writejpg_ccinfo[101];
+		jpeg_compress_struct *encodejpg_ccinfo[101];
+		jpeg_decompress_struct *readjpg_dcinfo;
+		jpeg_decompress_struct *decodejpg_dcinfo;
+
+		JpegCodecs();
+		~JpegCodecs();
+	};
+	static thread_local JpegCodecs jpeg_codecs;
+	static thread_local struct zm_error_mgr jpg_err;
 
 	unsigned int width;
 	unsigned int linesize;
@@ -163,6 +219,8 @@ protected:
 	uint8_t *buffer;
 	int buffertype; /* 0=not ours, no need to call free(), 1=malloc() buffer, 2=new buffer */
 	int holdbuffer; /* Hold the buffer instead of replacing it with new one */
+	uint8_t *scratch_buffer;
+	unsigned long scratch_allocation;
 	char text[1024];
 
 public:
@@ -184,6 +242,7 @@ public:
 	inline unsigned int Colours() const { return colours; }
 	inline unsigned int SubpixelOrder() const { return subpixelorder; }
 	inline unsigned int Size() const { return size; }
+	inline bool IsPlanar() const { return subpixelorder == ZM_SUBPIX_ORDER_YUV420P; }
 	
 	/* Internal buffer should not be modified from functions outside of this class */
 	inline const uint8_t* Buffer() const { return buffer; }
@@ -264,7 +323,8 @@ public:
 	void Delta( const Image &image, Image* targetimage) const;
 
 	const Coord centreCoord( const char *text, const int size ) const;
-  void MaskPrivacy( const unsigned char *p_bitmask, const Rgb pixel_colour=0x00222222 );
+  void MaskPrivacy( const PrivacyMask &p_mask, const Rgb pixel_colour=0x00222222 );
+  void MaskPrivacy( const PrivacyMask &p_mask, unsigned int lo_y, unsigned int hi_y, const Rgb pixel_colour=0x00222222 );
 	void Annotate( const char *p_text, const Coord &coord, const unsigned int size=1, const Rgb fg_colour=RGB_WHITE, const Rgb bg_colour=RGB_BLACK );
 	Image *HighlightEdges( Rgb colour, unsigned int p_colours, unsigned int p_subpixelorder, const Box *limits=0 );
 	//Image *HighlightEdges( Rgb colour, const Polygon &polygon );
@@ -280,13 +340,20 @@ public:
 	void Fill( Rgb colour, int density, const Polygon &polygon );
 
 	void Rotate( int angle );
+	void Rotate( int angle, uint8_t *rotate_buffer ) const;
 	void Flip( bool leftright );
+	void Flip( bool leftright, uint8_t *flip_buffer ) const;
 	void Scale( unsigned int factor );
 
-	void Deinterlace_Discard();
-	void Deinterlace_Linear();
-	void Deinterlace_Blend();
-	void Deinterlace_Blend_CustomRatio(int divider);
+	/* The row range variants only touch lines lo_y to hi_y-1, lo_y must be even */
+	void Deinterlace_Discard() { Deinterlace_Discard(0, height); }
+	void Deinterlace_Discard(unsigned int lo_y, unsigned int hi_y);
+	void Deinterlace_Linear() { Deinterlace_Linear(0, height); }
+	void Deinterlace_Linear(unsigned int lo_y, unsigned int hi_y);
+	void Deinterlace_Blend() { Deinterlace_Blend(0, height); }
+	void Deinterlace_Blend(unsigned int lo_y, unsigned int hi_y);
+	void Deinterlace_Blend_CustomRatio(int divider) { Deinterlace_Blend_CustomRatio(divider, 0, height); }
+	void Deinterlace_Blend_CustomRatio(int divider, unsigned int lo_y, unsigned int hi_y);
 	void Deinterlace_4Field(const Image* next_image, unsigned int threshold);
 	
 };
@@ -366,6 +433,22 @@ void zm_convert_rgb555_rgba(const uint8_t* col1, uint8_t* result, unsigned long
 void zm_convert_rgb565_rgb(const uint8_t* col1, uint8_t* result, unsigned long count);
 void zm_convert_rgb565_rgba(const uint8_t* col1, uint8_t* result, unsigned long count);
 
+/* Rotate and flip functions */
+void std_transpose_gray8(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride);
+void std_transpose_rgb24(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride);
+void std_transpose_rgb32(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride);
+void sse2_transpose_gray8(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride);
+void sse2_transpose_rgb32(const uint8_t* src, long src_stride, uint8_t* dst, long dst_stride);
+void std_reverse_gray8(const uint8_t* src, uint8_t* dst, unsigned long count);
+void std_reverse_rgb24(const uint8_t* src, uint8_t* dst, unsigned long count);
+void std_reverse_rgb32(const uint8_t* src, uint8_t* dst, unsigned long count);
+void sse2_reverse_gray8(const uint8_t* src, uint8_t* dst, unsigned long count);
+void sse2_reverse_rgb32(const uint8_t* src, uint8_t* dst, unsigned long count);
+
+/* Area averaging scale functions */
+void std_rowsum(const uint8_t* src, uint16_t* sums, unsigned long count);
+void sse2_rowsum(const uint8_t* src, uint16_t* sums, unsigned long count);
+
 /* Deinterlace_4Field functions */
 void std_deinterlace_4field_gray8(uint8_t* col1, uint8_t* col2, unsigned int threshold, unsigned int width, unsigned int height);
 void std_deinterlace_4field_rgb(uint8_t* col1, uint8_t* col2, unsigned int threshold, unsigned int width, unsigned int height);
@@ -0,0 +1,204 @@
+//ZoneMinder Image History Implementation Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "zm_image_history.h"
+
+#include <string.h>
+#include <algorithm>
+#include <cinttypes>
+
+#include "zm_monitor.h"
+
+size_t ImageHistory::SharedSize(int p_raw_count, int p_frame_count, uint64_t p_data_size) {
+  return sizeof(Header)
+    + (p_raw_count*sizeof(uint64_t))
+    + (p_frame_count*sizeof(Frame))
+    + p_data_size;
+}
+
+ImageHistory::ImageHistory(uint8_t *mem, int p_raw_count, int p_frame_count, uint64_t p_data_size) :
+  raw_count(p_raw_count),
+  frame_count(p_frame_count),
+  data_size(p_data_size)
+{
+  header = (Header *)mem;
+  raw_sequence = (std::atomic<uint64_t> *)(mem + sizeof(Header));
+  frames = (Frame *)((uint8_t *)raw_sequence + (raw_count*sizeof(uint64_t)));
+  data = (uint8_t *)frames + (frame_count*sizeof(Frame));
+}
+
+// Called by zmc once the shared memory has been cleared
+void ImageHistory::Initialise() {
+  header->size = sizeof(Header);
+  header->frame_count = frame_count;
+  header->data_size = data_size;
+  header->last_sequence.store(0);
+  header->write_end.store(0);
+}
+
+uint64_t ImageHistory::OldestSequence() const {
+  uint64_t last = LastSequence();
+  uint64_t depth = std::max(raw_count, frame_count);
+  return last > depth ? last - depth + 1 : 1;
+}
+
+// Frames are expected to average no more than data_size/frame_count, allow for some being a lot bigger
+unsigned int ImageHistory::MaxFrameSize() const {
+  if ( !frame_count )
+    return 0;
+  return std::min(data_size, 8*(data_size/frame_count));
+}
+
+bool ImageHistory::Store(uint64_t sequence, const struct timeval &timestamp, const uint8_t *jpeg, unsigned int size) {
+  if ( !frame_count || (size > MaxFrameSize()) )
+    return false;
+
+  uint64_t offset = header->write_end.load();
+  // Frames are not split across the end of the data ring
+  if ( (offset % data_size) + size > data_size )
+    offset += data_size - (offset % data_size);
+
+  Frame *frame = &frames[sequence % frame_count];
+  frame->sequence.store(0);
+  // Readers of whatever is about to be written over see this before any of it changes
+  header->write_end.store(offset + size);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  memcpy(data + (offset % data_size), jpeg, size);
+  frame->offset = offset;
+  frame->size = size;
+  frame->timestamp = timestamp;
+  frame->sequence.store(sequence, std::memory_order_release);
+  return true;
+}
+
+unsigned int ImageHistory::Fetch(uint64_t sequence, uint8_t *buffer, unsigned int buffer_size, struct timeval *timestamp) const {
+  if ( !frame_count || !sequence )
+    return 0;
+
+  const Frame *frame = &frames[sequence % frame_count];
+  if ( frame->sequence.load(std::memory_order_acquire) != sequence )
+    return 0;
+  uint64_t offset = frame->offset;
+  unsigned int size = frame->size;
+  struct timeval frame_timestamp = frame->timestamp;
+  if ( (size > buffer_size && buffer) || ((offset % data_size) + size > data_size) )
+    return 0;
+  if ( buffer )
+    memcpy(buffer, data + (offset % data_size), size);
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  // Replaced, or written over, while it was being copied
+  if ( frame->sequence.load() != sequence )
+    return 0;
+  if ( header->write_end.load() > offset + data_size )
+    return 0;
+
+  if ( timestamp )
+    *timestamp = frame_timestamp;
+  return size;
+}
+
+HistoryCompressor::HistoryCompressor(Monitor *p_monitor, ImageHistory *p_history) :
+  monitor(p_monitor),
+  history(p_history),
+  mCondition(mMutex),
+  mStop(false)
+{
+  quality = config.compressed_buffer_quality;
+  if ( quality < 1 || quality > 100 )
+    quality = config.jpeg_file_quality;
+  // Enough for a JPEG of anything that can be captured, however little it compresses
+  jpeg_buffer_size = monitor->Width() * monitor->Height() * 4 + 65536;
+  jpeg_buffer = new uint8_t[jpeg_buffer_size];
+}
+
+HistoryCompressor::~HistoryCompressor() {
+  stop();
+  if ( mStarted )
+    join();
+  delete[] jpeg_buffer;
+}
+
+// Called by the capture thread for every frame
+void HistoryCompressor::Notify() {
+  mMutex.lock();
+  mCondition.signal();
+  mMutex.unlock();
+}
+
+void HistoryCompressor::stop() {
+  mMutex.lock();
+  mStop = true;
+  mCondition.signal();
+  mMutex.unlock();
+}
+
+void HistoryCompressor::compress(uint64_t sequence) {
+  int index = history->RawIndex(sequence);
+  Monitor::Snapshot *snap = &monitor->image_buffer[index];
+  if ( history->Sequence(index) != sequence )
+    return;
+
+  struct timeval timestamp = *(snap->timestamp);
+  int size = 0;
+  if ( !snap->image->EncodeJpeg(jpeg_buffer, &size, quality) )
+    return;
+  if ( history->Sequence(index) != sequence ) {
+    Debug(1, "Frame %" PRIu64 " was captured over while being compressed", sequence);
+    return;
+  }
+  if ( !history->Store(sequence, timestamp, jpeg_buffer, size) )
+    Debug(1, "Frame %" PRIu64 " of %d bytes is too big for the compressed image buffer", sequence, size);
+}
+
+int HistoryCompressor::run() {
+  // It only needs to keep ahead of the capture overwriting the raw ring
+  uint64_t max_behind = std::max(1, monitor->GetImageBufferCount()/2);
+  uint64_t next = 0;
+  bool behind = false;
+
+  mMutex.lock();
+  while ( !mStop ) {
+    uint64_t last = history->LastSequence();
+    if ( !last || (next > last) ) {
+      mCondition.wait();
+      continue;
+    }
+    mMutex.unlock();
+
+    if ( !next ) {
+      next = last;
+    } else if ( last - next >= max_behind ) {
+      if ( !behind )
+        Warning("Compressing frames at %d quality can't keep up with capture, skipping %" PRIu64 " frames",
+            quality, last - next);
+      behind = true;
+      next = last;
+    } else {
+      behind = false;
+    }
+    compress(next);
+    next++;
+
+    mMutex.lock();
+  }
+  mMutex.unlock();
+
+  return 0;
+}
@@ -0,0 +1,121 @@
+//ZoneMinder Image History Interface Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef ZM_IMAGE_HISTORY_H
+#define ZM_IMAGE_HISTORY_H
+
+#include <sys/time.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "zm_thread.h"
+
+class Monitor;
+
+//
+// The compressed tier of a monitor's shared image ring. At high resolutions
+// the raw ring can only hold a few seconds of frames, so zmc also keeps every
+// frame JPEG compressed in a ring of bytes, which lets pre-event frames, zms
+// replay and zmu reach much further back. Frames are addressed by sequence
+// number, counting from 1 as they are captured. The raw slot a frame was
+// captured into records its sequence for as long as it holds it, and the
+// compressed copy can be read for as long as no newer frame has been written
+// over it. Readers check both after copying rather than taking any lock.
+//
+class ImageHistory {
+  private:
+    struct Header {
+      uint32_t size;
+      uint32_t frame_count;
+      uint64_t data_size;
+      std::atomic<uint64_t> last_sequence;   // Newest frame in the raw ring
+      std::atomic<uint64_t> write_end;       // Data ring position up to which anything may have been written over
+    };
+    struct Frame {
+      std::atomic<uint64_t> sequence;        // 0 while the entry is being replaced
+      uint64_t offset;                       // Position in the data ring, counting from when zmc started
+      uint32_t size;
+      uint32_t padding;
+      struct timeval timestamp;
+    };
+
+    int raw_count;
+    int frame_count;
+    uint64_t data_size;
+
+    Header *header;
+    std::atomic<uint64_t> *raw_sequence;     // Sequence of the frame in each raw slot, 0 while it is captured into
+    Frame *frames;
+    uint8_t *data;
+
+  public:
+    static size_t SharedSize(int p_raw_count, int p_frame_count, uint64_t p_data_size);
+
+    ImageHistory(uint8_t *mem, int p_raw_count, int p_frame_count, uint64_t p_data_size);
+
+    void Initialise();
+    bool Enabled() const { return frame_count > 0; }
+
+    // Called by zmc around writing a frame into raw slot index
+    void Capturing(int index) { raw_sequence[index].store(0); }
+    void Captured(int index, uint64_t sequence) {
+      raw_sequence[index].store(sequence);
+      header->last_sequence.store(sequence);
+    }
+    bool Store(uint64_t sequence, const struct timeval &timestamp, const uint8_t *jpeg, unsigned int size);
+
+    uint64_t LastSequence() const { return header->last_sequence.load(); }
+    uint64_t Sequence(int index) const { return raw_sequence[index].load(); }
+    int RawIndex(uint64_t sequence) const { return (sequence-1) % raw_count; }
+    uint64_t OldestSequence() const;
+    unsigned int MaxFrameSize() const;
+
+    // Copies a compressed frame into buffer, or only gets its timestamp if buffer is null.
+    // Returns the size of the frame, 0 if it is no longer there.
+    unsigned int Fetch(uint64_t sequence, uint8_t *buffer, unsigned int buffer_size, struct timeval *timestamp) const;
+};
+
+//
+// Compresses the frames zmc captures into the compressed tier as they arrive,
+// on a thread of its own so that capturing is not held up by it.
+//
+class HistoryCompressor : public Thread {
+  private:
+    Monitor *monitor;
+    ImageHistory *history;
+    int quality;
+    uint8_t *jpeg_buffer;
+    int jpeg_buffer_size;
+
+    Mutex mMutex;
+    Condition mCondition;
+    bool mStop;
+
+    void compress(uint64_t sequence);
+
+  public:
+    HistoryCompressor(Monitor *p_monitor, ImageHistory *p_history);
+    ~HistoryCompressor();
+
+    void Notify();
+    void stop();
+    int run();
+};
+
+#endif // ZM_IMAGE_HISTORY_H
@@ -309,7 +309,8 @@ void LibvlcCamera::log_callback(void *ptr, int level, const libvlc_log_t *ctx, c
   if ( log ) {
     char            logString[8192];
     vsnprintf(logString, sizeof(logString)-1, fmt, vargs);
-    log->logPrint(false, __FILE__, __LINE__, log_level, logString);
+    static constexpr const char *logFileName = logBasename(__FILE__, __FILE__);
+    log->logPrint(false, logFileName, __LINE__, log_level, logString);
   }
 }
 #endif // HAVE_LIBVLC
@@ -32,7 +32,6 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <errno.h>
-#include <libgen.h>
 #ifdef __FreeBSD__
 #include <sys/thr.h>
 #endif
@@ -64,7 +63,14 @@ Logger::Logger() :
   //mLogFile( mLogPath+"/"+mId+".log" ),
   mLogFileFP(nullptr),
   mHasTerminal(false),
-  mFlush(false) {
+  mFlush(false),
+  mDbRing(nullptr),
+  mDbHead(0),
+  mDbTail(0),
+  mDbDropped(0),
+  mDbStop(false),
+  mDbThread(nullptr),
+  mDbCondition(mDbMutex) {
 
   if ( smInstance ) {
     Panic("Attempt to create second instance of Logger class");
@@ -252,6 +258,10 @@ void Logger::terminate() {
 
   if ( mDatabaseLevel > NOLOG )
     closeDatabase();
+  if ( mDbRing ) {
+    delete[] mDbRing;
+    mDbRing = nullptr;
+  }
 }
 
 // These don't belong here, they have nothing to do with logging
@@ -351,9 +361,14 @@ Logger::Level Logger::databaseLevel(Logger::Level databaseLevel) {
       if ( (databaseLevel > NOLOG) && (mDatabaseLevel <= NOLOG) ) { // <= NOLOG would be NOOPT
         if ( !zmDbConnect() ) {
           databaseLevel = NOLOG;
+        } else {
+          openDatabase();
         }
       }  // end if ( databaseLevel > NOLOG && mDatabaseLevel <= NOLOG )
+      Level oldDatabaseLevel = mDatabaseLevel;
       mDatabaseLevel = databaseLevel;
+      if ( (databaseLevel <= NOLOG) && (oldDatabaseLevel > NOLOG) )
+        closeDatabase();
     }  // end if ( mDatabaseLevel != databaseLevel )
   }  // end if ( databaseLevel > NOOPT )
 
@@ -421,55 +436,170 @@ void Logger::closeFile() {
   }
 }
 
-void Logger::closeDatabase() {
+void Logger::openDatabase() {
+  if ( mDbThread )
+    return;
 
+  if ( !mDbRing ) {
+    mDbRing = new DbRecord[db_ring_size];
+    for ( unsigned int i = 0; i < db_ring_size; i++ )
+      mDbRing[i].sequence.store(i, std::memory_order_relaxed);
+    mDbHead.store(0);
+    mDbTail = 0;
+  }
+  mDbStop = false;
+  mDbThread = new std::thread(&Logger::dbThread, this);
+  mDbThreadId = mDbThread->get_id();
 }
 
-void Logger::openSyslog() {
-  (void) openlog(mId.c_str(), LOG_PID|LOG_NDELAY, LOG_LOCAL1);
-}
+void Logger::closeDatabase() {
+  if ( !mDbThread )
+    return;
 
-void Logger::closeSyslog() {
-  (void) closelog();
+  // The thread writes whatever is still queued before it exits
+  mDbStop = true;
+  mDbMutex.lock();
+  mDbCondition.signal();
+  mDbMutex.unlock();
+  mDbThread->join();
+  delete mDbThread;
+  mDbThread = nullptr;
+  mDbThreadId = std::thread::id();
 }
 
-void Logger::logPrint(bool hex, const char * const filepath, const int line, const int level, const char *fstring, ...) {
-  
-  if ( level > mEffectiveLevel ) {
-    return;
+// Called from any thread. Claims a slot in the ring without taking a lock,
+// or counts the record as dropped if the ring is full.
+void Logger::queueDbRecord(const struct timeval &timeVal, Level level, pid_t tid, const char *file, int line, const char *message) {
+  unsigned int pos = mDbHead.load(std::memory_order_relaxed);
+  DbRecord *record;
+
+  while ( true ) {
+    record = &mDbRing[pos & (db_ring_size-1)];
+    int diff = (int)(record->sequence.load(std::memory_order_acquire) - pos);
+    if ( diff == 0 ) {
+      if ( mDbHead.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed) )
+        break;
+    } else if ( diff < 0 ) {
+      // Still waiting to be written from the last time round
+      mDbDropped++;
+      return;
+    } else {
+      pos = mDbHead.load(std::memory_order_relaxed);
+    }
   }
-    
-  log_mutex.lock();
-  char            timeString[64];
-  char            logString[8192];
-  va_list         argPtr;
-  struct timeval  timeVal;
 
-  char *filecopy = strdup(filepath);
-  const char * const file = basename(filecopy);
-  const char *classString = smCodes[level].c_str();
+  record->timeVal = timeVal;
+  record->level = level;
+  record->tid = tid;
+  record->line = line;
+  strncpy(record->file, file, sizeof(record->file)-1);
+  record->file[sizeof(record->file)-1] = '\0';
+  strncpy(record->message, message, sizeof(record->message)-1);
+  record->message[sizeof(record->message)-1] = '\0';
+  record->sequence.store(pos+1, std::memory_order_release);
+
+  // Not holding the mutex, so the thread may miss this, but it doesn't sleep for long
+  mDbCondition.signal();
+}
 
-  if ( level < PANIC || level > DEBUG9 )
-    Panic("Invalid logger level %d", level);
+// Takes up to a batch of records from the ring, folding repeats of the same
+// message into one entry. Returns false if there was nothing to take.
+bool Logger::readDbRecords(std::vector<DbEntry> &entries) {
+  entries.clear();
+  while ( entries.size() < db_batch_size ) {
+    DbRecord *record = &mDbRing[mDbTail & (db_ring_size-1)];
+    if ( (int)(record->sequence.load(std::memory_order_acquire) - (mDbTail+1)) < 0 )
+      break;
+
+    if ( entries.size()
+        && (entries.back().level == record->level)
+        && (entries.back().line == record->line)
+        && (entries.back().file == record->file)
+        && (entries.back().message == record->message) ) {
+      entries.back().count++;
+    } else {
+      DbEntry entry;
+      entry.timeVal = record->timeVal;
+      entry.level = record->level;
+      entry.tid = record->tid;
+      entry.line = record->line;
+      entry.file = record->file;
+      entry.message = record->message;
+      entry.count = 1;
+      entries.push_back(entry);
+    }
+    record->sequence.store(mDbTail + db_ring_size, std::memory_order_release);
+    mDbTail++;
+  }
 
-  gettimeofday(&timeVal, nullptr);
+  unsigned int dropped = mDbDropped.exchange(0);
+  if ( dropped ) {
+    DbEntry entry;
+    gettimeofday(&entry.timeVal, nullptr);
+    entry.level = WARNING;
+    entry.tid = getpid();
+    entry.line = __LINE__;
+    entry.file = "zm_logger.cpp";
+    entry.message = stringtf("Dropped %u log records, the database isn't keeping up", dropped);
+    entry.count = 1;
+    entries.push_back(entry);
+  }
+  return !entries.empty();
+}
 
-#if 0
-  if ( logRuntime ) {
-    static struct timeval logStart;
+void Logger::writeDbEntries(const std::vector<DbEntry> &entries) {
+  std::string sql =
+    "INSERT INTO `Logs` "
+    "( `TimeKey`, `Component`, `ServerId`, `Pid`, `Level`, `Code`, `Message`, `File`, `Line` )"
+    " VALUES ";
+
+  db_mutex.lock();
+  for ( std::vector<DbEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it ) {
+    std::string message = it->message;
+    if ( it->count > 1 )
+      message += stringtf(" (repeated %d times)", it->count);
+    char escapedString[(message.size()*2)+1];
+    mysql_real_escape_string(&dbconn, escapedString, message.c_str(), message.size());
+
+    sql += stringtf("%s( %ld.%06ld, '%s', %d, %d, %d, '%s', '%s', '%s', %d )",
+        (it == entries.begin() ? "" : ", "),
+        it->timeVal.tv_sec, it->timeVal.tv_usec, mId.c_str(), staticConfig.SERVER_ID,
+        it->tid, it->level, smCodes[it->level].c_str(), escapedString, it->file.c_str(), it->line);
+  }
+  if ( mysql_query(&dbconn, sql.c_str()) ) {
+    // Records logged from this thread don't go to the database
+    Error("Can't insert %zu log entries: error(%s)", entries.size(), mysql_error(&dbconn));
+  }
+  db_mutex.unlock();
+}
 
-    subtractTime( &timeVal, &logStart );
+void Logger::dbThread() {
+  std::vector<DbEntry> entries;
 
-    snprintf( timeString, sizeof(timeString), "%ld.%03ld", timeVal.tv_sec, timeVal.tv_usec/1000 );
-  } else {
-#endif
-    char *timePtr = timeString;
-    timePtr += strftime(timePtr, sizeof(timeString), "%x %H:%M:%S", localtime(&timeVal.tv_sec));
-    snprintf(timePtr, sizeof(timeString)-(timePtr-timeString), ".%06ld", timeVal.tv_usec);
-#if 0
+  while ( !mDbStop ) {
+    if ( readDbRecords(entries) ) {
+      writeDbEntries(entries);
+    } else {
+      mDbMutex.lock();
+      if ( !mDbStop )
+        mDbCondition.wait(0.5);
+      mDbMutex.unlock();
+    }
   }
-#endif
+  while ( readDbRecords(entries) )
+    writeDbEntries(entries);
+}
+
+void Logger::openSyslog() {
+  (void) openlog(mId.c_str(), LOG_PID|LOG_NDELAY, LOG_LOCAL1);
+}
+
+void Logger::closeSyslog() {
+  (void) closelog();
+}
 
+// Thread ids are looked up once per thread
+static pid_t logTid() {
   pid_t tid;
 #ifdef __FreeBSD__
   long lwpid;
@@ -491,10 +621,57 @@ void Logger::logPrint(bool hex, const char * const filepath, const int line, con
   #endif // HAVE_SYSCALL
 #endif
     tid = getpid(); // Process id
+  return tid;
+}
+
+void Logger::logPrint(bool hex, const char * const file, const int line, const int level, const char *fstring, ...) {
+  // Each thread keeps the date and time it last formatted, which only
+  // changes once a second, and its id.
+  static thread_local time_t  cachedTimeSec = 0;
+  static thread_local char    cachedTimeString[48];
+  static thread_local pid_t   cachedTid = 0;
+
+  if ( level > mEffectiveLevel ) {
+    return;
+  }
+
+  if ( level < PANIC || level > DEBUG9 )
+    Panic("Invalid logger level %d", level);
+
+  char            logString[8192];
+  va_list         argPtr;
+  struct timeval  timeVal;
+
+  const char *classString = smCodes[level].c_str();
+
+  gettimeofday(&timeVal, nullptr);
+
+#if 0
+  if ( logRuntime ) {
+    static struct timeval logStart;
+
+    subtractTime( &timeVal, &logStart );
+
+    snprintf( timeString, sizeof(timeString), "%ld.%03ld", timeVal.tv_sec, timeVal.tv_usec/1000 );
+  } else {
+#endif
+    if ( timeVal.tv_sec != cachedTimeSec ) {
+      struct tm tm_info;
+      strftime(cachedTimeString, sizeof(cachedTimeString), "%x %H:%M:%S", localtime_r(&timeVal.tv_sec, &tm_info));
+      cachedTimeSec = timeVal.tv_sec;
+    }
+#if 0
+  }
+#endif
+
+  if ( !cachedTid )
+    cachedTid = logTid();
+  pid_t tid = cachedTid;
 
   char *logPtr = logString;
-  logPtr += snprintf(logPtr, sizeof(logString), "%s %s[%d].%s-%s/%d [",
-      timeString,
+  logPtr += snprintf(logPtr, sizeof(logString), "%s.%06ld %s[%d].%s-%s/%d [",
+      cachedTimeString,
+      timeVal.tv_usec,
       mId.c_str(),
       tid,
       classString,
@@ -519,57 +696,38 @@ void Logger::logPrint(bool hex, const char * const filepath, const int line, con
   char *syslogEnd = logPtr;
   strncpy(logPtr, "]\n", sizeof(logString)-(logPtr-logString));
 
-  if ( level <= mTerminalLevel ) {
-    puts(logString);
-    fflush(stdout);
-  }
-  if ( level <= mFileLevel ) {
-    if ( !mLogFileFP ) {
-      log_mutex.unlock();
-      openFile();
-      log_mutex.lock();
-    }
-    if ( mLogFileFP ) {
-      fputs(logString, mLogFileFP);
-      if ( mFlush )
-        fflush(mLogFileFP);
-    } else {
-      puts("Logging to file, but failed to open it\n");
+  // Everything above is done in the caller's own buffers, the mutex only
+  // keeps the writes to the terminal and file whole.
+  if ( (level <= mTerminalLevel) || (level <= mFileLevel) ) {
+    log_mutex.lock();
+    if ( level <= mTerminalLevel ) {
+      puts(logString);
+      fflush(stdout);
     }
+    if ( level <= mFileLevel ) {
+      if ( !mLogFileFP ) {
+        log_mutex.unlock();
+        openFile();
+        log_mutex.lock();
+      }
+      if ( mLogFileFP ) {
+        fputs(logString, mLogFileFP);
+        if ( mFlush )
+          fflush(mLogFileFP);
+      } else {
+        puts("Logging to file, but failed to open it\n");
+      }
 #if 0
-  } else {
-    printf("Not writing to log file because level %d %s <= mFileLevel %d %s\nstring: %s\n",
-        level, smCodes[level].c_str(), mFileLevel, smCodes[mFileLevel].c_str(), logString);
+    } else {
+      printf("Not writing to log file because level %d %s <= mFileLevel %d %s\nstring: %s\n",
+          level, smCodes[level].c_str(), mFileLevel, smCodes[mFileLevel].c_str(), logString);
 #endif
+    }
+    log_mutex.unlock();
   }
   *syslogEnd = '\0';
-  if ( level <= mDatabaseLevel ) {
-    char sql[ZM_SQL_MED_BUFSIZ];
-    char escapedString[(strlen(syslogStart)*2)+1];
-
-    if ( !db_mutex.trylock() ) {
-      mysql_real_escape_string(&dbconn, escapedString, syslogStart, strlen(syslogStart));
-
-      snprintf(sql, sizeof(sql),
-          "INSERT INTO `Logs` "
-          "( `TimeKey`, `Component`, `ServerId`, `Pid`, `Level`, `Code`, `Message`, `File`, `Line` )"
-         " VALUES "
-         "( %ld.%06ld, '%s', %d, %d, %d, '%s', '%s', '%s', %d )",
-         timeVal.tv_sec, timeVal.tv_usec, mId.c_str(), staticConfig.SERVER_ID, tid, level, classString, escapedString, file, line
-         );
-      if ( mysql_query(&dbconn, sql) ) {
-        Level tempDatabaseLevel = mDatabaseLevel;
-        databaseLevel(NOLOG);
-        Error("Can't insert log entry: sql(%s) error(%s)", sql, mysql_error(&dbconn));
-        databaseLevel(tempDatabaseLevel);
-      }
-      db_mutex.unlock();
-    } else {
-      Level tempDatabaseLevel = mDatabaseLevel;
-      databaseLevel(NOLOG);
-      Error("Can't insert log entry: sql(%s) error(db is locked)", logString);
-      databaseLevel(tempDatabaseLevel);
-    }
+  if ( (level <= mDatabaseLevel) && mDbThread && (std::this_thread::get_id() != mDbThreadId) ) {
+    queueDbRecord(timeVal, level, tid, file, line, syslogStart);
   }
   if ( level <= mSyslogLevel ) {
     int priority = smSyslogPriorities[level];
@@ -577,16 +735,13 @@ void Logger::logPrint(bool hex, const char * const filepath, const int line, con
     syslog(priority, "%s [%s] [%s]", classString, mId.c_str(), syslogStart);
   }
 
-  free(filecopy);
   if ( level <= FATAL ) {
-    log_mutex.unlock();
     logTerm();
     zmDbClose();
     if ( level <= PANIC )
       abort();
     exit(-1);
   }
-  log_mutex.unlock();
 }  // end logPrint
 
 void logInit(const char *name, const Logger::Options &options) {
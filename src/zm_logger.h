@@ -23,8 +23,12 @@
 #include "zm_config.h"
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <string>
 #include <map>
+#include <vector>
+#include <atomic>
+#include <thread>
 #ifdef HAVE_SYS_SYSCALL_H
 #include <sys/syscall.h>
 #endif // HAVE_SYS_SYSCALL_H
@@ -117,6 +121,39 @@ private:
   bool mHasTerminal;
   bool mFlush;
 
+  // Records for the database go through a lock free ring to a thread of
+  // their own, so logging never waits on the database.
+  struct DbRecord {
+    std::atomic<unsigned int> sequence;
+    struct timeval timeVal;
+    Level level;
+    pid_t tid;
+    int line;
+    char file[64];
+    char message[ZM_SQL_MED_BUFSIZ];
+  };
+  struct DbEntry {
+    struct timeval timeVal;
+    Level level;
+    pid_t tid;
+    int line;
+    std::string file;
+    std::string message;
+    int count;                  // How many times in a row it was logged
+  };
+  static const unsigned int db_ring_size = 256;   // Must be a power of two
+  static const unsigned int db_batch_size = 64;   // Rows per insert
+
+  DbRecord *mDbRing;
+  std::atomic<unsigned int> mDbHead;     // Next slot to be claimed
+  unsigned int mDbTail;                  // Next slot to be written, only used by the db thread
+  std::atomic<unsigned int> mDbDropped;
+  std::atomic<bool> mDbStop;
+  std::thread *mDbThread;
+  std::thread::id mDbThreadId;
+  Mutex mDbMutex;
+  Condition mDbCondition;
+
 private:
   Logger();
   ~Logger();
@@ -166,6 +203,10 @@ public:
   bool debugOn() const {
     return mEffectiveLevel >= DEBUG1;
   }
+  // Whether anything at this level would be output anywhere
+  bool logging(int level) const {
+    return level <= mEffectiveLevel;
+  }
 
   Level terminalLevel(Level=NOOPT);
   Level databaseLevel(Level=NOOPT);
@@ -178,12 +219,23 @@ private:
   void closeFile();
   void openSyslog();
   void closeSyslog();
+  void openDatabase();
   void closeDatabase();
+  void queueDbRecord(const struct timeval &timeVal, Level level, pid_t tid, const char *file, int line, const char *message);
+  bool readDbRecords(std::vector<DbEntry> &entries);
+  void writeDbEntries(const std::vector<DbEntry> &entries);
+  void dbThread();
 
 public:
-  void logPrint(bool hex, const char * const filepath, const int line, const int level, const char *fstring, ...);
+  void logPrint(bool hex, const char * const file, const int line, const int level, const char *fstring, ...);
 };
 
+// The part of a path after the last slash. Used to initialise a constexpr
+// it is worked out by the compiler, so __FILE__ costs nothing at run time.
+constexpr const char *logBasename(const char *path, const char *base) {
+  return !*path ? base : logBasename(path+1, (*path == '/') ? path+1 : base);
+}
+
 void logInit(const char *name, const Logger::Options &options=Logger::Options());
 void logTerm();
 inline const std::string &logId() {
@@ -196,14 +248,19 @@ inline Logger::Level logDebugging() {
   return Logger::fetch()->debugOn();
 }
 
+// The arguments are only evaluated if the level is being logged somewhere
 #define logPrintf(logLevel,params...)  {\
-    if ( logLevel <= Logger::fetch()->level() )\
-      Logger::fetch()->logPrint( false, __FILE__, __LINE__, logLevel, ##params );\
+    if ( Logger::fetch()->logging(logLevel) ) {\
+      static constexpr const char *logFileName = logBasename(__FILE__, __FILE__);\
+      Logger::fetch()->logPrint( false, logFileName, __LINE__, logLevel, ##params );\
+    }\
   }
 
 #define logHexdump(logLevel,data,len)  {\
-    if ( logLevel <= Logger::fetch()->level() )\
-      Logger::fetch()->logPrint( true, __FILE__, __LINE__, logLevel, "%p (%d)", data, len );\
+    if ( Logger::fetch()->logging(logLevel) ) {\
+      static constexpr const char *logFileName = logBasename(__FILE__, __FILE__);\
+      Logger::fetch()->logPrint( true, logFileName, __LINE__, logLevel, "%p (%d)", data, len );\
+    }\
   }
 
 /* Debug compiled out */
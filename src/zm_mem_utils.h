@@ -21,6 +21,7 @@
 #define ZM_MEM_UTILS_H
 
 #include <stdlib.h>
+#include <string.h>
 #include "zm.h"
 
 inline void* zm_mallocaligned(unsigned int reqalignment, size_t reqsize) {
@@ -82,20 +83,17 @@ inline char *memstr(const char *s, const char *n, size_t limit) {
   if ( !*n )
     return (char *)s;
 
-  unsigned int i,j,k;
   size_t n_len = strlen(n);
-
-  for ( i = 0; i < limit; i++, s++ ) {
-    if ( *s != *n )
-      continue;
-    j = 1;
-    k = 1;
-    while ( true ) {
-      if ( k >= n_len )
-        return (char *)s;
-      if ( s[j++] != n[k++] )
-        break;
-    }
+  const char *end = s + limit;
+
+  // memchr is vectorised by libc, so let it find candidate first bytes
+  while ( (size_t)(end - s) >= n_len ) {
+    s = (const char *)memchr(s, *n, (end - s) - n_len + 1);
+    if ( !s )
+      return nullptr;
+    if ( memcmp(s+1, n+1, n_len-1) == 0 )
+      return (char *)s;
+    s++;
   }
   return nullptr;
 }
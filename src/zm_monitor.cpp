@@ -19,9 +19,11 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <glob.h>
 #include <cinttypes>
+#include <algorithm>
 
 #include "zm.h"
 #include "zm_db.h"
@@ -57,7 +59,10 @@
 
 #if ZM_MEM_MAPPED
 #include <sys/mman.h>
-#include <fcntl.h>
+#if defined(__linux__)
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
 #else // ZM_MEM_MAPPED
 #include <sys/ipc.h>
 #include <sys/shm.h>
@@ -370,7 +375,8 @@ Monitor::Monitor(
   zones( p_zones ),
   timestamps( nullptr ),
   images( nullptr ),
-  privacy_bitmask( nullptr ),
+  privacy_mask( nullptr ),
+  orientation_buffer( nullptr ),
   event_delete_thread(nullptr)
 {
   if (analysis_fps > 0.0) {
@@ -427,11 +433,35 @@ Monitor::Monitor(
 
   Debug(1, "monitor purpose=%d", purpose);
 
+  image_slot_size = (camera->ImageSize() + 63) & ~63;
+  history_count = config.compressed_buffer_count > 0 ? config.compressed_buffer_count : 0;
+  /* Budget on about one bit per pixel, frames that need more just mean fewer of them are kept */
+  history_data_size = history_count ? (uint64_t)history_count * (((width * height / 8) + 63) & ~63) : 0;
+  history = nullptr;
+  history_compressor = nullptr;
+  history_buffer = nullptr;
+  history_images = nullptr;
+  history_timestamps = nullptr;
+  scaled_levels = config.stream_scale_levels > 0 ? config.stream_scale_levels : 0;
+  /* Planar frames are scaled as RGB24 */
+  scaled_colours = (camera->SubpixelOrder() == ZM_SUBPIX_ORDER_YUV420P) ? ZM_COLOUR_RGB24 : camera->Colours();
+  scaled_cache = nullptr;
+  if ( (videowriter == H264PASSTHROUGH) && camera->SupportsNativeVideo() && (config.passthrough_stream_buffer > 0) ) {
+    packet_ring_size = (uint64_t)config.passthrough_stream_buffer * 1024;
+    packet_ring_slots = 1024;
+  } else {
+    packet_ring_size = 0;
+    packet_ring_slots = 0;
+  }
+  packet_ring = nullptr;
   mem_size = sizeof(SharedData)
        + sizeof(TriggerData)
        + sizeof(VideoStoreData) //Information to pass back to the capture process
        + (image_buffer_count*sizeof(struct timeval))
-       + (image_buffer_count*camera->ImageSize())
+       + ImageHistory::SharedSize(image_buffer_count, history_count, history_data_size)
+       + ScaledFrameCache::SharedSize(scaled_levels, width, height, scaled_colours)
+       + PacketRing::SharedSize(packet_ring_slots, packet_ring_size)
+       + (image_buffer_count*image_slot_size)
        + 64; /* Padding used to permit aligning the images buffer to 64 byte boundary */
 
   Debug(1, "mem.size(%d) SharedData=%d TriggerData=%d VideoStoreData=%d timestamps=%d images=%dx%d = %" PRId64 " total=%" PRId64,
@@ -441,6 +471,12 @@ Monitor::Monitor(
       image_buffer_count, camera->ImageSize(), (image_buffer_count*camera->ImageSize()),
      mem_size);
   mem_ptr = nullptr;
+#if ZM_MEM_MAPPED
+  ring_fd = -1;
+  ring_file[0] = '\0';
+  ring_size = 0;
+  ring_ptr = nullptr;
+#endif // ZM_MEM_MAPPED
 
   storage = new Storage(storage_id);
   Debug(1, "Storage path: %s", storage->Path());
@@ -488,6 +524,13 @@ Monitor::Monitor(
     snprintf(video_store_data->event_file, sizeof(video_store_data->event_file), "nothing");
     video_store_data->size = sizeof(VideoStoreData);
     //video_store_data->frameNumber = 0;
+    history->Initialise();
+    scaled_cache->Initialise();
+    packet_ring->Initialise();
+    if ( history->Enabled() ) {
+      history_compressor = new HistoryCompressor(this, history);
+      history_compressor->start();
+    }
   } else if ( purpose == ANALYSIS ) {
     if ( ! (this->connect() && mem_ptr && shared_data->valid) ) {
       Error("Shared data not initialised by capture daemon for monitor %s", name);
@@ -504,6 +547,7 @@ Monitor::Monitor(
   start_time = last_fps_time = time( 0 );
 
   event = 0;
+  event_published = false;
 
   Debug(1, "Monitor %s has function %d,\n"
       "label format = '%s', label X = %d, label Y = %d, label size = %d,\n"
@@ -550,9 +594,85 @@ Monitor::Monitor(
   }  // end if purpose == ANALYSIS
 }  // Monitor::Monitor
 
+#if ZM_MEM_MAPPED
+/* Maps the images from a file of the same name on hugetlbfs, leaving the rest in mem_file
+   where everything else looks for it. Returns false, with nothing mapped, if that can't be done. */
+bool Monitor::mapHugePageRing(bool create) {
+#if defined(__linux__)
+  snprintf(ring_file, sizeof(ring_file), "%s/zm.mmap.%d", config.path_hugepages, id);
+  ring_fd = open(ring_file, O_RDWR|(create ? O_CREAT : 0), (mode_t)0600);
+  if ( ring_fd < 0 ) {
+    Error("Can't open huge page image ring %s: %s", ring_file, strerror(errno));
+    return false;
+  }
+
+  struct statfs ring_fs;
+  if ( fstatfs(ring_fd, &ring_fs) < 0 ) {
+    Error("Can't statfs %s: %s", ring_file, strerror(errno));
+  } else if ( ring_fs.f_type != HUGETLBFS_MAGIC ) {
+    Error("%s is not a hugetlbfs mount, set ZM_PATH_HUGEPAGES to one", config.path_hugepages);
+  } else {
+    long page_size = ring_fs.f_bsize;
+    ring_size = ((((off_t)image_buffer_count*image_slot_size) + page_size - 1) / page_size) * page_size;
+
+    struct stat ring_stat;
+    if ( create && (ftruncate(ring_fd, ring_size) < 0) ) {
+      Error("Can't extend huge page image ring %s to %" PRId64 " bytes: %s", ring_file, (int64_t)ring_size, strerror(errno));
+    } else if ( !create && ((fstat(ring_fd, &ring_stat) < 0) || (ring_stat.st_size < ring_size)) ) {
+      Error("Huge page image ring %s is not the expected %" PRId64 " bytes", ring_file, (int64_t)ring_size);
+    } else {
+      int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+      // Fault the whole ring in now rather than a page at a time as it first fills
+      if ( create )
+        flags |= MAP_POPULATE;
+#endif
+      ring_ptr = (unsigned char *)mmap(nullptr, ring_size, PROT_READ|PROT_WRITE, flags, ring_fd, 0);
+      if ( ring_ptr != MAP_FAILED ) {
+        Debug(1, "Mapped huge page image ring %s, %" PRId64 " bytes in %ldkB pages",
+            ring_file, (int64_t)ring_size, page_size/1024);
+        return true;
+      }
+      ring_ptr = nullptr;
+      Error("Can't map %" PRId64 " huge pages of %ldkB for image ring %s: %s. "
+          "Check that vm.nr_hugepages reserves enough of them for every monitor.",
+          (int64_t)(ring_size/page_size), page_size/1024, ring_file, strerror(errno));
+    }
+  }
+  close(ring_fd);
+  ring_fd = -1;
+  if ( create )
+    unlink(ring_file);
+#else
+  Error("Huge page image rings are only supported on Linux");
+#endif
+  return false;
+}
+#endif // ZM_MEM_MAPPED
+
 bool Monitor::connect() {
   Debug(3, "Connecting to monitor.  Purpose is %d", purpose );
 #if ZM_MEM_MAPPED
+  // Everything apart from the images, which is all there is in mem_file when they are on huge pages
+  off_t header_size = sizeof(SharedData) + sizeof(TriggerData) + sizeof(VideoStoreData)
+    + (image_buffer_count*sizeof(struct timeval))
+    + ImageHistory::SharedSize(image_buffer_count, history_count, history_data_size)
+    + ScaledFrameCache::SharedSize(scaled_levels, width, height, scaled_colours)
+    + PacketRing::SharedSize(packet_ring_slots, packet_ring_size);
+  if ( purpose == CAPTURE ) {
+    snprintf(ring_file, sizeof(ring_file), "%s/zm.mmap.%d", config.path_hugepages, id);
+    if ( config.path_hugepages[0] && mapHugePageRing(true) ) {
+      mem_size = header_size;
+    } else {
+      if ( config.path_hugepages[0] ) {
+        Warning("Falling back to normal pages for the image ring of monitor %d", id);
+        // So that nothing finds a stale ring from an earlier run
+        unlink(ring_file);
+      }
+      ring_file[0] = '\0';
+    }
+  }
+
   snprintf(mem_file, sizeof(mem_file), "%s/zm.mmap.%d", staticConfig.PATH_MAP.c_str(), id);
   map_fd = open(mem_file, O_RDWR|O_CREAT, (mode_t)0600);
   if ( map_fd < 0 ) {
@@ -569,6 +689,16 @@ bool Monitor::connect() {
     return false;
   }
 
+  if ( (purpose != CAPTURE) && (map_stat.st_size == header_size) ) {
+    // zmc put the images on huge pages
+    if ( !mapHugePageRing(false) ) {
+      close(map_fd);
+      map_fd = -1;
+      return false;
+    }
+    mem_size = header_size;
+  }
+
   if ( map_stat.st_size != mem_size ) {
     if ( purpose == CAPTURE ) {
       // Allocate the size
@@ -610,6 +740,18 @@ bool Monitor::connect() {
   } else {
     Debug(3, "mmapped to %p", mem_ptr);
   }
+#ifdef MADV_HUGEPAGE
+  // Without a hugetlbfs ring, tmpfs can still back the images with transparent
+  // huge pages when /sys/kernel/mm/transparent_hugepage/shmem_enabled is advise
+  if ( !ring_ptr && madvise(mem_ptr, mem_size, MADV_HUGEPAGE) < 0 ) {
+    // Only worth a warning when huge pages were asked for
+    if ( config.path_hugepages[0] ) {
+      Warning("Can't advise huge pages for %s: %s", mem_file, strerror(errno));
+    } else {
+      Debug(1, "Can't advise huge pages for %s: %s", mem_file, strerror(errno));
+    }
+  }
+#endif
 #else // ZM_MEM_MAPPED
   shm_id = shmget((config.shm_key&0xffff0000)|id, mem_size, IPC_CREAT|0700);
   if ( shm_id < 0 ) {
@@ -624,7 +766,20 @@ bool Monitor::connect() {
   trigger_data = (TriggerData *)((char *)shared_data + sizeof(SharedData));
   video_store_data = (VideoStoreData *)((char *)trigger_data + sizeof(TriggerData));
   struct timeval *shared_timestamps = (struct timeval *)((char *)video_store_data + sizeof(VideoStoreData));
-  unsigned char *shared_images = (unsigned char *)((char *)shared_timestamps + (image_buffer_count*sizeof(struct timeval)));
+  uint8_t *shared_history = (uint8_t *)((char *)shared_timestamps + (image_buffer_count*sizeof(struct timeval)));
+  uint8_t *shared_scaled = shared_history + ImageHistory::SharedSize(image_buffer_count, history_count, history_data_size);
+  uint8_t *shared_packets = shared_scaled + ScaledFrameCache::SharedSize(scaled_levels, width, height, scaled_colours);
+  unsigned char *shared_images = shared_packets + PacketRing::SharedSize(packet_ring_slots, packet_ring_size);
+  delete history;
+  history = new ImageHistory(shared_history, image_buffer_count, history_count, history_data_size);
+  delete scaled_cache;
+  scaled_cache = new ScaledFrameCache(shared_scaled, scaled_levels, width, height, scaled_colours);
+  delete packet_ring;
+  packet_ring = new PacketRing(shared_packets, packet_ring_slots, packet_ring_size);
+#if ZM_MEM_MAPPED
+  if ( ring_ptr )
+    shared_images = ring_ptr;
+#endif // ZM_MEM_MAPPED
 
   if ( ((unsigned long)shared_images % 64) != 0 ) {
     /* Align images buffer to nearest 64 byte boundary */
@@ -635,7 +790,7 @@ bool Monitor::connect() {
   image_buffer = new Snapshot[image_buffer_count];
   for ( int i = 0; i < image_buffer_count; i++ ) {
     image_buffer[i].timestamp = &(shared_timestamps[i]);
-    image_buffer[i].image = new Image(width, height, camera->Colours(), camera->SubpixelOrder(), &(shared_images[i*camera->ImageSize()]));
+    image_buffer[i].image = new Image(width, height, camera->Colours(), camera->SubpixelOrder(), &(shared_images[i*image_slot_size]));
     image_buffer[i].image->HoldBuffer(true); /* Don't release the internal buffer or replace it with another */
   }
   if ( (deinterlacing & 0xff) == 4 ) {
@@ -644,6 +799,10 @@ bool Monitor::connect() {
     next_buffer.image = new Image(width, height, camera->Colours(), camera->SubpixelOrder());
     next_buffer.timestamp = new struct timeval;
   }
+  if ( (orientation != ROTATE_0) && !orientation_buffer ) {
+    /* Rotation and flipping can't be done in place, so keep a target for them around */
+    orientation_buffer = (uint8_t*)zm_mallocaligned(64, camera->ImageSize());
+  }
   if ( purpose == ANALYSIS ) {
 		if ( analysis_fps ) {
 			// Size of pre event buffer must be greater than pre_event_count
@@ -660,6 +819,14 @@ bool Monitor::connect() {
 
     timestamps = new struct timeval *[pre_event_count];
     images = new Image *[pre_event_count];
+    if ( history->Enabled() && pre_event_count && !history_images ) {
+      /* Pre-event frames from the compressed tier are decoded a batch at a time */
+      int batch_size = std::min(pre_event_count, ZM_SQL_BATCH_SIZE);
+      history_images = new Image *[batch_size];
+      for ( int i = 0; i < batch_size; i++ )
+        history_images[i] = new Image();
+      history_timestamps = new struct timeval[batch_size];
+    }
     last_signal = shared_data->signal;
   } // end if purpose == ANALYSIS
 Debug(3, "Success connecting");
@@ -682,9 +849,9 @@ Monitor::~Monitor() {
     delete[] images;
     images = nullptr;
   }
-  if ( privacy_bitmask ) {
-    delete[] privacy_bitmask;
-    privacy_bitmask = nullptr;
+  if ( privacy_mask ) {
+    delete privacy_mask;
+    privacy_mask = nullptr;
   }
   if ( mem_ptr ) {
     if ( event ) {
@@ -699,6 +866,21 @@ Monitor::~Monitor() {
       }
     }
 
+    if ( history_compressor ) {
+      // It reads from image_buffer
+      delete history_compressor;
+      history_compressor = nullptr;
+    }
+    if ( history_images ) {
+      for ( int i = 0; i < std::min(pre_event_count, ZM_SQL_BATCH_SIZE); i++ )
+        delete history_images[i];
+      delete[] history_images;
+      delete[] history_timestamps;
+      history_images = nullptr;
+    }
+    delete[] history_buffer;
+    history_buffer = nullptr;
+
     if ( (deinterlacing & 0xff) == 4) {
       delete next_buffer.image;
       delete next_buffer.timestamp;
@@ -707,6 +889,10 @@ Monitor::~Monitor() {
       delete image_buffer[i].image;
     }
     delete[] image_buffer;
+    if ( orientation_buffer ) {
+      zm_freealigned(orientation_buffer);
+      orientation_buffer = nullptr;
+    }
   } // end if mem_ptr
 
   for ( int i = 0; i < n_zones; i++ ) {
@@ -737,12 +923,27 @@ Monitor::~Monitor() {
       memset(mem_ptr, 0, mem_size);
     }
 
+    delete history;
+    history = nullptr;
+    delete scaled_cache;
+    scaled_cache = nullptr;
+    delete packet_ring;
+    packet_ring = nullptr;
+
 #if ZM_MEM_MAPPED
     if ( msync(mem_ptr, mem_size, MS_SYNC) < 0 )
       Error("Can't msync: %s", strerror(errno));
     if ( munmap(mem_ptr, mem_size) < 0 )
       Fatal("Can't munmap: %s", strerror(errno));
     close( map_fd );
+    if ( ring_ptr ) {
+      if ( munmap(ring_ptr, ring_size) < 0 )
+        Error("Can't munmap huge page image ring: %s", strerror(errno));
+      close(ring_fd);
+      ring_ptr = nullptr;
+      if ( (purpose == CAPTURE) && (unlink(ring_file) < 0) )
+        Warning("Can't unlink '%s': %s", ring_file, strerror(errno));
+    }
 
     if ( purpose == CAPTURE ) {
       // How about we store this in the object on instantiation so that we don't have to do this again.
@@ -776,9 +977,9 @@ void Monitor::AddZones( int p_n_zones, Zone *p_zones[] ) {
 }
 
 void Monitor::AddPrivacyBitmask( Zone *p_zones[] ) {
-  if ( privacy_bitmask ) {
-    delete[] privacy_bitmask;
-    privacy_bitmask = nullptr;
+  if ( privacy_mask ) {
+    delete privacy_mask;
+    privacy_mask = nullptr;
   }
   Image *privacy_image = nullptr;
 
@@ -792,8 +993,11 @@ void Monitor::AddPrivacyBitmask( Zone *p_zones[] ) {
       privacy_image->Outline( 0xff, p_zones[i]->GetPolygon() );
     }
   } // end foreach zone
-  if ( privacy_image )
-    privacy_bitmask = privacy_image->Buffer();
+  if ( privacy_image ) {
+    /* Only the runs of masked pixels are kept, so masking a frame doesn't have to look at every pixel */
+    privacy_mask = new PrivacyMask(privacy_image->Buffer(), width, height);
+    delete privacy_image;
+  }
 }
 
 Monitor::State Monitor::GetState() const {
@@ -801,6 +1005,26 @@ Monitor::State Monitor::GetState() const {
 }
 
 int Monitor::GetImage( int index, int scale ) {
+  if ( index < -1 ) {
+    // Counting back from the newest frame, -2 being the one before it, which can reach into the compressed tier
+    uint64_t last = GetLastSequence();
+    uint64_t back = -(index+1);
+    struct timeval timestamp;
+    if ( !last || (back >= last) || !GetHistoryFrame(last - back, &alarm_image, &timestamp) ) {
+      Error("Unable to generate image, frame %d is no longer in the buffer", index);
+      return 0;
+    }
+    if ( scale != ZM_SCALE_BASE )
+      alarm_image.Scale(scale);
+    if ( !config.timestamp_on_capture )
+      TimestampImage(&alarm_image, &timestamp);
+
+    static char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "Monitor%d.jpg", id);
+    alarm_image.WriteJpeg(filename);
+    return 0;
+  }
+
   if ( index < 0 || index > image_buffer_count ) {
     index = shared_data->last_write_index;
   }
@@ -839,6 +1063,21 @@ int Monitor::GetImage( int index, int scale ) {
 }
 
 struct timeval Monitor::GetTimestamp( int index ) const {
+  if ( index < -1 ) {
+    struct timeval timestamp = { 0, 0 };
+    uint64_t last = GetLastSequence();
+    uint64_t back = -(index+1);
+    if ( last && (back < last) ) {
+      uint64_t sequence = last - back;
+      int raw_index = history->RawIndex(sequence);
+      if ( history->Sequence(raw_index) == sequence )
+        timestamp = *(image_buffer[raw_index].timestamp);
+      else
+        history->Fetch(sequence, nullptr, 0, &timestamp);
+    }
+    return timestamp;
+  }
+
   if ( index < 0 || index > image_buffer_count ) {
     index = shared_data->last_write_index;
   }
@@ -854,6 +1093,136 @@ struct timeval Monitor::GetTimestamp( int index ) const {
   }
 }
 
+/* Gets a frame by its sequence number, from the raw ring if it is still there and otherwise
+   from the compressed tier. Only the timestamp is got when image is null. Frames of planar
+   monitors come back as RGB24 either way, so that they all match. */
+bool Monitor::GetHistoryFrame(uint64_t sequence, Image *image, struct timeval *timestamp) {
+  if ( !history || !sequence || (sequence > history->LastSequence()) )
+    return false;
+
+  int index = history->RawIndex(sequence);
+  if ( history->Sequence(index) == sequence ) {
+    struct timeval raw_timestamp = *(image_buffer[index].timestamp);
+    if ( image )
+      image->Assign(*(image_buffer[index].image));
+    // It may have been captured over while being copied
+    if ( history->Sequence(index) == sequence ) {
+      if ( image && image->IsPlanar() )
+        image->Colourise(ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB);
+      *timestamp = raw_timestamp;
+      return true;
+    }
+  }
+
+  if ( !history->Enabled() )
+    return false;
+  if ( !image )
+    return history->Fetch(sequence, nullptr, 0, timestamp) > 0;
+
+  if ( !history_buffer )
+    history_buffer = new uint8_t[history->MaxFrameSize()];
+  unsigned int size = history->Fetch(sequence, history_buffer, history->MaxFrameSize(), timestamp);
+  if ( !size )
+    return false;
+  if ( camera->SubpixelOrder() == ZM_SUBPIX_ORDER_YUV420P )
+    return image->DecodeJpeg(history_buffer, size, ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB);
+  return image->DecodeJpeg(history_buffer, size, camera->Colours(), camera->SubpixelOrder());
+}
+
+/* Writes a frame out as a JPEG. Frames in the compressed tier already are one, so are written as they are
+   rather than compressed again from the raw ring. */
+bool Monitor::WriteHistoryFrame(uint64_t sequence, const char *filename, struct timeval *timestamp) {
+  if ( !history || !sequence )
+    return false;
+
+  unsigned int size = 0;
+  if ( history->Enabled() ) {
+    if ( !history_buffer )
+      history_buffer = new uint8_t[history->MaxFrameSize()];
+    size = history->Fetch(sequence, history_buffer, history->MaxFrameSize(), timestamp);
+  }
+  if ( !size ) {
+    Image image;
+    if ( !GetHistoryFrame(sequence, &image, timestamp) )
+      return false;
+    return image.WriteJpeg(filename, config.jpeg_file_quality);
+  }
+
+  int fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, (mode_t)0644);
+  if ( fd < 0 ) {
+    Error("Can't open %s: %s", filename, strerror(errno));
+    return false;
+  }
+  bool written = (write(fd, history_buffer, size) == (ssize_t)size);
+  if ( close(fd) || !written ) {
+    Error("Can't write %s: %s", filename, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+/* Gets a frame at one of the levels of the scaled frame cache. Whichever viewer gets to a
+   level of a frame first scales it, from the level above, and the others copy it from there. */
+bool Monitor::GetScaledImage(uint64_t sequence, int level, Image *image) {
+  if ( !scaled_cache || !sequence || (level < 1) || (level > scaled_cache->Levels()) )
+    return false;
+
+  if ( scaled_cache->Fetch(level, sequence, image) )
+    return true;
+
+  bool claimed = scaled_cache->Claim(level, sequence);
+  if ( !claimed && (scaled_cache->Claimed(level) == sequence) ) {
+    // Another viewer is scaling it, which shouldn't take more than a few milliseconds
+    for ( int i = 0; i < 20; i++ ) {
+      usleep(1000);
+      if ( scaled_cache->Fetch(level, sequence, image) )
+        return true;
+      if ( scaled_cache->Claimed(level) != sequence )
+        break;
+    }
+  }
+
+  if ( level == 1 ) {
+    int index = history->RawIndex(sequence);
+    if ( history->Sequence(index) != sequence )
+      return false;
+    image->Assign(*(image_buffer[index].image));
+    // It may have been captured over while being copied
+    if ( history->Sequence(index) != sequence )
+      return false;
+  } else if ( !GetScaledImage(sequence, level-1, image) ) {
+    return false;
+  }
+  image->Scale(ZM_SCALE_BASE/2);
+
+  if ( claimed )
+    scaled_cache->Store(level, sequence, *image);
+  return true;
+}
+
+/* Adds frames first up to end to the event, decoding no more than a batch of them at a time */
+void Monitor::AddHistoryFrames(uint64_t first, uint64_t end) {
+  int batch_size = std::min(pre_event_count, ZM_SQL_BATCH_SIZE);
+  int missing = 0;
+
+  while ( first < end ) {
+    int n_frames = 0;
+    for ( ; (first < end) && (n_frames < batch_size); first++ ) {
+      if ( !GetHistoryFrame(first, history_images[n_frames], &history_timestamps[n_frames]) ) {
+        missing++;
+        continue;
+      }
+      images[n_frames] = history_images[n_frames];
+      timestamps[n_frames] = &history_timestamps[n_frames];
+      n_frames++;
+    }
+    if ( n_frames )
+      event->AddFrames(n_frames, images, timestamps);
+  }
+  if ( missing )
+    Debug(1, "%d pre-event frames were no longer in the buffer", missing);
+}
+
 unsigned int Monitor::GetLastReadIndex() const {
   return( shared_data->last_read_index!=(unsigned int)image_buffer_count?shared_data->last_read_index:-1 );
 }
@@ -1426,7 +1795,7 @@ bool Monitor::Analyse() {
           }
           Warning("%s: %s", SIGNAL_CAUSE, signalText);
           if ( event && !signal ) {
-            Info("%s: %03d - Closing event %" PRIu64 ", signal loss", name, image_count, event->Id());
+            Info("%s: %03d - Closing event, signal loss", name, image_count);
             closeEvent();
           }
           if ( !event ) {
@@ -1506,8 +1875,8 @@ bool Monitor::Analyse() {
                   && ( ( timestamp->tv_sec - video_store_data->recording.tv_sec ) >= section_length )
                   && ( (function == MOCORD && (event_close_mode != CLOSE_TIME)) || ! ( timestamp->tv_sec % section_length ) ) 
                  ) {
-                Info("%s: %03d - Closing event %" PRIu64 ", section end forced %d - %d = %d >= %d",
-                    name, image_count, event->Id(),
+                Info("%s: %03d - Closing event, section end forced %d - %d = %d >= %d",
+                    name, image_count,
                     timestamp->tv_sec, video_store_data->recording.tv_sec,
                     timestamp->tv_sec - video_store_data->recording.tv_sec,
                     section_length
@@ -1519,12 +1888,11 @@ bool Monitor::Analyse() {
             if ( !event ) {
               // Create event
               event = new Event(this, *timestamp, "Continuous", noteSetMap, videoRecording);
-              shared_data->last_event = event->Id();
-              //set up video store data
-              snprintf(video_store_data->event_file, sizeof(video_store_data->event_file), "%s", event->getEventFile());
+              // The id and file are published by PublishEvent once the event has been opened
+              shared_data->last_event = 0;
               video_store_data->recording = event->StartTime();
 
-              Info("%s: %03d - Opening new event %" PRIu64 ", section start", name, image_count, event->Id());
+              Info("%s: %03d - Opening new event, section start", name, image_count);
 
               /* To prevent cancelling out an existing alert\prealarm\alarm state */
               if ( state == IDLE ) {
@@ -1543,8 +1911,8 @@ bool Monitor::Analyse() {
                 && ( ( timestamp->tv_sec - video_store_data->recording.tv_sec ) >= min_section_length )
 								&& ( (!pre_event_count) || (Event::PreAlarmCount() >= alarm_frame_count-1) )
                ) {
-              Info("%s: %03d - Closing event %" PRIu64 ", continuous end, alarm begins",
-                  name, image_count, event->Id());
+              Info("%s: %03d - Closing event, continuous end, alarm begins",
+                  name, image_count);
               closeEvent();
             } else if ( event ) {
 							// This is so if we need more than 1 alarm frame before going into alarm, so it is basically if we have enough alarm frames
@@ -1571,6 +1939,11 @@ bool Monitor::Analyse() {
               if ( !event ) {
                 int pre_index;
                 int pre_event_images = pre_event_count;
+                // Without analysis fps, pre-event frames are taken from wherever they still are,
+                // which may be a long way further back than the raw ring goes
+                uint64_t history_sequence = (!analysis_fps && pre_event_count && history->Enabled()) ? history->Sequence(index) : 0;
+                uint64_t history_first = 0;
+                uint64_t history_end = 0;
 
                 if ( analysis_fps && pre_event_count ) {
                   // If analysis fps is set,
@@ -1590,16 +1963,32 @@ bool Monitor::Analyse() {
                      pre_index, pre_event_images); 
 
                   event = new Event(this, *(pre_event_buffer[pre_index].timestamp), cause, noteSetMap);
+                } else if ( history_sequence ) {
+                  history_end = (history_sequence >= (uint64_t)alarm_frame_count) ? history_sequence - (alarm_frame_count - 1) : 1;
+                  history_first = (history_end > (uint64_t)pre_event_count) ? history_end - pre_event_count : 1;
+                  history_first = std::max(history_first, history->OldestSequence());
+
+                  // Seek forward to the oldest frame that is still there
+                  struct timeval pre_event_start = *(image_buffer[index].timestamp);
+                  while ( (history_first < history_end) && !GetHistoryFrame(history_first, nullptr, &pre_event_start) )
+                    history_first++;
+                  Debug(3, "Pre-event frames %" PRIu64 " to %" PRIu64 " for frame %" PRIu64,
+                      history_first, history_end, history_sequence);
+
+                  event = new Event(this, pre_event_start, cause, noteSetMap);
                 } else {
                   // If analysis fps is not set (analysis performed at capturing framerate),
-                  // compute the index for pre event images in the capturing buffer
+                  // compute the index for pre event images in the capturing buffer.
+                  // Only as many as the ring holds can be had from it, the compressed
+                  // history allows more to be asked for.
+                  pre_event_images = std::min(pre_event_count, std::max(image_buffer_count - alarm_frame_count, 0));
                   if ( alarm_frame_count > 1 )
-                    pre_index = ((index + image_buffer_count) - ((alarm_frame_count - 1) + pre_event_count))%image_buffer_count;
+                    pre_index = ((index + image_buffer_count) - ((alarm_frame_count - 1) + pre_event_images))%image_buffer_count;
                   else
-                    pre_index = ((index + image_buffer_count) - pre_event_count)%image_buffer_count;
+                    pre_index = ((index + image_buffer_count) - pre_event_images)%image_buffer_count;
 
-                  Debug(3, "Resulting pre_index(%d) from index(%d) + image_buffer_count(%d) - pre_event_count(%d)",
-                      pre_index, index, image_buffer_count, pre_event_count);
+                  Debug(3, "Resulting pre_index(%d) from index(%d) + image_buffer_count(%d) - pre_event_images(%d)",
+                      pre_index, index, image_buffer_count, pre_event_images);
 
                   // Seek forward the next filled slot in to the buffer (oldest data)
                   // from the current position
@@ -1612,14 +2001,14 @@ bool Monitor::Analyse() {
                   event = new Event(this, *(image_buffer[pre_index].timestamp), cause, noteSetMap);
                 } // end if analysis_fps && pre_event_count
 
-                shared_data->last_event = event->Id();
-                //set up video store data
-                snprintf(video_store_data->event_file, sizeof(video_store_data->event_file), "%s", event->getEventFile());
+                shared_data->last_event = 0;
                 video_store_data->recording = event->StartTime();
 
-                Info("%s: %03d - Opening new event %" PRIu64 ", alarm start", name, image_count, event->Id());
+                Info("%s: %03d - Opening new event, alarm start", name, image_count);
 
-                if ( pre_event_images ) {
+                if ( history_sequence ) {
+                  AddHistoryFrames(history_first, history_end);
+                } else if ( pre_event_images ) {
                   if ( analysis_fps ) {
                     for ( int i = 0; i < pre_event_images; i++ ) {
                       timestamps[i] = pre_event_buffer[pre_index].timestamp;
@@ -1667,13 +2056,13 @@ bool Monitor::Analyse() {
                 ( image_count-last_alarm_count > post_event_count )
                 && ( ( timestamp->tv_sec - video_store_data->recording.tv_sec ) >= min_section_length )
                 ) {
-              Info("%s: %03d - Left alarm state (%" PRIu64 ") - %d(%d) images",
-                  name, image_count, event->Id(), event->Frames(), event->AlarmFrames());
+              Info("%s: %03d - Left alarm state - %d(%d) images",
+                  name, image_count, event->Frames(), event->AlarmFrames());
               //if ( function != MOCORD || event_close_mode == CLOSE_ALARM || event->Cause() == SIGNAL_CAUSE )
               if ( ( function != MOCORD && function != RECORD ) || event_close_mode == CLOSE_ALARM ) {
                 shared_data->state = state = IDLE;
-                Info("%s: %03d - Closing event %" PRIu64 ", alarm end%s",
-                    name, image_count, event->Id(), (function==MOCORD)?", section truncated":"");
+                Info("%s: %03d - Closing event, alarm end%s",
+                    name, image_count, (function==MOCORD)?", section truncated":"");
                 closeEvent();
               } else {
                 shared_data->state = state = TAPE;
@@ -1739,17 +2128,15 @@ bool Monitor::Analyse() {
                   && ( ( timestamp->tv_sec - video_store_data->recording.tv_sec ) >= section_length )
                   && ! (image_count % fps_report_interval)
                  ) {
-                Warning("%s: %03d - event %" PRIu64 ", has exceeded desired section length. %d - %d = %d >= %d",
-                    name, image_count, event->Id(),
+                Warning("%s: %03d - event has exceeded desired section length. %d - %d = %d >= %d",
+                    name, image_count,
                     timestamp->tv_sec, video_store_data->recording.tv_sec,
                     timestamp->tv_sec - video_store_data->recording.tv_sec,
                     section_length
                     );
                 closeEvent();
                 event = new Event(this, *timestamp, cause, noteSetMap);
-                shared_data->last_event = event->Id();
-                //set up video store data
-                snprintf(video_store_data->event_file, sizeof(video_store_data->event_file), "%s", event->getEventFile());
+                shared_data->last_event = 0;
                 video_store_data->recording = event->StartTime();
               }
             } // end if event
@@ -1777,7 +2164,7 @@ bool Monitor::Analyse() {
       }
     } else {
       if ( event ) {
-        Info("%s: %03d - Closing event %" PRIu64 ", trigger off", name, image_count, event->Id());
+        Info("%s: %03d - Closing event, trigger off", name, image_count);
         closeEvent();
       }
       shared_data->state = state = IDLE;
@@ -1794,6 +2181,9 @@ bool Monitor::Analyse() {
     last_signal = signal;
   } // end if Enabled()
 
+  if ( event && !event_published && event->Opened() )
+    PublishEvent();
+
   shared_data->last_read_index = index % image_buffer_count;
   //shared_data->last_read_time = image_buffer[index].timestamp->tv_sec;
   shared_data->last_read_time = now.tv_sec;
@@ -1814,7 +2204,7 @@ void Monitor::Reload() {
   Debug(1, "Reloading monitor %s", name);
 
   if ( event ) {
-    Info("%s: %03d - Closing event %" PRIu64 ", reloading", name, image_count, event->Id());
+    Info("%s: %03d - Closing event, reloading", name, image_count);
     closeEvent();
   }
 
@@ -2162,6 +2552,13 @@ Monitor *Monitor::Load(MYSQL_ROW dbrow, bool load_zones, Purpose purpose) {
   int post_event_count = atoi(dbrow[col]); col++;
   int stream_replay_buffer = atoi(dbrow[col]); col++;
   int alarm_frame_count = atoi(dbrow[col]); col++;
+  // Without the compressed history, pre-event frames can only come from the image buffer
+  if ( (config.compressed_buffer_count <= 0) && (pre_event_count > image_buffer_count - alarm_frame_count) ) {
+    int max_pre_event_count = std::max(image_buffer_count - alarm_frame_count, 0);
+    Warning("Monitor %d pre event count %d doesn't fit in its image buffer of %d, using %d",
+        id, pre_event_count, image_buffer_count, max_pre_event_count);
+    pre_event_count = max_pre_event_count;
+  }
   int section_length = atoi(dbrow[col]); col++;
   int min_section_length = atoi(dbrow[col]); col++;
   int frame_skip = atoi(dbrow[col]); col++;
@@ -2174,6 +2571,15 @@ Monitor *Monitor::Load(MYSQL_ROW dbrow, bool load_zones, Purpose purpose) {
   int signal_check_points = dbrow[col] ? atoi(dbrow[col]) : 0;col++;
   int signal_check_color = strtol(dbrow[col][0] == '#' ? dbrow[col]+1 : dbrow[col], nullptr, 16); col++;
 
+  if ( colours == ZM_COLOUR_YUV420P ) {
+    // Only the ffmpeg decoders fill planar images, and orientation and deinterlacing only know packed pixels
+    if ( !((type == "Ffmpeg") || ((type == "Remote") && (protocol == "rtsp")))
+        || (orientation != ROTATE_0) || (deinterlacing & 0xff) ) {
+      Warning("Monitor %d can't capture YUV 4:2:0 with this source, orientation or deinterlacing, using 24 bit colour", id);
+      colours = ZM_COLOUR_RGB24;
+    }
+  }
+
   Camera *camera = nullptr;
   if ( type == "Local" ) {
 
@@ -2433,6 +2839,88 @@ Monitor *Monitor::Load(unsigned int p_id, bool load_zones, Purpose purpose) {
   return monitor;
 } // end Monitor *Monitor::Load(unsigned int p_id, bool load_zones, Purpose purpose)
 
+/* Applies deinterlacing, orientation and the privacy mask to a freshly captured image.
+ * The work is done in bands of lines, so that each band is masked while it is still
+ * in cache from the previous step, instead of making a separate pass over the whole
+ * image for each of them.
+ */
+void Monitor::ProcessCapture(Image *capture_image) {
+  unsigned int deinterlacing_value = deinterlacing & 0xff;
+
+  if ( deinterlacing_value == 4 ) {
+    /* Four field deinterlacing looks at the next image as well, so is done on its own */
+    capture_image->Deinterlace_4Field(next_buffer.image, (deinterlacing>>8)&0xff);
+    deinterlacing_value = 0;
+  }
+
+  /* Bands of roughly 64k, always an even number of lines so that field pairs don't straddle bands */
+  unsigned int band_lines = (65536 / capture_image->LineSize()) & ~1U;
+  if ( band_lines < 2 )
+    band_lines = 2;
+
+  /* When the image gets rotated or flipped the mask applies to the result, so is done while copying it back */
+  const PrivacyMask *band_mask = (orientation == ROTATE_0) ? privacy_mask : nullptr;
+
+  if ( deinterlacing_value || band_mask ) {
+    unsigned int capture_height = capture_image->Height();
+    for ( unsigned int lo_y = 0; lo_y < capture_height; lo_y += band_lines ) {
+      unsigned int hi_y = std::min(lo_y + band_lines, capture_height);
+
+      if ( deinterlacing_value == 1 ) {
+        capture_image->Deinterlace_Discard(lo_y, hi_y);
+      } else if ( deinterlacing_value == 2 ) {
+        capture_image->Deinterlace_Linear(lo_y, hi_y);
+      } else if ( deinterlacing_value == 3 ) {
+        capture_image->Deinterlace_Blend(lo_y, hi_y);
+      } else if ( deinterlacing_value == 5 ) {
+        capture_image->Deinterlace_Blend_CustomRatio((deinterlacing>>8)&0xff, lo_y, hi_y);
+      }
+
+      if ( band_mask )
+        capture_image->MaskPrivacy(*band_mask, lo_y, hi_y);
+    }
+  }
+
+  if ( orientation == ROTATE_0 )
+    return;
+
+  unsigned int new_width = capture_image->Width();
+  unsigned int new_height = capture_image->Height();
+
+  switch ( orientation ) {
+    case ROTATE_0 :
+      // No action required
+      break;
+    case ROTATE_90 :
+    case ROTATE_270 :
+      new_width = capture_image->Height();
+      new_height = capture_image->Width();
+      // Fall through
+    case ROTATE_180 :
+      capture_image->Rotate((orientation-1)*90, orientation_buffer);
+      break;
+    case FLIP_HORI :
+    case FLIP_VERT :
+      capture_image->Flip(orientation==FLIP_HORI, orientation_buffer);
+      break;
+  }
+
+  /* The shared memory buffer is held, so this only updates the dimensions */
+  uint8_t *buffer = capture_image->WriteBuffer(new_width, new_height,
+      capture_image->Colours(), capture_image->SubpixelOrder());
+  if ( !buffer )
+    return;
+
+  unsigned int line_bytes = capture_image->LineSize();
+  for ( unsigned int lo_y = 0; lo_y < new_height; lo_y += band_lines ) {
+    unsigned int hi_y = std::min(lo_y + band_lines, new_height);
+
+    memcpy(buffer + (lo_y * line_bytes), orientation_buffer + (lo_y * line_bytes), (hi_y - lo_y) * line_bytes);
+    if ( privacy_mask )
+      capture_image->MaskPrivacy(*privacy_mask, lo_y, hi_y);
+  }
+} // end void Monitor::ProcessCapture(Image *capture_image)
+
 /* Returns 0 on success, even if no new images are available (transient error)
  * Returns -1 on failure.
  */
@@ -2442,6 +2930,8 @@ int Monitor::Capture() {
 
   unsigned int index = image_count%image_buffer_count;
   Image* capture_image = image_buffer[index].image;
+  /* Nothing should read what was in this slot while it is captured over */
+  history->Capturing(index);
 
   unsigned int deinterlacing_value = deinterlacing & 0xff;
 
@@ -2496,35 +2986,7 @@ int Monitor::Capture() {
   } else if ( captureResult > 0 ) {
     Debug(4, "Return from Capture (%d)", captureResult);
 
-    /* Deinterlacing */
-    if ( deinterlacing_value == 1 ) {
-      capture_image->Deinterlace_Discard();
-    } else if ( deinterlacing_value == 2 ) {
-      capture_image->Deinterlace_Linear();
-    } else if ( deinterlacing_value == 3 ) {
-      capture_image->Deinterlace_Blend();
-    } else if ( deinterlacing_value == 4 ) {
-      capture_image->Deinterlace_4Field(next_buffer.image, (deinterlacing>>8)&0xff);
-    } else if ( deinterlacing_value == 5 ) {
-      capture_image->Deinterlace_Blend_CustomRatio((deinterlacing>>8)&0xff);
-    }
-
-    if ( orientation != ROTATE_0 ) {
-      switch ( orientation ) {
-        case ROTATE_0 :
-          // No action required
-          break;
-        case ROTATE_90 :
-        case ROTATE_180 :
-        case ROTATE_270 :
-          capture_image->Rotate((orientation-1)*90);
-          break;
-        case FLIP_HORI :
-        case FLIP_VERT :
-          capture_image->Flip(orientation==FLIP_HORI);
-          break;
-      }
-    } // end if have rotation
+    ProcessCapture(capture_image);
 
     if ( capture_image->Size() > camera->ImageSize() ) {
       Error("Captured image %d does not match expected size %d check width, height and colour depth",
@@ -2544,9 +3006,6 @@ int Monitor::Capture() {
       }
     } // end if overrun
 
-    if ( privacy_bitmask )
-      capture_image->MaskPrivacy(privacy_bitmask);
-
     // Might be able to remove this call, when we start passing around ZMPackets, which will already have a timestamp
     gettimeofday(image_buffer[index].timestamp, nullptr);
     if ( config.timestamp_on_capture ) {
@@ -2556,6 +3015,9 @@ int Monitor::Capture() {
     shared_data->signal = signal_check_points ? CheckSignal(capture_image) : true;
     shared_data->last_write_index = index;
     shared_data->last_write_time = image_buffer[index].timestamp->tv_sec;
+    history->Captured(index, image_count+1);
+    if ( history_compressor )
+      history_compressor->Notify();
 
     image_count++;
 
@@ -2670,10 +3132,22 @@ bool Monitor::closeEvent() {
   delete event;
   event = nullptr;
 #endif
+  event_published = false;
   video_store_data->recording = (struct timeval){0};
   return true;
 } // end bool Monitor::closeEvent()
 
+// Tells zmc and the stream servers about the current event. Events are opened
+// in the background, so this happens once the row and directory exist.
+void Monitor::PublishEvent() {
+  shared_data->last_event = event->Id();
+  //set up video store data
+  snprintf(video_store_data->event_file, sizeof(video_store_data->event_file), "%s", event->getEventFile());
+  event_published = true;
+
+  Info("%s: %03d - Opened event %" PRIu64, name, image_count, event->Id());
+} // end void Monitor::PublishEvent()
+
 unsigned int Monitor::DetectMotion(const Image &comp_image, Event::StringSet &zoneSet) {
   bool alarm = false;
   unsigned int score = 0;
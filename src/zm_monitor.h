@@ -37,6 +37,9 @@ class Monitor;
 #include "zm_utils.h"
 
 #include "zm_image_analyser.h"
+#include "zm_image_history.h"
+#include "zm_scaled_cache.h"
+#include "zm_packet_ring.h"
 
 #include <sys/time.h>
 #include <stdint.h>
@@ -51,6 +54,7 @@ class Monitor;
 //
 class Monitor {
   friend class MonitorStream;
+  friend class HistoryCompressor;
 
 public:
   typedef enum {
@@ -335,10 +339,15 @@ protected:
 #if ZM_MEM_MAPPED
   int             map_fd;
   char            mem_file[PATH_MAX];
+  int             ring_fd;
+  char            ring_file[PATH_MAX];  // The images, when they are on hugetlbfs rather than in mem_file
+  off_t           ring_size;
+  unsigned char   *ring_ptr;
 #else // ZM_MEM_MAPPED
   int             shm_id;
 #endif // ZM_MEM_MAPPED
   off_t           mem_size;
+  unsigned int    image_slot_size;    // ImageSize() rounded up to a whole number of cache lines
   unsigned char   *mem_ptr;
   SharedData      *shared_data;
   TriggerData     *trigger_data;
@@ -348,8 +357,25 @@ protected:
   Snapshot    next_buffer; /* Used by four field deinterlacing */
   Snapshot    *pre_event_buffer;
 
+  int               history_count;        // Frames kept in the compressed tier behind image_buffer
+  uint64_t          history_data_size;
+  ImageHistory      *history;
+  HistoryCompressor *history_compressor;
+  uint8_t           *history_buffer;      // A compressed frame being read back
+  Image             **history_images;     // Pre-event frames being added to an event, a batch at a time
+  struct timeval    *history_timestamps;
+
+  int               scaled_levels;        // Halvings of the frame kept for zms viewers at reduced scales
+  unsigned int      scaled_colours;
+  ScaledFrameCache  *scaled_cache;
+
+  int               packet_ring_slots;    // Passthrough packets kept for zms to stream without encoding
+  uint64_t          packet_ring_size;
+  PacketRing        *packet_ring;
+
   Camera      *camera;
   Event       *event;
+  bool        event_published; // Whether last_event and the event file refer to event yet
   Storage     *storage;
 
   int      n_zones;
@@ -358,7 +384,8 @@ protected:
   struct timeval    **timestamps;
   Image      **images;
 
-  const unsigned char  *privacy_bitmask;
+  PrivacyMask   *privacy_mask;
+  uint8_t       *orientation_buffer; // Preallocated target for rotating/flipping captured images
   std::thread   *event_delete_thread; // Used to close events, but continue processing.
 
   int      n_linked_monitors;
@@ -424,6 +451,10 @@ public:
   void AddPrivacyBitmask( Zone *p_zones[] );
 
   bool connect();
+#if ZM_MEM_MAPPED
+  bool mapHugePageRing(bool create);
+#endif // ZM_MEM_MAPPED
+  void AddHistoryFrames(uint64_t first, uint64_t end);
 
   inline int ShmValid() const {
     return shared_data && shared_data->valid;
@@ -488,6 +519,15 @@ public:
   int GetImage( int index=-1, int scale=100 );
   Snapshot *getSnapshot() const;
   struct timeval GetTimestamp( int index=-1 ) const;
+  bool GetHistoryFrame(uint64_t sequence, Image *image, struct timeval *timestamp);
+  bool WriteHistoryFrame(uint64_t sequence, const char *filename, struct timeval *timestamp);
+  bool HistoryEnabled() const { return history && history->Enabled(); }
+  uint64_t GetLastSequence() const { return history ? history->LastSequence() : 0; }
+  uint64_t GetOldestSequence() const { return history ? history->OldestSequence() : 0; }
+  uint64_t GetSequence(int index) const { return history ? history->Sequence(index) : 0; }
+  int GetScaledLevel(unsigned int scale) const { return scaled_cache ? scaled_cache->LevelFor(scale) : 0; }
+  bool GetScaledImage(uint64_t sequence, int level, Image *image);
+  PacketRing *GetPacketRing() const { return (packet_ring && packet_ring->Enabled()) ? packet_ring : nullptr; }
   void UpdateAdaptiveSkip();
   useconds_t GetAnalysisRate();
   unsigned int GetAnalysisUpdateDelay() const { return analysis_update_delay; }
@@ -528,10 +568,12 @@ public:
    // DetectBlack seems to be unused. Check it on zm_monitor.cpp for more info.
    //unsigned int DetectBlack( const Image &comp_image, Event::StringSet &zoneSet );
   bool CheckSignal( const Image *image );
+  void ProcessCapture( Image *capture_image );
   bool Analyse();
   void DumpImage( Image *dump_image ) const;
   void TimestampImage( Image *ts_image, const struct timeval *ts_time ) const;
   bool closeEvent();
+  void PublishEvent();
 
   void Reload();
   void ReloadZones();
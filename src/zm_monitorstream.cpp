@@ -26,6 +26,8 @@
 #include "zm_monitorstream.h"
 #include <arpa/inet.h>
 #include <glob.h>
+#include <algorithm>
+#include <cinttypes>
 
 const int MAX_SLEEP_USEC=1000000; // 1 sec
 
@@ -367,8 +369,31 @@ bool MonitorStream::sendFrame(const char *filepath, struct timeval *timestamp) {
   return false;
 } // end bool MonitorStream::sendFrame(const char *filepath, struct timeval *timestamp)
 
-bool MonitorStream::sendFrame(Image *image, struct timeval *timestamp) {
-  Image *send_image = prepareImage(image);
+/* Live frames viewed at a reduced scale are scaled from the monitor's shared pyramid of
+   scaled frames, which other viewers will often already have scaled them into */
+Image *MonitorStream::scaledImage(uint64_t sequence) {
+  // MPEG streams can't have the odd frame come out a pixel different
+  if ( !sequence || (type == STREAM_MPEG) || (zoom != ZM_SCALE_BASE) || (scale <= 0) || (scale >= ZM_SCALE_BASE) )
+    return nullptr;
+  int level = monitor->GetScaledLevel(scale);
+  if ( !level || !monitor->GetScaledImage(sequence, level, &scaled_image) )
+    return nullptr;
+
+  unsigned int level_scale = scale << level;
+  if ( level_scale != ZM_SCALE_BASE )
+    scaled_image.Scale(level_scale);
+
+  last_scale = scale;
+  last_zoom = zoom;
+  last_x = x;
+  last_y = y;
+  return &scaled_image;
+}
+
+bool MonitorStream::sendFrame(Image *image, struct timeval *timestamp, uint64_t sequence) {
+  Image *send_image = scaledImage(sequence);
+  if ( !send_image )
+    send_image = prepareImage(image);
   if ( !config.timestamp_on_capture && timestamp )
     monitor->TimestampImage(send_image, timestamp);
 
@@ -461,6 +486,17 @@ void MonitorStream::runStream() {
 
   openComms();
 
+  if ( type == STREAM_VIDEO ) {
+#if HAVE_LIBAVCODEC
+    if ( checkInitialised() && monitor->GetPacketRing() && sendPackets() ) {
+      closeComms();
+      return;
+    }
+#endif // HAVE_LIBAVCODEC
+    Warning("Monitor %d has no packets to stream, sending JPEGs instead", monitor_id);
+    type = STREAM_JPEG;
+  }
+
   if ( type == STREAM_JPEG )
     fputs("Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY "\r\n\r\n", stdout);
 
@@ -534,6 +570,29 @@ void MonitorStream::runStream() {
         temp_image_buffer = new SwapImage[temp_image_buffer_count];
         memset(temp_image_buffer, 0, sizeof(*temp_image_buffer)*temp_image_buffer_count);
         Debug(2, "Assigned temporary buffer");
+
+        if ( monitor->HistoryEnabled() ) {
+          // Start off with what zmc still has, so there is something to go back through straight away.
+          // The newest frame is left for the loop below to store as it sends it.
+          uint64_t last_sequence = monitor->GetLastSequence();
+          uint64_t seed_count = temp_image_buffer_count/2;
+          uint64_t sequence = last_sequence > seed_count ? last_sequence - seed_count : 1;
+          sequence = std::max(sequence, monitor->GetOldestSequence());
+          int seeded = 0;
+          for ( ; last_sequence && (sequence < last_sequence); sequence++ ) {
+            int temp_index = temp_write_index%temp_image_buffer_count;
+            SwapImage *swap_image = &temp_image_buffer[temp_index];
+            snprintf(swap_image->file_name, sizeof(swap_image->file_name),
+                "%s/zmswap-i%05d.jpg", swap_path.c_str(), temp_index);
+            if ( !monitor->WriteHistoryFrame(sequence, swap_image->file_name, &swap_image->timestamp) )
+              continue;
+            swap_image->valid = true;
+            temp_write_index = MOD_ADD(temp_write_index, 1, temp_image_buffer_count);
+            seeded++;
+          }
+          temp_read_index = temp_write_index;
+          Debug(2, "Stored %d earlier frames in the temporary buffer", seeded);
+        }
       }
     }
   } else {
@@ -687,15 +746,16 @@ void MonitorStream::runStream() {
               index, frame_mod, frame_count, paused, delayed);
           // Send the next frame
           Monitor::Snapshot *snap = &monitor->image_buffer[index];
+          uint64_t sequence = monitor->GetSequence(index);
 
-          if ( !sendFrame(snap->image, snap->timestamp) ) {
+          if ( !sendFrame(snap->image, snap->timestamp, sequence) ) {
             Debug(2, "sendFrame failed, quiting.");
             zm_terminate = true;
           }
           if ( frame_count == 0 ) {
             // Chrome will not display the first frame until it receives another.
             // Firefox is fine.  So just send the first frame twice.
-            if ( !sendFrame(snap->image, snap->timestamp) ) {
+            if ( !sendFrame(snap->image, snap->timestamp, sequence) ) {
               Debug(2, "sendFrame failed, quiting.");
               zm_terminate = true;
             }
@@ -835,6 +895,200 @@ void MonitorStream::runStream() {
   closeComms();
 } // end MonitorStream::runStream
 
+#if HAVE_LIBAVCODEC
+static int write_stdout(void *opaque, uint8_t *buf, int buf_size) {
+  if ( fwrite(buf, buf_size, 1, stdout) != 1 )
+    return AVERROR(EPIPE);
+  return buf_size;
+}
+
+/* Streams the packets of a passthrough monitor from its shared packet ring as they came
+   from the camera, remuxed to fragmented MP4 or MPEG-TS, or sent as they are if they are
+   JPEGs. Nothing is decoded or encoded, so scale and maxfps don't apply. */
+bool MonitorStream::sendPackets() {
+  PacketRing *packet_ring = monitor->GetPacketRing();
+  PacketRing::CodecInfo codec;
+  uint32_t generation = 0;
+  uint64_t next = 0;
+
+  // zmc may still be connecting to the camera
+  for ( int i = 0; !zm_terminate && (i < 100); i++ ) {
+    generation = packet_ring->GetCodec(&codec);
+    next = packet_ring->LastKeyframe();
+    if ( generation && next )
+      break;
+    if ( connkey )
+      checkCommandQueue();
+    usleep(100000);
+  }
+  if ( !generation || !next ) {
+    Error("No video packets from monitor %d to stream", monitor_id);
+    return false;
+  }
+
+  bool mjpeg = (codec.codec_id == AV_CODEC_ID_MJPEG);
+  bool mp4 = !(format && (!strcmp(format, "ts") || !strcmp(format, "mpegts")));
+  AVRational in_time_base = { codec.time_base_num, codec.time_base_den };
+  AVFormatContext *oc = nullptr;
+  AVStream *out_stream = nullptr;
+
+  if ( mjpeg ) {
+    fputs("Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY "\r\n\r\n", stdout);
+  } else {
+    avformat_alloc_output_context2(&oc, nullptr, mp4 ? "mp4" : "mpegts", nullptr);
+    if ( !oc ) {
+      Error("Unable to create %s muxer", mp4 ? "mp4" : "mpegts");
+      return false;
+    }
+    out_stream = avformat_new_stream(oc, nullptr);
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+    AVCodecParameters *parameters = out_stream->codecpar;
+#else
+    AVCodecContext *parameters = out_stream->codec;
+#endif
+    parameters->codec_type = AVMEDIA_TYPE_VIDEO;
+    parameters->codec_id = (AVCodecID)codec.codec_id;
+    parameters->width = codec.width;
+    parameters->height = codec.height;
+    if ( codec.extradata_size ) {
+      parameters->extradata = (uint8_t *)av_mallocz(codec.extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+      memcpy(parameters->extradata, codec.extradata, codec.extradata_size);
+      parameters->extradata_size = codec.extradata_size;
+    }
+    out_stream->time_base = in_time_base;
+
+    const int io_buffer_size = 65536;
+    uint8_t *io_buffer = (uint8_t *)av_malloc(io_buffer_size);
+    oc->pb = avio_alloc_context(io_buffer, io_buffer_size, 1, nullptr, nullptr, write_stdout, nullptr);
+
+    AVDictionary *opts = nullptr;
+    // A fragment per packet, written out as soon as it is muxed
+    if ( mp4 )
+      av_dict_set(&opts, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+    fprintf(stdout, "Content-Type: %s\r\n\r\n", mp4 ? "video/mp4" : "video/mp2t");
+    int ret = avformat_write_header(oc, &opts);
+    av_dict_free(&opts);
+    if ( ret < 0 ) {
+      Error("Unable to write %s header: %s", mp4 ? "mp4" : "mpegts", av_make_error_string(ret).c_str());
+      av_freep(&oc->pb->buffer);
+      av_freep(&oc->pb);
+      avformat_free_context(oc);
+      return true;
+    }
+  }
+  Debug(1, "Streaming codec %d %dx%d from packet %" PRIu64, codec.codec_id, codec.width, codec.height, next);
+
+  uint8_t *packet_buffer = new uint8_t[packet_ring->MaxPacketSize()];
+  int64_t start_dts = AV_NOPTS_VALUE;
+  int64_t last_dts = AV_NOPTS_VALUE;
+  bool waiting_for_keyframe = false;
+  time_t stream_start_time = time(nullptr);
+  frame_count = 0;
+
+  while ( !zm_terminate ) {
+    gettimeofday(&now, nullptr);
+    if ( connkey )
+      checkCommandQueue();
+    if ( ttl && ((now.tv_sec - stream_start_time) > ttl) )
+      break;
+    if ( packet_ring->Generation() != generation ) {
+      Info("Monitor %d camera was reopened with different codec parameters, ending stream", monitor_id);
+      break;
+    }
+
+    if ( next > packet_ring->LastSequence() ) {
+      usleep(10000);
+      continue;
+    }
+
+    PacketRing::PacketInfo info;
+    if ( !packet_ring->Fetch(next, packet_buffer, &info) ) {
+      // Written over before it could be sent, start again from the newest keyframe.
+      // If that has gone as well, carrying on mid-GOP would only send packets that
+      // can't be decoded, so wait for the next one.
+      uint64_t keyframe = packet_ring->LastKeyframe();
+      if ( keyframe > next ) {
+        Warning("Fell behind at packet %" PRIu64 ", skipping to keyframe %" PRIu64, next, keyframe);
+        next = keyframe;
+        waiting_for_keyframe = false;
+      } else {
+        if ( !waiting_for_keyframe ) {
+          Warning("Fell behind at packet %" PRIu64 ", waiting for the next keyframe", next);
+          waiting_for_keyframe = true;
+        }
+        usleep(10000);
+      }
+      continue;
+    }
+    next++;
+
+    if ( mjpeg ) {
+      if (
+          (0 > fprintf(stdout, "--" BOUNDARY "\r\nContent-Type: image/jpeg\r\n"
+                       "Content-Length: %d\r\nX-Timestamp: %d.%06d\r\n\r\n",
+                       info.size, (int)info.timestamp.tv_sec, (int)info.timestamp.tv_usec))
+          ||
+          (fwrite(packet_buffer, info.size, 1, stdout) != 1)
+         ) {
+        if ( !zm_terminate )
+          Warning("Unable to send stream frame: %s", strerror(errno));
+        break;
+      }
+      fputs("\r\n", stdout);
+    } else {
+      if ( info.dts == AV_NOPTS_VALUE ) {
+        Debug(1, "Not sending packet %" PRIu64 " without timestamps", next-1);
+        continue;
+      }
+      AVPacket pkt;
+      av_init_packet(&pkt);
+      pkt.data = packet_buffer;
+      pkt.size = info.size;
+      pkt.flags = info.flags;
+      pkt.stream_index = out_stream->index;
+      if ( start_dts == AV_NOPTS_VALUE )
+        start_dts = info.dts;
+      pkt.dts = info.dts - start_dts;
+      if ( (last_dts != AV_NOPTS_VALUE) && (pkt.dts <= last_dts) ) {
+        // The camera was reopened with the same parameters, or its timestamps wrapped.
+        // Carry on from where the stream got to, the muxer won't take dts going backwards.
+        Debug(1, "Packet %" PRIu64 " dts %" PRId64 " is not after %" PRId64 ", restarting timestamps",
+            next-1, pkt.dts, last_dts);
+        start_dts = info.dts - last_dts - 1;
+        pkt.dts = last_dts + 1;
+      }
+      last_dts = pkt.dts;
+      pkt.pts = ((info.pts == AV_NOPTS_VALUE) ? info.dts : info.pts) - start_dts;
+      av_packet_rescale_ts(&pkt, in_time_base, out_stream->time_base);
+
+      int ret = av_write_frame(oc, &pkt);
+      if ( (ret >= 0) && mp4 )
+        ret = av_write_frame(oc, nullptr);
+      if ( ret < 0 ) {
+        if ( !zm_terminate )
+          Warning("Unable to send stream packet: %s", av_make_error_string(ret).c_str());
+        break;
+      }
+      avio_flush(oc->pb);
+    }
+    fflush(stdout);
+    last_frame_sent = TV_2_FLOAT(now);
+    frame_count++;
+  }  // end while
+
+  if ( oc ) {
+    av_write_trailer(oc);
+    avio_flush(oc->pb);
+    av_freep(&oc->pb->buffer);
+    av_freep(&oc->pb);
+    avformat_free_context(oc);
+  }
+  delete[] packet_buffer;
+  Debug(1, "Streamed %d packets", frame_count);
+  return true;
+}  // end bool MonitorStream::sendPackets()
+#endif // HAVE_LIBAVCODEC
+
 void MonitorStream::SingleImage(int scale) {
   int img_buffer_size = 0;
   static JOCTET img_buffer[ZM_MAX_IMAGE_SIZE];
@@ -45,11 +45,17 @@ class MonitorStream : public StreamBase {
     int playback_buffer;
     bool delayed;
     int frame_count;
+    Image scaled_image;
 
   protected:
     bool checkSwapPath(const char *path, bool create_path);
     bool sendFrame(const char *filepath, struct timeval *timestamp);
-    bool sendFrame(Image *image, struct timeval *timestamp);
+    bool sendFrame(Image *image, struct timeval *timestamp, uint64_t sequence=0);
+    Image *scaledImage(uint64_t sequence);
+#if HAVE_LIBAVCODEC
+    // Returns false if nothing was sent, so another stream type can be sent instead
+    bool sendPackets();
+#endif // HAVE_LIBAVCODEC
     void processCommand(const CmdMsg *msg);
     void SingleImage(int scale=100);
     void SingleImageRaw(int scale=100);
@@ -19,6 +19,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <cinttypes>
 
 #include "zm.h"
 #include "zm_rgb.h"
@@ -136,7 +137,7 @@ void VideoStream::SetupCodec( int colours, int subpixelorder, int width, int hei
 	    }
 	    break;
 	  case ZM_COLOUR_GRAY8:
-	    pf = AV_PIX_FMT_GRAY8;
+	    pf = (subpixelorder == ZM_SUBPIX_ORDER_YUV420P) ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_GRAY8;
 	    break;
 	  default:
 	    Panic("Unexpected colours: %d",colours);
@@ -245,6 +246,13 @@ void VideoStream::SetupCodec( int colours, int subpixelorder, int width, int hei
 		/* emit one intra frame every second */
 		codec_context->gop_size = frame_rate;
 
+		/* let the encoder use as many threads as it can, with frame threading
+		   each one adds a frame of lag that the streaming thread drains */
+		codec_context->thread_count = 0;
+#if LIBAVCODEC_VERSION_CHECK(52, 112, 0, 112, 0)
+		codec_context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+#endif
+
 		// some formats want stream headers to be separate
 		if ( of->flags & AVFMT_GLOBALHEADER )
 #if LIBAVCODEC_VERSION_CHECK(56, 35, 0, 64, 0)
@@ -335,40 +343,8 @@ bool VideoStream::OpenStream( ) {
       codec_context->width, codec_context->height );
 #endif
 
-    /* if the output format is not identical to the input format, then a temporary
-       picture is needed too. It is then converted to the required
-       output format */
-    tmp_opicture = nullptr;
-    if ( codec_context->pix_fmt != pf ) {
-#if LIBAVCODEC_VERSION_CHECK(55, 28, 1, 45, 101)
-			tmp_opicture = av_frame_alloc( );
-#else
-			tmp_opicture = avcodec_alloc_frame( );
-#endif
-      if ( !tmp_opicture ) {
-        Error( "Could not allocate tmp_opicture" );
-        return false;
-      }
-#if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
-      int size = av_image_get_buffer_size( pf, codec_context->width, codec_context->height,1 );
-#else
-      int size = avpicture_get_size( pf, codec_context->width, codec_context->height );
-#endif
-      uint8_t *tmp_opicture_buf = (uint8_t *)av_malloc( size );
-      if ( !tmp_opicture_buf ) {
-        av_frame_free( &tmp_opicture );
-        Error( "Could not allocate tmp_opicture_buf" );
-        return false;
-      }
-#if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
-      av_image_fill_arrays(tmp_opicture->data,
-        tmp_opicture->linesize, tmp_opicture_buf, pf,
-        codec_context->width, codec_context->height, 1);
-#else
-      avpicture_fill( (AVPicture *)tmp_opicture,
-        tmp_opicture_buf, pf, codec_context->width, codec_context->height );
-#endif
-    }
+    /* if the output format is not identical to the input format, frames
+       are converted into opicture straight from the slot they were put in */
   } // end if ost
 
   /* open the output file, if needed */
@@ -431,20 +407,30 @@ VideoStream::VideoStream( const char *in_filename, const char *in_format, int bi
 		filename(in_filename),
 		format(in_format),
     opicture(nullptr),
-    tmp_opicture(nullptr),
+#ifdef HAVE_LIBSWSCALE
+    img_convert_ctx(nullptr),
+#endif // HAVE_LIBSWSCALE
     video_outbuf(nullptr),
     video_outbuf_size(0),
 		last_pts( -1 ),
+    write_slot(0),
+    encode_slot(1),
+    ready_slot(2),
 		streaming_thread(0),
 		do_streaming(true),
-    add_timestamp(false),
-    timestamp(0),
-		buffer_copy(nullptr),
-		buffer_copy_lock(new pthread_mutex_t),
-		buffer_copy_size(0),
-		buffer_copy_used(0),
-    packet_index(0)
+    frames_in(0),
+    packets_out(0),
+    frames_skipped(0),
+    ticks_missed(0)
 {
+  for ( int i = 0; i < 3; i++ ) {
+    frame_slots[i].buffer = nullptr;
+    frame_slots[i].size = 0;
+    frame_slots[i].used = 0;
+    frame_slots[i].add_timestamp = false;
+    frame_slots[i].timestamp = 0;
+  }
+
 	if ( !initialised ) {
 		Initialise( );
 	}
@@ -466,18 +452,6 @@ VideoStream::VideoStream( const char *in_filename, const char *in_format, int bi
 	SetupFormat( );
 	SetupCodec( colours, subpixelorder, width, height, bitrate, frame_rate );
 	SetParameters( );
-    
-  // Allocate buffered packets.
-  packet_buffers = new AVPacket*[2];
-  packet_buffers[0] = new AVPacket();
-  packet_buffers[1] = new AVPacket();
-  packet_index = 0;
-	
-	// Initialize mutex used by streaming thread.
-	if ( pthread_mutex_init( buffer_copy_lock, nullptr ) != 0 ) {
-		Fatal("pthread_mutex_init failed");
-	}
-
 }
 
 VideoStream::~VideoStream( ) {
@@ -493,32 +467,27 @@ VideoStream::~VideoStream( ) {
 		// Wait for thread to exit.
 		pthread_join(streaming_thread, &thread_exit_code);
 	}
+	if ( ost ) {
+		Flush();
+	}
+	Debug( 1, "Encoded %" PRId64 " frames into %" PRId64 " packets, %u frames were replaced before being encoded, %u frame intervals were missed",
+	    frames_in, packets_out, frames_skipped.load(), ticks_missed );
 	
-	if ( buffer_copy != nullptr ) {
-		av_free( buffer_copy );
+	for ( int i = 0; i < 3; i++ ) {
+		av_free( frame_slots[i].buffer );
 	}
-    
-	if ( buffer_copy_lock ) {
-		if ( pthread_mutex_destroy( buffer_copy_lock ) != 0 ) {
-			Error( "pthread_mutex_destroy failed" );
-		}
-		delete buffer_copy_lock;
+#ifdef HAVE_LIBSWSCALE
+	if ( img_convert_ctx ) {
+		sws_freeContext( img_convert_ctx );
 	}
-    
-  if (packet_buffers) {
-    delete packet_buffers[0];
-    delete packet_buffers[1];
-    delete[] packet_buffers;
-  }
+#endif // HAVE_LIBSWSCALE
 	
 	/* close each codec */
 	if ( ost ) {
 		avcodec_close( codec_context );
-		av_free( opicture->data[0] );
-		av_frame_free( &opicture );
-		if ( tmp_opicture ) {
-			av_free( tmp_opicture->data[0] );
-			av_frame_free( &tmp_opicture );
+		if ( opicture ) {
+			av_free( opicture->data[0] );
+			av_frame_free( &opicture );
 		}
 		av_free( video_outbuf );
 	}
@@ -550,33 +519,43 @@ VideoStream::~VideoStream( ) {
 }
 
 double VideoStream::EncodeFrame( const uint8_t *buffer, int buffer_size, bool _add_timestamp, unsigned int _timestamp ) {
-	if ( pthread_mutex_lock(buffer_copy_lock) != 0 ) {
-		Fatal( "EncodeFrame: pthread_mutex_lock failed." );
+	// Frames are laid out with the codec's size, anything else would come out sheared
+#if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
+	int expected_size = av_image_get_buffer_size( pf, codec_context->width, codec_context->height, 1 );
+#else
+	int expected_size = avpicture_get_size( pf, codec_context->width, codec_context->height );
+#endif
+	if ( buffer_size != expected_size ) {
+		Error( "Frame of %d bytes doesn't match the %dx%d stream, expected %d bytes",
+		    buffer_size, codec_context->width, codec_context->height, expected_size );
+		return 0;
 	}
-	
-	if (buffer_copy_size < buffer_size) {
-		if ( buffer_copy ) {
-			av_free(buffer_copy);
-		}
-		
+
+	FrameSlot *slot = &frame_slots[write_slot];
+	if ( slot->size < buffer_size ) {
+		av_free( slot->buffer );
+		slot->used = 0;
 		// Allocate a buffer to store source images for the streaming thread to encode.
-		buffer_copy = (uint8_t *)av_malloc(buffer_size);
-		if ( !buffer_copy ) {
-			Error( "Could not allocate buffer_copy" );
-      pthread_mutex_unlock(buffer_copy_lock);
-      return 0;
+		slot->buffer = (uint8_t *)av_malloc(buffer_size);
+		if ( !slot->buffer ) {
+			slot->size = 0;
+			Error( "Could not allocate frame slot" );
+			return 0;
 		}
-		buffer_copy_size = buffer_size;
+		slot->size = buffer_size;
 	}
 	
-	add_timestamp = _add_timestamp;
-	timestamp = _timestamp;
-	buffer_copy_used = buffer_size;
-	memcpy(buffer_copy, buffer, buffer_size);
+	slot->add_timestamp = _add_timestamp;
+	slot->timestamp = _timestamp;
+	slot->used = buffer_size;
+	memcpy(slot->buffer, buffer, buffer_size);
 	
-	if ( pthread_mutex_unlock(buffer_copy_lock) != 0 ) {
-		Fatal( "EncodeFrame: pthread_mutex_unlock failed." );
+	// Hand it over, taking back whichever slot was waiting before
+	int previous = ready_slot.exchange(write_slot | SLOT_FRESH, std::memory_order_acq_rel);
+	if ( previous & SLOT_FRESH ) {
+		frames_skipped++;
 	}
+	write_slot = previous & ~SLOT_FRESH;
 	
 	if ( streaming_thread == 0 ) {
 		Debug( 1, "Starting streaming thread" );
@@ -588,25 +567,29 @@ double VideoStream::EncodeFrame( const uint8_t *buffer, int buffer_size, bool _a
 		}
 	}
 	
-	//return ActuallyEncodeFrame( buffer, buffer_size, add_timestamp, timestamp);
-	
 	return _timestamp;
 }
 
-double VideoStream::ActuallyEncodeFrame( const uint8_t *buffer, int buffer_size, bool add_timestamp, unsigned int timestamp ) {
+double VideoStream::ActuallyEncodeFrame( const uint8_t *buffer, int buffer_size, int64_t pts, bool add_timestamp, unsigned int timestamp ) {
 
 	if ( codec_context->pix_fmt != pf ) {
 #ifdef HAVE_LIBSWSCALE
-	static struct SwsContext *img_convert_ctx = nullptr;
-#endif // HAVE_LIBSWSCALE
-		memcpy( tmp_opicture->data[0], buffer, buffer_size );
-#ifdef HAVE_LIBSWSCALE
+#if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
+		uint8_t *src_data[4];
+		int src_linesize[4];
+		av_image_fill_arrays( src_data, src_linesize, buffer, pf, codec_context->width, codec_context->height, 1 );
+#else
+		AVPicture src_picture;
+		avpicture_fill( &src_picture, (uint8_t *)buffer, pf, codec_context->width, codec_context->height );
+		uint8_t **src_data = src_picture.data;
+		int *src_linesize = src_picture.linesize;
+#endif
 		if ( !img_convert_ctx ) {
 			img_convert_ctx = sws_getCachedContext( nullptr, codec_context->width, codec_context->height, pf, codec_context->width, codec_context->height, codec_context->pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr );
 			if ( !img_convert_ctx )
 				Panic( "Unable to initialise image scaling context" );
 		}
-		sws_scale( img_convert_ctx, tmp_opicture->data, tmp_opicture->linesize, 0, codec_context->height, opicture->data, opicture->linesize );
+		sws_scale( img_convert_ctx, src_data, src_linesize, 0, codec_context->height, opicture->data, opicture->linesize );
 #else // HAVE_LIBSWSCALE
 		Fatal( "swscale is required for MPEG mode" );
 #endif // HAVE_LIBSWSCALE
@@ -615,9 +598,10 @@ double VideoStream::ActuallyEncodeFrame( const uint8_t *buffer, int buffer_size,
 	}
 	AVFrame *opicture_ptr = opicture;
 	
-	AVPacket *pkt = packet_buffers[packet_index];
-	av_init_packet( pkt );
-  int got_packet = 0;
+	AVPacket pkt;
+	av_init_packet( &pkt );
+	pkt.data = nullptr;
+	pkt.size = 0;
 #if LIBAVFORMAT_VERSION_CHECK(57, 0, 0, 0, 0)
     if (codec_context->codec_type == AVMEDIA_TYPE_VIDEO &&
        codec_context->codec_id == AV_CODEC_ID_RAWVIDEO) {
@@ -626,68 +610,126 @@ double VideoStream::ActuallyEncodeFrame( const uint8_t *buffer, int buffer_size,
 #endif
 
 #if LIBAVCODEC_VERSION_CHECK(52, 30, 2, 30, 2)
-		pkt->flags |= AV_PKT_FLAG_KEY;
+		pkt.flags |= AV_PKT_FLAG_KEY;
 #else
-		pkt->flags |= PKT_FLAG_KEY;
+		pkt.flags |= PKT_FLAG_KEY;
 #endif
-		pkt->stream_index = ost->index;
-		pkt->data = (uint8_t *)opicture_ptr;
-		pkt->size = sizeof (AVPicture);
-    got_packet = 1;
+		pkt.data = (uint8_t *)opicture_ptr;
+		pkt.size = sizeof (AVPicture);
+		frames_in++;
+		SendPacket( &pkt );
+		packets_out++;
 	} else {
-		opicture_ptr->pts = codec_context->frame_number;
+		opicture_ptr->pts = pts;
 		opicture_ptr->quality = codec_context->global_quality;
 
 #if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
-      avcodec_send_frame(codec_context, opicture_ptr);
-      int ret = avcodec_receive_packet(codec_context, pkt);
-      if ( ret < 0 ) {
-        if ( AVERROR_EOF != ret ) {
-          Error("ERror encoding video (%d) (%s)", ret,
-                av_err2str(ret));
-        }
-      } else {
-        got_packet = 1;
-      }
+		// The encoder makes its own reference, opicture can be reused straight away
+		int ret = avcodec_send_frame( codec_context, opicture_ptr );
+		if ( ret < 0 ) {
+			Error( "Error sending frame to encoder (%d) (%s)", ret, av_err2str(ret) );
+		} else {
+			frames_in++;
+		}
+		ReceivePackets();
 #else
-
+		int got_packet = 0;
 #if LIBAVFORMAT_VERSION_CHECK(54, 1, 0, 2, 100)
-		int ret = avcodec_encode_video2( codec_context, pkt, opicture_ptr, &got_packet );
+		int ret = avcodec_encode_video2( codec_context, &pkt, opicture_ptr, &got_packet );
 		if ( ret != 0 ) {
 			Fatal( "avcodec_encode_video2 failed with errorcode %d \"%s\"", ret, av_err2str( ret ) );
 		}
 #else
 		int out_size = avcodec_encode_video( codec_context, video_outbuf, video_outbuf_size, opicture_ptr );
 		got_packet = out_size > 0 ? 1 : 0;
-		pkt->data = got_packet ? video_outbuf : nullptr;
-		pkt->size = got_packet ? out_size : 0;
+		pkt.data = got_packet ? video_outbuf : nullptr;
+		pkt.size = got_packet ? out_size : 0;
 #endif
+		frames_in++;
+		if ( got_packet ) {
+			SendPacket( &pkt );
+			packets_out++;
+		}
+#endif
+	}
+	
+	return ( opicture_ptr->pts);
+}
+
+// Writes out whatever packets the encoder has finished, there can be several
+// or none for each frame sent to it when it is running frame threads.
+int VideoStream::ReceivePackets() {
+	int count = 0;
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+	AVPacket pkt;
+	av_init_packet( &pkt );
+	pkt.data = nullptr;
+	pkt.size = 0;
+	int ret;
+	while ( (ret = avcodec_receive_packet( codec_context, &pkt )) == 0 ) {
+		SendPacket( &pkt );
+		count++;
+	}
+	if ( (ret != AVERROR(EAGAIN)) && (ret != AVERROR_EOF) ) {
+		Error( "Error encoding video (%d) (%s)", ret, av_err2str(ret) );
+	}
+	packets_out += count;
+#endif
+	return count;
+}
+
+// Gets back the frames the encoder is still holding on to, once nothing more
+// is going to be encoded.
+void VideoStream::Flush() {
+	if ( !frames_in )
+		return;
+#if LIBAVFORMAT_VERSION_CHECK(57, 0, 0, 0, 0)
+	if ( codec_context->codec_id == AV_CODEC_ID_RAWVIDEO )
+		return;
+#else
+	if ( of->flags & AVFMT_RAWPICTURE )
+		return;
+#endif
+
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+	int ret = avcodec_send_frame( codec_context, nullptr );
+	if ( ret < 0 ) {
+		Error( "Error flushing encoder (%d) (%s)", ret, av_err2str(ret) );
+		return;
+	}
+	ReceivePackets();
+#elif LIBAVFORMAT_VERSION_CHECK(54, 1, 0, 2, 100)
+	if ( !(codec_context->codec->capabilities & CODEC_CAP_DELAY) )
+		return;
+	int got_packet;
+	do {
+		AVPacket pkt;
+		av_init_packet( &pkt );
+		pkt.data = nullptr;
+		pkt.size = 0;
+		got_packet = 0;
+		int ret = avcodec_encode_video2( codec_context, &pkt, nullptr, &got_packet );
+		if ( ret < 0 ) {
+			Error( "Error flushing encoder (%d) (%s)", ret, av_err2str(ret) );
+			break;
+		}
+		if ( got_packet ) {
+			SendPacket( &pkt );
+			packets_out++;
+		}
+	} while ( got_packet );
 #endif
-    if ( got_packet ) {
-//      if ( c->coded_frame->key_frame )
-//      {
-//#if LIBAVCODEC_VERSION_CHECK(52, 30, 2, 30, 2)
-//        pkt->flags |= AV_PKT_FLAG_KEY;
-//#else
-//        pkt->flags |= PKT_FLAG_KEY;
-//#endif
-//      }
-
-      if ( pkt->pts != (int64_t)AV_NOPTS_VALUE ) {
-        pkt->pts = av_rescale_q( pkt->pts, codec_context->time_base, ost->time_base );
-      }
-      if ( pkt->dts != (int64_t)AV_NOPTS_VALUE ) {
-        pkt->dts = av_rescale_q( pkt->dts, codec_context->time_base, ost->time_base );
-      }
-      pkt->duration = av_rescale_q( pkt->duration, codec_context->time_base, ost->time_base );
-      pkt->stream_index = ost->index;
-    }
-  }
-  
-  return ( opicture_ptr->pts);
 }
 
 int VideoStream::SendPacket(AVPacket *packet) {
+    if ( packet->pts != (int64_t)AV_NOPTS_VALUE ) {
+        packet->pts = av_rescale_q( packet->pts, codec_context->time_base, ost->time_base );
+    }
+    if ( packet->dts != (int64_t)AV_NOPTS_VALUE ) {
+        packet->dts = av_rescale_q( packet->dts, codec_context->time_base, ost->time_base );
+    }
+    packet->duration = av_rescale_q( packet->duration, codec_context->time_base, ost->time_base );
+    packet->stream_index = ost->index;
     
     int ret = av_write_frame( ofc, packet );
     if ( ret != 0 ) {
@@ -711,12 +753,13 @@ void *VideoStream::StreamingThreadCallback(void *ctx){
 
 	const uint64_t nanosecond_multiplier = 1000000000;
 
-#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
-	uint64_t target_interval_ns = nanosecond_multiplier * ( ((double)videoStream->codec_context->time_base.num) / (videoStream->codec_context->time_base.den) );
-#else
 	uint64_t target_interval_ns = nanosecond_multiplier * ( ((double)videoStream->codec_context->time_base.num) / (videoStream->codec_context->time_base.den) );
-#endif
-	uint64_t frame_count = 0;
+	// Frames are stamped with the interval they are encoded in, so that when
+	// the encoder can't keep up the video still plays in real time
+	int64_t tick = 0;
+	int64_t report_ticks = videoStream->codec_context->time_base.den * 10;
+	int64_t next_report_tick = report_ticks;
+	bool behind = false;
 	timespec start_time;
 	clock_gettime(CLOCK_MONOTONIC, &start_time);
 	uint64_t start_time_ns = (start_time.tv_sec*nanosecond_multiplier) + start_time.tv_nsec;
@@ -724,45 +767,40 @@ void *VideoStream::StreamingThreadCallback(void *ctx){
 		timespec current_time;
 		clock_gettime(CLOCK_MONOTONIC, &current_time);
 		uint64_t current_time_ns = (current_time.tv_sec*nanosecond_multiplier) + current_time.tv_nsec;
-		uint64_t target_ns = start_time_ns + (target_interval_ns * frame_count);
+		uint64_t target_ns = start_time_ns + (target_interval_ns * tick);
 		
 		if ( current_time_ns < target_ns ) {
 			// It's not time to render a frame yet.
 			usleep( (target_ns - current_time_ns) * 0.001 );
+		} else if ( current_time_ns - target_ns >= 2*target_interval_ns ) {
+			// Don't try to catch up on intervals that have already gone by
+			unsigned int missed = (current_time_ns - target_ns) / target_interval_ns;
+			if ( !behind ) {
+				Warning( "Encoder can't keep up with %d fps, missed %u frame intervals",
+				    videoStream->codec_context->time_base.den, missed );
+				behind = true;
+			}
+			videoStream->ticks_missed += missed;
+			tick += missed;
 		}
 
-    // By sending the last rendered frame we deliver frames to the client more accurate.
-    // If we're encoding the frame before sending it there will be lag.
-    // Since this lag is not constant the client may skip frames.
-
-    // Get the last rendered packet.
-    AVPacket *packet = videoStream->packet_buffers[videoStream->packet_index];
-    if (packet->size) {
-      videoStream->SendPacket(packet);
-    }
-#if LIBAVCODEC_VERSION_CHECK(57, 8, 0, 12, 100)
-    av_packet_unref( packet);
-#else
-    av_free_packet( packet );
-#endif
-    videoStream->packet_index = videoStream->packet_index ? 0 : 1;
-
-    // Lock buffer and render next frame.
-        
-		if ( pthread_mutex_lock( videoStream->buffer_copy_lock ) != 0 ) {
-			Fatal( "StreamingThreadCallback: pthread_mutex_lock failed." );
+		// Take the newest frame if there is one, otherwise encode the last one again
+		if ( videoStream->ready_slot.load(std::memory_order_acquire) & SLOT_FRESH ) {
+			int ready = videoStream->ready_slot.exchange(videoStream->encode_slot, std::memory_order_acq_rel);
+			videoStream->encode_slot = ready & ~SLOT_FRESH;
 		}
-		
-		if ( videoStream->buffer_copy ) {
-			// Encode next frame.
-			videoStream->ActuallyEncodeFrame( videoStream->buffer_copy, videoStream->buffer_copy_used, videoStream->add_timestamp, videoStream->timestamp );
+		FrameSlot *slot = &videoStream->frame_slots[videoStream->encode_slot];
+		if ( slot->used ) {
+			videoStream->ActuallyEncodeFrame( slot->buffer, slot->used, tick, slot->add_timestamp, slot->timestamp );
 		}
-	
-		if ( pthread_mutex_unlock( videoStream->buffer_copy_lock ) != 0 ) {
-			Fatal( "StreamingThreadCallback: pthread_mutex_unlock failed." );
+		tick++;
+
+		// Skipped intervals can jump right over a multiple, so count on from the last report
+		if ( report_ticks && (tick >= next_report_tick) ) {
+			Debug( 1, "Encoder lag %" PRId64 " frames, %u frames replaced before being encoded, %u frame intervals missed",
+			    videoStream->frames_in - videoStream->packets_out, videoStream->frames_skipped.load(), videoStream->ticks_missed );
+			next_report_tick = tick + report_ticks;
 		}
-		
-		frame_count++;
 	}
 	
 	return nullptr;
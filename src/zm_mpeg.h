@@ -22,6 +22,8 @@
 
 #include "zm_ffmpeg.h"
 
+#include <atomic>
+
 #if HAVE_LIBAVCODEC
 
 class VideoStream {
@@ -47,22 +49,39 @@ protected:
   AVCodecContext *codec_context;
   AVCodec *codec;
   AVFrame *opicture;
-  AVFrame *tmp_opicture;
+#ifdef HAVE_LIBSWSCALE
+  struct SwsContext *img_convert_ctx;
+#endif // HAVE_LIBSWSCALE
   uint8_t *video_outbuf;
   int video_outbuf_size;
   double last_pts;
 
+  // Frames are handed to the streaming thread through three slots, so that
+  // neither side ever waits for the other. EncodeFrame fills write_slot and
+  // swaps it with ready_slot, the streaming thread swaps encode_slot with
+  // ready_slot whenever that holds a frame it hasn't seen.
+  struct FrameSlot {
+    uint8_t *buffer;
+    int size;
+    int used;
+    bool add_timestamp;
+    unsigned int timestamp;
+  };
+  enum { SLOT_FRESH=4 };
+  FrameSlot frame_slots[3];
+  int write_slot;
+  int encode_slot;
+  std::atomic<int> ready_slot;    // With SLOT_FRESH set until the streaming thread takes it
+
   pthread_t streaming_thread;
-  bool do_streaming;
-  bool add_timestamp;
-  unsigned int timestamp;
-  uint8_t *buffer_copy;
-  pthread_mutex_t *buffer_copy_lock;
-  int buffer_copy_size;
-  int buffer_copy_used;
-  AVPacket** packet_buffers;
-  int packet_index;
+  std::atomic<bool> do_streaming;
+  int64_t frames_in;               // Given to the encoder
+  int64_t packets_out;             // Got back from it
+  std::atomic<unsigned int> frames_skipped;   // Replaced before they could be encoded
+  unsigned int ticks_missed;       // Frame intervals the encoder couldn't keep up with
   int SendPacket(AVPacket *packet);
+  int ReceivePackets();
+  void Flush();
   static void* StreamingThreadCallback(void *ctx);
 
 protected:
@@ -72,7 +91,7 @@ protected:
   void SetupCodec( int colours, int subpixelorder, int width, int height, int bitrate, double frame_rate );
   void SetParameters();
   void ActuallyOpenStream();
-  double ActuallyEncodeFrame( const uint8_t *buffer, int buffer_size, bool add_timestamp=false, unsigned int timestamp=0 );
+  double ActuallyEncodeFrame( const uint8_t *buffer, int buffer_size, int64_t pts, bool add_timestamp=false, unsigned int timestamp=0 );
 
 public:
   VideoStream( const char *filename, const char *format, int bitrate, double frame_rate, int colours, int subpixelorder, int width, int height );
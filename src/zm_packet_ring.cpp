@@ -0,0 +1,160 @@
+//ZoneMinder Packet Ring Implementation Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "zm_packet_ring.h"
+
+#include <string.h>
+
+#include "zm.h"
+
+size_t PacketRing::SharedSize(int p_slot_count, uint64_t p_data_size) {
+  if ( !p_slot_count )
+    return 0;
+  return sizeof(Header) + (p_slot_count*sizeof(Slot)) + p_data_size;
+}
+
+PacketRing::PacketRing(uint8_t *mem, int p_slot_count, uint64_t p_data_size) :
+  slot_count(p_slot_count),
+  data_size(p_data_size)
+{
+  header = (Header *)mem;
+  slots = (Slot *)(mem + sizeof(Header));
+  data = (uint8_t *)slots + (slot_count*sizeof(Slot));
+}
+
+// Called by zmc once the shared memory has been cleared
+void PacketRing::Initialise() {
+  if ( !slot_count )
+    return;
+  header->size = sizeof(Header);
+  header->slot_count = slot_count;
+  header->data_size = data_size;
+  header->last_sequence.store(0);
+  header->last_keyframe.store(0);
+  header->write_end.store(0);
+  header->generation.store(0);
+}
+
+uint32_t PacketRing::GetCodec(CodecInfo *codec) const {
+  if ( !slot_count )
+    return 0;
+  uint32_t generation = header->generation.load(std::memory_order_acquire);
+  if ( !generation )
+    return 0;
+  *codec = header->codec;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return (header->generation.load() == generation) ? generation : 0;
+}
+
+bool PacketRing::Fetch(uint64_t sequence, uint8_t *buffer, PacketInfo *info) const {
+  if ( !slot_count || !sequence )
+    return false;
+
+  const Slot *slot = &slots[sequence % slot_count];
+  if ( slot->sequence.load(std::memory_order_acquire) != sequence )
+    return false;
+  uint64_t offset = slot->offset;
+  PacketInfo slot_info = slot->info;
+  if ( (slot_info.size > MaxPacketSize()) || ((offset % data_size) + slot_info.size > data_size) )
+    return false;
+  memcpy(buffer, data + (offset % data_size), slot_info.size);
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  // Replaced, or written over, while it was being copied
+  if ( slot->sequence.load() != sequence )
+    return false;
+  if ( header->write_end.load() > offset + data_size )
+    return false;
+
+  *info = slot_info;
+  return true;
+}
+
+#if HAVE_LIBAVCODEC
+// Republishes the codec parameters if the camera has been reopened with different ones
+bool PacketRing::updateCodec(const AVStream *stream) {
+  CodecInfo codec;
+  memset(&codec, 0, sizeof(codec));
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+  const AVCodecParameters *parameters = stream->codecpar;
+#else
+  const AVCodecContext *parameters = stream->codec;
+#endif
+  if ( parameters->extradata_size > MAX_EXTRADATA ) {
+    Error("Codec extradata of %d bytes is too big to share with viewers", parameters->extradata_size);
+    return false;
+  }
+  codec.codec_id = parameters->codec_id;
+  codec.width = parameters->width;
+  codec.height = parameters->height;
+  codec.time_base_num = stream->time_base.num;
+  codec.time_base_den = stream->time_base.den;
+  codec.extradata_size = parameters->extradata_size;
+  if ( codec.extradata_size )
+    memcpy(codec.extradata, parameters->extradata, codec.extradata_size);
+
+  uint32_t generation = header->generation.load();
+  if ( generation && !memcmp(&codec, &header->codec, sizeof(codec)) )
+    return true;
+
+  Debug(1, "Sharing codec %d %dx%d with viewers", codec.codec_id, codec.width, codec.height);
+  header->generation.store(0);
+  // Nothing from before can be decoded with the new parameters
+  header->last_keyframe.store(0);
+  std::atomic_thread_fence(std::memory_order_release);
+  header->codec = codec;
+  header->generation.store((generation+1) ? generation+1 : 1, std::memory_order_release);
+  return true;
+}
+
+bool PacketRing::Store(const AVPacket *packet, const AVStream *stream, const struct timeval &timestamp) {
+  if ( !slot_count || !updateCodec(stream) )
+    return false;
+  unsigned int size = packet->size;
+  if ( size > MaxPacketSize() ) {
+    Debug(1, "Packet of %d bytes is too big for the packet ring", size);
+    return false;
+  }
+
+  uint64_t sequence = header->last_sequence.load() + 1;
+  uint64_t offset = header->write_end.load();
+  // Packets are not split across the end of the data ring
+  if ( (offset % data_size) + size > data_size )
+    offset += data_size - (offset % data_size);
+
+  Slot *slot = &slots[sequence % slot_count];
+  slot->sequence.store(0);
+  // Readers of whatever is about to be written over see this before any of it changes
+  header->write_end.store(offset + size);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  memcpy(data + (offset % data_size), packet->data, size);
+  slot->offset = offset;
+  slot->info.size = size;
+  slot->info.flags = packet->flags;
+  slot->info.pts = packet->pts;
+  slot->info.dts = packet->dts;
+  slot->info.timestamp = timestamp;
+  slot->sequence.store(sequence, std::memory_order_release);
+
+  header->last_sequence.store(sequence);
+  if ( packet->flags & AV_PKT_FLAG_KEY )
+    header->last_keyframe.store(sequence);
+  return true;
+}
+#endif // HAVE_LIBAVCODEC
@@ -0,0 +1,115 @@
+//ZoneMinder Packet Ring Interface Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef ZM_PACKET_RING_H
+#define ZM_PACKET_RING_H
+
+#include <sys/time.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+#include "zm_ffmpeg.h"
+
+//
+// The compressed video packets of a passthrough monitor, as zmc reads them
+// from the camera, kept in a ring in the monitor's shared memory so that zms
+// can stream them live without decoding or encoding anything. The codec
+// parameters a viewer needs to set up its muxer are kept alongside, with a
+// generation that changes whenever the camera is reopened. Packets are
+// addressed by sequence number, counting from 1, and can be read for as long
+// as nothing newer has been written over them. Readers check that after
+// copying rather than taking any lock, as with the compressed image tier.
+//
+class PacketRing {
+  public:
+    enum { MAX_EXTRADATA=1024 };
+
+    struct CodecInfo {
+      int32_t codec_id;
+      int32_t width;
+      int32_t height;
+      int32_t time_base_num;
+      int32_t time_base_den;
+      uint32_t extradata_size;
+      uint8_t extradata[MAX_EXTRADATA];
+    };
+    struct PacketInfo {
+      uint32_t size;
+      uint32_t flags;
+      int64_t pts;
+      int64_t dts;
+      struct timeval timestamp;
+    };
+
+  private:
+    struct Header {
+      uint32_t size;
+      uint32_t slot_count;
+      uint64_t data_size;
+      std::atomic<uint64_t> last_sequence;   // Newest packet
+      std::atomic<uint64_t> last_keyframe;   // Newest keyframe, where viewers start from
+      std::atomic<uint64_t> write_end;       // Data ring position up to which anything may have been written over
+      std::atomic<uint32_t> generation;      // Of the codec parameters, 0 while they are being changed
+      uint32_t padding;
+      CodecInfo codec;
+    };
+    struct Slot {
+      std::atomic<uint64_t> sequence;        // 0 while the slot is being replaced
+      uint64_t offset;                       // Position in the data ring, counting from when zmc started
+      PacketInfo info;
+    };
+
+    int slot_count;
+    uint64_t data_size;
+
+    Header *header;
+    Slot *slots;
+    uint8_t *data;
+
+#if HAVE_LIBAVCODEC
+    bool updateCodec(const AVStream *stream);
+#endif // HAVE_LIBAVCODEC
+
+  public:
+    static size_t SharedSize(int p_slot_count, uint64_t p_data_size);
+
+    PacketRing(uint8_t *mem, int p_slot_count, uint64_t p_data_size);
+
+    void Initialise();
+    bool Enabled() const { return slot_count > 0; }
+
+#if HAVE_LIBAVCODEC
+    // Called by zmc for every video packet
+    bool Store(const AVPacket *packet, const AVStream *stream, const struct timeval &timestamp);
+#endif // HAVE_LIBAVCODEC
+
+    uint64_t LastSequence() const { return header->last_sequence.load(); }
+    uint64_t LastKeyframe() const { return header->last_keyframe.load(); }
+    uint32_t Generation() const { return header->generation.load(); }
+    // Returns the generation of the codec parameters copied, 0 if there are none yet
+    uint32_t GetCodec(CodecInfo *codec) const;
+    // Copies a packet into buffer, which should be able to take MaxPacketSize() bytes.
+    // Returns false if it is no longer there.
+    bool Fetch(uint64_t sequence, uint8_t *buffer, PacketInfo *info) const;
+    // Anything bigger would leave too little of the ring for the rest of its GOP
+    uint64_t MaxPacketSize() const { return data_size/4; }
+};
+
+#endif // ZM_PACKET_RING_H
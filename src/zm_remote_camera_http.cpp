@@ -74,6 +74,7 @@ RemoteCameraHttp::RemoteCameraHttp(
     p_record_audio )
 {
   sd = -1;
+  scan_offset = 0;
 
   timeout.tv_sec = 0;
   timeout.tv_usec = 0;
@@ -122,6 +123,7 @@ void RemoteCameraHttp::Initialise() {
   mode = SINGLE_IMAGE;
   format = UNDEF;
   state = HEADER;
+  scan_offset = 0;
 
 #if HAVE_LIBPCRE
     if ( method == REGEXP ) {
@@ -190,17 +192,15 @@ int RemoteCameraHttp::SendRequest() {
   }
   format = UNDEF;
   state = HEADER;
+  scan_offset = 0;
   Debug(3, "Request sent");
   return 0;
 }
 
-/* Return codes are as follows:
- * -1 means there was an error
- * 0 means no bytes were returned but there wasn't actually an error.
- * > 0 is the # of bytes read.
+/* Waits up to the timeout for the socket to become readable. Returns 1 when
+ * it is, 0 on a timeout and -1 on an error, as ReadData does.
  */
-
-int RemoteCameraHttp::ReadData( Buffer &buffer, unsigned int bytes_expected ) {
+int RemoteCameraHttp::WaitForData() {
   fd_set rfds;
   FD_ZERO(&rfds);
   FD_SET(sd, &rfds);
@@ -226,46 +226,43 @@ int RemoteCameraHttp::ReadData( Buffer &buffer, unsigned int bytes_expected ) {
     Error("Select error: %s", strerror(errno));
     return -1;
   }
+  return 1;
+}
 
-  unsigned int total_bytes_to_read = 0;
-
-  if ( bytes_expected ) {
-    total_bytes_to_read = bytes_expected;
-  } else {
-    if ( ioctl( sd, FIONREAD, &total_bytes_to_read ) < 0 ) {
-      Error( "Can't ioctl(): %s", strerror(errno) );
-      return -1;
-    }
+/* Return codes are as follows:
+ * -1 means there was an error
+ * 0 means no bytes were returned but there wasn't actually an error.
+ * > 0 is the # of bytes read.
+ */
 
-    if ( total_bytes_to_read == 0 ) {
-      if ( mode == SINGLE_IMAGE ) {
-        int error = 0;
-        socklen_t len = sizeof (error);
-        int retval = getsockopt( sd, SOL_SOCKET, SO_ERROR, &error, &len );
-        if ( retval != 0 ) {
-          Debug( 1, "error getting socket error code %s", strerror(retval) );
-        }
-        if ( error != 0 ) {
-          return -1;
-        }
-        // Case where we are grabbing a single jpg, but no content-length was given, so the expectation is that we read until close.
-		    return 0;
+int RemoteCameraHttp::ReadData( Buffer &buffer, unsigned int bytes_expected ) {
+  if ( !bytes_expected ) {
+    // Take whatever is there, up to 32K. There can be lots of bytes available,
+    // I've seen 4MB or more, which would vastly inflate our buffer size unnecessarily.
+    // On a busy stream there is nearly always data queued, so try to take it
+    // before paying for select(), and go back to waiting if it woke us for nothing.
+    while ( true ) {
+      int bytes_read = buffer.recv_into(sd, ZM_NETWORK_BUFSIZ, MSG_DONTWAIT);
+      if ( bytes_read > 0 ) {
+        Debug(3, "Read %d bytes", bytes_read);
+        return bytes_read;
+      } else if ( bytes_read == 0 ) {
+        return ClosedRemotely();
+      } else if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+        Error("Read error: %s", strerror(errno));
+        return -1;
       }
-      // If socket is closed locally, then select will fail, but if it is closed remotely
-      // then we have an exception on our socket.. but no data.
-      Debug(3, "Socket closed remotely");
-      //Disconnect(); // Disconnect is done outside of ReadData now.
-      return -1;
+      int n_found = WaitForData();
+      if ( n_found <= 0 )
+        return n_found;
     }
+  }
 
-    // There can be lots of bytes available.  I've seen 4MB or more. This will vastly inflate our buffer size unnecessarily.
-    if ( total_bytes_to_read > ZM_NETWORK_BUFSIZ ) {
-      total_bytes_to_read = ZM_NETWORK_BUFSIZ;
-      Debug(3, "Just getting 32K" );
-    } else {
-      Debug(3, "Just getting %d", total_bytes_to_read );
-    }
-  } // end if bytes_expected or not
+  int n_found = WaitForData();
+  if ( n_found <= 0 )
+    return n_found;
+
+  unsigned int total_bytes_to_read = bytes_expected;
   Debug( 3, "Expecting %d bytes", total_bytes_to_read );
 
   int total_bytes_read = 0;
@@ -292,6 +289,85 @@ int RemoteCameraHttp::ReadData( Buffer &buffer, unsigned int bytes_expected ) {
   return total_bytes_read;
 }
 
+/* The peer has closed the connection and there is nothing left to read */
+int RemoteCameraHttp::ClosedRemotely() {
+  if ( mode == SINGLE_IMAGE ) {
+    int error = 0;
+    socklen_t len = sizeof (error);
+    int retval = getsockopt( sd, SOL_SOCKET, SO_ERROR, &error, &len );
+    if ( retval != 0 ) {
+      Debug( 1, "error getting socket error code %s", strerror(retval) );
+    }
+    if ( error != 0 ) {
+      return -1;
+    }
+    // Case where we are grabbing a single jpg, but no content-length was given, so the expectation is that we read until close.
+    return 0;
+  }
+  // If socket is closed locally, then select will fail, but if it is closed remotely
+  // then we have an exception on our socket.. but no data.
+  Debug(3, "Socket closed remotely");
+  //Disconnect(); // Disconnect is done outside of ReadData now.
+  return -1;
+}
+
+/* Looks for the blank line that ends a header block, only examining bytes
+ * that have arrived since the last call. scan_offset is relative to the
+ * buffer head and must be reset whenever the head moves.
+ */
+bool RemoteCameraHttp::HaveHeaderEnd() {
+  const char *start = (const char *)buffer;
+  unsigned int size = buffer.size();
+
+  while ( scan_offset < size ) {
+    const char *lf = (const char *)memchr(start+scan_offset, '\n', size-scan_offset);
+    if ( !lf ) {
+      scan_offset = size;
+      return false;
+    }
+    unsigned int pos = lf - start;
+    if ( pos+1 >= size ) {
+      // Need the next byte before we can decide
+      scan_offset = pos;
+      return false;
+    }
+    if ( lf[1] == '\n' ) {
+      scan_offset = pos+1;
+      return true;
+    }
+    if ( lf[1] == '\r' ) {
+      if ( pos+2 >= size ) {
+        scan_offset = pos;
+        return false;
+      }
+      if ( lf[2] == '\n' ) {
+        scan_offset = pos+1;
+        return true;
+      }
+    }
+    scan_offset = pos+1;
+  }
+  return false;
+}
+
+/* Looks for pattern in the bytes that have arrived since the last call, keeping
+ * enough overlap to catch a pattern split across two reads. Returns the offset
+ * of the match from the buffer head, or -1.
+ */
+int RemoteCameraHttp::FindInNewData(const char *pattern, unsigned int pattern_len) {
+  unsigned int size = buffer.size();
+  unsigned int start = scan_offset > pattern_len ? scan_offset - pattern_len + 1 : 0;
+  if ( start >= size )
+    return -1;
+  const char *match = memstr((const char *)buffer+start, pattern, size-start);
+  if ( match ) {
+    scan_offset = match - (const char *)buffer;
+    return scan_offset;
+  }
+  scan_offset = size;
+  return -1;
+}
+
 int RemoteCameraHttp::GetData() {
 	time_t start_time = time(nullptr);
 	int buffer_len = 0;
@@ -332,7 +408,8 @@ int RemoteCameraHttp::GetResponse() {
               return -1;
             }
 						bytes += buffer_len;
-            if ( header_expr->Match( (char*)buffer, buffer.size() ) == 2 ) {
+            // Only run the regexp once the end of the header block has arrived
+            if ( HaveHeaderEnd() && (header_expr->Match( (char*)buffer, buffer.size() ) == 2) ) {
               header = header_expr->MatchString( 1 );
               header_len = header_expr->MatchLength( 1 );
               Debug(4, "Captured header (%d bytes):\n'%s'", header_len, header);
@@ -440,6 +517,7 @@ int RemoteCameraHttp::GetResponse() {
                 return( -1 );
               }
               buffer.consume( header_len );
+              scan_offset = 0;
             }
             else
             {
@@ -460,7 +538,7 @@ int RemoteCameraHttp::GetResponse() {
               snprintf( subheader_pattern, sizeof(subheader_pattern), "^((?:\r?\n){0,2}?(?:--)?%s\r?\n.+?\r?\n\r?\n)", content_boundary );
               subheader_expr = new RegExpr( subheader_pattern, PCRE_DOTALL );
             }
-            if ( subheader_expr->Match( (char *)buffer, (int)buffer ) == 2 )
+            if ( HaveHeaderEnd() && (subheader_expr->Match( (char *)buffer, (int)buffer ) == 2) )
             {
               subheader = subheader_expr->MatchString( 1 );
               subheader_len = subheader_expr->MatchLength( 1 );
@@ -483,6 +561,7 @@ int RemoteCameraHttp::GetResponse() {
               }
 
               buffer.consume( subheader_len );
+              scan_offset = 0;
               state = CONTENT;
             }
             else
@@ -524,6 +603,7 @@ int RemoteCameraHttp::GetResponse() {
               return( -1 );
             }
 
+            scan_offset = 0;
             if ( content_length )
             {
               while ( ((long)buffer.size() < content_length ) && ! zm_terminate )
@@ -558,14 +638,26 @@ int RemoteCameraHttp::GetResponse() {
                     snprintf( content_pattern, sizeof(content_pattern), "^(.+?)(?:\r?\n)*(?:--)?%s\r?\n", content_boundary );
                     content_expr = new RegExpr( content_pattern, PCRE_DOTALL );
                   }
-                  if ( content_expr->Match( buffer, buffer.size() ) == 2 )
+                  unsigned int boundary_len = strlen(content_boundary);
+                  int boundary_offset = FindInNewData(content_boundary, boundary_len);
+                  if ( boundary_offset >= 0 )
                   {
-                    content_length = content_expr->MatchLength( 1 );
-                    Debug( 3, "Got end of image by pattern, content-length = %d", content_length );
+                    if ( content_expr->Match( buffer, buffer.size() ) == 2 )
+                    {
+                      content_length = content_expr->MatchLength( 1 );
+                      Debug( 3, "Got end of image by pattern, content-length = %d", content_length );
+                    }
+                    else if ( buffer.size() >= boundary_offset + boundary_len + 2 )
+                    {
+                      // The pattern has had everything it needs and doesn't end here,
+                      // so search on from past this boundary next time
+                      scan_offset = boundary_offset + boundary_len;
+                    }
                   }
                 }
               }
             }
+            scan_offset = 0;
             if ( mode == SINGLE_IMAGE ) {
               state = HEADER;
               Disconnect();
@@ -992,6 +1084,7 @@ int RemoteCameraHttp::GetResponse() {
               }
             }
 
+            scan_offset = 0;
             if ( content_length ) {
               while ( ( (long)buffer.size() < content_length ) && ! zm_terminate ) {
 								Debug(4, "getting more data");
@@ -1019,8 +1112,10 @@ int RemoteCameraHttp::GetResponse() {
 
                   if ( mode == MULTI_IMAGE ) {
                     // Look for the boundary marker, determine content length using it's position
-                    if ( char *start_ptr = (char *)memstr( (char *)buffer, "\r\n--", buffer_size ) ) {
-                      content_length = start_ptr - (char *)buffer;
+                    // Only the newly read bytes are searched, so this is linear in the image size
+                    int boundary_offset = FindInNewData("\r\n--", 4);
+                    if ( boundary_offset >= 0 ) {
+                      content_length = boundary_offset;
                       Debug( 2, "Got end of image by pattern (crlf--), content-length = %d", content_length );
                     } else {
                       Debug( 2, "Did not find end of image by patten (crlf--) yet, content-length = %d", content_length );
@@ -1046,6 +1141,7 @@ int RemoteCameraHttp::GetResponse() {
               } // end while ! content_length
             } // end if content_length
 
+            scan_offset = 0;
             if ( mode == SINGLE_IMAGE ) {
               state = HEADER;
               Disconnect();
@@ -1077,6 +1173,7 @@ int RemoteCameraHttp::PrimeCapture() {
     }
     mode = SINGLE_IMAGE;
     buffer.clear();
+    scan_offset = 0;
   }
   return 0;
 }
@@ -1089,6 +1186,7 @@ int RemoteCameraHttp::PreCapture() {
     }
     mode = SINGLE_IMAGE;
     buffer.clear();
+    scan_offset = 0;
   }
   if ( mode == SINGLE_IMAGE ) {
     if ( SendRequest() < 0 ) {
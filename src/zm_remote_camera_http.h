@@ -42,6 +42,12 @@ protected:
   enum { UNDEF, JPEG, X_RGB, X_RGBZ } format;
   enum { HEADER, HEADERCONT, SUBHEADER, SUBHEADERCONT, CONTENT } state;
   enum { SIMPLE, REGEXP } method;
+  unsigned int scan_offset; // How far into buffer we have already searched for a delimiter
+
+  int ClosedRemotely();
+  int WaitForData();
+  bool HaveHeaderEnd();
+  int FindInNewData(const char *pattern, unsigned int pattern_len);
 
 public:
   RemoteCameraHttp( unsigned int p_monitor_id, const std::string &method, const std::string &host, const std::string &port, const std::string &path, int p_width, int p_height, int p_colours, int p_brightness, int p_contrast, int p_hue, int p_colour, bool p_capture, bool p_record_audio );
@@ -87,6 +87,11 @@ RemoteCameraRtsp::RemoteCameraRtsp(
   } else if ( colours == ZM_COLOUR_GRAY8 ) {
     subpixelorder = ZM_SUBPIX_ORDER_NONE;
     imagePixFormat = AV_PIX_FMT_GRAY8;
+  } else if ( colours == ZM_COLOUR_YUV420P ) {
+    colours = ZM_COLOUR_GRAY8;
+    subpixelorder = ZM_SUBPIX_ORDER_YUV420P;
+    imagePixFormat = AV_PIX_FMT_YUVJ420P;
+    imagesize = zm_image_buffer_size(width, height, colours, subpixelorder);
   } else {
     Panic("Unexpected colours: %d", colours);
   }
@@ -326,7 +331,14 @@ int RemoteCameraRtsp::Capture( Image &image ) {
       if ( frameComplete ) {
          
         Debug(3, "Got frame %d", frameCount);
-            
+
+        // Decoders mostly produce 4:2:0 already, which only needs copying
+        if ( (subpixelorder == ZM_SUBPIX_ORDER_YUV420P) && zm_copy_yuv420p(mRawFrame, directbuffer, width, height) ) {
+          frameCount++;
+          zm_av_packet_unref(&packet);
+          return 1;
+        }
+
 #if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
         // From what I've read, we should align the linesizes to 32bit so that ffmpeg can use SIMD instructions too.
         int size = av_image_fill_arrays(
@@ -100,6 +100,10 @@ typedef uint32_t Rgb;  // RGB colour type
 #define ZM_COLOUR_RGB24 3
 #define ZM_COLOUR_GRAY8 1
 
+/* Monitor Colours setting for planar YUV 4:2:0, 12 bits per pixel. It is never
+   used as an image's colours, such images are GRAY8 with the YUV420P subpixel order */
+#define ZM_COLOUR_YUV420P 12
+
 /* Subpixel ordering */
 /* Based on byte order naming. For example, for ARGB (on both little endian or big endian) byte+0 should be alpha, byte+1 should be red, and so on. */
 #define ZM_SUBPIX_ORDER_NONE 2
@@ -109,11 +113,22 @@ typedef uint32_t Rgb;  // RGB colour type
 #define ZM_SUBPIX_ORDER_RGBA 8
 #define ZM_SUBPIX_ORDER_ABGR 9
 #define ZM_SUBPIX_ORDER_ARGB 10
+/* Full range (JPEG) YUV 4:2:0, a GRAY8 Y plane followed by the U and V planes at half
+   the width and height. Anything that only looks at the first width*height bytes of a
+   GRAY8 image, such as Delta and the zones, works on the Y plane unchanged */
+#define ZM_SUBPIX_ORDER_YUV420P 11
 
 /* A macro to use default subpixel order for a specified colour. */
 /* for grayscale it will use NONE, for 3 colours it will use R,G,B, for 4 colours it will use R,G,B,A */
 #define ZM_SUBPIX_ORDER_DEFAULT_FOR_COLOUR(c)  ((c)<<1)
 
+/* Bytes needed to hold an image, planar images carry their chroma after the Y plane */
+inline unsigned int zm_image_buffer_size(unsigned int p_width, unsigned int p_height, unsigned int p_colours, unsigned int p_subpixelorder) {
+  if ( p_subpixelorder == ZM_SUBPIX_ORDER_YUV420P )
+    return p_width*p_height + 2*(((p_width+1)>>1)*((p_height+1)>>1));
+  return p_width*p_height*p_colours;
+}
+
 /* Convert RGB colour value into BGR\ARGB\ABGR */
 inline Rgb rgb_convert(Rgb p_col, int p_subpixorder) {
   Rgb result;
@@ -0,0 +1,137 @@
+//ZoneMinder Scaled Frame Cache Implementation Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "zm_scaled_cache.h"
+
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "zm.h"
+#include "zm_image.h"
+
+// Each level is what Image::Scale gives for half of the level before it
+size_t ScaledFrameCache::LevelSize(int level, unsigned int p_width, unsigned int p_height, unsigned int p_colours) {
+  unsigned int factor = ZM_SCALE_BASE/2;
+  for ( int i = 0; i < level; i++ ) {
+    p_width = std::max(1U, ((p_width*factor)+(factor/2))/ZM_SCALE_BASE);
+    p_height = std::max(1U, ((p_height*factor)+(factor/2))/ZM_SCALE_BASE);
+  }
+  return ((p_width*p_height*p_colours) + 63) & ~63;
+}
+
+size_t ScaledFrameCache::SharedSize(int p_levels, unsigned int p_width, unsigned int p_height, unsigned int p_colours) {
+  p_levels = std::min(std::max(p_levels, 0), (int)MAX_LEVELS);
+  size_t size = sizeof(Header) + (p_levels*sizeof(Level));
+  for ( int i = 1; i <= p_levels; i++ )
+    size += LevelSize(i, p_width, p_height, p_colours);
+  return size;
+}
+
+ScaledFrameCache::ScaledFrameCache(uint8_t *mem, int p_levels, unsigned int p_width, unsigned int p_height, unsigned int p_colours) :
+  level_count(std::min(std::max(p_levels, 0), (int)MAX_LEVELS))
+{
+  header = (Header *)mem;
+  levels = (Level *)(mem + sizeof(Header));
+  uint8_t *level_data = (uint8_t *)levels + (level_count*sizeof(Level));
+  for ( int i = 0; i < level_count; i++ ) {
+    data[i] = level_data;
+    data_size[i] = LevelSize(i+1, p_width, p_height, p_colours);
+    level_data += data_size[i];
+  }
+}
+
+// Called by zmc once the shared memory has been cleared
+void ScaledFrameCache::Initialise() {
+  header->size = sizeof(Header);
+  header->levels = level_count;
+  for ( int i = 0; i < level_count; i++ ) {
+    levels[i].sequence.store(0);
+    levels[i].claim.store(0);
+    levels[i].writing.store(0);
+  }
+}
+
+int ScaledFrameCache::LevelFor(unsigned int scale) const {
+  for ( int level = level_count; level > 0; level-- ) {
+    if ( (scale << level) <= ZM_SCALE_BASE )
+      return level;
+  }
+  return 0;
+}
+
+bool ScaledFrameCache::Fetch(int level, uint64_t sequence, Image *image) const {
+  const Level *l = &levels[level-1];
+  if ( !sequence || (l->sequence.load(std::memory_order_acquire) != sequence) )
+    return false;
+
+  unsigned int width = l->width;
+  unsigned int height = l->height;
+  unsigned int colours = l->colours;
+  unsigned int subpixelorder = l->subpixelorder;
+  size_t size = width*height*colours;
+  if ( !size || (size > data_size[level-1]) )
+    return false;
+  image->Assign(width, height, colours, subpixelorder, data[level-1], size);
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  // Replaced while it was being copied
+  return l->sequence.load() == sequence;
+}
+
+bool ScaledFrameCache::Claim(int level, uint64_t sequence) {
+  Level *l = &levels[level-1];
+  uint64_t claimed = l->claim.load();
+  while ( claimed < sequence ) {
+    if ( l->claim.compare_exchange_weak(claimed, sequence) )
+      return true;
+  }
+  return false;
+}
+
+bool ScaledFrameCache::Store(int level, uint64_t sequence, const Image &image) {
+  Level *l = &levels[level-1];
+  if ( image.Size() > data_size[level-1] ) {
+    Debug(1, "Scaled frame of %d bytes is too big for level %d", image.Size(), level);
+    return false;
+  }
+
+  // Only one viewer writes at a time, one that died while writing is given a few seconds
+  int64_t now = time(nullptr);
+  int64_t started = 0;
+  if ( !l->writing.compare_exchange_strong(started, now) ) {
+    if ( (now - started < 5) || !l->writing.compare_exchange_strong(started, now) )
+      return false;
+  }
+  // A newer frame has been claimed since
+  if ( l->claim.load() != sequence ) {
+    l->writing.store(0);
+    return false;
+  }
+
+  l->sequence.store(0);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(data[level-1], image.Buffer(), image.Size());
+  l->width = image.Width();
+  l->height = image.Height();
+  l->colours = image.Colours();
+  l->subpixelorder = image.SubpixelOrder();
+  l->sequence.store(sequence, std::memory_order_release);
+  l->writing.store(0);
+  return true;
+}
@@ -0,0 +1,81 @@
+//ZoneMinder Scaled Frame Cache Interface Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef ZM_SCALED_CACHE_H
+#define ZM_SCALED_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+class Image;
+
+//
+// A pyramid of downscaled copies of a monitor's latest frame, kept in its
+// shared memory so that every zms viewing it at a reduced scale can share
+// them. Level 1 is half the size of the captured frame, and each level after
+// that is half the size of the one before. Nothing is scaled by zmc, the
+// first viewer to want a level of a frame scales it and publishes it for the
+// others. Each level holds one frame, identified by its sequence number,
+// which is cleared while the level is being written and checked again by
+// readers after copying it out.
+//
+class ScaledFrameCache {
+  private:
+    struct Header {
+      uint32_t size;
+      uint32_t levels;
+    };
+    struct Level {
+      std::atomic<uint64_t> sequence;        // Frame the level holds, 0 while it is being written
+      std::atomic<uint64_t> claim;           // Newest frame a viewer has set out to scale into it
+      std::atomic<int64_t> writing;          // When a viewer started writing into it, 0 if none is
+      uint32_t width;
+      uint32_t height;
+      uint32_t colours;
+      uint32_t subpixelorder;
+    };
+    enum { MAX_LEVELS=4 };
+
+    int level_count;
+    Header *header;
+    Level *levels;
+    uint8_t *data[MAX_LEVELS];
+    size_t data_size[MAX_LEVELS];
+
+    static size_t LevelSize(int level, unsigned int p_width, unsigned int p_height, unsigned int p_colours);
+
+  public:
+    static size_t SharedSize(int p_levels, unsigned int p_width, unsigned int p_height, unsigned int p_colours);
+
+    ScaledFrameCache(uint8_t *mem, int p_levels, unsigned int p_width, unsigned int p_height, unsigned int p_colours);
+
+    void Initialise();
+    int Levels() const { return level_count; }
+    // The smallest level that is still no smaller than scale, 0 if there is none
+    int LevelFor(unsigned int scale) const;
+
+    bool Fetch(int level, uint64_t sequence, Image *image) const;
+    // Returns false if another viewer has already claimed this frame or a newer one
+    bool Claim(int level, uint64_t sequence);
+    uint64_t Claimed(int level) const { return levels[level-1].claim.load(); }
+    bool Store(int level, uint64_t sequence, const Image &image);
+};
+
+#endif // ZM_SCALED_CACHE_H
@@ -0,0 +1,486 @@
+//ZoneMinder Segment Writer Implementation Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "zm_segment_writer.h"
+
+#if HAVE_LIBAVCODEC
+
+#include <glob.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cinttypes>
+#include <algorithm>
+
+#include "zm_time.h"
+#include "zm_monitor.h"
+
+static bool overlaps(const struct timeval &start, const struct timeval &end, const struct timeval &event_start, const struct timeval &event_end) {
+  return (tvCmp(end, event_start) > 0) && (tvIsZero(event_end) || (tvCmp(start, event_end) < 0));
+}
+
+SegmentWriter::SegmentWriter(Monitor *p_monitor, AVStream *p_video_in_stream, AVStream *p_audio_in_stream) :
+  monitor(p_monitor),
+  video_in_stream(p_video_in_stream),
+  audio_in_stream(p_audio_in_stream),
+  mCondition(mMutex),
+  mStop(false),
+  dropping(false),
+  mJoinCondition(mMutex),
+  mJoinStop(false),
+  join_thread(nullptr),
+  store(nullptr)
+{
+  current.start = current.end = tvZero();
+  last_timestamp = tvZero();
+  last_queued = tvZero();
+
+  std::string monitor_dir = stringtf("%s/%d", monitor->getStorage()->Path(), monitor->Id());
+  directory = monitor_dir + "/segments";
+  if ( mkdir(monitor_dir.c_str(), 0755) && (errno != EEXIST) )
+    Error("Can't mkdir %s: %s", monitor_dir.c_str(), strerror(errno));
+  if ( mkdir(directory.c_str(), 0755) && (errno != EEXIST) )
+    Error("Can't mkdir %s: %s", directory.c_str(), strerror(errno));
+
+  loadSegments();
+  join_thread = new std::thread(&SegmentWriter::joinThread, this);
+}
+
+SegmentWriter::~SegmentWriter() {
+  stop();
+  if ( mStarted )
+    join();
+
+  // Events closed by the last segment are still joined before going
+  mMutex.lock();
+  mJoinStop = true;
+  mJoinCondition.signal();
+  mMutex.unlock();
+  join_thread->join();
+  delete join_thread;
+
+  for ( std::deque<ZMPacket *>::iterator it = packets.begin(); it != packets.end(); ++it )
+    delete *it;
+  packets.clear();
+}
+
+// Picks up the segments left by a previous run so that they are kept and expired as normal
+void SegmentWriter::loadSegments() {
+  std::string glob_pattern = directory + "/*.mp4";
+  glob_t pglob;
+
+  if ( glob(glob_pattern.c_str(), 0, 0, &pglob) == 0 ) {
+    for ( unsigned int i = 0; i < pglob.gl_pathc; i++ ) {
+      const char *file = pglob.gl_pathv[i];
+      const char *name = strrchr(file, '/');
+      uint64_t start_ms = strtoull(name ? name+1 : file, nullptr, 10);
+      struct stat st;
+      if ( !start_ms || stat(file, &st) ) {
+        Debug(1, "Ignoring %s in segment directory", file);
+        continue;
+      }
+      Segment segment;
+      segment.file = file;
+      segment.start.tv_sec = start_ms / 1000;
+      segment.start.tv_usec = (start_ms % 1000) * 1000;
+      segment.end.tv_sec = st.st_mtime;
+      segment.end.tv_usec = 0;
+      segments.push_back(segment);
+    }
+    Debug(1, "Found %d existing segments in %s", segments.size(), directory.c_str());
+  }
+  globfree(&pglob);
+
+  pruneSegments();
+}
+
+void SegmentWriter::pruneSegments() {
+  std::deque<std::string> expired;
+  unsigned int segment_count = config.passthrough_segment_count > 0 ? config.passthrough_segment_count : 1;
+
+  mMutex.lock();
+  while ( segments.size() > segment_count ) {
+    expired.push_back(segments.front().file);
+    segments.pop_front();
+  }
+  mMutex.unlock();
+
+  // Events keep their own links to any of these
+  for ( std::deque<std::string>::iterator it = expired.begin(); it != expired.end(); ++it ) {
+    Debug(2, "Removing expired segment %s", it->c_str());
+    if ( unlink(it->c_str()) && (errno != ENOENT) )
+      Error("Can't unlink %s: %s", it->c_str(), strerror(errno));
+  }
+}
+
+void SegmentWriter::openSegment(const struct timeval &start) {
+  current.file = stringtf("%s/%" PRIu64 ".mp4", directory.c_str(),
+      (uint64_t)start.tv_sec * 1000 + start.tv_usec / 1000);
+  current.end = tvZero();
+
+  store = new VideoStore(current.file.c_str(), "mp4", video_in_stream, audio_in_stream, monitor);
+  if ( !store->open() ) {
+    Error("Unable to open segment %s", current.file.c_str());
+    delete store;
+    store = nullptr;
+    return;
+  }
+  Debug(1, "Opened segment %s", current.file.c_str());
+
+  mMutex.lock();
+  current.start = start;
+  mMutex.unlock();
+}
+
+void SegmentWriter::closeSegment(const struct timeval &end) {
+  if ( !store )
+    return;
+
+  delete store;
+  store = nullptr;
+  current.end = end;
+  Debug(1, "Closed segment %s, %.2f seconds", current.file.c_str(), tvDiffSec(current.start, current.end));
+
+  for ( std::list<EventLink>::iterator it = events.begin(); it != events.end(); ) {
+    if ( overlaps(current.start, current.end, it->start, it->end) )
+      linkSegment(current, *it);
+    // An event that ended within this segment has all of its segments now
+    if ( !tvIsZero(it->end) && (tvCmp(it->end, current.end) <= 0) ) {
+      Debug(1, "Event %" PRIu64 " linked to %d segments", it->id, it->links);
+      if ( it->links > 1 ) {
+        JoinJob job;
+        job.files = it->link_files;
+        job.output = it->file;
+        mMutex.lock();
+        join_jobs.push_back(job);
+        mJoinCondition.signal();
+        mMutex.unlock();
+      }
+      it = events.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  mMutex.lock();
+  segments.push_back(current);
+  current.start = tvZero();
+  mMutex.unlock();
+
+  pruneSegments();
+}
+
+void SegmentWriter::linkSegment(const Segment &segment, EventLink &event) {
+  std::string link_file = event.file;
+  if ( event.links ) {
+    size_t extension = link_file.rfind('.');
+    link_file.insert((extension == std::string::npos) ? link_file.size() : extension,
+        stringtf("-%d", event.links+1));
+  }
+  if ( link(segment.file.c_str(), link_file.c_str()) ) {
+    Error("Can't link %s to %s: %s", segment.file.c_str(), link_file.c_str(), strerror(errno));
+    return;
+  }
+  Debug(2, "Linked segment %s to %s", segment.file.c_str(), link_file.c_str());
+  event.links++;
+  event.link_files.push_back(link_file);
+}
+
+void SegmentWriter::joinThread() {
+  mMutex.lock();
+  while ( true ) {
+    while ( !mJoinStop && join_jobs.empty() )
+      mJoinCondition.wait();
+    if ( join_jobs.empty() )
+      break;
+    JoinJob job = join_jobs.front();
+    join_jobs.pop_front();
+    mMutex.unlock();
+
+    joinSegments(job);
+
+    mMutex.lock();
+  }
+  mMutex.unlock();
+}
+
+// Remuxes the segments linked into an event into its video file, so that
+// playback and download don't stop at the end of the first one. The links
+// are only removed once the joined file has replaced the first of them.
+bool SegmentWriter::joinSegments(const JoinJob &job) {
+  std::string tmp_file = job.output + ".tmp";
+  AVFormatContext *oc = nullptr;
+  avformat_alloc_output_context2(&oc, nullptr, "mp4", tmp_file.c_str());
+  if ( !oc ) {
+    Error("Unable to create muxer for %s", tmp_file.c_str());
+    return false;
+  }
+
+  std::vector<int64_t> next_dts;
+  bool ok = true;
+  bool header_written = false;
+  for ( unsigned int f = 0; ok && (f < job.files.size()); f++ ) {
+    AVFormatContext *ic = nullptr;
+    int ret = avformat_open_input(&ic, job.files[f].c_str(), nullptr, nullptr);
+    if ( ret < 0 ) {
+      Error("Can't open segment %s: %s", job.files[f].c_str(), av_make_error_string(ret).c_str());
+      ok = false;
+      break;
+    }
+    if ( (ret = avformat_find_stream_info(ic, nullptr)) < 0 ) {
+      Error("Can't read segment %s: %s", job.files[f].c_str(), av_make_error_string(ret).c_str());
+      avformat_close_input(&ic);
+      ok = false;
+      break;
+    }
+
+    if ( !header_written ) {
+      // Every segment is muxed from the same camera streams, the first one sets them up
+      for ( unsigned int i = 0; i < ic->nb_streams; i++ ) {
+        AVStream *out_stream = avformat_new_stream(oc, nullptr);
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+        avcodec_parameters_copy(out_stream->codecpar, ic->streams[i]->codecpar);
+        out_stream->codecpar->codec_tag = 0;
+#else
+        avcodec_copy_context(out_stream->codec, ic->streams[i]->codec);
+        out_stream->codec->codec_tag = 0;
+#endif
+        out_stream->time_base = ic->streams[i]->time_base;
+      }
+      next_dts.assign(oc->nb_streams, 0);
+      if ( (ret = avio_open(&oc->pb, tmp_file.c_str(), AVIO_FLAG_WRITE)) < 0 ) {
+        Error("Can't open %s: %s", tmp_file.c_str(), av_make_error_string(ret).c_str());
+        avformat_close_input(&ic);
+        ok = false;
+        break;
+      }
+      if ( (ret = avformat_write_header(oc, nullptr)) < 0 ) {
+        Error("Can't write header to %s: %s", tmp_file.c_str(), av_make_error_string(ret).c_str());
+        avformat_close_input(&ic);
+        ok = false;
+        break;
+      }
+      header_written = true;
+    }
+
+    // Each segment's timestamps carry on from where the one before ended
+    std::vector<int64_t> offset(oc->nb_streams, AV_NOPTS_VALUE);
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    pkt.data = nullptr;
+    pkt.size = 0;
+    while ( av_read_frame(ic, &pkt) >= 0 ) {
+      unsigned int s = pkt.stream_index;
+      if ( s >= oc->nb_streams ) {
+        zm_av_packet_unref(&pkt);
+        continue;
+      }
+      av_packet_rescale_ts(&pkt, ic->streams[s]->time_base, oc->streams[s]->time_base);
+      if ( pkt.dts == AV_NOPTS_VALUE )
+        pkt.dts = pkt.pts;
+      if ( pkt.dts == AV_NOPTS_VALUE ) {
+        zm_av_packet_unref(&pkt);
+        continue;
+      }
+      if ( offset[s] == AV_NOPTS_VALUE )
+        offset[s] = next_dts[s] - pkt.dts;
+      pkt.dts += offset[s];
+      if ( pkt.pts != AV_NOPTS_VALUE )
+        pkt.pts += offset[s];
+      next_dts[s] = std::max(next_dts[s], pkt.dts + std::max(pkt.duration, (int64_t)1));
+      if ( (ret = av_interleaved_write_frame(oc, &pkt)) < 0 ) {
+        Error("Can't write to %s: %s", tmp_file.c_str(), av_make_error_string(ret).c_str());
+        ok = false;
+        break;
+      }
+    }
+    avformat_close_input(&ic);
+  }
+
+  if ( header_written && (av_write_trailer(oc) < 0) )
+    ok = false;
+  if ( oc->pb )
+    avio_close(oc->pb);
+  avformat_free_context(oc);
+
+  if ( !ok || rename(tmp_file.c_str(), job.output.c_str()) ) {
+    if ( ok )
+      Error("Can't rename %s to %s: %s", tmp_file.c_str(), job.output.c_str(), strerror(errno));
+    unlink(tmp_file.c_str());
+    return false;
+  }
+  for ( unsigned int f = 1; f < job.files.size(); f++ ) {
+    if ( unlink(job.files[f].c_str()) && (errno != ENOENT) )
+      Error("Can't unlink %s: %s", job.files[f].c_str(), strerror(errno));
+  }
+  Debug(1, "Joined %zu segments into %s", job.files.size(), job.output.c_str());
+  return true;
+}
+
+void SegmentWriter::updateEvents(std::deque<EventLink> &started, std::deque<EventLink> &ended) {
+  while ( started.size() ) {
+    events.push_back(started.front());
+    started.pop_front();
+    // Pre-event video is in segments that have already been completed
+    EventLink &event = events.back();
+    for ( std::deque<Segment>::iterator it = segments.begin(); it != segments.end(); ++it ) {
+      if ( overlaps(it->start, it->end, event.start, event.end) )
+        linkSegment(*it, event);
+    }
+  }
+  while ( ended.size() ) {
+    for ( std::list<EventLink>::iterator it = events.begin(); it != events.end(); ++it ) {
+      if ( it->id == ended.front().id ) {
+        it->end = ended.front().end;
+        break;
+      }
+    }
+    ended.pop_front();
+  }
+}
+
+void SegmentWriter::writePacket(ZMPacket *packet) {
+  AVPacket *avp = packet->av_packet();
+  last_timestamp = packet->timestamp;
+
+  if ( avp->stream_index == video_in_stream->index ) {
+    if ( avp->flags & AV_PKT_FLAG_KEY ) {
+      if ( !store || (tvDiffSec(current.start, packet->timestamp) >= config.passthrough_segment_length) ) {
+        closeSegment(packet->timestamp);
+        openSegment(packet->timestamp);
+      }
+    }
+    if ( store && (store->writeVideoFramePacket(avp) < 0) )
+      Warning("Error writing video packet to segment %s", current.file.c_str());
+  } else if ( store && audio_in_stream && (avp->stream_index == audio_in_stream->index) ) {
+    if ( store->writeAudioFramePacket(avp) < 0 )
+      Warning("Error writing audio packet to segment %s", current.file.c_str());
+  }
+}
+
+// Called from the capture thread, the packet is referenced so the caller can unref its own
+void SegmentWriter::queuePacket(AVPacket *packet) {
+  bool keyframe = (packet->stream_index == video_in_stream->index) && (packet->flags & AV_PKT_FLAG_KEY);
+
+  mMutex.lock();
+  if ( dropping && !keyframe ) {
+    mMutex.unlock();
+    return;
+  }
+  if ( packets.size() >= max_queued_packets ) {
+    if ( !dropping )
+      Warning("Segment writer has fallen %d packets behind, dropping up to the next keyframe", packets.size());
+    dropping = true;
+    mMutex.unlock();
+    return;
+  }
+  dropping = false;
+  mMutex.unlock();
+
+  ZMPacket *queued_packet = new ZMPacket(packet);
+
+  mMutex.lock();
+  last_queued = queued_packet->timestamp;
+  packets.push_back(queued_packet);
+  mCondition.signal();
+  mMutex.unlock();
+}
+
+// Returns when the event's video starts, which is the start of the first segment it overlaps
+struct timeval SegmentWriter::startEvent(uint64_t event_id, const char *event_file, struct timeval event_start) {
+  EventLink event;
+  event.id = event_id;
+  event.file = event_file;
+  event.start = event_start;
+  event.end = tvZero();
+  event.links = 0;
+
+  struct timeval video_start = event_start;
+
+  mMutex.lock();
+  started_events.push_back(event);
+  bool found = false;
+  for ( std::deque<Segment>::iterator it = segments.begin(); it != segments.end(); ++it ) {
+    if ( tvCmp(it->end, event_start) > 0 ) {
+      video_start = it->start;
+      found = true;
+      break;
+    }
+  }
+  if ( !found && !tvIsZero(current.start) )
+    video_start = current.start;
+  mCondition.signal();
+  mMutex.unlock();
+
+  Debug(1, "Event %" PRIu64 " video starts %.2f seconds before it",
+      event_id, tvDiffSec(video_start, event_start));
+  return video_start;
+}
+
+void SegmentWriter::endEvent(uint64_t event_id) {
+  EventLink event;
+  event.id = event_id;
+  event.links = 0;
+
+  mMutex.lock();
+  // The event ends with the last packet captured for it, however far behind the writer is
+  event.end = tvIsZero(last_queued) ? tvNow() : last_queued;
+  ended_events.push_back(event);
+  mCondition.signal();
+  mMutex.unlock();
+}
+
+void SegmentWriter::stop() {
+  mMutex.lock();
+  mStop = true;
+  mCondition.signal();
+  mMutex.unlock();
+}
+
+int SegmentWriter::run() {
+  std::deque<EventLink> started;
+  std::deque<EventLink> ended;
+  bool stopping = false;
+
+  while ( !stopping ) {
+    mMutex.lock();
+    while ( !mStop && packets.empty() && started_events.empty() && ended_events.empty() )
+      mCondition.wait();
+    // Whatever was queued before stopping still gets written
+    stopping = mStop && packets.empty();
+    started.swap(started_events);
+    ended.swap(ended_events);
+    ZMPacket *packet = nullptr;
+    if ( packets.size() ) {
+      packet = packets.front();
+      packets.pop_front();
+    }
+    mMutex.unlock();
+
+    updateEvents(started, ended);
+    if ( packet ) {
+      writePacket(packet);
+      delete packet;
+    }
+  }
+
+  closeSegment(last_timestamp);
+  return 0;
+}
+
+#endif // HAVE_LIBAVCODEC
@@ -0,0 +1,117 @@
+//ZoneMinder Segment Writer Interface Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef ZM_SEGMENT_WRITER_H
+#define ZM_SEGMENT_WRITER_H
+
+#include <sys/time.h>
+
+#include <deque>
+#include <list>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "zm_thread.h"
+#include "zm_packet.h"
+#include "zm_videostore.h"
+
+#if HAVE_LIBAVCODEC
+
+class Monitor;
+
+//
+// Records a passthrough monitor continuously into a ring of keyframe aligned
+// segments, muxed on a thread of its own. The segments an event overlaps are
+// hard linked into its directory, so the oldest segment can be removed from
+// the ring as each new one is completed without touching any event. Once an
+// event has ended, any that span more than one segment have them remuxed
+// into their single video file on another thread.
+//
+class SegmentWriter : public Thread {
+  private:
+    struct Segment {
+      std::string file;
+      struct timeval start;
+      struct timeval end;
+    };
+    struct EventLink {
+      uint64_t id;
+      std::string file;        // The event's video file, the first segment is linked as this
+      struct timeval start;
+      struct timeval end;      // Zero while the event is open
+      int links;
+      std::vector<std::string> link_files;
+    };
+    struct JoinJob {
+      std::vector<std::string> files;
+      std::string output;
+    };
+
+    // Packets beyond this are dropped up to the next keyframe rather than queued
+    static const unsigned int max_queued_packets = 2000;
+
+    Monitor *monitor;
+    AVStream *video_in_stream;
+    AVStream *audio_in_stream;
+    std::string directory;
+
+    Mutex mMutex;
+    Condition mCondition;
+    bool mStop;
+    bool dropping;
+    std::deque<ZMPacket *> packets;
+    std::deque<EventLink> started_events;
+    std::deque<EventLink> ended_events;
+    std::deque<Segment> segments;   // Completed segments, oldest first
+    struct timeval last_queued;     // Capture time of the newest packet queued
+
+    Condition mJoinCondition;
+    bool mJoinStop;
+    std::deque<JoinJob> join_jobs;
+    std::thread *join_thread;
+
+    // Owned by the writer thread, apart from current.start which is also read under mMutex
+    std::list<EventLink> events;
+    Segment current;
+    VideoStore *store;
+    struct timeval last_timestamp;
+
+    void loadSegments();
+    void pruneSegments();
+    void openSegment(const struct timeval &start);
+    void closeSegment(const struct timeval &end);
+    void linkSegment(const Segment &segment, EventLink &event);
+    void updateEvents(std::deque<EventLink> &started, std::deque<EventLink> &ended);
+    void writePacket(ZMPacket *packet);
+    void joinThread();
+    static bool joinSegments(const JoinJob &job);
+
+  public:
+    SegmentWriter(Monitor *p_monitor, AVStream *p_video_in_stream, AVStream *p_audio_in_stream);
+    ~SegmentWriter();
+
+    void queuePacket(AVPacket *packet);
+    struct timeval startEvent(uint64_t event_id, const char *event_file, struct timeval event_start);
+    void endEvent(uint64_t event_id);
+    void stop();
+    int run();
+};
+
+#endif // HAVE_LIBAVCODEC
+#endif // ZM_SEGMENT_WRITER_H
@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <algorithm>
 
 #include "zm.h"
 #include "zm_mpeg.h"
@@ -136,8 +137,6 @@ Image *StreamBase::prepareImage(Image *image) {
   // Works in FF2 but breaks FF3 which doesn't like image sizes changing in mid stream.
   bool optimisedScaling = false;
 
-  bool image_copied = false;
-
   int mag = (scale * zoom) / ZM_SCALE_BASE;
   int act_mag = optimisedScaling?(mag > ZM_SCALE_BASE?ZM_SCALE_BASE:mag):mag;
 
@@ -178,16 +177,8 @@ Image *StreamBase::prepareImage(Image *image) {
       last_send_image_width, last_send_image_height
       );
 
-  if ( ( mag != ZM_SCALE_BASE ) && (act_mag != ZM_SCALE_BASE) ) {
-    Debug(3, "Magnifying by %d", mag);
-    static Image copy_image;
-    copy_image.Assign(*image);
-    image = &copy_image;
-    image_copied = true;
-    image->Scale(mag);
-  }
-
-  Debug(3, "Real image width = %d, height = %d", image->Width(), image->Height());
+  Box crop;
+  bool cropped = false;
 
   if ( disp_image_width < virt_image_width || disp_image_height < virt_image_height ) {
     static Box last_crop;
@@ -229,16 +220,39 @@ Image *StreamBase::prepareImage(Image *image) {
       last_crop = Box( lo_x, lo_y, hi_x, hi_y );
     }  // end if ( mag != last_mag || x != last_x || y != last_y )
 
-    Debug(3, "Cropping to %d,%d -> %d,%d", last_crop.LoX(), last_crop.LoY(), last_crop.HiX(), last_crop.HiY());
-    if ( !image_copied ) {
-      static Image copy_image;
-      copy_image.Assign(*image);
-      image = &copy_image;
-      image_copied = true;
-    }
-    image->Crop(last_crop);
+    // The crop is in scaled pixels, only the part of the image that it covers gets scaled.
+    // Its unscaled size only depends on the zoom, rounded up so that once scaled it covers
+    // the whole send image, so panning around never changes the size of what is sent.
+    int crop_width = std::min(base_image_width, ((send_image_width * ZM_SCALE_BASE) + act_mag - 1) / act_mag);
+    int crop_height = std::min(base_image_height, ((send_image_height * ZM_SCALE_BASE) + act_mag - 1) / act_mag);
+    int lo_x = std::min((last_crop.LoX() * ZM_SCALE_BASE) / act_mag, base_image_width - crop_width);
+    int lo_y = std::min((last_crop.LoY() * ZM_SCALE_BASE) / act_mag, base_image_height - crop_height);
+    Debug(3, "Cropping to %d,%d -> %d,%d, %d,%d %dx%d unscaled",
+        last_crop.LoX(), last_crop.LoY(), last_crop.HiX(), last_crop.HiY(), lo_x, lo_y, crop_width, crop_height);
+    crop = Box(lo_x, lo_y, lo_x + crop_width - 1, lo_y + crop_height - 1);
+    cropped = true;
   }  // end if difference in image vs displayed dimensions
 
+  bool scaled = ( mag != ZM_SCALE_BASE ) && ( act_mag != ZM_SCALE_BASE );
+  if ( cropped || scaled ) {
+    static Image copy_image;
+    copy_image.Assign(*image);
+    image = &copy_image;
+    if ( cropped )
+      image->Crop(crop);
+    if ( scaled ) {
+      Debug(3, "Magnifying by %d", mag);
+      image->Scale(act_mag);
+      // Take off whatever rounding the crop up added
+      if ( cropped && ((image->Width() > (unsigned int)send_image_width) || (image->Height() > (unsigned int)send_image_height)) )
+        image->Crop(0, 0,
+            std::min(image->Width(), (unsigned int)send_image_width) - 1,
+            std::min(image->Height(), (unsigned int)send_image_height) - 1);
+    }
+  }
+
+  Debug(3, "Real image width = %d, height = %d", image->Width(), image->Height());
+
   last_scale = scale;
   last_zoom = zoom;
   last_x = x;
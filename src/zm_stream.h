@@ -33,7 +33,7 @@ class Monitor;
 
 class StreamBase {
 public:
-  typedef enum { STREAM_JPEG, STREAM_RAW, STREAM_ZIP, STREAM_SINGLE, STREAM_MPEG } StreamType;
+  typedef enum { STREAM_JPEG, STREAM_RAW, STREAM_ZIP, STREAM_SINGLE, STREAM_MPEG, STREAM_VIDEO } StreamType;
 
 protected:
   static const int MAX_STREAM_DELAY = 5; // Seconds
@@ -26,6 +26,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
 #include <utility>
 
 #if HAVE_GNUTLS_GNUTLS_H
@@ -212,6 +218,217 @@ User *zmLoadTokenUser(std::string jwt_token_str, bool use_remote_addr) {
   return user;
 }  // User *zmLoadTokenUser(std::string jwt_token_str, bool use_remote_addr)
  
+#if HAVE_DECL_MD5 || HAVE_DECL_GNUTLS_FINGERPRINT
+// Checking an auth hash means hashing every enabled user for every hour of
+// ZM_AUTH_HASH_TTL, and zms and zmu each do it once per request. So the hashes
+// are worked out once an hour for each remote address and kept, sorted, in a
+// file in ZM_PATH_MAP. A cache is only used while its hour, the hash settings
+// and the generation of the Users table it was built from are all current.
+#define ZM_USERS_GENERATION   "zm_users.generation"
+#define ZM_AUTH_CACHE_PREFIX  "zm_authcache."
+
+struct AuthCacheHeader {
+  char magic[4];
+  uint32_t layout;
+  uint64_t generation;
+  int32_t hour;             // The local time the newest hashes are for
+  int32_t mday;
+  int32_t mon;
+  int32_t year;
+  uint32_t hours;
+  unsigned char settings_md5[16];
+  uint32_t n_entries;
+};
+
+struct AuthCacheEntry {
+  unsigned char md5[16];
+  uint32_t user_id;
+  uint32_t hour;            // Hours before the newest
+};
+
+static bool operator<(const AuthCacheEntry &a, const AuthCacheEntry &b) {
+  return memcmp(a.md5, b.md5, sizeof(a.md5)) < 0;
+}
+
+static void authMD5(const char *key, unsigned char *md5sum) {
+#if HAVE_DECL_MD5
+  MD5((unsigned char *)key, strlen(key), md5sum);
+#elif HAVE_DECL_GNUTLS_FINGERPRINT
+  size_t md5len = 16;
+  gnutls_datum_t md5data = { (unsigned char *)key, (unsigned int)strlen(key) };
+  gnutls_fingerprint(GNUTLS_DIG_MD5, &md5data, md5sum, &md5len);
+#endif
+}
+
+static void authHash(const char *user, const char *pass, const char *remote_addr, time_t when, unsigned char *md5sum) {
+  char auth_key[512] = "";
+  struct tm when_tm;
+  localtime_r(&when, &when_tm);
+
+  snprintf(auth_key, sizeof(auth_key)-1, "%s%s%s%s%d%d%d%d",
+    config.auth_hash_secret,
+    user,
+    pass,
+    remote_addr,
+    when_tm.tm_hour,
+    when_tm.tm_mday,
+    when_tm.tm_mon,
+    when_tm.tm_year);
+  authMD5(auth_key, md5sum);
+}
+
+// The hex the web interface sends, which is always lower case
+static bool parseAuthHash(const char *auth, unsigned char *md5sum) {
+  if ( strlen(auth) != 32 )
+    return false;
+  for ( int i = 0; i < 32; i++ ) {
+    const char c = auth[i];
+    int nibble;
+    if ( c >= '0' && c <= '9' )
+      nibble = c - '0';
+    else if ( c >= 'a' && c <= 'f' )
+      nibble = c - 'a' + 10;
+    else
+      return false;
+    if ( i % 2 )
+      md5sum[i/2] |= nibble;
+    else
+      md5sum[i/2] = nibble << 4;
+  }
+  return true;
+}
+
+static std::string authCachePath(const char *remote_addr) {
+  std::string name = remote_addr[0] ? remote_addr : "any";
+  for ( std::string::iterator c = name.begin(); c != name.end(); ++c ) {
+    if ( !isxdigit(*c) && (*c != '.') && (*c != ':') )
+      *c = '_';
+  }
+  return staticConfig.PATH_MAP + "/" ZM_AUTH_CACHE_PREFIX + name;
+}
+
+// Hashes every enabled user for every hour, oldest last, and writes the result out for the next request
+// unless path is empty
+static bool buildAuthCache(const std::string &path, const AuthCacheHeader &header, const char *remote_addr, time_t now, std::vector<AuthCacheEntry> &entries) {
+  if ( mysql_query(&dbconn, "SELECT `Id`, `Username`, `Password` FROM `Users` WHERE `Enabled` = 1") ) {
+    Error("Can't run query: %s", mysql_error(&dbconn));
+    exit(mysql_errno(&dbconn));
+  }
+  MYSQL_RES *result = mysql_store_result(&dbconn);
+  if ( !result ) {
+    Error("Can't use query result: %s", mysql_error(&dbconn));
+    return false;
+  }
+
+  entries.clear();
+  entries.reserve(mysql_num_rows(result) * header.hours);
+  while ( MYSQL_ROW dbrow = mysql_fetch_row(result) ) {
+    AuthCacheEntry entry;
+    entry.user_id = atoi(dbrow[0]);
+    time_t our_now = now;
+    for ( entry.hour = 0; entry.hour < header.hours; entry.hour++, our_now -= 3600 ) {
+      authHash(dbrow[1], dbrow[2], remote_addr, our_now, entry.md5);
+      entries.push_back(entry);
+    }
+  }
+  mysql_free_result(result);
+  std::sort(entries.begin(), entries.end());
+  Debug(1, "Built %zu auth hashes for '%s'", entries.size(), remote_addr);
+
+  if ( path.empty() )
+    return true;
+
+  // These are as good as passwords, so only we get to read them
+  std::string temp_path = stringtf("%s.%d", path.c_str(), getpid());
+  int fd = open(temp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if ( fd < 0 ) {
+    Warning("Can't create auth cache %s: %s", temp_path.c_str(), strerror(errno));
+    return true;
+  }
+  AuthCacheHeader out_header = header;
+  out_header.n_entries = entries.size();
+  size_t entries_size = entries.size() * sizeof(AuthCacheEntry);
+  bool written = (write(fd, &out_header, sizeof(out_header)) == (ssize_t)sizeof(out_header))
+    && (!entries_size || (write(fd, &entries[0], entries_size) == (ssize_t)entries_size));
+  if ( close(fd) || !written || rename(temp_path.c_str(), path.c_str()) ) {
+    Warning("Can't write auth cache %s: %s", path.c_str(), strerror(errno));
+    unlink(temp_path.c_str());
+  }
+  return true;
+}
+
+// Looks md5sum up in the cache, building it first if there isn't a current one
+static bool findAuthHash(const char *remote_addr, const unsigned char *md5sum, AuthCacheEntry &found) {
+  time_t now = time(nullptr);
+  unsigned int hours = config.auth_hash_ttl;
+  if ( ! hours ) {
+    Warning("No value set for ZM_AUTH_HASH_TTL. Defaulting to 2.");
+    hours = 2;
+  } else {
+    Debug(1, "AUTH_HASH_TTL is %d", hours);
+  }
+
+  struct tm now_tm;
+  localtime_r(&now, &now_tm);
+  AuthCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "ZMAC", 4);
+  header.layout = 1;
+  // Without a generation to go by, nothing cached can be believed to be current
+  bool use_cache = zmReadGeneration(staticConfig.PATH_MAP + "/" ZM_USERS_GENERATION, header.generation);
+  header.hour = now_tm.tm_hour;
+  header.mday = now_tm.tm_mday;
+  header.mon = now_tm.tm_mon;
+  header.year = now_tm.tm_year;
+  header.hours = hours;
+  authMD5(config.auth_hash_secret, header.settings_md5);
+
+  AuthCacheEntry key;
+  memcpy(key.md5, md5sum, sizeof(key.md5));
+  std::string path = authCachePath(remote_addr);
+
+  int fd = use_cache ? open(path.c_str(), O_RDONLY) : -1;
+  if ( fd >= 0 ) {
+    struct stat st;
+    AuthCacheHeader cached;
+    // Anyone can create files in ZM_PATH_MAP, so only a cache we wrote ourselves will do
+    if ( (fstat(fd, &st) == 0)
+        && (st.st_uid == geteuid())
+        && !(st.st_mode & (S_IWGRP|S_IWOTH))
+        && (read(fd, &cached, sizeof(cached)) == (ssize_t)sizeof(cached))
+        && !memcmp(&cached, &header, offsetof(AuthCacheHeader, n_entries))
+        && ((size_t)st.st_size == sizeof(cached) + (cached.n_entries * sizeof(AuthCacheEntry))) ) {
+      void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if ( map == MAP_FAILED ) {
+        Warning("Can't map auth cache %s: %s", path.c_str(), strerror(errno));
+      } else {
+        const AuthCacheEntry *begin = (const AuthCacheEntry *)((char *)map + sizeof(cached));
+        const AuthCacheEntry *end = begin + cached.n_entries;
+        const AuthCacheEntry *entry = std::lower_bound(begin, end, key);
+        bool matched = (entry != end) && !memcmp(entry->md5, md5sum, sizeof(entry->md5));
+        if ( matched )
+          found = *entry;
+        munmap(map, st.st_size);
+        return matched;
+      }
+    } else {
+      close(fd);
+      Debug(1, "Auth cache %s is out of date or not ours", path.c_str());
+    }
+  }
+
+  std::vector<AuthCacheEntry> entries;
+  if ( !buildAuthCache(use_cache ? path : std::string(), header, remote_addr, now, entries) )
+    return false;
+  std::vector<AuthCacheEntry>::const_iterator entry = std::lower_bound(entries.begin(), entries.end(), key);
+  if ( (entry == entries.end()) || memcmp(entry->md5, md5sum, sizeof(entry->md5)) )
+    return false;
+  found = *entry;
+  return true;
+}
+#endif  // HAVE_DECL_MD5 || HAVE_DECL_GNUTLS_FINGERPRINT
+
 // Function to validate an authentication string
 User *zmLoadAuthUser(const char *auth, bool use_remote_addr) {
 #if HAVE_DECL_MD5 || HAVE_DECL_GNUTLS_FINGERPRINT
@@ -234,11 +451,18 @@ User *zmLoadAuthUser(const char *auth, bool use_remote_addr) {
   }
 
   Debug(1, "Attempting to authenticate user from auth string '%s'", auth);
+  unsigned char md5sum[16];
+  AuthCacheEntry found;
+  if ( !parseAuthHash(auth, md5sum) || !findAuthHash(remote_addr, md5sum, found) ) {
+    Debug(1, "No user found for auth_key %s", auth);
+    return nullptr;
+  }
+
   char sql[ZM_SQL_SML_BUFSIZ] = "";
   snprintf(sql, sizeof(sql),
       "SELECT `Id`, `Username`, `Password`, `Enabled`,"
       " `Stream`+0, `Events`+0, `Control`+0, `Monitors`+0, `System`+0,"
-      " `MonitorIds` FROM `Users` WHERE `Enabled` = 1");
+      " `MonitorIds` FROM `Users` WHERE `Id` = %u AND `Enabled` = 1", found.user_id);
 
   if ( mysql_query(&dbconn, sql) ) {
     Error("Can't run query: %s", mysql_error(&dbconn));
@@ -250,80 +474,31 @@ User *zmLoadAuthUser(const char *auth, bool use_remote_addr) {
     Error("Can't use query result: %s", mysql_error(&dbconn));
     return nullptr;
   }
-  int n_users = mysql_num_rows(result);
-  if ( n_users < 1 ) {
+  MYSQL_ROW dbrow = mysql_fetch_row(result);
+  if ( !dbrow ) {
     mysql_free_result(result);
     Warning("Unable to authenticate user");
     return nullptr;
   }
 
-  time_t now = time(nullptr);
-  unsigned int hours = config.auth_hash_ttl;
-  if ( ! hours ) {
-    Warning("No value set for ZM_AUTH_HASH_TTL. Defaulting to 2.");
-    hours = 2;
-  } else {
-    Debug(1, "AUTH_HASH_TTL is %d", hours);
+  // The user may have been changed since the cache was built, without the generation being bumped
+  unsigned char check_md5sum[16];
+  authHash(dbrow[1], dbrow[2], remote_addr, time(nullptr) - (found.hour * 3600), check_md5sum);
+  if ( memcmp(check_md5sum, md5sum, sizeof(md5sum)) ) {
+    mysql_free_result(result);
+    Debug(1, "Auth hash for user %u is out of date", found.user_id);
+    return nullptr;
   }
-  char auth_key[512] = "";
-  char auth_md5[32+1] = "";
-  size_t md5len = 16;
-  unsigned char md5sum[md5len];
-
-  const char * hex = "0123456789abcdef";
-  while ( MYSQL_ROW dbrow = mysql_fetch_row(result) ) {
-    const char *user = dbrow[1];
-    const char *pass = dbrow[2];
-
-    time_t our_now = now;
-    for ( unsigned int i = 0; i < hours; i++, our_now -= 3600 ) {
-      struct tm *now_tm = localtime(&our_now);
-
-      snprintf(auth_key, sizeof(auth_key)-1, "%s%s%s%s%d%d%d%d",
-        config.auth_hash_secret,
-        user,
-        pass,
-        remote_addr,
-        now_tm->tm_hour,
-        now_tm->tm_mday,
-        now_tm->tm_mon,
-        now_tm->tm_year);
-
-#if HAVE_DECL_MD5
-      MD5((unsigned char *)auth_key, strlen(auth_key), md5sum);
-#elif HAVE_DECL_GNUTLS_FINGERPRINT
-      gnutls_datum_t md5data = { (unsigned char *)auth_key, (unsigned int)strlen(auth_key) };
-      gnutls_fingerprint(GNUTLS_DIG_MD5, &md5data, md5sum, &md5len);
-#endif
-      unsigned char *md5sum_ptr = md5sum;
-      char *auth_md5_ptr = auth_md5;
-
-      for ( unsigned int j = 0; j < md5len; j++ ) {
-        *auth_md5_ptr++ = hex[(*md5sum_ptr>>4)&0xf];
-        *auth_md5_ptr++ = hex[(*md5sum_ptr++)&0xf];
-      }
-      *auth_md5_ptr = 0;
-
-      Debug(1, "Checking auth_key '%s' -> auth_md5 '%s' == '%s'",
-          auth_key, auth_md5, auth);
 
-      if ( !strcmp(auth, auth_md5) ) {
-        // We have a match
-        User *user = new User(dbrow);
-        Debug(1, "Authenticated user '%s'", user->getUsername());
-        mysql_free_result(result);
-        return user;
-      } else {
-        Debug(1, "No match for %s", auth);
-      }
-    }  // end foreach hour
-  }  // end foreach user
+  User *user = new User(dbrow);
+  Debug(1, "Authenticated user '%s'", user->getUsername());
   mysql_free_result(result);
+  return user;
 #else  // HAVE_DECL_MD5 || HAVE_DECL_GNUTLS_FINGERPRINT
   Error("You need to build with gnutls or openssl to use hash based auth");
-#endif  // HAVE_DECL_MD5 || HAVE_DECL_GNUTLS_FINGERPRINT
   Debug(1, "No user found for auth_key %s", auth);
   return nullptr;
+#endif  // HAVE_DECL_MD5 || HAVE_DECL_GNUTLS_FINGERPRINT
 }  // end User *zmLoadAuthUser( const char *auth, bool use_remote_addr )
 
 // Function to check Username length
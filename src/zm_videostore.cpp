@@ -26,6 +26,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <cinttypes>
 
 extern "C" {
@@ -38,11 +42,18 @@ VideoStore::VideoStore(
     AVStream *p_video_in_stream,
     AVStream *p_audio_in_stream,
     Monitor *p_monitor
-    ) {
+    ) :
+  audio_thread(nullptr),
+  audio_condition(audio_mutex),
+  audio_stop(false),
+  audio_dropped(0)
+{
 
   video_in_stream = p_video_in_stream;
   audio_in_stream = p_audio_in_stream;
   monitor = p_monitor;
+  fd = -1;
+  preallocated = 0;
 
 #if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
   //video_in_ctx = avcodec_alloc_context3(NULL);
@@ -403,12 +414,8 @@ bool VideoStore::open() {
   int ret;
   /* open the out file, if needed */
   if ( !(out_format->flags & AVFMT_NOFILE) ) {
-    ret = avio_open2(&oc->pb, filename, AVIO_FLAG_WRITE, nullptr, nullptr);
-    if ( ret < 0 ) {
-      Error("Could not open out file '%s': %s", filename,
-            av_make_error_string(ret).c_str());
+    if ( !open_output() )
       return false;
-    }
   }
 
   zm_dump_stream_format(oc, 0, 0, 1);
@@ -451,18 +458,130 @@ bool VideoStore::open() {
     Error("Error occurred when writing out file header to %s: %s",
           filename, av_make_error_string(ret).c_str());
     /* free the stream */
-    avio_closep(&oc->pb);
+    close_output();
     //avformat_free_context(oc);
     return false;
   }
+  if ( audio_out_codec )
+    audio_thread = new std::thread(&VideoStore::transcode_audio_thread, this);
   return true;
 } // end VideoStore::open()
 
+// The muxer writes a lot of small boxes, so rather than avio's default 32k
+// buffer we give it a large one, which av_malloc aligns, so that the file
+// is mostly written a megabyte at a time.
+bool VideoStore::open_output() {
+  fd = ::open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if ( fd < 0 ) {
+    Error("Could not open out file '%s': %s", filename, strerror(errno));
+    return false;
+  }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+  if ( config.video_file_preallocate > 0 ) {
+    // Reserve the space without changing the file size, so that the file
+    // still ends where the video does for anything reading it as it grows.
+    int64_t length = (int64_t)config.video_file_preallocate * 1024 * 1024;
+    if ( fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length) ) {
+      Debug(1, "Unable to preallocate %" PRId64 " bytes for %s: %s", length, filename, strerror(errno));
+    } else {
+      preallocated = length;
+    }
+  }
+#endif
+
+  uint8_t *buffer = (uint8_t *)av_malloc(io_buffer_size);
+  if ( !buffer ) {
+    Error("Unable to allocate %d byte write buffer", io_buffer_size);
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+  oc->pb = avio_alloc_context(buffer, io_buffer_size, 1, this, nullptr, write_output, seek_output);
+  if ( !oc->pb ) {
+    Error("Unable to allocate avio context for %s", filename);
+    av_free(buffer);
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void VideoStore::close_output() {
+  if ( !oc->pb )
+    return;
+
+  avio_flush(oc->pb);
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if ( preallocated ) {
+    // Give back whatever was reserved and not used
+    struct stat st;
+    if ( !fstat(fd, &st) && (st.st_size < preallocated) ) {
+      if ( fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, st.st_size, preallocated - st.st_size) )
+        Debug(1, "Unable to release preallocated space in %s: %s", filename, strerror(errno));
+    }
+    preallocated = 0;
+  }
+#endif
+
+  av_freep(&oc->pb->buffer);
+#if LIBAVFORMAT_VERSION_CHECK(57, 80, 0, 80, 0)
+  avio_context_free(&oc->pb);
+#else
+  av_freep(&oc->pb);
+#endif
+  if ( ::close(fd) )
+    Error("Error closing %s: %s", filename, strerror(errno));
+  fd = -1;
+}
+
+int VideoStore::write_output(void *opaque, uint8_t *buf, int buf_size) {
+  VideoStore *store = static_cast<VideoStore *>(opaque);
+  int written = 0;
+
+  while ( written < buf_size ) {
+    ssize_t ret = ::write(store->fd, buf + written, buf_size - written);
+    if ( ret < 0 ) {
+      int error = errno;
+      if ( error == EINTR )
+        continue;
+      Error("Error writing to %s: %s", store->filename, strerror(error));
+      return AVERROR(error);
+    }
+    written += ret;
+  }
+  return written;
+}
+
+int64_t VideoStore::seek_output(void *opaque, int64_t offset, int whence) {
+  VideoStore *store = static_cast<VideoStore *>(opaque);
+
+  if ( whence == AVSEEK_SIZE ) {
+    struct stat st;
+    return fstat(store->fd, &st) ? AVERROR(errno) : st.st_size;
+  }
+  off_t ret = lseek(store->fd, offset, whence & ~AVSEEK_FORCE);
+  return (ret < 0) ? AVERROR(errno) : ret;
+}
+
 VideoStore::~VideoStore() {
 
+  if ( audio_thread ) {
+    // Transcodes whatever is still queued before stopping
+    audio_mutex.lock();
+    audio_stop = true;
+    audio_condition.signal();
+    audio_mutex.unlock();
+    audio_thread->join();
+    delete audio_thread;
+    audio_thread = nullptr;
+  }
+
   if ( oc->pb ) {
 
     if ( audio_out_codec ) {
+      write_encoded_audio();
 
       // The codec queues data.  We need to send a flush command and out
       // whatever we get. Failures are not fatal.
@@ -551,10 +670,7 @@ VideoStore::~VideoStore() {
     if ( !(out_format->flags & AVFMT_NOFILE) ) {
       /* Close the out file. */
       Debug(2, "Closing");
-      if ( int rc = avio_close(oc->pb) ) {
-        oc->pb = nullptr;
-        Error("Error closing avio %s", av_err2str(rc));
-      }
+      close_output();
     } else {
       Debug(3, "Not closing avio because we are not writing to a file.");
     }
@@ -636,6 +752,16 @@ VideoStore::~VideoStore() {
 #endif
   } // end if audio_out_stream
 
+  // Only left over if the file was never opened
+  while ( !audio_in_queue.empty() ) {
+    delete audio_in_queue.front();
+    audio_in_queue.pop_front();
+  }
+  while ( !audio_out_queue.empty() ) {
+    delete audio_out_queue.front();
+    audio_out_queue.pop_front();
+  }
+
   /* free the streams */
   avformat_free_context(oc);
   delete[] next_dts;
@@ -912,6 +1038,9 @@ bool VideoStore::setup_resampler() {
 }  // end bool VideoStore::setup_resampler()
 
 int VideoStore::writeVideoFramePacket(AVPacket *ipkt) {
+  if ( audio_thread )
+    write_encoded_audio();
+
   av_init_packet(&opkt);
 
   dumpPacket(video_in_stream, ipkt, "video input packet");
@@ -944,16 +1073,18 @@ int VideoStore::writeVideoFramePacket(AVPacket *ipkt) {
   av_packet_rescale_ts(&opkt, video_in_stream->time_base, video_out_stream->time_base);
 
   dumpPacket(video_out_stream, &opkt, "after pts adjustment");
-  write_packet(&opkt, video_out_stream);
+  int ret = write_packet(&opkt, video_out_stream);
+  // A keyframe completes the previous fragment, get it into the file rather
+  // than have it wait for the buffer to fill.
+  if ( (ipkt->flags & AV_PKT_FLAG_KEY) && oc->pb )
+    avio_flush(oc->pb);
 
   zm_av_packet_unref(&opkt);
 
-  return 0;
+  return ret < 0 ? ret : 0;
 }  // end int VideoStore::writeVideoFramePacket( AVPacket *ipkt )
 
 int VideoStore::writeAudioFramePacket(AVPacket *ipkt) {
-  int ret;
-
   if ( !audio_out_stream ) {
     Debug(1, "Called writeAudioFramePacket when no audio_out_stream");
     return 0;  // FIXME -ve return codes do not free packet in ffmpeg_camera at
@@ -972,50 +1103,21 @@ int VideoStore::writeAudioFramePacket(AVPacket *ipkt) {
   dumpPacket(audio_in_stream, ipkt, "after pts adjustment");
 
   if ( audio_out_codec ) {
-    // I wonder if we can get multiple frames per packet? Probably
-    ret = zm_send_packet_receive_frame(audio_in_ctx, in_frame, *ipkt);
-    if ( ret < 0 ) {
-      Debug(3, "failed to receive frame code: %d", ret);
-      return 0;
+    audio_mutex.lock();
+    if ( audio_in_queue.size() >= max_audio_queue ) {
+      if ( !audio_dropped )
+        Warning("Audio transcoding has fallen %zu packets behind, dropping audio", audio_in_queue.size());
+      audio_dropped++;
+    } else {
+      if ( audio_dropped ) {
+        Info("Dropped %u audio packets", audio_dropped);
+        audio_dropped = 0;
+      }
+      audio_in_queue.push_back(new ZMPacket(ipkt));
+      audio_condition.signal();
     }
-    zm_dump_frame(in_frame, "In frame from decode");
-
-    AVFrame *input_frame = in_frame;
-
-    while ( zm_resample_audio(resample_ctx, input_frame, out_frame) ) {
-      //out_frame->pkt_duration = in_frame->pkt_duration; // resampling doesn't alter duration
-      if ( zm_add_samples_to_fifo(fifo, out_frame) <= 0 )
-        break;
-
-      // We put the samples into the fifo so we are basically resetting the frame
-      out_frame->nb_samples = audio_out_ctx->frame_size;
-      
-      if ( zm_get_samples_from_fifo(fifo, out_frame) <= 0 )
-        break;
-
-      out_frame->pts = audio_next_pts;
-      audio_next_pts += out_frame->nb_samples;
-
-      zm_dump_frame(out_frame, "Out frame after resample");
-
-      av_init_packet(&opkt);
-      if ( zm_send_frame_receive_packet(audio_out_ctx, out_frame, opkt) <= 0 )
-        break;
-
-      // Scale the PTS of the outgoing packet to be the correct time base
-      av_packet_rescale_ts(&opkt,
-          audio_out_ctx->time_base,
-          audio_out_stream->time_base);
-
-      write_packet(&opkt, audio_out_stream);
-      zm_av_packet_unref(&opkt);
-
-      if ( zm_resample_get_delay(resample_ctx, out_frame->sample_rate) < out_frame->nb_samples)
-        break;
-      // This will send a null frame, emptying out the resample buffer
-      input_frame = nullptr;
-    } // end while there is data in the resampler
-
+    audio_mutex.unlock();
+    write_encoded_audio();
   } else {
     Debug(2,"copying");
     av_init_packet(&opkt);
@@ -1027,14 +1129,112 @@ int VideoStore::writeAudioFramePacket(AVPacket *ipkt) {
     opkt.pts = ipkt->pts;
     opkt.dts = ipkt->dts;
     av_packet_rescale_ts(&opkt, audio_in_stream->time_base, audio_out_stream->time_base);
-    write_packet(&opkt, audio_out_stream);
+    int ret = write_packet(&opkt, audio_out_stream);
 
     zm_av_packet_unref(&opkt);
+    if ( ret < 0 )
+      return ret;
   }  // end if encoding or copying
 
   return 0;
 }  // end int VideoStore::writeAudioFramePacket(AVPacket *ipkt)
 
+void VideoStore::transcode_audio_thread() {
+  std::deque<ZMPacket *> packets;
+  std::deque<ZMPacket *> encoded;
+
+  while ( true ) {
+    audio_mutex.lock();
+    while ( !audio_stop && audio_in_queue.empty() )
+      audio_condition.wait();
+    if ( audio_in_queue.empty() ) {
+      audio_mutex.unlock();
+      break;
+    }
+    // Take everything that has been queued and do it in one go
+    packets.swap(audio_in_queue);
+    audio_mutex.unlock();
+
+    while ( !packets.empty() ) {
+      transcode_audio(packets.front()->av_packet(), encoded);
+      delete packets.front();
+      packets.pop_front();
+    }
+    if ( !encoded.empty() ) {
+      audio_mutex.lock();
+      audio_out_queue.insert(audio_out_queue.end(), encoded.begin(), encoded.end());
+      audio_mutex.unlock();
+      encoded.clear();
+    }
+  }
+}  // end void VideoStore::transcode_audio_thread()
+
+// Decodes the packet, resamples it into the fifo and encodes as many AAC
+// frames as the fifo holds. The packets are left in encoded for muxing.
+void VideoStore::transcode_audio(AVPacket *ipkt, std::deque<ZMPacket *> &encoded) {
+  int ret;
+  AVPacket pkt;
+
+  // I wonder if we can get multiple frames per packet? Probably
+  ret = zm_send_packet_receive_frame(audio_in_ctx, in_frame, *ipkt);
+  if ( ret < 0 ) {
+    Debug(3, "failed to receive frame code: %d", ret);
+    return;
+  }
+  zm_dump_frame(in_frame, "In frame from decode");
+
+  AVFrame *input_frame = in_frame;
+
+  while ( zm_resample_audio(resample_ctx, input_frame, out_frame) ) {
+    //out_frame->pkt_duration = in_frame->pkt_duration; // resampling doesn't alter duration
+    if ( zm_add_samples_to_fifo(fifo, out_frame) <= 0 )
+      break;
+
+    // We put the samples into the fifo so we are basically resetting the frame
+    out_frame->nb_samples = audio_out_ctx->frame_size;
+    
+    if ( zm_get_samples_from_fifo(fifo, out_frame) <= 0 )
+      break;
+
+    out_frame->pts = audio_next_pts;
+    audio_next_pts += out_frame->nb_samples;
+
+    zm_dump_frame(out_frame, "Out frame after resample");
+
+    av_init_packet(&pkt);
+    if ( zm_send_frame_receive_packet(audio_out_ctx, out_frame, pkt) <= 0 )
+      break;
+
+    // Scale the PTS of the outgoing packet to be the correct time base
+    av_packet_rescale_ts(&pkt,
+        audio_out_ctx->time_base,
+        audio_out_stream->time_base);
+
+    encoded.push_back(new ZMPacket(&pkt));
+    zm_av_packet_unref(&pkt);
+
+    if ( zm_resample_get_delay(resample_ctx, out_frame->sample_rate) < out_frame->nb_samples)
+      break;
+    // This will send a null frame, emptying out the resample buffer
+    input_frame = nullptr;
+  } // end while there is data in the resampler
+}  // end void VideoStore::transcode_audio(AVPacket *ipkt, std::deque<ZMPacket *> &encoded)
+
+// Muxes whatever the audio thread has encoded so far
+void VideoStore::write_encoded_audio() {
+  std::deque<ZMPacket *> encoded;
+
+  audio_mutex.lock();
+  encoded.swap(audio_out_queue);
+  audio_mutex.unlock();
+
+  while ( !encoded.empty() ) {
+    write_packet(encoded.front()->av_packet(), audio_out_stream);
+    delete encoded.front();
+    encoded.pop_front();
+  }
+}  // end void VideoStore::write_encoded_audio()
+
 int VideoStore::write_packet(AVPacket *pkt, AVStream *stream) {
   pkt->pos = -1;
   pkt->stream_index = stream->index;
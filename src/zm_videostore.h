@@ -15,7 +15,12 @@ extern "C"  {
 
 #if HAVE_LIBAVCODEC
 
+#include <deque>
+#include <thread>
+
 #include "zm_monitor.h"
+#include "zm_packet.h"
+#include "zm_thread.h"
 
 class VideoStore {
 private:
@@ -75,8 +80,31 @@ private:
 
   int max_stream_index;
 
+  // Output file, written through our own AVIOContext
+  static const int io_buffer_size = 1024*1024;
+  int fd;
+  int64_t preallocated;   // Bytes reserved with fallocate beyond what has been written
+
+  // Audio that has to be transcoded to AAC is done on a thread of its own,
+  // and the encoded packets are muxed by whichever thread writes the video.
+  static const unsigned int max_audio_queue = 250;
+  std::thread *audio_thread;
+  Mutex audio_mutex;
+  Condition audio_condition;
+  bool audio_stop;
+  std::deque<ZMPacket *> audio_in_queue;
+  std::deque<ZMPacket *> audio_out_queue;
+  unsigned int audio_dropped;
+
   bool setup_resampler();
   int write_packet(AVPacket *pkt, AVStream *stream);
+  void transcode_audio_thread();
+  void transcode_audio(AVPacket *ipkt, std::deque<ZMPacket *> &encoded);
+  void write_encoded_audio();
+  bool open_output();
+  void close_output();
+  static int write_output(void *opaque, uint8_t *buf, int buf_size);
+  static int64_t seek_output(void *opaque, int64_t offset, int whence);
 
 public:
 	VideoStore(
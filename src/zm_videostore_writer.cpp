@@ -0,0 +1,254 @@
+//ZoneMinder Video Store Writer Implementation Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "zm_videostore_writer.h"
+
+#if HAVE_LIBAVCODEC
+
+#include "zm_time.h"
+#include "zm_monitor.h"
+
+VideoStoreWriter::VideoStoreWriter(Monitor *p_monitor, AVStream *p_video_in_stream) :
+  monitor(p_monitor),
+  video_in_stream(p_video_in_stream),
+  mCondition(mMutex),
+  mStop(false),
+  dropping(false),
+  queued_packets(0),
+  dropped_packets(0),
+  opened_serial(0),
+  failed_serial(0),
+  write_errors(0),
+  last_write_error(0),
+  opened(false),
+  open_serial(0),
+  store(nullptr),
+  total_lag(0.0),
+  max_lag(0.0),
+  written_packets(0),
+  last_report(time(nullptr))
+{
+}
+
+VideoStoreWriter::~VideoStoreWriter() {
+  stop();
+  if ( mStarted )
+    join();
+
+  for ( std::deque<Item>::iterator it = items.begin(); it != items.end(); ++it )
+    delete it->packet;
+  items.clear();
+  delete store;
+}
+
+void VideoStoreWriter::queueItem(Item &item) {
+  gettimeofday(&item.queued, nullptr);
+
+  mMutex.lock();
+  items.push_back(item);
+  if ( item.packet )
+    queued_packets++;
+  mCondition.signal();
+  mMutex.unlock();
+}
+
+void VideoStoreWriter::open(const char *filename, AVStream *audio_in_stream) {
+  Item item;
+  item.type = Item::OPEN;
+  item.packet = nullptr;
+  item.filename = filename;
+  item.audio_in_stream = audio_in_stream;
+  item.serial = ++open_serial;
+  queueItem(item);
+  opened = true;
+}
+
+// Whether the last open has succeeded (1), failed (-1) or not been done yet (0)
+int VideoStoreWriter::openResult() {
+  int result = 0;
+  mMutex.lock();
+  if ( opened_serial == open_serial )
+    result = 1;
+  else if ( failed_serial == open_serial )
+    result = -1;
+  mMutex.unlock();
+  return result;
+}
+
+// Returns the number of packets that failed to write since the last call
+unsigned int VideoStoreWriter::takeWriteErrors(int &error) {
+  mMutex.lock();
+  unsigned int errors = write_errors;
+  error = last_write_error;
+  write_errors = 0;
+  mMutex.unlock();
+  return errors;
+}
+
+void VideoStoreWriter::close() {
+  Item item;
+  item.type = Item::CLOSE;
+  item.packet = nullptr;
+  item.audio_in_stream = nullptr;
+  item.serial = open_serial;
+  queueItem(item);
+  opened = false;
+}
+
+// Called from the capture thread, the packet is referenced so the caller can unref its own
+void VideoStoreWriter::queuePacket(AVPacket *packet) {
+  bool keyframe = (packet->stream_index == video_in_stream->index) && (packet->flags & AV_PKT_FLAG_KEY);
+
+  mMutex.lock();
+  if ( queued_packets >= max_queued_packets ) {
+    if ( !dropping )
+      Warning("Video writer has fallen %d packets behind, dropping up to the next keyframe", queued_packets);
+    dropping = true;
+  } else if ( keyframe ) {
+    dropping = false;
+  }
+  if ( dropping ) {
+    dropped_packets++;
+    mMutex.unlock();
+    return;
+  }
+  mMutex.unlock();
+
+  queuePacket(new ZMPacket(packet));
+}
+
+// Takes ownership of the packet
+void VideoStoreWriter::queuePacket(ZMPacket *packet) {
+  Item item;
+  item.type = Item::PACKET;
+  item.packet = packet;
+  item.audio_in_stream = nullptr;
+  item.serial = open_serial;
+  queueItem(item);
+}
+
+void VideoStoreWriter::writeItem(Item &item) {
+  switch ( item.type ) {
+    case Item::OPEN :
+      delete store;
+      store = new VideoStore(item.filename.c_str(), "mp4", video_in_stream, item.audio_in_stream, monitor);
+      if ( !store->open() ) {
+        // Packets are discarded until the capture thread sees the failure and reopens
+        Error("Unable to open video store %s", item.filename.c_str());
+        delete store;
+        store = nullptr;
+      }
+      mMutex.lock();
+      if ( store )
+        opened_serial = item.serial;
+      else
+        failed_serial = item.serial;
+      mMutex.unlock();
+      break;
+    case Item::CLOSE :
+      // Writes the trailer and closes the file
+      delete store;
+      store = nullptr;
+      break;
+    case Item::PACKET : {
+      if ( store ) {
+        AVPacket *avp = item.packet->av_packet();
+        int ret;
+        if ( avp->stream_index == video_in_stream->index ) {
+          ret = store->writeVideoFramePacket(avp);
+        } else {
+          ret = store->writeAudioFramePacket(avp);
+        }
+        if ( ret < 0 ) {
+          mMutex.lock();
+          write_errors++;
+          last_write_error = ret;
+          mMutex.unlock();
+        }
+      }
+      delete item.packet;
+      item.packet = nullptr;
+
+      struct timeval now;
+      gettimeofday(&now, nullptr);
+      double lag = tvDiffSec(item.queued, now);
+      total_lag += lag;
+      if ( lag > max_lag )
+        max_lag = lag;
+      written_packets++;
+      break;
+    }
+  }
+}
+
+void VideoStoreWriter::report() {
+  time_t now = time(nullptr);
+  if ( (now - last_report < report_interval) || !written_packets )
+    return;
+
+  mMutex.lock();
+  unsigned int queued = queued_packets;
+  unsigned int dropped = dropped_packets;
+  dropped_packets = 0;
+  mMutex.unlock();
+
+  if ( dropped || (max_lag > lag_warning) ) {
+    Warning("Video writer lag %.3f s average, %.3f s max, %u packets queued, %u dropped",
+        total_lag/written_packets, max_lag, queued, dropped);
+  } else {
+    Debug(1, "Video writer lag %.3f s average, %.3f s max, %u packets queued",
+        total_lag/written_packets, max_lag, queued);
+  }
+  total_lag = max_lag = 0.0;
+  written_packets = 0;
+  last_report = now;
+}
+
+void VideoStoreWriter::stop() {
+  mMutex.lock();
+  mStop = true;
+  mCondition.signal();
+  mMutex.unlock();
+}
+
+int VideoStoreWriter::run() {
+  while ( true ) {
+    mMutex.lock();
+    while ( !mStop && items.empty() )
+      mCondition.wait();
+    // Whatever was queued before stopping still gets written
+    if ( items.empty() ) {
+      mMutex.unlock();
+      break;
+    }
+    Item item = items.front();
+    items.pop_front();
+    if ( item.packet )
+      queued_packets--;
+    mMutex.unlock();
+
+    writeItem(item);
+    report();
+  }
+
+  delete store;
+  store = nullptr;
+  return 0;
+}
+
+#endif // HAVE_LIBAVCODEC
@@ -0,0 +1,108 @@
+//ZoneMinder Video Store Writer Interface Class
+//
+//This file is part of ZoneMinder.
+//
+//ZoneMinder is free software: you can redistribute it and/or modify
+//it under the terms of the GNU General Public License as published by
+//the Free Software Foundation, either version 3 of the License, or
+//(at your option) any later version.
+//
+//ZoneMinder is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+//
+//You should have received a copy of the GNU General Public License
+//along with ZoneMinder.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef ZM_VIDEOSTORE_WRITER_H
+#define ZM_VIDEOSTORE_WRITER_H
+
+#include <sys/time.h>
+
+#include <deque>
+#include <string>
+
+#include "zm_thread.h"
+#include "zm_packet.h"
+#include "zm_videostore.h"
+
+#if HAVE_LIBAVCODEC
+
+class Monitor;
+
+//
+// Does the muxing and file writing for a monitor's event videos on a thread
+// of its own, so that a slow disk holds up this thread rather than capture.
+// Opening and closing the store are queued along with the packets so they
+// happen in order.
+//
+class VideoStoreWriter : public Thread {
+  private:
+    struct Item {
+      enum { OPEN, PACKET, CLOSE } type;
+      ZMPacket *packet;
+      std::string filename;
+      AVStream *audio_in_stream;
+      unsigned int serial;
+      struct timeval queued;
+    };
+
+    // Packets beyond this are dropped up to the next keyframe rather than queued
+    static const unsigned int max_queued_packets = 2000;
+    // How often, in seconds, to report how far behind the writer is
+    static const int report_interval = 60;
+    // More lag than this, in seconds, is reported as a warning
+    static const int lag_warning = 2;
+
+    Monitor *monitor;
+    AVStream *video_in_stream;
+
+    Mutex mMutex;
+    Condition mCondition;
+    bool mStop;
+    bool dropping;
+    std::deque<Item> items;
+    unsigned int queued_packets;
+    unsigned int dropped_packets;
+    // Outcome of the opens, by serial, and write failures since last taken
+    unsigned int opened_serial;
+    unsigned int failed_serial;
+    unsigned int write_errors;
+    int last_write_error;
+
+    // Only used by the capture thread
+    bool opened;
+    unsigned int open_serial;
+
+    // Only used by the writer thread
+    VideoStore *store;
+    double total_lag;
+    double max_lag;
+    unsigned int written_packets;
+    time_t last_report;
+
+    void queueItem(Item &item);
+    void writeItem(Item &item);
+    void report();
+
+  public:
+    VideoStoreWriter(Monitor *p_monitor, AVStream *p_video_in_stream);
+    ~VideoStoreWriter();
+
+    void open(const char *filename, AVStream *audio_in_stream);
+    void close();
+    bool isOpen() const {
+      return opened;
+    }
+    int openResult();
+    unsigned int takeWriteErrors(int &error);
+    void queuePacket(AVPacket *packet);
+    void queuePacket(ZMPacket *packet);
+    void stop();
+    int run();
+};
+
+#endif // HAVE_LIBAVCODEC
+#endif // ZM_VIDEOSTORE_WRITER_H
@@ -19,6 +19,7 @@
 
 #define __STDC_FORMAT_MACROS 1
 #include <cinttypes>
+#include <algorithm>
 #include "zm.h"
 #include "zm_db.h"
 #include "zm_zone.h"
@@ -132,18 +133,15 @@ Zone::~Zone() {
   delete[] ranges;
 }
 
-void Zone::RecordStats(const Event *event) {
-  static char sql[ZM_SQL_MED_BUFSIZ];
-  db_mutex.lock();
-  snprintf(sql, sizeof(sql),
-      "INSERT INTO Stats SET MonitorId=%d, ZoneId=%d, EventId=%" PRIu64 ", FrameId=%d, PixelDiff=%d, AlarmPixels=%d, FilterPixels=%d, BlobPixels=%d, Blobs=%d, MinBlobSize=%d, MaxBlobSize=%d, MinX=%d, MinY=%d, MaxX=%d, MaxY=%d, Score=%d",
-      monitor->Id(), id, event->Id(), event->Frames(), pixel_diff, alarm_pixels, alarm_filter_pixels, alarm_blob_pixels, alarm_blobs, min_blob_size, max_blob_size, alarm_box.LoX(), alarm_box.LoY(), alarm_box.HiX(), alarm_box.HiY(), score
+// The event adds its id, which it might not have yet
+void Zone::RecordStats(Event *event) {
+  char stats[ZM_SQL_MED_BUFSIZ];
+  snprintf(stats, sizeof(stats),
+      "MonitorId=%d, ZoneId=%d, FrameId=%d, PixelDiff=%d, AlarmPixels=%d, FilterPixels=%d, BlobPixels=%d, Blobs=%d, MinBlobSize=%d, MaxBlobSize=%d, MinX=%d, MinY=%d, MaxX=%d, MaxY=%d, Score=%d",
+      monitor->Id(), id, event->Frames(), pixel_diff, alarm_pixels, alarm_filter_pixels, alarm_blob_pixels, alarm_blobs, min_blob_size, max_blob_size, alarm_box.LoX(), alarm_box.LoY(), alarm_box.HiX(), alarm_box.HiY(), score
       );
-  if ( mysql_query(&dbconn, sql) ) {
-    Error("Can't insert event stats: %s", mysql_error(&dbconn));
-  }
-  db_mutex.unlock();
-}  // end void Zone::RecordStats( const Event *event )
+  event->AddStats(stats);
+}  // end void Zone::RecordStats( Event *event )
 
 bool Zone::CheckOverloadCount() {
   if ( overload_count ) {
@@ -275,50 +273,11 @@ bool Zone::CheckAlarms(const Image *delta_image) {
   if ( check_method >= FILTERED_PIXELS ) {
     int bx = filter_box.X();
     int by = filter_box.Y();
-    int bx1 = bx-1;
-    int by1 = by-1;
 
     Debug(5, "Checking for filtered pixels");
     if ( bx > 1 || by > 1 ) {
       // Now remove any pixels smaller than our filter size
-      unsigned char *cpdiff;
-      int ldx, hdx, ldy, hdy;
-      bool block;
-      for ( unsigned int y = lo_y; y <= hi_y; y++ ) {
-        int lo_x = ranges[y].lo_x;
-        int hi_x = ranges[y].hi_x;
-
-        pdiff = (uint8_t*)diff_image->Buffer(lo_x, y);
-
-        for ( int x = lo_x; x <= hi_x; x++, pdiff++ ) {
-          if ( *pdiff == WHITE ) {
-            // Check participation in an X block
-            ldx = (x>=(lo_x+bx1))?-bx1:lo_x-x;
-            hdx = (x<=(hi_x-bx1))?0:((hi_x-x)-bx1);
-            ldy = (y>=(lo_y+by1))?-by1:lo_y-y;
-            hdy = (y<=(hi_y-by1))?0:((hi_y-y)-by1);
-            block = false;
-            for ( int dy = ldy; !block && dy <= hdy; dy++ ) {
-              for ( int dx = ldx; !block && dx <= hdx; dx++ ) {
-                block = true;
-                for ( int dy2 = 0; block && dy2 < by; dy2++ ) {
-                  for ( int dx2 = 0; block && dx2 < bx; dx2++ ) {
-                    cpdiff = diff_buff + (((y+dy+dy2)*diff_width) + (x+dx+dx2));
-                    if ( !*cpdiff ) {
-                      block = false;
-                    }
-                  }
-                }
-              }
-            }
-            if ( !block ) {
-              *pdiff = BLACK;
-              continue;
-            }
-            alarm_filter_pixels++;
-          } // end if white
-        } // end for x
-      } // end foreach y line
+      alarm_filter_pixels = FilterPixels(diff_image, bx, by);
     } else {
       alarm_filter_pixels = alarm_pixels;
     }
@@ -357,193 +316,74 @@ bool Zone::CheckAlarms(const Image *delta_image) {
 
     if ( check_method >= BLOBS ) {
       Debug(5, "Checking for blob pixels");
-      // ICON FIXME Would like to get rid of this memset
-      memset(blob_stats, 0, sizeof(BlobStats)*256);
-      uint8_t *spdiff;
-      uint8_t last_x, last_y;
-      BlobStats *bsx, *bsy;
-      BlobStats *bsm, *bss;
+      /*
+       * Blobs are 4-connected groups of white pixels. Each line is split into runs of
+       * white pixels, and a run joins the blob of every run on the line above that it
+       * shares a column with, merging those blobs where there is more than one.
+       * Blobs are tracked with union-find, so this is linear in the size of the zone
+       * however many blobs there are.
+       */
+      blob_stats.clear();
+      blob_parents.clear();
+      blob_runs.clear();
+
+      unsigned int above_run = 0;
+      unsigned int above_end = 0;
       for ( unsigned int y = lo_y; y <= hi_y; y++ ) {
         int lo_x = ranges[y].lo_x;
         int hi_x = ranges[y].hi_x;
+        unsigned int line_start = blob_runs.size();
 
         pdiff = (uint8_t*)diff_image->Buffer(lo_x, y);
         for ( int x = lo_x; x <= hi_x; x++, pdiff++ ) {
-          if ( *pdiff == WHITE ) {
-            Debug(9, "Got white pixel at %d,%d (%p)", x, y, pdiff);
-
-            last_x = ((x > 0) && ( (x-1) >= lo_x )) ? *(pdiff-1) : 0;
+          if ( *pdiff != WHITE )
+            continue;
 
-            last_y = 0;
-            if ( y > 0 ) {
-              if ( (y-1) >= lo_y && ranges[(y-1)].lo_x <= x && ranges[(y-1)].hi_x >= x ) {
-                last_y = *(pdiff-diff_width);
-              }
+          BlobRun run = { (int)y, x, x, -1 };
+          while ( (run.hi_x < hi_x) && (*(pdiff+1) == WHITE) ) {
+            run.hi_x++;
+            pdiff++;
+          }
+          x = run.hi_x;
+
+          // Runs above that end before this one starts can't touch any later run either
+          while ( (above_run < above_end) && (blob_runs[above_run].hi_x < run.lo_x) )
+            above_run++;
+          for ( unsigned int i = above_run; (i < above_end) && (blob_runs[i].lo_x <= run.hi_x); i++ ) {
+            int blob = FindBlob(blob_runs[i].label);
+            if ( run.label < 0 ) {
+              run.label = blob;
+            } else if ( blob != run.label ) {
+              Debug(9, "Run %d->%d at line %d joins blobs %d and %d", run.lo_x, run.hi_x, y, run.label, blob);
+              run.label = MergeBlobs(run.label, blob);
+              alarm_blobs--;
             }
+          }
 
-            if ( last_x ) {
-              Debug(9, "Left neighbour is %d", last_x);
-              bsx = &blob_stats[last_x];
-              if ( last_y ) {
-                Debug(9, "Top neighbour is %d", last_y);
-                bsy = &blob_stats[last_y];
-                if ( last_x == last_y ) {
-                  Debug(9, "Matching neighbours, setting to %d", last_x);
-                  // Add to the blob from the x side (either side really)
-                  *pdiff = last_x;
-                  alarm_blob_pixels++;
-                  bsx->count++;
-                  if ( x > bsx->hi_x ) bsx->hi_x = x;
-                  if ( (int)y > bsx->hi_y ) bsx->hi_y = y;
-                } else {
-                  // Aggregate blobs
-                  bsm = bsx->count>=bsy->count?bsx:bsy;
-                  bss = bsm==bsx?bsy:bsx;
-
-                  Debug(9,
-                      "Different neighbours, setting pixels of %d to %d\n"
-                      "Master blob t:%d, c:%d, lx:%d, hx:%d, ly:%d, hy:%d\n"
-                      "Slave blob t:%d, c:%d, lx:%d, hx:%d, ly:%d, hy:%d\n",
-                      bss->tag, bsm->tag,
-                      bsm->tag, bsm->count, bsm->lo_x, bsm->hi_x, bsm->lo_y, bsm->hi_y,
-                      bss->tag, bss->count, bss->lo_x, bss->hi_x, bss->lo_y, bss->hi_y
-                      );
-                  // Now change all those pixels to the other setting
-                  int changed = 0;
-                  for ( int sy = bss->lo_y; sy <= bss->hi_y; sy++ ) {
-                    int lo_sx = bss->lo_x>=ranges[sy].lo_x?bss->lo_x:ranges[sy].lo_x;
-                    int hi_sx = bss->hi_x<=ranges[sy].hi_x?bss->hi_x:ranges[sy].hi_x;
-
-                    Debug(9,
-                        "Changing %d, %d->%d Range %d->%d",
-                        sy, lo_sx, hi_sx, ranges[sy].lo_x, ranges[sy].hi_x
-                        );
-                    spdiff = diff_buff + ((diff_width * sy) + lo_sx);
-                    for ( int sx = lo_sx; sx <= hi_sx; sx++, spdiff++ ) {
-                      Debug(9, "Pixel at %d,%d (%p) is %d", sx, sy, spdiff, *spdiff);
-                      if ( *spdiff == bss->tag ) {
-                        Debug(9, "Setting pixel");
-                        *spdiff = bsm->tag;
-                        changed++;
-                      }
-                    }
-                  }
-                  *pdiff = bsm->tag;
-                  alarm_blob_pixels++;
-                  if ( !changed ) {
-                    Info(
-                        "Master blob t:%d, c:%d, lx:%d, hx:%d, ly:%d, hy:%d\n"
-                        "Slave blob t:%d, c:%d, lx:%d, hx:%d, ly:%d, hy:%d",
-                        bsm->tag, bsm->count, bsm->lo_x, bsm->hi_x, bsm->lo_y, bsm->hi_y,
-                        bss->tag, bss->count, bss->lo_x, bss->hi_x, bss->lo_y, bss->hi_y
-                        );
-                    Error("No pixels changed, exiting");
-                    exit(-1);
-                  }
-
-                  // Merge the slave blob into the master
-                  bsm->count += bss->count+1;
-                  if ( x > bsm->hi_x ) bsm->hi_x = x;
-                  if ( (int)y > bsm->hi_y ) bsm->hi_y = y;
-                  if ( bss->lo_x < bsm->lo_x ) bsm->lo_x = bss->lo_x;
-                  if ( bss->lo_y < bsm->lo_y ) bsm->lo_y = bss->lo_y;
-                  if ( bss->hi_x > bsm->hi_x ) bsm->hi_x = bss->hi_x;
-                  if ( bss->hi_y > bsm->hi_y ) bsm->hi_y = bss->hi_y;
-
-                  alarm_blobs--;
-
-                  Debug(6, "Merging blob %d with %d at %d,%d, %d current blobs",
-                      bss->tag, bsm->tag, x, y, alarm_blobs);
-
-                  // Clear out the old blob
-                  bss->tag = 0;
-                  bss->count = 0;
-                  bss->lo_x = 0;
-                  bss->lo_y = 0;
-                  bss->hi_x = 0;
-                  bss->hi_y = 0;
-                }
-              } else {
-                Debug(9, "Setting to left neighbour %d", last_x);
-                // Add to the blob from the x side 
-                *pdiff = last_x;
-                alarm_blob_pixels++;
-                bsx->count++;
-                if ( x > bsx->hi_x ) bsx->hi_x = x;
-                if ( (int)y > bsx->hi_y ) bsx->hi_y = y;
-              }
-            } else {
-              if ( last_y ) {
-                Debug(9, "Top neighbour is %d", last_y);
-
-                // Add to the blob from the y side
-                BlobStats *bsy = &blob_stats[last_y];
-
-                *pdiff = last_y;
-                alarm_blob_pixels++;
-                bsy->count++;
-                if ( x > bsy->hi_x ) bsy->hi_x = x;
-                if ( (int)y > bsy->hi_y ) bsy->hi_y = y;
-              } else {
-                // Create a new blob
-                int i;
-                for ( i = (WHITE-1); i > 0; i-- ) {
-                  BlobStats *bs = &blob_stats[i];
-                  // See if we can recycle one first, only if it's at least two rows up
-                  if ( bs->count && bs->hi_y < (int)(y-1) ) {
-                    if (
-                        (min_blob_pixels && bs->count < min_blob_pixels)
-                        ||
-                        (max_blob_pixels && bs->count > max_blob_pixels)
-                       ) {
-                      if ( ( monitor->GetOptSaveJPEGs() > 1 ) || config.record_diag_images ) {
-                        for ( int sy = bs->lo_y; sy <= bs->hi_y; sy++ ) {
-                          spdiff = diff_buff + ((diff_width * sy) + bs->lo_x);
-                          for ( int sx = bs->lo_x; sx <= bs->hi_x; sx++, spdiff++ ) {
-                            if ( *spdiff == bs->tag ) {
-                              *spdiff = BLACK;
-                            }
-                          }
-                        }
-                      }
-                      alarm_blobs--;
-                      alarm_blob_pixels -= bs->count;
-
-                      Debug(6, "Eliminated blob %d, %d pixels (%d,%d - %d,%d), %d current blobs",
-                          i, bs->count, bs->lo_x, bs->lo_y, bs->hi_x, bs->hi_y, alarm_blobs);
-
-                      bs->tag = 0;
-                      bs->count = 0;
-                      bs->lo_x = 0;
-                      bs->lo_y = 0;
-                      bs->hi_x = 0;
-                      bs->hi_y = 0;
-                    }
-                  }
-                  if ( !bs->count ) {
-                    Debug(9, "Creating new blob %d", i);
-                    *pdiff = i;
-                    alarm_blob_pixels++;
-                    bs->tag = i;
-                    bs->count++;
-                    bs->lo_x = bs->hi_x = x;
-                    bs->lo_y = bs->hi_y = y;
-                    alarm_blobs++;
-
-                    Debug(6, "Created blob %d at %d,%d, %d current blobs", bs->tag, x, y, alarm_blobs);
-                    break;
-                  }
-                }
-                if ( i == 0 ) {
-                  Warning("Max blob count reached. Unable to allocate new blobs so terminating. Zone settings may be too sensitive.");
-                  x = hi_x+1;
-                  y = hi_y+1;
-                }
-              }
-            }
+          if ( run.label < 0 ) {
+            run.label = blob_stats.size();
+            BlobStats bs = { 0, run.lo_x, run.hi_x, (int)y, (int)y, 0, 0 };
+            blob_stats.push_back(bs);
+            blob_parents.push_back(run.label);
+            alarm_blobs++;
+            Debug(9, "Created blob %d at %d,%d, %d current blobs", run.label, run.lo_x, y, alarm_blobs);
           }
-        }
-      }
+
+          BlobStats *bs = &blob_stats[run.label];
+          int run_pixels = run.hi_x - run.lo_x + 1;
+          bs->count += run_pixels;
+          if ( run.lo_x < bs->lo_x ) bs->lo_x = run.lo_x;
+          if ( run.hi_x > bs->hi_x ) bs->hi_x = run.hi_x;
+          if ( (int)y > bs->hi_y ) bs->hi_y = y;
+          bs->x_total += ((unsigned long)(run.lo_x + run.hi_x) * run_pixels) / 2;
+          bs->y_total += (unsigned long)y * run_pixels;
+          alarm_blob_pixels += run_pixels;
+
+          blob_runs.push_back(run);
+        } // end foreach x
+        above_run = line_start;
+        above_end = blob_runs.size();
+      } // end foreach y
 
       if ( config.record_diag_images )
         diff_image->WriteJpeg(diag_path, config.record_diag_images_fifo);
@@ -561,40 +401,37 @@ bool Zone::CheckAlarms(const Image *delta_image) {
       }
 
       // Now eliminate blobs under the threshold
-      for ( int i = 1; i < WHITE; i++ ) {
+      bool eliminated = false;
+      for ( unsigned int i = 0; i < blob_stats.size(); i++ ) {
         BlobStats *bs = &blob_stats[i];
-        if ( bs->count ) {
-          if ( (min_blob_pixels && bs->count < min_blob_pixels) || (max_blob_pixels && bs->count > max_blob_pixels) ) {
-            if ( ( monitor->GetOptSaveJPEGs() > 1 ) || config.record_diag_images ) {
-              for ( int sy = bs->lo_y; sy <= bs->hi_y; sy++ ) {
-                spdiff = diff_buff + ((diff_width * sy) + bs->lo_x);
-                for ( int sx = bs->lo_x; sx <= bs->hi_x; sx++, spdiff++ ) {
-                  if ( *spdiff == bs->tag ) {
-                    *spdiff = BLACK;
-                  }
-                }
-              }
-            }
-            alarm_blobs--;
-            alarm_blob_pixels -= bs->count;
-
-            Debug(6, "Eliminated blob %d, %d pixels (%d,%d - %d,%d), %d current blobs",
-                i, bs->count, bs->lo_x, bs->lo_y, bs->hi_x, bs->hi_y, alarm_blobs);
-
-            bs->tag = 0;
-            bs->count = 0;
-            bs->lo_x = 0;
-            bs->lo_y = 0;
-            bs->hi_x = 0;
-            bs->hi_y = 0;
-          } else {
-            Debug(6, "Preserved blob %d, %d pixels (%d,%d - %d,%d), %d current blobs",
-                i, bs->count, bs->lo_x, bs->lo_y, bs->hi_x, bs->hi_y, alarm_blobs);
-            if ( !min_blob_size || bs->count < min_blob_size ) min_blob_size = bs->count;
-            if ( !max_blob_size || bs->count > max_blob_size ) max_blob_size = bs->count;
+        if ( blob_parents[i] != (int)i )
+          continue;
+
+        if ( (min_blob_pixels && bs->count < min_blob_pixels) || (max_blob_pixels && bs->count > max_blob_pixels) ) {
+          alarm_blobs--;
+          alarm_blob_pixels -= bs->count;
+
+          Debug(6, "Eliminated blob %d, %d pixels (%d,%d - %d,%d), %d current blobs",
+              i, bs->count, bs->lo_x, bs->lo_y, bs->hi_x, bs->hi_y, alarm_blobs);
+
+          bs->count = 0;
+          eliminated = true;
+        } else {
+          Debug(6, "Preserved blob %d, %d pixels (%d,%d - %d,%d), %d current blobs",
+              i, bs->count, bs->lo_x, bs->lo_y, bs->hi_x, bs->hi_y, alarm_blobs);
+          if ( !min_blob_size || bs->count < min_blob_size ) min_blob_size = bs->count;
+          if ( !max_blob_size || bs->count > max_blob_size ) max_blob_size = bs->count;
+        }
+      } // end foreach blob
+
+      if ( eliminated && (( monitor->GetOptSaveJPEGs() > 1 ) || config.record_diag_images) ) {
+        for ( unsigned int i = 0; i < blob_runs.size(); i++ ) {
+          const BlobRun &run = blob_runs[i];
+          if ( !blob_stats[FindBlob(run.label)].count ) {
+            memset(diff_buff + ((diff_width * run.y) + run.lo_x), BLACK, run.hi_x - run.lo_x + 1);
           }
-        } // end if bs_count
-      } // end for i < WHITE
+        }
+      }
 
       if ( config.record_diag_images )
         diff_image->WriteJpeg(diag_path, config.record_diag_images_fifo);
@@ -635,29 +472,20 @@ bool Zone::CheckAlarms(const Image *delta_image) {
       alarm_lo_y = polygon.HiY()+1;
       alarm_hi_y = polygon.LoY()-1;
 
-      for ( int i = 1; i < WHITE; i++ ) {
+      bool have_centre = false;
+      for ( unsigned int i = 0; i < blob_stats.size(); i++ ) {
         BlobStats *bs = &blob_stats[i];
-        if ( bs->count ) {
-          if ( bs->count == max_blob_size ) {
+        if ( (blob_parents[i] == (int)i) && bs->count ) {
+          // The centre is that of the largest blob, the first one found if there are several
+          if ( !have_centre && (bs->count == max_blob_size) ) {
             if ( config.weighted_alarm_centres ) {
-              unsigned long x_total = 0;
-              unsigned long y_total = 0;
-
-              for ( int sy = bs->lo_y; sy <= bs->hi_y; sy++ ) {
-                spdiff = diff_buff + ((diff_width * sy) + bs->lo_x);
-                for ( int sx = bs->lo_x; sx <= bs->hi_x; sx++, spdiff++ ) {
-                  if ( *spdiff == bs->tag ) {
-                    x_total += sx;
-                    y_total += sy;
-                  }
-                }
-              }
-              alarm_mid_x = int(round(x_total/bs->count));
-              alarm_mid_y = int(round(y_total/bs->count));
+              alarm_mid_x = int(round(bs->x_total/bs->count));
+              alarm_mid_y = int(round(bs->y_total/bs->count));
             } else {
               alarm_mid_x = int((bs->hi_x+bs->lo_x+1)/2);
               alarm_mid_y = int((bs->hi_y+bs->lo_y+1)/2);
             }
+            have_centre = true;
           }
 
           if ( alarm_lo_x > bs->lo_x ) alarm_lo_x = bs->lo_x;
@@ -665,7 +493,7 @@ bool Zone::CheckAlarms(const Image *delta_image) {
           if ( alarm_hi_x < bs->hi_x ) alarm_hi_x = bs->hi_x;
           if ( alarm_hi_y < bs->hi_y ) alarm_hi_y = bs->hi_y;
         } // end if bs->count
-      } // end for i < WHITE
+      } // end foreach blob
     } else {
       alarm_mid_x = int((alarm_hi_x+alarm_lo_x+1)/2);
       alarm_mid_y = int((alarm_hi_y+alarm_lo_y+1)/2);
@@ -746,6 +574,107 @@ bool Zone::CheckAlarms(const Image *delta_image) {
   return true;
 }
 
+/*
+ * Removes alarmed pixels that are not part of a fully alarmed bx by by box within the zone,
+ * and returns the number that are left. This is a morphological opening done with counters:
+ * runs of alarmed pixels along each line give the boxes that fit horizontally, runs of those
+ * down each column give the boxes that fit completely, and each box found is then spread back
+ * over the pixels it covers. A line is finished as soon as the boxes that can cover it are all
+ * known, by lines below, so the diff image is updated in place in a single pass and the cost
+ * doesn't depend on the size of the box.
+ */
+unsigned int Zone::FilterPixels(Image *diff_image, int bx, int by) {
+  int bx1 = bx-1;
+  int by1 = by-1;
+  int lo_y = polygon.LoY();
+  int hi_y = polygon.HiY();
+  int zone_lo_x = polygon.LoX();
+  int zone_width = polygon.HiX() - zone_lo_x + 1;
+  unsigned int pixel_count = 0;
+
+  // Per column of the zone: lines in a row on which a box fits horizontally, and the last line a whole box starts on
+  filter_runs.assign(zone_width, 0);
+  filter_boxes.assign(zone_width, lo_y - by - 1);
+
+  for ( int y = lo_y; y <= hi_y + by1; y++ ) {
+    if ( y <= hi_y ) {
+      int lo_x = ranges[y].lo_x;
+      int hi_x = ranges[y].hi_x;
+      const uint8_t *pdiff = diff_image->Buffer(lo_x, y);
+      int run = 0;
+      int box_x = zone_lo_x;
+
+      for ( int x = lo_x; x <= hi_x; x++, pdiff++ ) {
+        run = (*pdiff == WHITE) ? run+1 : 0;
+        // A box starting at x-bx1 fits on this line if the run reaches back that far
+        for ( ; box_x <= x-bx1; box_x++ ) {
+          int *box_run = &filter_runs[box_x-zone_lo_x];
+          if ( (box_x == x-bx1) && (run >= bx) ) {
+            if ( ++(*box_run) >= by )
+              filter_boxes[box_x-zone_lo_x] = y-by1;
+          } else {
+            *box_run = 0;
+          }
+        }
+      }
+      for ( ; box_x < zone_lo_x + zone_width; box_x++ )
+        filter_runs[box_x-zone_lo_x] = 0;
+    }
+
+    // Every box that can cover line y-by1 is now known
+    int line = y-by1;
+    if ( line < lo_y )
+      continue;
+
+    int lo_x = ranges[line].lo_x;
+    int hi_x = ranges[line].hi_x;
+    uint8_t *pdiff = (uint8_t*)diff_image->Buffer(lo_x, line);
+    int last_box_x = lo_x - bx - 1;
+
+    for ( int x = lo_x; x <= hi_x; x++, pdiff++ ) {
+      if ( filter_boxes[x-zone_lo_x] >= line-by1 )
+        last_box_x = x;
+      if ( *pdiff == WHITE ) {
+        if ( last_box_x >= x-bx1 )
+          pixel_count++;
+        else
+          *pdiff = BLACK;
+      }
+    }
+  } // end foreach y
+
+  return pixel_count;
+}
+
+/* Returns the label a blob has been merged into, flattening the path on the way */
+int Zone::FindBlob(int blob) {
+  while ( blob_parents[blob] != blob ) {
+    blob_parents[blob] = blob_parents[blob_parents[blob]];
+    blob = blob_parents[blob];
+  }
+  return blob;
+}
+
+/* Merges two blobs into the one that was created first, and returns its label */
+int Zone::MergeBlobs(int blob1, int blob2) {
+  if ( blob2 < blob1 )
+    std::swap(blob1, blob2);
+  BlobStats *bsm = &blob_stats[blob1];
+  BlobStats *bss = &blob_stats[blob2];
+
+  bsm->count += bss->count;
+  if ( bss->lo_x < bsm->lo_x ) bsm->lo_x = bss->lo_x;
+  if ( bss->lo_y < bsm->lo_y ) bsm->lo_y = bss->lo_y;
+  if ( bss->hi_x > bsm->hi_x ) bsm->hi_x = bss->hi_x;
+  if ( bss->hi_y > bsm->hi_y ) bsm->hi_y = bss->hi_y;
+  bsm->x_total += bss->x_total;
+  bsm->y_total += bss->y_total;
+  bss->count = 0;
+
+  blob_parents[blob2] = blob1;
+  return blob1;
+}
+
 bool Zone::ParsePolygonString(const char *poly_string, Polygon &polygon) {
 
   char *str = (char *)poly_string;
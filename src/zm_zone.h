@@ -26,6 +26,8 @@
 #include "zm_image.h"
 #include "zm_event.h"
 
+#include <vector>
+
 class Monitor;
 
 //
@@ -39,7 +41,9 @@ protected:
     int hi_x;
     int off_x;
   };
-  typedef struct { unsigned char tag; int count; int lo_x; int hi_x; int lo_y; int hi_y; } BlobStats;
+  typedef struct { int count; int lo_x; int hi_x; int lo_y; int hi_y; unsigned long x_total; unsigned long y_total; } BlobStats;
+  // A horizontal run of alarmed pixels and the blob it was labelled with
+  typedef struct { int y; int lo_x; int hi_x; int label; } BlobRun;
 
 public:
   typedef enum { ACTIVE=1, INCLUSIVE, EXCLUSIVE, PRECLUSIVE, INACTIVE, PRIVACY } ZoneType;
@@ -66,7 +70,12 @@ protected:
   int        min_filter_pixels;
   int        max_filter_pixels;
 
-  BlobStats blob_stats[256];
+  // Working storage for filtering and blob labelling, kept between frames to avoid reallocating
+  std::vector<int> filter_runs;
+  std::vector<int> filter_boxes;
+  std::vector<BlobStats> blob_stats;
+  std::vector<int> blob_parents;
+  std::vector<BlobRun> blob_runs;
   int        min_blob_pixels;
   int        max_blob_pixels;
   int        min_blobs;
@@ -99,6 +108,9 @@ protected:
 protected:
   void Setup( Monitor *p_monitor, int p_id, const char *p_label, ZoneType p_type, const Polygon &p_polygon, const Rgb p_alarm_rgb, CheckMethod p_check_method, int p_min_pixel_threshold, int p_max_pixel_threshold, int p_min_alarm_pixels, int p_max_alarm_pixels, const Coord &p_filter_box, int p_min_filter_pixels, int p_max_filter_pixels, int p_min_blob_pixels, int p_max_blob_pixels, int p_min_blobs, int p_max_blobs, int p_overload_frames, int p_extend_alarm_frames );
   void std_alarmedpixels(Image* pdiff_image, const Image* ppoly_image, unsigned int* pixel_count, unsigned int* pixel_sum);
+  unsigned int FilterPixels( Image *diff_image, int bx, int by );
+  int FindBlob( int blob );
+  int MergeBlobs( int blob1, int blob2 );
   
 public:
   Zone( Monitor *p_monitor, int p_id, const char *p_label, ZoneType p_type, const Polygon &p_polygon, const Rgb p_alarm_rgb, CheckMethod p_check_method, int p_min_pixel_threshold=15, int p_max_pixel_threshold=0, int p_min_alarm_pixels=50, int p_max_alarm_pixels=75000, const Coord &p_filter_box=Coord( 3, 3 ), int p_min_filter_pixels=50, int p_max_filter_pixels=50000, int p_min_blob_pixels=10, int p_max_blob_pixels=0, int p_min_blobs=0, int p_max_blobs=0, int p_overload_frames=0, int p_extend_alarm_frames=0 )
@@ -151,7 +163,7 @@ public:
     max_blob_size = 0;
     score = 0;
   }
-  void RecordStats( const Event *event );
+  void RecordStats( Event *event );
   bool CheckAlarms( const Image *delta_image );
   bool DumpSettings( char *output, bool verbose );
 
@@ -56,7 +56,7 @@ int main(int argc, const char *argv[], char **envp) {
   srand(getpid() * time(nullptr));
 
   enum { ZMS_UNKNOWN, ZMS_MONITOR, ZMS_EVENT, ZMS_FIFO } source = ZMS_UNKNOWN;
-  enum { ZMS_JPEG, ZMS_MPEG, ZMS_RAW, ZMS_ZIP, ZMS_SINGLE } mode = ZMS_JPEG;
+  enum { ZMS_JPEG, ZMS_MPEG, ZMS_RAW, ZMS_ZIP, ZMS_SINGLE, ZMS_VIDEO } mode = ZMS_JPEG;
   char format[32] = "";
   int monitor_id = 0;
   time_t event_time = 0;
@@ -126,6 +126,7 @@ int main(int argc, const char *argv[], char **envp) {
       mode = !strcmp(value, "raw")?ZMS_RAW:mode;
       mode = !strcmp(value, "zip")?ZMS_ZIP:mode;
       mode = !strcmp(value, "single")?ZMS_SINGLE:mode;
+      mode = !strcmp(value, "video")?ZMS_VIDEO:mode;
     } else if ( !strcmp(name, "format") ) {
       strncpy(format, value, sizeof(format)-1);
     } else if ( !strcmp(name, "monitor") ) {
@@ -270,6 +271,9 @@ int main(int argc, const char *argv[], char **envp) {
       stream.setStreamType(MonitorStream::STREAM_ZIP);
     } else if ( mode == ZMS_SINGLE ) {
       stream.setStreamType(MonitorStream::STREAM_SINGLE);
+    } else if ( mode == ZMS_VIDEO ) {
+      stream.setStreamFormat(format);
+      stream.setStreamType(MonitorStream::STREAM_VIDEO);
     } else {
 #if HAVE_LIBAVCODEC
       stream.setStreamFormat(format);
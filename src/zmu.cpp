@@ -61,10 +61,12 @@ Options for use with monitors:
   -H, --hue [value]                       - Output the current hue, set to value if given 
   -O, --colour [value]                    - Output the current colour, set to value if given 
   -i, --image [image_index]               - Write captured image to disk as <monitor_name>.jpg, last image captured
-                                            or specified ring buffer index if given.
+                                            or specified ring buffer index if given. An index below -1 counts back
+                                            from the last image, -2 being the one before it, and can reach back into
+                                            the compressed image buffer.
   -S, --scale <scale_%%ge>                - With --image specify any scaling (in %%) to be applied to the image
   -t, --timestamp [image_index]           - Output captured image timestamp, last image captured or specified
-                                            ring buffer index if given
+                                            ring buffer index if given, counting back from the last image if below -1
   -R, --read_index                        - Output ring buffer read index
   -W, --write_index                       - Output ring buffer write index
   -e, --event                             - Output last event index
@@ -118,10 +120,12 @@ void Usage(int status=-1) {
 			"  -H, --hue [value]        : Output the current hue, set to value if given \n"
 			"  -O, --colour [value]       : Output the current colour, set to value if given \n"
 			"  -i, --image [image_index]    : Write captured image to disk as <monitor_name>.jpg, last image captured\n"
-			"                   or specified ring buffer index if given.\n"
+			"                   or specified ring buffer index if given. An index below -1 counts back\n"
+			"                   from the last image, -2 being the one before it, and can reach back into\n"
+			"                   the compressed image buffer.\n"
 			"  -S, --scale <scale_%%ge>    : With --image specify any scaling (in %%) to be applied to the image\n"
 			"  -t, --timestamp [image_index]  : Output captured image timestamp, last image captured or specified\n"
-			"                   ring buffer index if given\n"
+			"                   ring buffer index if given, counting back from the last image if below -1\n"
 			"  -R, --read_index         : Output ring buffer read index\n"
 			"  -W, --write_index        : Output ring buffer write index\n" 
 			"  -e, --event          : Output last event index\n" 
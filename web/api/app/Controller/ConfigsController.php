@@ -87,6 +87,7 @@ class ConfigsController extends AppController {
 		}
 		if ($this->request->is(array('post', 'put'))) {
 			if ($this->Config->save($this->request->data)) {
+				bumpConfigGeneration();
 				return $this->flash(__('The config has been saved.'), array('action' => 'index'));
 			}
 		} else {
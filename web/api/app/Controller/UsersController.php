@@ -93,6 +93,8 @@ class UsersController extends AppController {
 
 			$this->User->create();
 			if ( $this->User->save($this->request->data) ) {
+				if ( ZM_OPT_USE_AUTH )
+					bumpUsersGeneration();
 				return $this->flash(__('The user has been saved.'), array('action' => 'index'));
 			}
 			$this->Session->setFlash(
@@ -124,6 +126,8 @@ class UsersController extends AppController {
 
 		if ( $this->request->is('post') || $this->request->is('put') ) {
 			if ( $this->User->save($this->request->data) ) {
+				if ( ZM_OPT_USE_AUTH )
+					bumpUsersGeneration();
 				$message = 'Saved';
 			} else {
 				$message = 'Error';
@@ -49,6 +49,7 @@ if ( $action == 'donate' && isset($_REQUEST['option']) ) {
       Warning("Unknown value for option in donate: $option");
       break;
   } // end switch option
+  bumpConfigGeneration();
   $redirect = '?view=console';
 }
 ?>
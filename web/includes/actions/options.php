@@ -91,6 +91,7 @@ if ( $action == 'delete' ) {
       break;
     }
     $redirect = '?view=options&tab='.$_REQUEST['tab'];
+    bumpConfigGeneration();
     loadConfig(false);
     # Might need to update auth hash
     # This doesn't work because the config are constants and won't really be loaded until the next refresh.
@@ -38,5 +38,6 @@ if ( ($action == 'privacy') && isset($_POST['option']) ) {
   default: # Enable the privacy statement if we somehow submit something other than accept or decline
     dbQuery("UPDATE Config SET Value = '1' WHERE Name = 'ZM_SHOW_PRIVACY'");
   } // end switch option
+  bumpConfigGeneration();
 } // end if
 ?>
@@ -52,6 +52,7 @@ if ( $action == 'Save' ) {
     if ( count($changes) ) {
       if ( !empty($_REQUEST['uid']) ) {
         dbQuery('UPDATE Users SET '.implode(', ', $changes).' WHERE Id = ?', array($_REQUEST['uid']));
+        bumpUsersGeneration();
         # If we are updating the logged in user, then update our session user data.
         if ( $user and ( $dbUser['Username'] == $user['Username'] ) ) {
           # We are the logged in user, need to update the $user object and generate a new auth_hash
@@ -65,6 +66,7 @@ if ( $action == 'Save' ) {
         }
       } else {
         dbQuery('INSERT INTO Users SET '.implode(', ', $changes));
+        bumpUsersGeneration();
       }
     } # end if changes
   } else if ( ZM_USER_SELF_EDIT and ( $_REQUEST['uid'] == $user['Id'] ) ) {
@@ -89,6 +91,7 @@ if ( $action == 'Save' ) {
     }
     if ( count($changes) ) {
       dbQuery('UPDATE Users SET '.implode(', ', $changes).' WHERE Id=?', array($uid));
+      bumpUsersGeneration();
 
       # We are the logged in user, need to update the $user object and generate a new auth_hash
       $sql = 'SELECT * FROM Users WHERE Enabled=1 AND Id=?';
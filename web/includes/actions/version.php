@@ -51,4 +51,5 @@ if ( $action == 'version' && isset($_REQUEST['option']) ) {
     dbQuery("UPDATE Config SET Value = '0' WHERE Name = 'ZM_CHECK_FOR_UPDATES'");
     break;
   } // end switch (option)
+  bumpConfigGeneration();
 }
@@ -48,6 +48,7 @@ function migrateHash($user, $pass) {
     //ZM\Info ("hased bcrypt $pass is $bcrypt_hash");
     $update_password_sql = 'UPDATE Users SET Password=\''.$bcrypt_hash.'\' WHERE Username=\''.$user.'\'';
     dbQuery($update_password_sql);
+    bumpUsersGeneration();
     # Since password field has changed, existing auth_hash is no longer valid
     generateAuthHash(ZM_AUTH_HASH_IPS, true);
   } else {
@@ -221,6 +222,13 @@ function generateAuthHash($useRemoteAddr, $force=false) {
   return '';
 }
 
+# zms and zmu keep the auth hashes of all users cached in ZM_PATH_MAP and
+# only work them out again once this number has moved on, so anything that
+# adds users or changes their Password or Enabled has to bump it.
+function bumpUsersGeneration() {
+  bumpGeneration('users');
+}
+
 function visibleMonitor($mid) {
   global $user;
 
@@ -80,6 +80,7 @@ $SLANG = array(
     'Line'                  => 'Line',
     'More'                  => 'More',
     'Clear'                 => 'Clear',
+    '12BitYUV420'           => '12 bit YUV 4:2:0 (Ffmpeg and RTSP)',
     '24BitColour'           => '24 bit colour',
     '32BitColour'           => '32 bit colour',
     '8BitGrey'              => '8 bit greyscale',
@@ -178,7 +179,7 @@ $SLANG = array(
     'BadPath'               => 'Path must be set to a valid value',
     'BadPort'               => 'Port must be set to a valid number',
     'BadPostEventCount'     => 'Post event image count must be an integer of zero or more',
-    'BadPreEventCount'      => 'Pre event image count must be at least zero, and less than image buffer size',
+    'BadPreEventCount'      => 'Pre event image count must be at least zero, and less than image buffer size or compressed buffer count',
     'BadRefBlendPerc'       => 'Reference blend percentage must be a positive integer',
     'BadNoSaveJPEGsOrVideoWriter' => 'SaveJPEGs and VideoWriter are both set to disabled.  Nothing will be recorded!',
     'BadSectionLength'      => 'Section length must be an integer of 30 or more',
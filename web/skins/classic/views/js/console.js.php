@@ -7,6 +7,7 @@ if ( canEdit('System') && ZM_DYN_SHOW_DONATE_REMINDER ) {
   } else {
     $nextReminder = time() + 30*24*60*60;
     dbQuery("UPDATE Config SET Value = '".$nextReminder."' WHERE Name = 'ZM_DYN_DONATE_REMINDER_TIME'");
+    bumpConfigGeneration();
   }
 }
 ?>
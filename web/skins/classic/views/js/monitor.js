@@ -258,8 +258,10 @@ function update_estimated_ram_use() {
   var width = document.querySelectorAll('input[name="newMonitor[Width]"]')[0].value;
   var height = document.querySelectorAll('input[name="newMonitor[Height]"]')[0].value;
   var colours = document.querySelectorAll('select[name="newMonitor[Colours]"]')[0].value;
+  // YUV 4:2:0 is 12 bits per pixel
+  var bytes_per_pixel = (colours == 12) ? 1.5 : colours;
 
-  document.getElementById('estimated_ram_use').innerHTML = human_filesize(buffer_count * width * height * colours, 0);
+  document.getElementById('estimated_ram_use').innerHTML = human_filesize(buffer_count * width * height * bytes_per_pixel, 0);
 }
 
 function updateLatitudeAndLongitude(latitude, longitude) {
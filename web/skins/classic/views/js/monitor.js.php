@@ -89,7 +89,7 @@ function validateForm( form ) {
     if ( !form.elements['newMonitor[RefBlendPerc]'].value || (parseInt(form.elements['newMonitor[RefBlendPerc]'].value) > 100 ) || (parseInt(form.elements['newMonitor[RefBlendPerc]'].value) < 0 ) )
       errors[errors.length] = "<?php echo translate('BadRefBlendPerc') ?>";
 
-    if ( !form.elements['newMonitor[Colours]'].value || (parseInt(form.elements['newMonitor[Colours]'].value) != 1 && parseInt(form.elements['newMonitor[Colours]'].value) != 3 && parseInt(form.elements['newMonitor[Colours]'].value) != 4 ) )
+    if ( !form.elements['newMonitor[Colours]'].value || (parseInt(form.elements['newMonitor[Colours]'].value) != 1 && parseInt(form.elements['newMonitor[Colours]'].value) != 3 && parseInt(form.elements['newMonitor[Colours]'].value) != 4 && parseInt(form.elements['newMonitor[Colours]'].value) != 12 ) )
       errors[errors.length] = "<?php echo translate('BadColours') ?>";
     if ( !form.elements['newMonitor[Width]'].value || !(parseInt(form.elements['newMonitor[Width]'].value) > 0 ) )
       errors[errors.length] = "<?php echo translate('BadWidth') ?>";
@@ -103,7 +103,7 @@ function validateForm( form ) {
       errors[errors.length] = "<?php echo translate('BadImageBufferCount') ?>";
     if ( !form.elements['newMonitor[WarmupCount]'].value || !(parseInt(form.elements['newMonitor[WarmupCount]'].value) >= 0 ) )
       errors[errors.length] = "<?php echo translate('BadWarmupCount') ?>";
-    if ( !form.elements['newMonitor[PreEventCount]'].value || !(parseInt(form.elements['newMonitor[PreEventCount]'].value) >= 0 ) || (parseInt(form.elements['newMonitor[PreEventCount]'].value) > parseInt(form.elements['newMonitor[ImageBufferCount]'].value)) )
+    if ( !form.elements['newMonitor[PreEventCount]'].value || !(parseInt(form.elements['newMonitor[PreEventCount]'].value) >= 0 ) || (parseInt(form.elements['newMonitor[PreEventCount]'].value) > Math.max(parseInt(form.elements['newMonitor[ImageBufferCount]'].value), <?php echo (int)ZM_COMPRESSED_BUFFER_COUNT ?>)) )
       errors[errors.length] = "<?php echo translate('BadPreEventCount') ?>";
     if ( !form.elements['newMonitor[PostEventCount]'].value || !(parseInt(form.elements['newMonitor[PostEventCount]'].value) >= 0 ) )
       errors[errors.length] = "<?php echo translate('BadPostEventCount') ?>";
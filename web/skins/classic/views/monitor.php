@@ -309,7 +309,8 @@ if ( ZM_HAS_V4L2 ) {
 $Colours = array(
     '1' => translate('8BitGrey'),
     '3' => translate('24BitColour'),
-    '4' => translate('32BitColour')
+    '4' => translate('32BitColour'),
+    '12' => translate('12BitYUV420')
     );
 
 $orientations = array(
@@ -990,7 +991,7 @@ include('_monitor_source_nvsocket.php');
             </tr>
             <tr>
               <td class="text-right pr-3"><?php echo translate('EstimatedRamUse') ?></td>
-              <td id="estimated_ram_use"><?php echo human_filesize($monitor->ImageBufferCount() * $monitor->Width() * $monitor->Height() * $monitor->Colours(), 0) ?></td>
+              <td id="estimated_ram_use"><?php echo human_filesize($monitor->ImageBufferCount() * $monitor->Width() * $monitor->Height() * ($monitor->Colours() == 12 ? 1.5 : $monitor->Colours()), 0) ?></td>
             </tr>
 <?php
       break;